@@ -25,6 +25,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include <errno.h>
 #include <unistd.h>
@@ -36,33 +38,58 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netdb.h>
 #include <sys/wait.h>
+#include <sys/random.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
 #include <termios.h>
+#include <zlib.h>
 #undef crypt
     /* We redefine crypt */
 
 const char * documentation [] = {
 "efm -doc",
 "",
-"efm moveto target file ...",
-"efm movefrom source file ...",
-"efm copyto target file ...",
-"efm copyfrom source file ...",
-"efm check source file ...",
-"efm md5check source file ...",
-"efm remove target file ...",
+"efm moveto [-j N] target file ...",
+"efm movefrom [-j N] source file ...",
+"efm copyto [-j N] target file ...",
+"efm copyfrom [-j N] source file ...",
+"efm check [-j N] source file ...",
+"efm md5check [-j N] source file ...",
+"efm remove [-j N] target file ...",
+"efm archive NAME DIRECTORY target",
+"efm gc target",
+"efm batch [-0] command [option ...] <files",
 "",
 "efm list [file ...]",
 "efm listkeys [file ...]",
 "efm listfiles [file ...]",
+"efm query [option ...]",
 "",
 "efm start",
 "efm kill",
+"efm - <commands",
 "",
 "efm trace on",
 "efm trace off",
 "efm trace",
 "",
+"efm jobs N",
+"efm jobs",
+"",
+"efm s3parts N",
+"efm s3parts",
+"",
+"efm compress none|zip|zlib",
+"efm compress",
+"",
+"efm chunking on|off",
+"efm chunking",
+"\f",
 "efm listall [file ...]",
 "efm listallkeys [file ...]",
 "efm listcurfiles [file ...]",
@@ -73,7 +100,14 @@ const char * documentation [] = {
 "efm obs file ...",
 "efm add file ...",
 "efm sub file ...",
-"efm del source file ...",
+"efm del [-j N] source file ...",
+"",
+"efm format binary",
+"efm format text",
+"efm format",
+"efm export",
+"",
+"efm stats",
 "",
 "efm s3cmd ...",
 "\f",
@@ -97,19 +131,62 @@ const char * documentation [] = {
 "    that its MD5 sum matches that of the retrieved",
 "    decrypted file.  Neither of these two commands",
 "    deletes or alters any existing decrypted file.",
+"    Encrypted files are decrypted as they are read",
+"    from the source directory, without being copied",
+"    to the current directory, and \"check\" only com-",
+"    putes the MD5 sum of the decrypted data, which",
+"    it never writes.",
 "",
 "    The \"md5check\" command checks the MD5 sums of",
 "    any existing encrypted and/or decrypted files.",
+"    The MD5 sums of remote encrypted files are com-",
+"    puted by one md5sum command for many files, and",
+"    those of S3 files are taken from one listing of",
+"    the S3 directory.",
+"",
+"    The MD5 sums of decrypted files in the current",
+"    directory are kept in \"EFM-MD5CACHE\", along",
+"    with the device, inode, size, modification",
+"    time, and change time of each file, and a file",
+"    whose status is unchanged is not read again to",
+"    compute its MD5 sum.  Files changed within 2",
+"    seconds of when their sums were computed are",
+"    not cached.  \"EFM-MD5CACHE\" may be deleted at",
+"    any time.",
+"",
+"    The \"archive\" command makes an index entry",
+"    NAME for a tar archive of DIRECTORY, and en-",
+"    crypts the archive to the target directory, as",
+"    \"moveto\" would for a file named NAME holding",
+"    the archive, but without writing the archive in",
+"    the current directory.  The archive is as made",
+"    by \"tar cf NAME --exclude-from DIRECTORY/.BACK-",
+"    UP-IGNORE DIRECTORY\", except that hard links",
+"    are archived as separate files and special",
+"    files are skipped.  It is made twice, once to",
+"    compute its MD5 sum and once to encrypt it, and",
+"    DIRECTORY must not change meanwhile.",
 "",
 "    File names must not contain any '/'s (files must",
 "    be in the current directory).  Source and target",
 "    names can be any directory names acceptable to",
 "    scp or s3cmd.  Efm makes temporary files in the",
-"    current directory whose base names are the 32",
+"    current directory whose names begin with",
+"    \"EFM-\" and its process id, and end with the 32",
 "    character MD5 sums of the decrypted files.  No",
 "    two encrypted files may have the same MD5 sum.",
-"    It is expected that files will be tar files of",
-"    directories.",
+"    A file moved or copied to a target directory",
+"    other than \".\" is encrypted as it is written",
+"    to the target, without a temporary encrypted",
+"    file.  A failed copy is retried, resuming after",
+"    the part of the target already written.  A retry",
+"    encrypts the file again exactly as before, and",
+"    writes only what the target is missing, except",
+"    that s3cmd put writes it all again.  A retry of",
+"    a decryption reads only the rest of the source,",
+"    except that s3cmd get reads it all again.  It is",
+"    expected that files will be tar files of direc-",
+"    tories.",
 "\f",
 "    Efm maintains an index of encrypted files.  This",
 "    index is itself encrypted, and is stored in the",
@@ -171,6 +248,37 @@ const char * documentation [] = {
 "    file names (that consist of MD sum basenames",
 "    plus .gpg extension).",
 "",
+"    The \"query\" command lists the index entries",
+"    selected by its options, as \"list\" does, in",
+"    name order.  The options are:",
+"",
+"        -current  -obsolete  -all",
+"            Select current (the default), obsolete,",
+"            or all entries.  With -all, the listing",
+"            includes indicators as for \"listall\".",
+"        -name GLOB  -prefix PREFIX",
+"            Select names matching the glob pattern",
+"            or beginning with PREFIX.",
+"        -after TIME  -before TIME",
+"            Select modification times from/to TIME,",
+"            \"YYYY/MM/DD\" or \"YYYY/MM/DD HH:MM:SS\".",
+"        -minsize N  -maxsize N",
+"            Select sizes from/to N bytes.",
+"        -sort name|mtime|size  -reverse",
+"            List in order of name, modification",
+"            time, or size, or in reverse order.",
+"        -offset N  -limit N",
+"            Skip the first N entries selected, and",
+"            list at most N entries.",
+"        -keys  -files",
+"            List as \"listkeys\" or \"listfiles\"",
+"            would.",
+"",
+"    The background process keeps the index sorted",
+"    by name, time, and size, and a range of names",
+"    with PREFIX, or of times or sizes when sorting",
+"    by them, is found without checking every entry.",
+"",
 "    This program returns exit status 0 if there is",
 "    no error and if there is an error, returns exit",
 "    status 1 and prints the error message to the",
@@ -200,12 +308,152 @@ const char * documentation [] = {
 "    \"trace\" command without any \"on\" or \"off\"",
 "    argument just prints the current trace status.",
 "",
+"    The \"-j N\" option makes a command process up",
+"    to N files at once.  Each file is copied, de-",
+"    leted, decrypted, and checked by its own worker",
+"    process, while index changes are made one at a",
+"    time by the background process, and results are",
+"    reported in the order of the file arguments.",
+"    The \"jobs\" command sets the N used when there",
+"    is no -j option (initially 1), or without an ar-",
+"    gument prints it.",
+"\f",
+"    When tracing is on, file commands also print",
+"    the wall time, megabytes, and megabytes per",
+"    second of each stage of their work (hash, en-",
+"    crypt, decrypt, transfer, and verify) for each",
+"    file and for the whole command.  Transfer time",
+"    does not include the time spent encrypting or",
+"    decrypting data piped to or from a remote or S3",
+"    file, and verify is the computing of MD5 sums of",
+"    remote and S3 files.  Stages done at once by",
+"    several processes may take more time in all",
+"    than the whole command.  The \"stats\" command",
+"    prints the totals of these times for all the",
+"    file commands run by the background process.",
+"",
+"    If the EFM_STATS environment variable names a",
+"    file when the background process starts, a",
+"    line holding a JSON object that gives the same",
+"    times is appended to that file for each file",
+"    and for each file command.",
+"\f",
+"    The background process does not rewrite the",
+"    whole index each time a command changes it.  In-",
+"    stead it appends the changes to the encrypted",
+"    journal \"EFM-JOURNAL.gpg\", which is read after",
+"    the index when the background process starts.",
+"    The index is rewritten and the journal deleted",
+"    when the journal grows long, and by the \"kill\"",
+"    command.  So after \"efm kill\", \"EFM-INDEX.gpg\"",
+"    holds the whole index, and \"EFM-INDEX.gpg-\"",
+"    holds the index before it was last rewritten.",
+"",
+"    Commands that change the index are run by the",
+"    background process one at a time, in the order",
+"    given.  Other commands, such as \"list\" and",
+"    \"copyfrom\", are run at once, even while a com-",
+"    mand that changes the index is running, and see",
+"    the index as it was before that command, except",
+"    that a file command's changes for the files it",
+"    has finished are appended to the journal as it",
+"    runs, at most once a second, and are seen.",
+"    Commands that process the same file take turns,",
+"    using locks on the file \"EFM-LOCK\".",
+"\f",
+"    \"efm -\" reads commands from the standard input,",
+"    one per line, each line holding the arguments",
+"    that would follow \"efm\", quoted as in the in-",
+"    dex if they contain special characters.  Blank",
+"    lines are ignored.  The commands are all sent to",
+"    the background process on one connection without",
+"    waiting for their results, and are run one after",
+"    another in the order given.  The exit status is",
+"    1 if any command has an error.",
+"",
+"    \"efm batch\" runs the command that follows it",
+"    on the files named by the lines of the standard",
+"    input, or with -0 by its NUL separated strings,",
+"    as if they were given after the command's other",
+"    arguments.  The command may be cur, obs, add,",
+"    sub, or a file command.  Files are reported on",
+"    as they are done, as usual, but the index",
+"    changes are all written at the end, and are not",
+"    seen by other commands before then.  As the",
+"    standard input is not then the terminal, the",
+"    background process must already be running for",
+"    \"efm -\" and \"efm batch\" unless EFM_PASS-",
+"    WORD_FD is set.",
+"\f",
+"    The background process keeps one ssh connec-",
+"    tion open to each remote account it uses, and",
+"    each ssh or scp it executes uses that connec-",
+"    tion instead of making a new one.  A connection",
+"    is closed after 10 minutes unused, or by the",
+"    \"kill\" command.  The EFM_SSH and EFM_SCP envi-",
+"    ronment variables, if set, name programs to",
+"    execute instead of ssh and scp.  If the",
+"    EFM_PASSWORD_FD environment variable is set to",
+"    a file descriptor number, the password is read",
+"    as a line from that descriptor instead of from",
+"    the terminal.",
+"",
+"    If EFM-S3CONFIG sets \"efm_builtin_client =",
+"    True\" and \"use_https = False\", efm transfers",
+"    S3 files itself over HTTP to the \"host_base\"",
+"    endpoint, instead of executing s3cmd.  Files",
+"    longer than 8 megabytes are then uploaded and",
+"    downloaded in parts, and the \"s3parts\" command",
+"    sets the number of parts transferred at once",
+"    (initially 4), or without an argument prints it.",
+"    \"efm s3parts 0\" makes efm always execute s3cmd.",
+"    Https endpoints are always accessed by executing",
+"    s3cmd.  Files encrypted to S3 by s3cmd are piped",
+"    into \"s3cmd put\", and as it records no MD5 sum",
+"    for them, their MD5 sums are checked by reading",
+"    them back with \"s3cmd get\".",
+"\f",
+"    The \"compress\" command sets the compression",
+"    used when encrypting files of new index entries",
+"    (initially none), or without an argument prints",
+"    it.  Zip and zlib are the OpenPGP compression al-",
+"    gorithms of those names, which gpg can decrypt.",
+"    Each entry records the compression used for it,",
+"    so its file is always encrypted the same way and",
+"    keeps the same esize.",
+"",
+"    The \"chunking\" command sets whether new index",
+"    entries copied to directories other than \".\"",
+"    are chunked (initially off), or without an ar-",
+"    gument prints it.  The file of a chunked entry",
+"    is split into chunks of about a megabyte, with",
+"    boundaries chosen by the file contents, and each",
+"    chunk is encrypted and stored in the target di-",
+"    rectory as CCCC.chunk.gpg.  MMMM.gpg then holds",
+"    the list of the chunks of the file, and only",
+"    chunks not already in the directory are copied",
+"    to it, so an edited file shares most chunks with",
+"    its old version.  The name CCCC and the key of a",
+"    chunk are made from its contents with HMAC-SHA-",
+"    256 under a random secret, which \"chunking on\"",
+"    adds to the index as a comment line beginning",
+"    with \"#efm-chunk-secret\" if it has none.  This",
+"    line must never be changed or removed, or chunks",
+"    already stored would no longer be shared.",
+"",
+"    Removing a chunked file deletes only MMMM.gpg,",
+"    as its chunks may be shared.  The \"gc\" command",
+"    deletes the chunks in the target directory that",
+"    are not listed by the MMMM.gpg there of any",
+"    chunked entry, current or obsolete.  It deletes",
+"    nothing if one of those MMMM.gpg cannot be read.",
+"",
 "    The index file contains four line entries of",
 "    the form:",
 "",
 "	 indicator filename",
 "            mode mtime size md5sum",
-"            esize emd5sum",
+"            esize emd5sum [codec] [chunked]",
 "            key",
 "\f",
 "    where the first entry line is not indented and",
@@ -217,6 +465,11 @@ const char * documentation [] = {
 "    is Greenwich Mean Time (GMT).  Esize may be 0",
 "    to indicate its value is not known, and emd5sum",
 "    may be \"\" to indicate its value is not known.",
+"    The codec, if present, is zip or zlib and names",
+"    the compression used when encrypting the file.",
+"    The word chunked is present if the entry is",
+"    chunked, and then esize and emd5sum are those",
+"    of the encrypted list of chunks.",
 "",
 "    Lines at the beginning of the index file whose",
 "    first character is # are comment lines, and are",
@@ -277,10 +530,9 @@ const char * documentation [] = {
 "    deletes encrypted files like \"remove\" but does",
 "    not change index entries.",
 "",
-"    An external program is used to encrypt/decrypt",
-"    files.  By default this is gpg.  The encrypted",
-"    file name is MD5SUM.gpg with this default.  In",
-"    general the encrypted file basename is the",
+"    Files are encrypted/decrypted in the format of",
+"    gpg -c.  The encrypted file name is MD5SUM.gpg.",
+"    In general the encrypted file basename is the",
 "    MD5sum of the file contents and the extension",
 "    denotes the encrypting program.",
 "\f",
@@ -292,13 +544,50 @@ const char * documentation [] = {
 "    --access_key=... and --secret_key=... arguments",
 "    added with values from EFM-KEYS.gpg.",
 "",
-"    Currently only gpg is supported as an encryp-",
-"    ing program.",
+"    The .gpg extension is handled by an encryption",
+"    engine built into efm, which writes files gpg",
+"    can decrypt and reads files written by gpg -c,",
+"    without executing gpg.  Files that use features",
+"    the built-in engine lacks (e.g., CAST5 or BZIP2",
+"    compression) are decrypted by executing gpg.",
+"    Any other extension is handled by executing",
+"    gpg.",
+"",
+"    The decrypted index may instead be in a binary",
+"    format with fixed size entries, which is faster",
+"    to read and takes less memory for a large index.",
+"    The \"format binary\" and \"format text\" com-",
+"    mands rewrite the index in the given format,",
+"    which is kept when the index is later rewritten.",
+"    The \"format\" command without an argument",
+"    prints the current format.  The \"export\" com-",
+"    mand prints the whole index, including comment",
+"    lines, in the text format described above.",
 NULL
 };
 
 int trace = 0;		/* 1 if trace on, 0 if off. */
 
+int jobs = 1;		/* Number of files processed at
+			   once by file commands. */
+
+int s3_parts = 4;	/* Parts of an S3 object trans-
+			   ferred at once by the built-in
+			   client; 0 to always execute
+			   s3cmd. */
+
+/* Names of the compression algorithms used when en-
+ * crypting, indexed by their OpenPGP algorithm numbers.
+ */
+const char * codecs[] = { "none", "zip", "zlib", NULL };
+
+int compression = 0;	/* Codec given to new index
+			   entries. */
+
+int chunking = 0;	/* 1 if new index entries copied
+			   to a directory other than "."
+			   are chunked. */
+
 int RETRIES = 3;	/* Number of retries. */
 
 #define MAX_LEXEME_SIZE 2000
@@ -308,8 +597,6 @@ int RETRIES = 3;	/* Number of retries. */
 typedef char line_buffer[MAX_LINE_SIZE+2];
 
 const char * time_format = "%Y/%m/%d %H:%M:%S";
-#define BEGIN_STRING "\001\002\003\004"
-#define END_STRING "\001\002\003\005"
 
 /* The following lines are filtered out of the output
  * (we could find no other way to keep gpg quiet).
@@ -350,8 +637,16 @@ int get_line ( line_buffer buffer, FILE * in )
  */
 int index_modified;
 
-/* Index is a circular list of entries.  All char *'s
- * are malloc'ed.
+/* The following is set if the whole index must be
+ * rewritten, and not just have its changes appended
+ * to the journal (see write_journal).
+ */
+int index_rewrite = 0;
+
+/* Index is a circular list of entries.  Entries and
+ * all their char *'s are malloc'ed, or are in the
+ * index arena if read from a binary index (see
+ * free_field).
  */
 struct entry {
 
@@ -372,17 +667,45 @@ struct entry {
 
     char * emd5sum;
     off_t esize;
+    int codec;
+	/* Compression algorithm used when encrypting,
+	 * an index into codecs.
+	 */
+    int chunked;
+	/* 1 if the file is kept in the chunk store
+	 * (see put_chunked), 0 if it is one encrypted
+	 * file.
+	 */
 
     char * key;
 
     struct entry * previous, * next;
+
+    struct entry * next_filename, * next_md5sum;
+	/* Next entries in the hash table buckets
+	 * for filename and md5sum.
+	 */
+
+    int modified;
+	/* 1 if entry changed since the index or the
+	 * journal was last written.
+	 */
 };
 struct entry * first_entry = NULL;
 
+/* Filenames of entries subtracted since the index or
+ * the journal was last written.  Malloc'ed.
+ */
+struct removal {
+    char * filename;
+    struct removal * next;
+};
+struct removal * first_removal = NULL;
+
 /* Comment lines are just a circular list of lines.
  */
 struct comment {
-    char * line;	/* Malloc'ed. */
+    char * line;	/* Malloc'ed or in index arena. */
 
     struct comment * previous, * next;
 };
@@ -398,6 +721,176 @@ void error ( int err_no )
     exit ( 1 );
 }
 
+/* Hash tables of the index entries by filename and by
+ * md5sum.  Each bucket is a list of entries linked by
+ * next_filename or next_md5sum and kept in index
+ * order, so lookups find the same entry a search of
+ * the index would.  Entries are put in the tables by
+ * hash_entry when they are linked into the index,
+ * and taken out by unhash_entry before they are
+ * unlinked.  The tables are doubled in size when the
+ * number of entries exceeds their size.
+ */
+struct entry ** filename_table = NULL;
+struct entry ** md5sum_table = NULL;
+unsigned long hash_size = 0, hash_count = 0;
+unsigned long index_generation = 0;
+    /* Incremented whenever an entry is put in or
+     * taken out of the tables. */
+
+unsigned long hash_string ( const char * s )
+{
+    unsigned long h = 2166136261UL;
+    while ( * s )
+	h = ( h ^ (unsigned char) * s ++ )
+	    * 16777619UL;
+    return h;
+}
+
+/* Put entry at the end of the buckets of its filename
+ * and md5sum.
+ */
+void hash_insert ( struct entry * e )
+{
+    struct entry ** p;
+
+    p = filename_table
+      + hash_string ( e->filename ) % hash_size;
+    while ( * p ) p = & ( * p )->next_filename;
+    * p = e;
+    e->next_filename = NULL;
+
+    p = md5sum_table
+      + hash_string ( e->md5sum ) % hash_size;
+    while ( * p ) p = & ( * p )->next_md5sum;
+    * p = e;
+    e->next_md5sum = NULL;
+}
+
+/* Add entry, which has just been linked into the
+ * index, to the hash tables.
+ */
+void hash_entry ( struct entry * e )
+{
+    struct entry * f;
+
+    ++ index_generation;
+    if ( ++ hash_count <= hash_size )
+    {
+	hash_insert ( e );
+	return;
+    }
+
+    /* Rebuild larger tables from the index, which
+     * includes e.
+     */
+    free ( filename_table );
+    free ( md5sum_table );
+    hash_size = ( hash_size == 0 ? 1024
+				 : 2 * hash_size );
+    filename_table = (struct entry **)
+	calloc ( hash_size, sizeof ( struct entry * ) );
+    md5sum_table = (struct entry **)
+	calloc ( hash_size, sizeof ( struct entry * ) );
+    if ( filename_table == NULL
+	 || md5sum_table == NULL )
+	error ( ENOMEM );
+    f = first_entry;
+    do hash_insert ( f );
+    while ( ( f = f->next ) != first_entry );
+}
+
+/* Remove entry from the hash tables.
+ */
+void unhash_entry ( struct entry * e )
+{
+    struct entry ** p;
+
+    p = filename_table
+      + hash_string ( e->filename ) % hash_size;
+    while ( * p != e ) p = & ( * p )->next_filename;
+    * p = e->next_filename;
+
+    p = md5sum_table
+      + hash_string ( e->md5sum ) % hash_size;
+    while ( * p != e ) p = & ( * p )->next_md5sum;
+    * p = e->next_md5sum;
+
+    -- hash_count;
+    ++ index_generation;
+}
+
+/* Check if index has entry with given filename.
+ * Return entry if yes, NULL if no.
+ */
+struct entry * find_filename ( const char * filename )
+{
+    struct entry * e;
+    if ( hash_size == 0 ) return NULL;
+    e = filename_table
+      [hash_string ( filename ) % hash_size];
+    for ( ; e != NULL; e = e->next_filename )
+    {
+	if ( strcmp ( filename, e->filename ) == 0 )
+	    return e;
+    }
+    return NULL;
+}
+
+/* Check if index has entry with given MD5sum.
+ * Return entry if yes, NULL if no.
+ *
+ * If current_only is 1, ignore obsolete entries.
+ */
+struct entry * find_md5sum
+	( const char * md5sum, int current_only )
+{
+    struct entry * e;
+    if ( hash_size == 0 ) return NULL;
+    e = md5sum_table
+      [hash_string ( md5sum ) % hash_size];
+    for ( ; e != NULL; e = e->next_md5sum )
+    {
+	if ( current_only && ! e->current ) continue;
+	if ( strcmp ( md5sum, e->md5sum ) == 0 )
+	    return e;
+    }
+    return NULL;
+}
+
+/* Memory holding a binary index that has been read,
+ * together with the entries and MD5 sum and key
+ * strings made from it (see read_binary_index), or
+ * NULL if none.
+ */
+char * index_arena = NULL, * index_arena_end = NULL;
+
+/* Free an entry or entry field, unless it is in the
+ * index arena, which is never freed.
+ */
+void free_field ( void * p )
+{
+    if ( (char *) p < index_arena
+	 || (char *) p >= index_arena_end )
+	free ( p );
+}
+
+/* Unlink entry from the index and free it.
+ */
+void remove_entry ( struct entry * e )
+{
+    unhash_entry ( e );
+    e->next->previous = e->previous;
+    e->previous->next = e->next;
+    if ( first_entry == e ) first_entry = e->next;
+    if ( first_entry == e ) first_entry = NULL;
+    free_field ( e->filename );
+    free_field ( e->md5sum );
+    free_field ( e->emd5sum );
+    free_field ( e->key );
+    free_field ( e );
+}
+
 /* Given a pointer into the line buffer, scan the next
  * lexeme.  A lexeme is a sequence of non-whitespace
  * characters, or is " quoted.  "" denotes " in quoted
@@ -489,8 +982,11 @@ void put_lexeme ( char ** buffer, const char * lexeme )
     }
 }
 
-/* Read password from input terminal only.  On error
- * print error message to stdout and exit ( 1 ).
+/* Read password from input terminal only, unless the
+ * EFM_PASSWORD_FD environment variable is set, in which
+ * case read it as a line from that file descriptor.
+ * On error print error message to stdout and exit
+ * ( 1 ).
  *
  * Note: getpass(3) has been marked OBSOLETE.
  */
@@ -499,6 +995,30 @@ void read_password ( void )
 {
     struct termios tios;
     size_t len;
+    const char * passfd = getenv ( "EFM_PASSWORD_FD" );
+    if ( passfd != NULL && isdigit ( passfd[0] ) )
+    {
+	int fd = atoi ( passfd ), r;
+	char c;
+	len = 0;
+	while ( ( r = read ( fd, & c, 1 ) ) != 0 )
+	{
+	    if ( r < 0 )
+	    {
+		if ( errno == EINTR ) continue;
+		error ( errno );
+	    }
+	    if ( c == '\n' ) break;
+	    if ( len == MAX_KEY_SIZE )
+	    {
+		printf ( "ERROR: password too long\n" );
+		exit ( 1 );
+	    }
+	    password[len++] = c;
+	}
+	password[len] = 0;
+	return;
+    }
     if ( tcgetattr ( 0, & tios ) < 0 )
     {
 	printf ( "ERROR: password required"
@@ -542,39 +1062,115 @@ void read_password ( void )
  */
 char s3_config[100000];
 
-/* Create EFM-S3CONFIG.pipe but no NOT write into it.
+/* Copy the value of the EFM-S3CONFIG setting name,
+ * given by a line `name = value', into value, which
+ * has room for size characters.  Return 0 if the
+ * setting is found and fits, and -1 otherwise.
+ */
+int s3_setting ( const char * name, char * value,
+		 int size )
+{
+    const char * p = s3_config;
+    int n = strlen ( name );
+    while ( * p )
+    {
+	const char * q = p;
+	const char * end = strchr ( p, '\n' );
+	if ( end == NULL ) end = p + strlen ( p );
+	p = ( * end ? end + 1 : end );
+	if ( strncmp ( q, name, n ) != 0 ) continue;
+	q += n;
+	while ( q < end && isspace ( * q ) ) ++ q;
+	if ( q == end || * q ++ != '=' ) continue;
+	while ( q < end && isspace ( * q ) ) ++ q;
+	while ( end > q && isspace ( end[-1] ) ) -- end;
+	if ( end - q >= size ) return -1;
+	memcpy ( value, q, end - q );
+	value[end-q] = 0;
+	return 0;
+    }
+    return -1;
+}
+
+/* Return 1 if S3 objects are transferred by the built-
+ * in client, and 0 if by executing s3cmd.  The built-
+ * in client is used only if EFM-S3CONFIG sets efm_-
+ * builtin_client to True, and, as the client speaks
+ * only HTTP, sets use_https to False.
+ */
+int s3_builtin ( void )
+{
+    char value[16];
+    if ( s3_parts < 1
+	 || s3_setting ( "efm_builtin_client", value,
+			 sizeof ( value ) ) < 0
+	 || value[0] == 0
+	 || strchr ( "TtYy1", value[0] ) == NULL
+	 || s3_setting ( "use_https", value,
+			 sizeof ( value ) ) < 0 )
+	return 0;
+    return value[0] != 0
+	   && strchr ( "FfNn0", value[0] ) != NULL;
+}
+
+/* Name of the named pipe that s3cmd reads EFM-S3CONFIG
+ * from.  It is set by setup_s3_pipe to include the
+ * process id, so that worker processes do not share
+ * it.
+ */
+char s3_pipe[64] = "EFM-S3CONFIG.pipe";
+
+/* Create s3_pipe but no NOT write into it.
  * Execute in PARENT process if child is going to
- * execute s3cmd.
- *
- * Does return -1 if EFM-S3CONFIG.gpg does not exist,
- * return 0 if no errors, and exit on system error.
+ * execute s3cmd.  Exit on system error.
  */
-int setup_s3_pipe ( void )
+void make_s3_pipe ( void )
 {
+    sprintf ( s3_pipe, "EFM-S3CONFIG-%d.pipe",
+	      (int) getpid() );
     if ( trace )
     {
 	fprintf ( stderr,
-		  "Making and loading"
-		  " EFM-S3CONFIG.pipe\n" );
+		  "Making and loading %s\n",
+		  s3_pipe );
 	fflush ( stderr );
     }
+    unlink ( s3_pipe );
+    if ( mkfifo ( s3_pipe, 0600 ) < 0 )
+	error ( errno );
+}
+
+/* Execute in PARENT process if child is going to
+ * access S3.  Create s3_pipe by make_s3_pipe, unless
+ * the built-in S3 client is used, in which case
+ * s3_pipe is made empty.
+ *
+ * Does return -1 if EFM-S3CONFIG.gpg does not exist,
+ * return 0 if no errors, and exit on system error.
+ */
+int setup_s3_pipe ( void )
+{
     if ( s3_config[0] == 0 )
     {
 	printf ( "ERROR: EFM-S3CONFIG.gpg missing\n" );
 	return -1;
     }
-    unlink ( "EFM-S3CONFIG.pipe" );
-    if ( mkfifo ( "EFM-S3CONFIG.pipe", 0600 ) < 0 )
-        error ( errno );
+    if ( s3_builtin() )
+	s3_pipe[0] = 0;
+    else
+	make_s3_pipe();
     return 0;
 }
 
-/* Write EFM-S3CONFIG into EFM-S3CONFIG.pipe.  Exits
- * if error.  Execute in parent AFTER STARTING child.
+/* Write EFM-S3CONFIG into s3_pipe, if it is not
+ * empty.  Exits if error.  Execute in parent AFTER
+ * STARTING child.
  */
 void write_s3_pipe ( void )
 {
-    int fd = open ( "EFM-S3CONFIG.pipe", O_WRONLY );
+    int fd;
+    if ( s3_pipe[0] == 0 ) return;
+    fd = open ( s3_pipe, O_WRONLY );
     if ( fd < 0 ) error ( errno );
     if ( write ( fd, s3_config, strlen ( s3_config ) )
          < 0 )
@@ -582,14 +1178,33 @@ void write_s3_pipe ( void )
     close ( fd );
 }
 
+/* Return the index in codecs of the named compression
+ * algorithm, or -1 if there is none.
+ */
+int find_codec ( const char * name )
+{
+    int i;
+    for ( i = 0; codecs[i] != NULL; ++ i )
+	if ( strcmp ( name, codecs[i] ) == 0 )
+	    return i;
+    return -1;
+}
+
 /* Read index from file stream.  On error print error
  * message to stdout and exit ( 1 );
+ *
+ * If journal is 1, the stream is a decrypted journal
+ * record instead (see write_journal), which has no
+ * comments, whose entries replace any existing entries
+ * with the same filenames, and which may also contain
+ * lines of the form `x filename' that subtract the
+ * entry for filename if it exists.
  */
 int index_read = 0;
-void read_index ( FILE * f )
+void read_index ( FILE * f, int journal )
 {
     line_buffer buffer;
-    int begin = 1;
+    int begin = ! journal;
     char * filename;
 
     index_read = 1;
@@ -599,9 +1214,9 @@ void read_index ( FILE * f )
 	struct tm td;
 	char * b, * c, * q,
 	     * mode, * mtime, * size, * md5sum,
-	     * emd5sum, * esize,
+	     * emd5sum, * esize, * codec,
 	     * key;
-	int current;
+	int current, k, chunked;
 	unsigned long m, s, es;
 	const char * ts;
 	time_t d;
@@ -637,6 +1252,20 @@ void read_index ( FILE * f )
 	    exit ( 1 );
 	}
 	c = get_lexeme ( & b );
+	if ( c != NULL && journal
+	     && strcmp ( c, "x" ) == 0 )
+	{
+	    filename = get_lexeme ( & b );
+	    if ( filename == NULL || get_lexeme ( & b ) )
+	    {
+		printf ( "ERROR: bad journal line"
+			 "\n    %s\n", buffer );
+		exit ( 1 );
+	    }
+	    e = find_filename ( filename );
+	    if ( e != NULL ) remove_entry ( e );
+	    continue;
+	}
 	if ( c == NULL
 	     ||
 	     ( strcmp ( c, "+" ) != 0
@@ -726,6 +1355,7 @@ void read_index ( FILE * f )
 		     mode, filename );
 	    exit ( 1 );
 	}
+	memset ( & td, 0, sizeof ( td ) );
 	ts = (const char *)
 	     strptime ( mtime, time_format, & td );
 	d = ( ts == NULL || * ts != 0 ) ?
@@ -785,7 +1415,20 @@ void read_index ( FILE * f )
 		     filename );
 	    exit ( 1 );
 	}
-	if ( get_lexeme ( & b ) )
+	k = chunked = 0;
+	codec = get_lexeme ( & b );
+	if ( codec != NULL && find_codec ( codec ) > 0 )
+	{
+	    k = find_codec ( codec );
+	    codec = get_lexeme ( & b );
+	}
+	if ( codec != NULL
+	     && strcmp ( codec, "chunked" ) == 0 )
+	{
+	    chunked = 1;
+	    codec = get_lexeme ( & b );
+	}
+	if ( codec != NULL )
 	{
 	    printf ( "ERROR: stuff on line after"
 		     " emd5sum\n    for file %s\n",
@@ -850,8 +1493,29 @@ void read_index ( FILE * f )
 	}
 	key = strdup ( key );
 
-	e = (struct entry * )
-	    malloc ( sizeof ( struct entry ) );
+	e = journal ? find_filename ( filename ) : NULL;
+	if ( e != NULL )
+	{
+	    unhash_entry ( e );
+	    free_field ( e->filename );
+	    free_field ( e->md5sum );
+	    free_field ( e->emd5sum );
+	    free_field ( e->key );
+	}
+	else
+	{
+	    e = (struct entry * )
+		malloc ( sizeof ( struct entry ) );
+	    if ( first_entry == NULL )
+		first_entry = e->previous = e->next = e;
+	    else
+	    {
+		e->previous = first_entry->previous;
+		e->next = first_entry;
+		e->previous->next = e->next->previous
+				  = e;
+	    }
+	}
 	e->current  = current;
 	e->filename = filename;
 	e->mode     = m;
@@ -860,15 +1524,11 @@ void read_index ( FILE * f )
 	e->md5sum   = md5sum;
 	e->emd5sum  = emd5sum;
 	e->esize    = es;
+	e->codec    = k;
+	e->chunked  = chunked;
 	e->key      = key;
-	if ( first_entry == NULL )
-	    first_entry = e->previous = e->next = e;
-	else
-	{
-	    e->previous = first_entry->previous;
-	    e->next = first_entry;
-	    e->previous->next = e->next->previous = e;
-	}
+	e->modified = 0;
+	hash_entry ( e );
 	index_modified = 1;
     }
 }
@@ -948,6 +1608,16 @@ void write_index_entry
 	b += strlen ( b );
 	* b ++ = ' ';
 	put_lexeme ( & b, e->emd5sum );
+	if ( e->codec != 0 )
+	{
+	    * b ++ = ' ';
+	    put_lexeme ( & b, codecs[e->codec] );
+	}
+	if ( e->chunked )
+	{
+	    * b ++ = ' ';
+	    put_lexeme ( & b, "chunked" );
+	}
 	* b = 0;
 	fprintf ( f, "%s%s\n", prefix, buffer );
 
@@ -987,45 +1657,244 @@ void write_index ( FILE * f, int mode, int current )
     while ( ( e = e->next ) != first_entry );
 }
 
-/* Check if index has entry with given filename.
- * Return entry if yes, NULL if no.
+/* Sorted views of the index for the query command:
+ * arrays of pointers to all view_size entries, sorted
+ * by name, by modification time, and by size, with
+ * ties in name order.  They are made by update_views
+ * when the index has changed since they were made,
+ * which the background process does before forking
+ * the child serving a query, so a child finds them
+ * made unless the index changed after the fork.
  */
-struct entry * find_filename ( const char * filename )
+#define SORT_NAME	0
+#define SORT_MTIME	1
+#define SORT_SIZE	2
+#define SORT_KEYS	3
+const char * sort_names[SORT_KEYS] =
+    { "name", "mtime", "size" };
+
+struct entry ** views[SORT_KEYS];
+unsigned long view_size = 0;
+unsigned long view_generation = 0;
+    /* Index_generation when views were made, plus 1,
+     * or 0 if they were never made. */
+
+int compare_view_names ( const void * a, const void * b )
+{
+    return strcmp ( ( * (struct entry * const *) a )
+		    ->filename,
+		    ( * (struct entry * const *) b )
+		    ->filename );
+}
+
+int compare_view_mtimes ( const void * a, const void * b )
+{
+    const struct entry * e = * (struct entry * const *) a;
+    const struct entry * f = * (struct entry * const *) b;
+    if ( e->mtime != f->mtime )
+	return e->mtime < f->mtime ? -1 : 1;
+    return strcmp ( e->filename, f->filename );
+}
+
+int compare_view_sizes ( const void * a, const void * b )
+{
+    const struct entry * e = * (struct entry * const *) a;
+    const struct entry * f = * (struct entry * const *) b;
+    if ( e->size != f->size )
+	return e->size < f->size ? -1 : 1;
+    return strcmp ( e->filename, f->filename );
+}
+
+void update_views ( void )
 {
     struct entry * e = first_entry;
+    unsigned long n = 0;
+    int k;
+
+    if ( view_generation == index_generation + 1 )
+	return;
+    for ( k = 0; k < SORT_KEYS; ++ k )
+    {
+	free ( views[k] );
+	views[k] = (struct entry **) malloc
+	    ( ( hash_count + 1 )
+	      * sizeof ( struct entry * ) );
+	if ( views[k] == NULL ) error ( ENOMEM );
+    }
     if ( e ) do
+	views[SORT_NAME][n ++] = e;
+    while ( ( e = e->next ) != first_entry );
+    view_size = n;
+
+    qsort ( views[SORT_NAME], n,
+	    sizeof ( struct entry * ),
+	    compare_view_names );
+    memcpy ( views[SORT_MTIME], views[SORT_NAME],
+	     n * sizeof ( struct entry * ) );
+    qsort ( views[SORT_MTIME], n,
+	    sizeof ( struct entry * ),
+	    compare_view_mtimes );
+    memcpy ( views[SORT_SIZE], views[SORT_NAME],
+	     n * sizeof ( struct entry * ) );
+    qsort ( views[SORT_SIZE], n,
+	    sizeof ( struct entry * ),
+	    compare_view_sizes );
+    view_generation = index_generation + 1;
+}
+
+/* A query (see the query command).  Entries match if
+ * they have the given status (current is -1 for
+ * either), and names that match glob if it is not
+ * NULL and begin with prefix, modification times from
+ * after to before, and sizes from min_size to
+ * max_size, all inclusive.
+ */
+struct query {
+    int current;
+    const char * glob;
+    const char * prefix;
+    time_t after, before;
+    unsigned long long min_size, max_size;
+    int sort;		/* SORT_NAME, ... */
+    int reverse;	/* 1 to list in reverse order. */
+    unsigned long offset, limit;
+			/* Skip offset matches and then
+			   list at most limit matches. */
+    int mode;		/* As per write_index_entry. */
+};
+
+int query_match ( const struct query * q,
+		  const struct entry * e )
+{
+    return ( q->current == -1
+	     || e->current == q->current )
+	   && strncmp ( e->filename, q->prefix,
+			strlen ( q->prefix ) ) == 0
+	   && ( q->glob == NULL
+		|| fnmatch ( q->glob, e->filename, 0 )
+		   == 0 )
+	   && e->mtime >= q->after
+	   && e->mtime <= q->before
+	   && (unsigned long long) e->size
+	      >= q->min_size
+	   && (unsigned long long) e->size
+	      <= q->max_size;
+}
+
+/* Return 1 if entry e is at or past the beginning of
+ * the range of view q->sort that can match q, as only
+ * the sort key is checked.  As the view is sorted,
+ * binary search finds the beginning and end of the
+ * range, so only the entries in it are checked.
+ */
+int query_at_or_after ( const struct query * q,
+			const struct entry * e )
+{
+    return q->sort == SORT_NAME ?
+	       strcmp ( e->filename, q->prefix ) >= 0 :
+	   q->sort == SORT_MTIME ?
+	       e->mtime >= q->after :
+	       (unsigned long long) e->size
+	       >= q->min_size;
+}
+
+int query_past ( const struct query * q,
+		 const struct entry * e )
+{
+    return q->sort == SORT_NAME ?
+	       strncmp ( e->filename, q->prefix,
+			 strlen ( q->prefix ) ) > 0 :
+	   q->sort == SORT_MTIME ?
+	       e->mtime > q->before :
+	       (unsigned long long) e->size
+	       > q->max_size;
+}
+
+/* Return the first i in [lo,hi) of view for which
+ * test ( q, view[i] ) is 1, or hi if none.  Test must
+ * be 0 for a prefix of the view and 1 for the rest.
+ */
+unsigned long view_search
+	( struct entry ** view,
+	  unsigned long lo, unsigned long hi,
+	  const struct query * q,
+	  int (* test) ( const struct query * q,
+			 const struct entry * e ) )
+{
+    while ( lo < hi )
     {
-        if ( strcmp ( filename, e->filename ) == 0 )
-	    return e;
-    } while ( ( e = e->next ) != first_entry );
-    return NULL;
+	unsigned long mid = lo + ( hi - lo ) / 2;
+	if ( test ( q, view[mid] ) ) hi = mid;
+	else lo = mid + 1;
+    }
+    return lo;
 }
 
-/* Check if index has entry with given MD5sum.
- * Return entry if yes, NULL if no.
- *
- * If current_only is 1, ignore obsolete entries.
+/* List the index entries that match q.  Return the
+ * number listed.
  */
-struct entry * find_md5sum
-	( const char * md5sum, int current_only )
+unsigned long run_query ( const struct query * q )
 {
-    struct entry * e = first_entry;
-    if ( e ) do
+    struct entry ** view;
+    unsigned long lo, hi, i, skipped = 0, listed = 0;
+
+    update_views();
+    view = views[q->sort];
+    lo = view_search ( view, 0, view_size, q,
+		       query_at_or_after );
+    hi = view_search ( view, lo, view_size, q,
+		       query_past );
+    for ( i = 0; i < hi - lo && listed < q->limit;
+	  ++ i )
     {
-        if ( current_only && ! e->current ) continue;
-        if ( strcmp ( md5sum, e->md5sum ) == 0 )
-	    return e;
-    } while ( ( e = e->next ) != first_entry );
-    return NULL;
+	struct entry * e =
+	    view[q->reverse ? hi - 1 - i : lo + i];
+	if ( ! query_match ( q, e ) ) continue;
+	if ( skipped < q->offset )
+	{
+	    ++ skipped;
+	    continue;
+	}
+	write_index_entry ( stdout, e, q->mode, "" );
+	++ listed;
+    }
+    return listed;
+}
+
+/* Read a query time argument, "YYYY/MM/DD" or
+ * "YYYY/MM/DD HH:MM:SS", into * t, with end 1 if the
+ * time is the end of a range, so that a date alone
+ * means the end of that day.  Return -1 if arg is
+ * malformed, and 0 otherwise.
+ */
+int query_time ( time_t * t, const char * arg,
+		 int end )
+{
+    struct tm td;
+    line_buffer buffer;
+    const char * ts;
+
+    if ( strlen ( arg ) == 10 )
+    {
+	sprintf ( buffer, "%s %s", arg,
+		  end ? "23:59:59" : "00:00:00" );
+	arg = buffer;
+    }
+    memset ( & td, 0, sizeof ( td ) );
+    ts = (const char *)
+	strptime ( arg, time_format, & td );
+    if ( ts == NULL || * ts != 0 ) return -1;
+    * t = mktime ( & td );
+    return * t == -1 ? -1 : 0;
 }
 
 /* The background process ignores signals.  Its
  * children have default settings, and terminate.
- * The foreground process receives a BEGIN_STRING
- * line from the background process on connection,
+ * The foreground process receives a BEGIN_FRAME
+ * from the background process for each command,
  * uses it to set siggroup, and thereafter routes
  * signals to the process group named in the
- * BEGIN_STRING line.
+ * BEGIN_FRAME.
  */
 
 pid_t siggroup = 0;
@@ -1068,1005 +1937,10749 @@ int cwait ( pid_t child )
         return -1;
 }
 
-/* Create a random 32 hexadecimal digit key.  Buffer
- * must be at least 33 characters to hold key and
- * trailing NUL.
+/* Stages of the work done on the files of a file com-
+ * mand.  The wall time, bytes, and number of times of
+ * each stage are recorded for trace output, for the
+ * stats command, and for the EFM_STATS file (see
+ * write_stats).
  */
-void newkey ( char * buffer )
+#define HASH_STAGE	0
+#define ENCRYPT_STAGE	1
+#define DECRYPT_STAGE	2
+#define TRANSFER_STAGE	3
+#define VERIFY_STAGE	4
+#define STAGES		5
+const char * stage_names[STAGES] =
+    { "hash", "encrypt", "decrypt", "transfer",
+      "verify" };
+
+struct stage {
+    double seconds;
+    long long bytes;
+    long long count;
+};
+
+struct stage file_stages[STAGES];
+    /* Stages timed by this process since they were
+     * last reported. */
+double stage_seconds = 0;
+    /* Seconds recorded by all stages timed by this
+     * process. */
+double pipe_seconds = 0;
+long long pipe_bytes = 0;
+    /* Seconds spent waiting on, and bytes moved
+     * through, pipes and sockets by fd_source and
+     * fd_sink. */
+
+/* Return the time of day in seconds.
+ */
+double wall_clock ( void )
 {
-    int fd, size, result, delays;
-    unsigned char b[16];
+    struct timeval tv;
+    gettimeofday ( & tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
 
-    fd = open ( "/dev/random", O_RDONLY );
-    if ( fd < 0 ) error ( errno );
-    unsigned char * p = b;
-    size = 0;
-    delays = 0;
-    while ( size < 16 )
-    {
-	result = read ( fd, b + size, 16 - size );
-	if ( result < 0 ) error ( errno );
-	if ( result == 0 )
-	{
-	    if ( delays == 2 )
-	        printf ( "WAITING FOR RANDOM NUMBER"
-		         " GENERATOR\n" );
-	    sleep ( 1 );
-	    ++ delays;
-	}
-	else size += result;
-    }
-    close ( fd );
+/* Timing of a stage.  Stages may be timed within the
+ * timing of another stage, whose time then does not
+ * include theirs.
+ */
+struct timing {
+    double start;
+    double inner;	/* Stage_seconds at start. */
+};
 
-    sprintf ( buffer,
-              "%02x%02x%02x%02x%02x%02x%02x%02x"
-              "%02x%02x%02x%02x%02x%02x%02x%02x",
-	      b[0], b[1], b[2], b[3],
-	      b[4], b[5], b[6], b[7],
-	      b[8], b[9], b[10], b[11],
-	      b[12], b[13], b[14], b[15] );
+void start_stage ( struct timing * t )
+{
+    t->start = wall_clock();
+    t->inner = stage_seconds;
 }
 
-/* Encrypt/decrypt file.  If input file is NULL, return
- * file descriptor to write input into.  If output file
- * is NULL, return file descriptor to read output from.
- * Either the input file or the output file or both must
- * be non-NULL.
- *
- * If a descriptor is returned, the child process on
- * the other end of the descriptor pipe has its pid
- * returned in the child argument.  This can be passed
- * to cwait after the returned descriptor is closed.
- *
- * Output files are created, truncated if they exist,
- * and given user only read/write mode when they are
- * created.  Password is plength string of bytes.  If
- * error, returns -1 and writes error messages to
- * stdout.
+/* Record in file_stages[stage] the time since start_-
+ * stage ( t ), less that of stages timed since, and
+ * the given number of bytes.
  */
-int crypt ( int decrypt,
-            const char * input,
-            const char * output,
-	    const char * password, int plength,
-	    pid_t * child )
+void end_stage ( struct timing * t, int stage,
+		 long long bytes )
 {
-    int infd, outfd, passfd, passwritefd, result;
-    assert ( input != NULL || output != NULL );
+    double s = wall_clock() - t->start
+	       - ( stage_seconds - t->inner );
+    if ( s < 0 ) s = 0;
+    stage_seconds += s;
+    file_stages[stage].seconds += s;
+    file_stages[stage].bytes += bytes;
+    ++ file_stages[stage].count;
+}
 
-    if ( input == NULL )
+/* Add the stages in from to those in to, and clear
+ * from.
+ */
+void add_stages ( struct stage * to,
+		  struct stage * from )
+{
+    int i;
+    for ( i = 0; i < STAGES; ++ i )
     {
-        int fd[2];
-	if ( pipe ( fd ) < 0 ) error ( errno );
-	result = fd[1];
-	infd = fd[0];
+	to[i].seconds += from[i].seconds;
+	to[i].bytes += from[i].bytes;
+	to[i].count += from[i].count;
     }
-    else
+    memset ( from, 0, STAGES * sizeof ( * from ) );
+}
+
+/* Print a line for each stage of s that was timed,
+ * preceded by prefix.
+ */
+void print_stages ( const char * prefix,
+		    const struct stage * s )
+{
+    int i;
+    for ( i = 0; i < STAGES; ++ i )
     {
-        infd = open ( input, O_RDONLY );
-	if ( infd < 0 )
-	{
-	    printf ( "ERROR: cannot open %s"
-	             " for reading\n", input );
-	    return -1;
-	}
+	if ( s[i].count == 0 ) continue;
+	printf ( "%s%-8s %10.1f MB in %8.2f s",
+		 prefix, stage_names[i],
+		 s[i].bytes / 1e6, s[i].seconds );
+	if ( s[i].bytes > 0 && s[i].seconds > 0 )
+	    printf ( ", %.1f MB/s",
+		     s[i].bytes / 1e6 / s[i].seconds );
+	printf ( "\n" );
     }
+}
 
-    if ( output == NULL )
+/* If the EFM_STATS environment variable names a file,
+ * append to it a JSON object on one line giving the
+ * type (file or command), the name, and the stages
+ * s of a file or command, and for a command its
+ * number of files and wall time.  Lines are written
+ * by single appending writes, so lines from parallel
+ * workers are not mixed.
+ */
+void write_stats ( const char * type, const char * name,
+		   const struct stage * s,
+		   long long files, double seconds )
+{
+    const char * filename = getenv ( "EFM_STATS" );
+    char line[6 * MAX_LEXEME_SIZE + 100 * STAGES + 200];
+    char * p = line;
+    int fd, i;
+
+    if ( filename == NULL || filename[0] == 0 ) return;
+
+    p += sprintf ( p, "{\"time\": %.3f, \"type\": \"%s\","
+		      " \"name\": \"",
+		   wall_clock(), type );
+    for ( ; * name; ++ name )
     {
-        int fd[2];
-	if ( pipe ( fd ) < 0 ) error ( errno );
-	result = fd[0];
-	outfd = fd[1];
+	unsigned char c = * name;
+	if ( c == '"' || c == '\\' )
+	    p += sprintf ( p, "\\%c", c );
+	else if ( c < 0x20 )
+	    p += sprintf ( p, "\\u%04x", c );
+	else
+	    * p ++ = c;
     }
-    else
+    * p ++ = '"';
+    if ( strcmp ( type, "command" ) == 0 )
+	p += sprintf ( p, ", \"files\": %lld,"
+			  " \"seconds\": %.6f",
+		       files, seconds );
+    for ( i = 0; i < STAGES; ++ i )
     {
-        outfd = open ( output,
-	               O_WRONLY + O_CREAT + O_TRUNC,
-		       S_IWUSR + S_IRUSR );
-	if ( outfd < 0 )
-	{
-	    printf ( "ERROR: cannot open %s"
-	             " for writing\n", output );
-	    return -1;
-	}
+	if ( s[i].count == 0 ) continue;
+	p += sprintf ( p, ", \"%s\": {\"count\": %lld,"
+			  " \"bytes\": %lld,"
+			  " \"seconds\": %.6f}",
+		       stage_names[i], s[i].count,
+		       s[i].bytes, s[i].seconds );
     }
+    p += sprintf ( p, "}\n" );
 
+    fd = open ( filename, O_WRONLY + O_CREAT + O_APPEND,
+		S_IRUSR + S_IWUSR );
+    if ( fd < 0 )
     {
-        int fd[2];
-	if ( pipe ( fd ) < 0 ) error ( errno );
-	passfd = fd[0];
-	passwritefd = fd[1];
+	printf ( "ERROR: cannot open %s for"
+		 " writing\n", filename );
+	return;
     }
+    if ( write ( fd, line, p - line ) < 0 )
+	printf ( "ERROR: %s\n    writing %s\n",
+		 strerror ( errno ), filename );
+    close ( fd );
+}
 
-    fflush ( stdout );
-    fflush ( stderr );
-
-    * child = fork();
-    if ( * child < 0 ) error ( errno );
-
-    if ( * child == 0 )
+/* Send the stages timed by this process, a child, on
+ * fd for receive_stages.
+ */
+void send_stages ( int fd )
+{
+    if ( write ( fd, file_stages, sizeof ( file_stages ) )
+	 < 0 )
     {
-        int fd, nullfd;
-
-	/* Set fd's as follows:
-	 * 	0 -> infd
-	 *	1 -> outfd
-	 *	2 -> /dev/null
-	 *	3 -> passfd
-	 */
-	close ( 0 );
-	if ( dup2 ( infd, 0 ) < 0 ) error ( errno );
-	close ( infd );
-	close ( 1 );
-	if ( dup2 ( outfd, 1 ) < 0 ) error ( errno );
-	close ( outfd );
+	/* The stages are lost. */
+    }
+}
 
-	/*
-	nullfd = open ( "/dev/null", O_RDONLY );
-	if ( nullfd < 0 ) error ( errno );
-	close ( 2 );
-	if ( dup2 ( nullfd, 2 ) < 0 ) error ( errno );
-	close ( nullfd );
-	*/
+/* Receive the stages sent on fd by send_stages and add
+ * them to s.
+ */
+void receive_stages ( int fd, struct stage * s )
+{
+    struct stage sent[STAGES];
+    if ( read ( fd, sent, sizeof ( sent ) )
+	 == sizeof ( sent ) )
+	add_stages ( s, sent );
+}
 
-	if ( passfd != 3 )
-	{
-	    close ( 3 );
-	    if ( dup2 ( passfd, 3 ) < 0 )
-		error ( errno );
-	    close ( passfd );
-	}
-	fd = getdtablesize() - 1;
-	while ( fd > 3 ) close ( fd -- );
+/* Totals of file commands.
+ */
+struct stats {
+    struct stage stages[STAGES];
+    long long commands, files;
+    double seconds;
+};
 
-	if ( decrypt )
-	{
-	    if ( trace )
-	    {
-		fprintf ( stderr,
-		          "* executing gpg --batch -q"
-		          " --no-tty"
-			  " --ignore-mdc-error" );
-		if ( input != NULL )
-		{
-		    fprintf ( stderr, " \\\n"
-			  "            < %s",
-			  input );
-		    if ( output != NULL )
-			fprintf ( stderr, " \\\n"
-			  "            > %s",
-			  output );
-		}
-		else if ( output != NULL )
-		    fprintf ( stderr, " \\\n"
-		              "            > %s",
-			      output );
-		fprintf ( stderr, "\n" );
-		fflush ( stderr );
-	    }
-	    if ( execlp ( "gpg", "gpg",
-	                  "--passphrase-fd", "3",
-		          "--batch", "-q", "--no-tty",
-			  "--ignore-mdc-error",
-		          NULL ) < 0 )
-		error ( errno );
-	}
-	else
+struct stats command_stats;
+    /* Of the current file command, whose stages in-
+     * clude those of its files once they are done. */
+struct stats daemon_stats;
+    /* Of the file commands executed by children of
+     * the background process, which each send their
+     * command_stats on stats_pipe[1]. */
+int stats_pipe[2] = { -1, -1 };
+
+/* Report the stages s of a file of a file command:
+ * print them if tracing, write them to the EFM_STATS
+ * file, and add them to command_stats.
+ */
+void file_done ( const char * arg, struct stage * s )
+{
+    int i;
+    for ( i = 0; i < STAGES && s[i].count == 0; ++ i );
+    if ( i < STAGES )
+    {
+	if ( trace )
 	{
-	    if ( trace )
-	    {
-		fprintf ( stderr,
-		          "* executing gpg"
-			  " --batch -q --no-tty -c" );
-		if ( input != NULL )
-		{
-		    fprintf ( stderr, " \\\n"
-			  "            < %s",
-			  input );
-		    if ( output != NULL )
-			fprintf ( stderr, " \\\n"
-			  "            > %s",
-			  output );
-		}
-		else if ( output != NULL )
-		    fprintf ( stderr, " \\\n"
-		              "            > %s",
-			      output );
-		fprintf ( stderr, "\n" );
-		fflush ( stderr );
-	    }
-	    if ( execlp ( "gpg", "gpg",
-	                  "--passphrase-fd", "3",
-		          "--batch", "-q", "--no-tty",
-			  "-c", NULL ) < 0 )
-	    error ( errno );
+	    printf ( "* times for %s:\n", arg );
+	    print_stages ( "*     ", s );
 	}
+	write_stats ( "file", arg, s, 0, 0 );
     }
+    add_stages ( command_stats.stages, s );
+    ++ command_stats.files;
+}
 
-    close ( infd );
-    close ( outfd );
-    close ( passfd );
-
-    if ( write ( passwritefd, password, plength ) < 0 )
-        error ( errno );
-    close ( passwritefd );
+/* Report the stages of a file command that took the
+ * given wall time, including any timed since its last
+ * file was done, as file_done does, and send its
+ * totals to the background process.
+ */
+void command_done ( const char * command,
+		    double seconds )
+{
+    struct stats * c = & command_stats;
 
-    if ( input != NULL && output != NULL )
-        return cwait ( * child );
-    else
-	return result;
+    add_stages ( c->stages, file_stages );
+    c->commands = 1;
+    c->seconds = seconds;
+    if ( trace )
+    {
+	printf ( "* times for %s of %lld files in"
+		 " %.2f s:\n",
+		 command, c->files, seconds );
+	print_stages ( "*     ", c->stages );
+    }
+    write_stats ( "command", command, c->stages,
+		  c->files, seconds );
+    if ( stats_pipe[1] >= 0
+	 && write ( stats_pipe[1], c, sizeof ( * c ) )
+	    < 0 )
+    {
+	/* Pipe is full; the totals are lost. */
+    }
+    memset ( c, 0, sizeof ( * c ) );
 }
 
-/* Return true iff filename begins with `s3:'.  Also,
- * if true is returned, checks that s3_config read,
- * and if not, prints an error message and exits
- * program.
+/* Add the totals sent on stats_pipe[0] to daemon_-
+ * stats.
  */
-int is_s3 ( const char * filename )
+void receive_stats ( void )
 {
-    if ( strncmp ( "s3:", filename, 3 ) == 0 )
+    struct stats s;
+    while ( read ( stats_pipe[0], & s, sizeof ( s ) )
+	    == sizeof ( s ) )
     {
-        if ( s3_config[0] == 0 )
-	{
-	    printf ( "ERROR: S3 used in %s\n"
-		     "       but EFM-S3CONFIG.gpg"
-		     " missing\n",
-		     filename );
-	    exit ( 1 );
-	}
-	return 1;
+	add_stages ( daemon_stats.stages, s.stages );
+	daemon_stats.commands += s.commands;
+	daemon_stats.files += s.files;
+	daemon_stats.seconds += s.seconds;
     }
-    else
-        return 0;
 }
 
-/* Return a pointer to the first `:' in the file name
- * if there is a `:' and the first `:' is preceeded
- * by exactly one `@'.
+/* Built-in OpenPGP engine.
+ *
+ * Files are encrypted and decrypted in-process in the
+ * OpenPGP (RFC 4880) symmetric message format written
+ * by `gpg -c', so files written by efm can be decrypted
+ * by gpg, and files written by gpg can be decrypted by
+ * efm.  Messages are written as a symmetric-key en-
+ * crypted session key (SKESK) packet with an iterated
+ * and salted SHA-1 S2K, followed by an AES-256 symmet-
+ * rically encrypted integrity protected data (SEIPD)
+ * packet containing one literal data packet.
+ *
+ * When reading, AES-128/192/256, SHA-1 and SHA-256
+ * S2Ks, data packets with or without MDC, and uncom-
+ * pressed, ZIP, or ZLIB compressed contents are
+ * accepted.  Anything else is reported as unsupported
+ * so the caller can fall back to executing gpg.
  */
-const char * is_remote ( const char * filename )
+
+#define PGP_BUFFER_SIZE 65536
+    /* Must be a power of 2 at least 512 as it is also
+     * the size of partial body length chunks.
+     */
+
+#define ROL32(x,n) \
+    ( ( (x) << (n) ) | ( (x) >> ( 32 - (n) ) ) )
+#define ROR32(x,n) \
+    ( ( (x) >> (n) ) | ( (x) << ( 32 - (n) ) ) )
+#define GET32(p) (   (uint32_t) (p)[0] << 24 \
+		   | (uint32_t) (p)[1] << 16 \
+		   | (uint32_t) (p)[2] << 8  \
+		   | (uint32_t) (p)[3] )
+
+/* SHA-1 and SHA-256 hash context.  Algo is the OpenPGP
+ * hash algorithm id: 2 for SHA-1 and 8 for SHA-256.
+ */
+struct sha {
+    int algo;
+    uint32_t h[8];
+    uint64_t length;
+    unsigned char block[64];
+    unsigned used;
+};
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+void sha1_block ( uint32_t * h, const unsigned char * p )
 {
-    int at_found = 0;
-    const char * p = filename;
-    for ( ; * p; ++ p )
+    uint32_t w[80], a, b, c, d, e, t;
+    int i;
+
+    for ( i = 0; i < 16; ++ i ) w[i] = GET32 ( p + 4 * i );
+    for ( ; i < 80; ++ i )
+	w[i] = ROL32 ( w[i-3] ^ w[i-8] ^ w[i-14]
+			    ^ w[i-16], 1 );
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+    for ( i = 0; i < 80; ++ i )
     {
-	if ( * p == '@' )
-	{
-	    if ( at_found ) break;
-	    at_found = 1;
-	}
-	else if ( * p == ':' ) break;
+	if ( i < 20 )
+	    t = ( ( b & c ) | ( ~ b & d ) ) + 0x5a827999;
+	else if ( i < 40 )
+	    t = ( b ^ c ^ d ) + 0x6ed9eba1;
+	else if ( i < 60 )
+	    t = ( ( b & c ) | ( b & d ) | ( c & d ) )
+	      + 0x8f1bbcdc;
+	else
+	    t = ( b ^ c ^ d ) + 0xca62c1d6;
+	t += ROL32 ( a, 5 ) + e + w[i];
+	e = d; d = c; c = ROL32 ( b, 30 ); b = a; a = t;
     }
-    return * p == ':' && at_found ? p : NULL;
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
 }
 
-/* Compute the MD5 sum of a file.  The filename may have
- * any format acceptable to scp, and must not be longer
- * than MAX_LEXEME_SIZE.  The 32 character md5sum
- * followed by a NUL is returned in the buffer, which
- * must be at least 33 characters long.  0 is returned
- * on success, -1 on error.  Error messages are written
- * on stdout.  If filename is remote (has @ and :) then
- * RETRIES retries are done on failure.
- */
-int md5sum ( char * buffer,
-             const char * filename )
+void sha256_block ( uint32_t * h, const unsigned char * p )
 {
-    line_buffer name, line;
-    int remote = 0;
-    int retries = RETRIES;
-    int s3_name, at_found, error_found;
-    char * p;
+    uint32_t w[64], v[8], s0, s1, t1, t2;
+    int i;
 
-    strcpy ( name, filename );
-    p = (char *) is_remote ( name );
-    s3_name = is_s3 ( name );
-    if ( s3_name )
-        remote = 1;
-    else if ( p != NULL )
+    for ( i = 0; i < 16; ++ i ) w[i] = GET32 ( p + 4 * i );
+    for ( ; i < 64; ++ i )
     {
-        remote = 1;
-	* p ++ = 0;
+	s0 = ROR32 ( w[i-15], 7 ) ^ ROR32 ( w[i-15], 18 )
+	   ^ ( w[i-15] >> 3 );
+	s1 = ROR32 ( w[i-2], 17 ) ^ ROR32 ( w[i-2], 19 )
+	   ^ ( w[i-2] >> 10 );
+	w[i] = w[i-16] + s0 + w[i-7] + s1;
     }
-    else retries = 0;
-
-    while ( 1 )
+    memcpy ( v, h, sizeof ( v ) );
+    for ( i = 0; i < 64; ++ i )
     {
-	int fd[2];
-	int child;
-	FILE * inf;
-	if ( pipe ( fd ) < 0 ) error ( errno );
+	s1 = ROR32 ( v[4], 6 ) ^ ROR32 ( v[4], 11 )
+	   ^ ROR32 ( v[4], 25 );
+	t1 = v[7] + s1 + ( ( v[4] & v[5] )
+			   ^ ( ~ v[4] & v[6] ) )
+	   + sha256_k[i] + w[i];
+	s0 = ROR32 ( v[0], 2 ) ^ ROR32 ( v[0], 13 )
+	   ^ ROR32 ( v[0], 22 );
+	t2 = s0 + ( ( v[0] & v[1] ) ^ ( v[0] & v[2] )
+		    ^ ( v[1] & v[2] ) );
+	memmove ( v + 1, v, 7 * sizeof ( uint32_t ) );
+	v[4] += t1;
+	v[0] = t1 + t2;
+    }
+    for ( i = 0; i < 8; ++ i ) h[i] += v[i];
+}
 
-	fflush ( stdout );
-	fflush ( stderr );
+void sha_init ( struct sha * s, int algo )
+{
+    static const uint32_t h1[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+	0xc3d2e1f0 };
+    static const uint32_t h256[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    s->algo = algo;
+    if ( algo == 2 ) memcpy ( s->h, h1, sizeof ( h1 ) );
+    else memcpy ( s->h, h256, sizeof ( h256 ) );
+    s->length = 0;
+    s->used = 0;
+}
 
-	if ( s3_name && setup_s3_pipe() < 0 )
-	    return -1;
+void sha_update ( struct sha * s, const void * data,
+		  size_t n )
+{
+    const unsigned char * p = data;
+    void ( * block ) ( uint32_t *, const unsigned char * ) =
+	( s->algo == 2 ? sha1_block : sha256_block );
 
-	child = fork();
-	if ( child < 0 )
+    s->length += n;
+    while ( n > 0 )
+    {
+	size_t k;
+	if ( s->used == 0 && n >= 64 )
 	{
-	    int saved_errno = errno;
-	    if ( s3_name )
-	        unlink ( "EFM-S3CONFIG.pipe" );
-	    error ( saved_errno );
+	    block ( s->h, p );
+	    p += 64;
+	    n -= 64;
+	    continue;
 	}
-
-	if ( child == 0 )
+	k = 64 - s->used;
+	if ( k > n ) k = n;
+	memcpy ( s->block + s->used, p, k );
+	s->used += k;
+	p += k;
+	n -= k;
+	if ( s->used == 64 )
 	{
-	    int newfd, d;
+	    block ( s->h, s->block );
+	    s->used = 0;
+	}
+    }
+}
 
-	    close ( fd[0] );
+/* Finish hash, store digest, and return its length.
+ */
+int sha_final ( struct sha * s, unsigned char * digest )
+{
+    uint64_t bits = s->length * 8;
+    unsigned char pad[72];
+    int padlength = ( s->used < 56 ? 56 : 120 ) - s->used;
+    int i, n;
+
+    memset ( pad, 0, sizeof ( pad ) );
+    pad[0] = 0x80;
+    for ( i = 0; i < 8; ++ i )
+	pad[padlength+i] = bits >> ( 56 - 8 * i );
+    sha_update ( s, pad, padlength + 8 );
+
+    n = ( s->algo == 2 ? 5 : 8 );
+    for ( i = 0; i < n; ++ i )
+    {
+	digest[4*i]   = s->h[i] >> 24;
+	digest[4*i+1] = s->h[i] >> 16;
+	digest[4*i+2] = s->h[i] >> 8;
+	digest[4*i+3] = s->h[i];
+    }
+    return 4 * n;
+}
 
-	    /* Set fd's as follows:
-	     * 	0 -> /dev/null
-	     *	1 -> fd[1]
-	     *	2 -> parent's fd 1
-	     */
-	    newfd = open ( "/dev/null", O_RDONLY );
-	    if ( newfd < 0 ) error ( errno );
-	    close ( 0 );
-	    if ( dup2 ( newfd, 0 ) < 0 )
-	    	error ( errno );
-	    close ( newfd );
-	    close ( 2 );
-	    if ( dup2 ( 1, 2 ) < 0 )
-	    	error ( errno );
-	    close ( 1 );
-	    if ( dup2 ( fd[1], 1 ) < 0 )
-	    	error ( errno );
-	    close ( fd[1] );
-	    d = getdtablesize() - 1;
-	    while ( d > 2 ) close ( d -- );
+/* MD5 hash context.
+ */
+struct md5 {
+    uint32_t h[4];
+    uint64_t length;
+    unsigned char block[64];
+    unsigned used;
+};
 
-	    if ( ! remote )
-	    {
-		/* Not a remote file. */
+#define GET32LE(p) (   (uint32_t) (p)[0] \
+		     | (uint32_t) (p)[1] << 8 \
+		     | (uint32_t) (p)[2] << 16 \
+		     | (uint32_t) (p)[3] << 24 )
 
-		if ( trace )
-		{
-		    fprintf ( stderr,
-			      "* executing md5sum %s\n",
-			      filename );
-		    fflush ( stderr );
-		}
-		if ( execlp ( "md5sum", "md5sum",
-			      filename, NULL ) < 0 )
-		    error ( errno );
-	    }
-	    else if ( s3_name )
-	    {
-		/* Remote s3cmd file. */
+#define MD5_F(x,y,z) ( (z) ^ ( (x) & ( (y) ^ (z) ) ) )
+#define MD5_G(x,y,z) ( (y) ^ ( (z) & ( (x) ^ (y) ) ) )
+#define MD5_H(x,y,z) ( (x) ^ (y) ^ (z) )
+#define MD5_I(x,y,z) ( (y) ^ ( (x) | ~ (z) ) )
+#define MD5_STEP(f,a,b,c,d,w,k,s) \
+    ( (a) += f ( (b), (c), (d) ) + (w) + (k), \
+      (a) = ROL32 ( (a), (s) ) + (b) )
 
-		if ( trace )
-		{
-		    fprintf ( stderr,
-			      "* executing s3cmd"
-			      " info \\\n"
-			      "    %s\n",
-			      name );
-		    fflush ( stderr );
-		}
-		execlp ( "s3cmd", "s3cmd",
-		         "-c", "EFM-S3CONFIG.pipe",
-		         "info", name, NULL );
-		int saved_errno = errno;
-		unlink ( "EFM-S3CONFIG.pipe" );
-		error ( saved_errno );
-	    }
-	    else
-	    {
-		/* Remote scp/ssh file. */
+void md5_block ( uint32_t * h, const unsigned char * p )
+{
+    uint32_t w[16], a, b, c, d;
+    int i;
+
+    for ( i = 0; i < 16; ++ i )
+	w[i] = GET32LE ( p + 4 * i );
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+
+    MD5_STEP ( MD5_F, a, b, c, d, w[0],  0xd76aa478, 7 );
+    MD5_STEP ( MD5_F, d, a, b, c, w[1],  0xe8c7b756, 12 );
+    MD5_STEP ( MD5_F, c, d, a, b, w[2],  0x242070db, 17 );
+    MD5_STEP ( MD5_F, b, c, d, a, w[3],  0xc1bdceee, 22 );
+    MD5_STEP ( MD5_F, a, b, c, d, w[4],  0xf57c0faf, 7 );
+    MD5_STEP ( MD5_F, d, a, b, c, w[5],  0x4787c62a, 12 );
+    MD5_STEP ( MD5_F, c, d, a, b, w[6],  0xa8304613, 17 );
+    MD5_STEP ( MD5_F, b, c, d, a, w[7],  0xfd469501, 22 );
+    MD5_STEP ( MD5_F, a, b, c, d, w[8],  0x698098d8, 7 );
+    MD5_STEP ( MD5_F, d, a, b, c, w[9],  0x8b44f7af, 12 );
+    MD5_STEP ( MD5_F, c, d, a, b, w[10], 0xffff5bb1, 17 );
+    MD5_STEP ( MD5_F, b, c, d, a, w[11], 0x895cd7be, 22 );
+    MD5_STEP ( MD5_F, a, b, c, d, w[12], 0x6b901122, 7 );
+    MD5_STEP ( MD5_F, d, a, b, c, w[13], 0xfd987193, 12 );
+    MD5_STEP ( MD5_F, c, d, a, b, w[14], 0xa679438e, 17 );
+    MD5_STEP ( MD5_F, b, c, d, a, w[15], 0x49b40821, 22 );
+
+    MD5_STEP ( MD5_G, a, b, c, d, w[1],  0xf61e2562, 5 );
+    MD5_STEP ( MD5_G, d, a, b, c, w[6],  0xc040b340, 9 );
+    MD5_STEP ( MD5_G, c, d, a, b, w[11], 0x265e5a51, 14 );
+    MD5_STEP ( MD5_G, b, c, d, a, w[0],  0xe9b6c7aa, 20 );
+    MD5_STEP ( MD5_G, a, b, c, d, w[5],  0xd62f105d, 5 );
+    MD5_STEP ( MD5_G, d, a, b, c, w[10], 0x02441453, 9 );
+    MD5_STEP ( MD5_G, c, d, a, b, w[15], 0xd8a1e681, 14 );
+    MD5_STEP ( MD5_G, b, c, d, a, w[4],  0xe7d3fbc8, 20 );
+    MD5_STEP ( MD5_G, a, b, c, d, w[9],  0x21e1cde6, 5 );
+    MD5_STEP ( MD5_G, d, a, b, c, w[14], 0xc33707d6, 9 );
+    MD5_STEP ( MD5_G, c, d, a, b, w[3],  0xf4d50d87, 14 );
+    MD5_STEP ( MD5_G, b, c, d, a, w[8],  0x455a14ed, 20 );
+    MD5_STEP ( MD5_G, a, b, c, d, w[13], 0xa9e3e905, 5 );
+    MD5_STEP ( MD5_G, d, a, b, c, w[2],  0xfcefa3f8, 9 );
+    MD5_STEP ( MD5_G, c, d, a, b, w[7],  0x676f02d9, 14 );
+    MD5_STEP ( MD5_G, b, c, d, a, w[12], 0x8d2a4c8a, 20 );
+
+    MD5_STEP ( MD5_H, a, b, c, d, w[5],  0xfffa3942, 4 );
+    MD5_STEP ( MD5_H, d, a, b, c, w[8],  0x8771f681, 11 );
+    MD5_STEP ( MD5_H, c, d, a, b, w[11], 0x6d9d6122, 16 );
+    MD5_STEP ( MD5_H, b, c, d, a, w[14], 0xfde5380c, 23 );
+    MD5_STEP ( MD5_H, a, b, c, d, w[1],  0xa4beea44, 4 );
+    MD5_STEP ( MD5_H, d, a, b, c, w[4],  0x4bdecfa9, 11 );
+    MD5_STEP ( MD5_H, c, d, a, b, w[7],  0xf6bb4b60, 16 );
+    MD5_STEP ( MD5_H, b, c, d, a, w[10], 0xbebfbc70, 23 );
+    MD5_STEP ( MD5_H, a, b, c, d, w[13], 0x289b7ec6, 4 );
+    MD5_STEP ( MD5_H, d, a, b, c, w[0],  0xeaa127fa, 11 );
+    MD5_STEP ( MD5_H, c, d, a, b, w[3],  0xd4ef3085, 16 );
+    MD5_STEP ( MD5_H, b, c, d, a, w[6],  0x04881d05, 23 );
+    MD5_STEP ( MD5_H, a, b, c, d, w[9],  0xd9d4d039, 4 );
+    MD5_STEP ( MD5_H, d, a, b, c, w[12], 0xe6db99e5, 11 );
+    MD5_STEP ( MD5_H, c, d, a, b, w[15], 0x1fa27cf8, 16 );
+    MD5_STEP ( MD5_H, b, c, d, a, w[2],  0xc4ac5665, 23 );
+
+    MD5_STEP ( MD5_I, a, b, c, d, w[0],  0xf4292244, 6 );
+    MD5_STEP ( MD5_I, d, a, b, c, w[7],  0x432aff97, 10 );
+    MD5_STEP ( MD5_I, c, d, a, b, w[14], 0xab9423a7, 15 );
+    MD5_STEP ( MD5_I, b, c, d, a, w[5],  0xfc93a039, 21 );
+    MD5_STEP ( MD5_I, a, b, c, d, w[12], 0x655b59c3, 6 );
+    MD5_STEP ( MD5_I, d, a, b, c, w[3],  0x8f0ccc92, 10 );
+    MD5_STEP ( MD5_I, c, d, a, b, w[10], 0xffeff47d, 15 );
+    MD5_STEP ( MD5_I, b, c, d, a, w[1],  0x85845dd1, 21 );
+    MD5_STEP ( MD5_I, a, b, c, d, w[8],  0x6fa87e4f, 6 );
+    MD5_STEP ( MD5_I, d, a, b, c, w[15], 0xfe2ce6e0, 10 );
+    MD5_STEP ( MD5_I, c, d, a, b, w[6],  0xa3014314, 15 );
+    MD5_STEP ( MD5_I, b, c, d, a, w[13], 0x4e0811a1, 21 );
+    MD5_STEP ( MD5_I, a, b, c, d, w[4],  0xf7537e82, 6 );
+    MD5_STEP ( MD5_I, d, a, b, c, w[11], 0xbd3af235, 10 );
+    MD5_STEP ( MD5_I, c, d, a, b, w[2],  0x2ad7d2bb, 15 );
+    MD5_STEP ( MD5_I, b, c, d, a, w[9],  0xeb86d391, 21 );
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+}
 
-		if ( trace )
-		{
-		    fprintf ( stderr,
-			      "* executing ssh %s \\\n"
-			      "            md5sum %s\n",
-			      name, p );
-		    fflush ( stderr );
-		}
-		if ( execlp ( "ssh", "ssh", name,
-			      "md5sum", p, NULL ) < 0 )
-		    error ( errno );
-	    }
+void md5_init ( struct md5 * m )
+{
+    m->h[0] = 0x67452301;
+    m->h[1] = 0xefcdab89;
+    m->h[2] = 0x98badcfe;
+    m->h[3] = 0x10325476;
+    m->length = 0;
+    m->used = 0;
+}
+
+void md5_update ( struct md5 * m, const void * data,
+		  size_t n )
+{
+    const unsigned char * p = data;
+
+    m->length += n;
+    while ( n > 0 )
+    {
+	size_t k;
+	if ( m->used == 0 && n >= 64 )
+	{
+	    md5_block ( m->h, p );
+	    p += 64;
+	    n -= 64;
+	    continue;
+	}
+	k = 64 - m->used;
+	if ( k > n ) k = n;
+	memcpy ( m->block + m->used, p, k );
+	m->used += k;
+	p += k;
+	n -= k;
+	if ( m->used == 64 )
+	{
+	    md5_block ( m->h, m->block );
+	    m->used = 0;
 	}
+    }
+}
 
-	close ( fd[1] );
-	inf = fdopen ( fd[0], "r" );
+/* Finish MD5 sum and store it in buffer as 32 lower
+ * case hexadecimal digits followed by a NUL, as
+ * md5sum(1) prints it.  Buffer must be at least 33
+ * characters long.
+ */
+void md5_final ( struct md5 * m, char * buffer )
+{
+    uint64_t bits = m->length * 8;
+    unsigned char pad[72];
+    int padlength = ( m->used < 56 ? 56 : 120 ) - m->used;
+    int i;
+
+    memset ( pad, 0, sizeof ( pad ) );
+    pad[0] = 0x80;
+    for ( i = 0; i < 8; ++ i )
+	pad[padlength+i] = bits >> ( 8 * i );
+    md5_update ( m, pad, padlength + 8 );
+
+    for ( i = 0; i < 16; ++ i )
+	sprintf ( buffer + 2 * i, "%02x",
+		  ( m->h[i/4] >> ( 8 * ( i % 4 ) ) )
+		  & 0xff );
+}
 
-	error_found = 0;
+/* Multi-buffer MD5.  md5_block_lanes performs one
+ * block of MD5_LANES independent MD5 computations, the
+ * lanes being interleaved in vector registers.  With
+ * GCC on x86 the kernel is compiled both for AVX2 and
+ * for the baseline (SSE2) instruction set, and the
+ * version used is chosen when the program is loaded;
+ * elsewhere the lanes are computed one at a time.
+ */
+#define MD5_LANES 8
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+
+/* Message word and rotation of each step.
+ */
+static const unsigned char md5_w[64] = {
+    0, 1, 2, 3, 4, 5, 6, 7,
+    8, 9, 10, 11, 12, 13, 14, 15,
+    1, 6, 11, 0, 5, 10, 15, 4,
+    9, 14, 3, 8, 13, 2, 7, 12,
+    5, 8, 11, 14, 1, 4, 7, 10,
+    13, 0, 3, 6, 9, 12, 15, 2,
+    0, 7, 14, 5, 12, 3, 10, 1,
+    8, 15, 6, 13, 4, 11, 2, 9 };
+static const unsigned char md5_s[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20,
+    4, 11, 16, 23, 6, 10, 15, 21 };
+
+#ifdef __GNUC__
+
+typedef uint32_t md5v
+    __attribute__ ((vector_size (4 * MD5_LANES)));
+
+#define MD5V_STEP(f,i) \
+    ( t = a + f ( b, c, d ) + md5_k[i] + w[md5_w[i]], \
+      s = md5_s[( (i) >> 4 ) * 4 + ( (i) & 3 )], \
+      a = d, d = c, c = b, \
+      b += t << s | t >> ( 32 - s ) )
+
+#if defined ( __x86_64__ ) || defined ( __i386__ )
+__attribute__ ((target_clones ("avx2", "default")))
+#endif
+void md5_block_lanes ( uint32_t (* h)[4],
+		       const unsigned char ** p )
+{
+    md5v w[16], a, b, c, d, a0, b0, c0, d0, t;
+    int i, j, s;
 
-	if ( s3_name )
-	{
-	    write_s3_pipe();
+    for ( j = 0; j < MD5_LANES; ++ j )
+    {
+	for ( i = 0; i < 16; ++ i )
+	    w[i][j] = GET32LE ( p[j] + 4 * i );
+	a[j] = h[j][0]; b[j] = h[j][1];
+	c[j] = h[j][2]; d[j] = h[j][3];
+    }
+    a0 = a; b0 = b; c0 = c; d0 = d;
 
-	    int first = 1;
-	    while ( get_line ( line, inf ) )
+    for ( i = 0; i < 16; ++ i ) MD5V_STEP ( MD5_F, i );
+    for ( ; i < 32; ++ i ) MD5V_STEP ( MD5_G, i );
+    for ( ; i < 48; ++ i ) MD5V_STEP ( MD5_H, i );
+    for ( ; i < 64; ++ i ) MD5V_STEP ( MD5_I, i );
+
+    a += a0; b += b0; c += c0; d += d0;
+    for ( j = 0; j < MD5_LANES; ++ j )
+    {
+	h[j][0] = a[j]; h[j][1] = b[j];
+	h[j][2] = c[j]; h[j][3] = d[j];
+    }
+}
+
+#else
+
+void md5_block_lanes ( uint32_t (* h)[4],
+		       const unsigned char ** p )
+{
+    int j;
+    for ( j = 0; j < MD5_LANES; ++ j )
+	md5_block ( h[j], p[j] );
+}
+
+#endif
+
+/* One lane of md5_files: a file being read and the
+ * MD5 computation of its contents.
+ */
+struct md5_lane {
+    int fd;
+    int index;		/* Of file in names. */
+    struct md5 md5;
+    unsigned char * buffer;
+    size_t length, position;
+};
+
+/* Compute the MD5 sums of the n local files names[0],
+ * ..., names[n-1], storing the sum of names[i] in
+ * sums[i] as md5_final does.  Names that are NULL are
+ * skipped.  Up to MD5_LANES files are read at once,
+ * and their blocks are hashed together by md5_block_-
+ * lanes.  If a file cannot be read an error message
+ * is written on stdout, sums[i] is set to "", and -1
+ * is eventually returned.  Otherwise 0 is returned.
+ */
+int md5_files ( char (* sums)[33],
+		const char * const * names, int n )
+{
+    struct md5_lane lane[MD5_LANES];
+    static const unsigned char idle_block[64];
+    int next = 0, active = 0, result = 0, j;
+    long long bytes = 0;
+    int opened = 0;
+    struct timing t;
+
+    start_stage ( & t );
+
+    for ( j = 0; j < MD5_LANES; ++ j )
+    {
+	lane[j].fd = -1;
+	lane[j].buffer = (unsigned char *)
+	    malloc ( PGP_BUFFER_SIZE );
+	if ( lane[j].buffer == NULL ) error ( ENOMEM );
+    }
+
+    while ( 1 )
+    {
+	uint32_t h[MD5_LANES][4];
+	const unsigned char * p[MD5_LANES];
+	size_t blocks = 0;
+
+	/* Give every lane at least one whole block,
+	 * opening the next files as lanes finish.
+	 */
+	for ( j = 0; j < MD5_LANES; ++ j )
+	{
+	    struct md5_lane * l = lane + j;
+	    while ( 1 )
 	    {
-	        const char * p = line;
-	        if ( first )
+		size_t k = l->length - l->position;
+		ssize_t r;
+
+		if ( l->fd < 0 )
 		{
-		    /* First line is object name */
-		    if ( ! is_s3 ( line ) )
+		    int i = next ++;
+		    if ( i >= n ) break;
+		    if ( names[i] == NULL ) continue;
+		    if ( trace )
+			printf ( "* computing MD5 sum of"
+				 " %s\n", names[i] );
+		    l->fd = open ( names[i], O_RDONLY );
+		    if ( l->fd < 0 )
 		    {
-			do {
-			    printf ( "%s\n", line );
-			} while
-			    ( get_line ( line, inf ) );
-			error_found = 1;
+			printf ( "ERROR: cannot open %s"
+				 " for reading\n",
+				 names[i] );
+			sums[i][0] = 0;
+			result = -1;
+			continue;
 		    }
-		    first = 0;
+		    l->index = i;
+		    ++ opened;
+		    md5_init ( & l->md5 );
+		    l->length = l->position = 0;
+		    ++ active;
 		    continue;
 		}
-		while ( isspace ( * p ) ) ++ p;
-		if ( strncmp ( "MD5 sum:", p, 8 ) == 0 )
+		if ( l->md5.used == 0 && k >= 64 ) break;
+
+		/* Hash any partial block, then read. */
+
+		if ( l->md5.used != 0
+		     && k > 64 - l->md5.used )
+		    k = 64 - l->md5.used;
+		md5_update ( & l->md5,
+			     l->buffer + l->position, k );
+		l->position += k;
+		if ( l->position < l->length ) continue;
+
+		r = read ( l->fd, l->buffer,
+			   PGP_BUFFER_SIZE );
+		if ( r < 0 && errno == EINTR ) continue;
+		l->position = 0;
+		l->length = r < 0 ? 0 : r;
+		if ( r > 0 ) bytes += r;
+		if ( r > 0 ) continue;
+
+		if ( r < 0 )
 		{
-		    p += 8;
-		    while ( isspace ( * p ) ) ++ p;
-		    if ( strlen ( p ) == 32 )
-			strcpy ( buffer, p );
-		    else
-		    {
-		        printf ( "ERROR: wrong size MD5"
-			         " sum: %s\n", p );
-			error_found = 1;
-		    }
+		    printf ( "ERROR: %s\n"
+			     "    reading %s\n",
+			     strerror ( errno ),
+			     names[l->index] );
+		    sums[l->index][0] = 0;
+		    result = -1;
 		}
 		else
-		{
-		    if ( p != line )
-		        while ( * p && * p != ':' )
-			    ++ p;
-		    if ( p == line || * p == 0 ) do {
-			/* Likely error messages */
-			printf ( "%s\n", line );
-			error_found = 1;
-		    } while ( get_line ( line, inf ) );
-		}
+		    md5_final ( & l->md5,
+				sums[l->index] );
+		close ( l->fd );
+		l->fd = -1;
+		-- active;
 	    }
 	}
-	else if ( get_line ( line, inf ) )
+	if ( active == 0 ) break;
+
+	/* Hash the whole blocks all lanes have. */
+
+	for ( j = 0; j < MD5_LANES; ++ j )
 	{
-	    char * p = line;
-	    while ( * p != 0 && ! isspace ( * p ) )
-	        ++ p;
-	    if ( p - line == 32 )
-	    {
-	        strncpy ( buffer, line, 32 );
-		buffer[32] = 0;
-	    }
-	    else
-	    {
-		* p = 0;
-		printf ( "ERROR: wrong size MD5"
-			 " sum: %s\n", line );
-		error_found = 1;
-	    }
-	    while ( get_line ( line, inf ) )
-	    {
-		/* Extra lines indicate an error */
-	        printf ( "%s\n", line );
-		error_found = 1;
-	    }
+	    size_t k;
+	    if ( lane[j].fd < 0 ) continue;
+	    k = ( lane[j].length - lane[j].position )
+		/ 64;
+	    if ( blocks == 0 || k < blocks ) blocks = k;
 	}
-	else
+	if ( active == 1 )
 	{
-	    printf ( "ERROR: md5sum produced no"
-	             " output\n" );
-	    error_found = 1;
+	    for ( j = 0; lane[j].fd < 0; ++ j );
+	    md5_update ( & lane[j].md5,
+			 lane[j].buffer
+			 + lane[j].position,
+			 64 * blocks );
+	    lane[j].position += 64 * blocks;
+	    continue;
 	}
-
-	if ( ! error_found )
+	memset ( h, 0, sizeof ( h ) );
+	for ( j = 0; j < MD5_LANES; ++ j )
 	{
-	    char * p = buffer;
-	    for ( ; * p; ++ p )
-	    {
-		char c = * p;
-		if ( '0' <= c && c <= '9' ) continue;
-		if ( 'a' <= c && c <= 'f' ) continue;
-		if ( 'A' <= c && c <= 'F' ) continue;
-		break;
-	    }
-	    if ( * p )
+	    if ( lane[j].fd < 0 )
+		p[j] = idle_block;
+	    else
 	    {
-	        printf ( "ERROR: bad digits in MD5 sum:"
-		         " %s\n", buffer );
-		error_found = 1;
+		memcpy ( h[j], lane[j].md5.h,
+			 sizeof ( h[j] ) );
+		p[j] = lane[j].buffer + lane[j].position;
 	    }
 	}
-	fclose ( inf );
-	if ( cwait ( child ) < 0 ) error_found = 1;
-	if ( s3_name ) unlink ( "EFM-S3CONFIG.pipe" );
-
-	if ( error_found && retries > 0 )
+	while ( blocks -- > 0 )
 	{
-	    printf ( "RETRYING md5sum %s\n", filename );
-	    -- retries;
-	    continue;
+	    md5_block_lanes ( h, p );
+	    for ( j = 0; j < MD5_LANES; ++ j )
+		if ( p[j] != idle_block ) p[j] += 64;
 	}
-	else if ( error_found != 0 )
+	for ( j = 0; j < MD5_LANES; ++ j )
 	{
-	    printf ( "ERROR: cannot compute MD5 sum of"
-		     " %s\n", filename );
-	    return -1;
+	    struct md5_lane * l = lane + j;
+	    if ( l->fd < 0 ) continue;
+	    memcpy ( l->md5.h, h[j], sizeof ( h[j] ) );
+	    l->md5.length +=
+		p[j] - ( l->buffer + l->position );
+	    l->position = p[j] - l->buffer;
 	}
-	else return 0;
     }
+
+    for ( j = 0; j < MD5_LANES; ++ j )
+	free ( lane[j].buffer );
+    if ( opened > 0 )
+	end_stage ( & t, HASH_STAGE, bytes );
+    return result;
 }
 
-/* Copy file.  0 is returned on success, -1 on error.
- * Error messages are written on stdout.  The mode
- * and mtime of the file are preserved if this is
- * easy to do, but not for files stored in S3 (it
- * would be possible using the MIME type to do so,
- * but we do not).  The filenames may have any format
- * acceptable to scp or s3cmd.  If a filename has
- * S3 form (begins with `s3:'), the other file name
- * must be local (not have `@' before a `:' or begin
- * with `s3:').  RETRIES retries are done on failure
- * (it is assumed that one of the file names is
- * probably remote).
+/* The MD5 cache.  EFM-MD5CACHE holds the MD5 sums of
+ * local plaintext files computed by md5_plain_files,
+ * so that a file that has not changed since its sum
+ * was computed need not be read again.  Each line is
+ *
+ *	DEVICE INODE SIZE MTIME CTIME MD5SUM FILENAME
+ *
+ * and a file is taken to be unchanged if its device,
+ * inode, size, mtime, and ctime are those of a line.
+ * The ctime of a file cannot be set, and changes
+ * whenever the file is written, but these times are
+ * only in seconds, so the sum of a file whose mtime
+ * or ctime is within MD5_CACHE_RACE seconds of when
+ * it was hashed is not cached, as the file might
+ * have been written again in the same second.
+ *
+ * Each process that computes sums appends lines for
+ * them, and a later line for a file replaces an ear-
+ * lier one.  When the cache is read and has more
+ * than twice as many lines as files, it is rewritten
+ * without the replaced lines and the lines of files
+ * that have changed.
  */
-int copyfile
-	( const char * source, const char * target )
-{
-    int child;
-    int retries = RETRIES;
-    int s3_source = is_s3 ( source );
-    int s3_target = is_s3 ( target );
+#define MD5_CACHE_RACE 2
 
-    while ( 1 )
-    {
-	fflush ( stdout );
-	fflush ( stderr );
+struct md5_cache_entry {
+    unsigned long long dev, ino, size;
+    long long mtime, ctime;
+    char md5sum[33];
+    char * filename;	/* NULL if entry is unused. */
+};
+
+struct md5_cache_entry * md5_cache = NULL;
+    /* Hash table of md5_cache_size entries, a power
+     * of 2, of which md5_cache_count are used. */
+int md5_cache_size = 0;
+int md5_cache_count = 0;
+long md5_cache_offset = 0;
+int md5_cache_lines = 0;
+unsigned long long md5_cache_ino = 0;
+    /* EFM-MD5CACHE has been read up to md5_cache_
+     * offset, in which there are md5_cache_lines
+     * lines, and has inode md5_cache_ino. */
+
+/* Return the entry for dev and ino, or the unused
+ * entry where it would go.
+ */
+struct md5_cache_entry * md5_cache_find
+	( unsigned long long dev, unsigned long long ino )
+{
+    unsigned long long h =
+	( dev * 0x9e3779b97f4a7c15ULL ) ^ ino;
+    int i = ( h ^ ( h >> 29 ) ) & ( md5_cache_size - 1 );
+    while ( md5_cache[i].filename != NULL
+	    && ( md5_cache[i].dev != dev
+		 || md5_cache[i].ino != ino ) )
+	i = ( i + 1 ) & ( md5_cache_size - 1 );
+    return md5_cache + i;
+}
+
+/* Return 1 if the file with status st is that of
+ * cache entry c, and 0 otherwise.
+ */
+int md5_cache_match ( const struct md5_cache_entry * c,
+		      const struct stat * st )
+{
+    return c->filename != NULL
+	   && c->dev == (unsigned long long) st->st_dev
+	   && c->ino == (unsigned long long) st->st_ino
+	   && c->size == (unsigned long long) st->st_size
+	   && c->mtime == (long long) st->st_mtime
+	   && c->ctime == (long long) st->st_ctime;
+}
+
+/* Set the cache entry for entry->dev and entry->ino
+ * to entry, whose filename is taken over.
+ */
+void md5_cache_set ( struct md5_cache_entry * entry )
+{
+    struct md5_cache_entry * c;
+
+    if ( 2 * ( md5_cache_count + 1 ) > md5_cache_size )
+    {
+	struct md5_cache_entry * old = md5_cache;
+	int size = md5_cache_size, i;
+
+	md5_cache_size =
+	    ( size == 0 ? 1024 : 2 * size );
+	md5_cache = (struct md5_cache_entry *)
+	    calloc ( md5_cache_size, sizeof ( * c ) );
+	if ( md5_cache == NULL ) error ( ENOMEM );
+	for ( i = 0; i < size; ++ i )
+	{
+	    if ( old[i].filename == NULL ) continue;
+	    * md5_cache_find ( old[i].dev, old[i].ino )
+		= old[i];
+	}
+	free ( old );
+    }
+
+    c = md5_cache_find ( entry->dev, entry->ino );
+    if ( c->filename == NULL ) ++ md5_cache_count;
+    else free ( c->filename );
+    * c = * entry;
+}
+
+/* Write the line for cache entry c on out.
+ */
+void write_md5_cache_line
+	( FILE * out, const struct md5_cache_entry * c )
+{
+    fprintf ( out, "%llu %llu %llu %lld %lld %s %s\n",
+	      c->dev, c->ino, c->size, c->mtime,
+	      c->ctime, c->md5sum, c->filename );
+}
+
+/* Read any lines of EFM-MD5CACHE not yet read into
+ * md5_cache, starting over if the file has been re-
+ * placed, and rewrite the file if it has too many
+ * lines.  Other processes may have appended lines
+ * since the last read.
+ */
+void read_md5_cache ( void )
+{
+    FILE * in = fopen ( "EFM-MD5CACHE", "r" );
+    struct stat st;
+    line_buffer line;
+    int i;
+
+    if ( in == NULL ) return;
+    if ( fstat ( fileno ( in ), & st ) < 0 )
+	error ( errno );
+    if ( st.st_size == md5_cache_offset
+	 && md5_cache_ino
+	    == (unsigned long long) st.st_ino )
+    {
+	fclose ( in );
+	return;
+    }
+    if ( st.st_size < md5_cache_offset
+	 || md5_cache_ino
+	    != (unsigned long long) st.st_ino )
+    {
+	for ( i = 0; i < md5_cache_size; ++ i )
+	    free ( md5_cache[i].filename );
+	free ( md5_cache );
+	md5_cache = NULL;
+	md5_cache_size = md5_cache_count = 0;
+	md5_cache_offset = md5_cache_lines = 0;
+	md5_cache_ino = st.st_ino;
+    }
+    fseek ( in, md5_cache_offset, SEEK_SET );
+    while ( fgets ( line, sizeof ( line ), in ) )
+    {
+	struct md5_cache_entry c;
+	int n = -1;
+	char * p = line + strlen ( line );
+
+	if ( p == line || p[-1] != '\n' ) break;
+	md5_cache_offset += p - line;
+	++ md5_cache_lines;
+	p[-1] = 0;
+	sscanf ( line, "%llu %llu %llu %lld %lld %32s %n",
+		 & c.dev, & c.ino, & c.size, & c.mtime,
+		 & c.ctime, c.md5sum, & n );
+	if ( n < 0 || strlen ( c.md5sum ) != 32
+		   || line[n] == 0 )
+	    continue;
+	c.filename = strdup ( line + n );
+	if ( c.filename == NULL ) error ( ENOMEM );
+	md5_cache_set ( & c );
+    }
+    fclose ( in );
+
+    if ( md5_cache_lines <= 2 * md5_cache_count )
+	return;
+
+    if ( trace )
+	printf ( "* rewriting EFM-MD5CACHE\n" );
+    in = fopen ( "EFM-MD5CACHE+", "w" );
+    if ( in == NULL )
+    {
+	printf ( "ERROR: cannot open EFM-MD5CACHE+"
+		 " for writing\n" );
+	return;
+    }
+    md5_cache_lines = 0;
+    for ( i = 0; i < md5_cache_size; ++ i )
+    {
+	struct md5_cache_entry * c = md5_cache + i;
+	if ( c->filename == NULL
+	     || stat ( c->filename, & st ) < 0
+	     || ! md5_cache_match ( c, & st ) )
+	    continue;
+	write_md5_cache_line ( in, c );
+	++ md5_cache_lines;
+    }
+    if ( fflush ( in ) != 0
+	 || fstat ( fileno ( in ), & st ) < 0
+	 || fclose ( in ) != 0
+	 || rename ( "EFM-MD5CACHE+", "EFM-MD5CACHE" )
+	    < 0 )
+    {
+	printf ( "ERROR: cannot rewrite"
+		 " EFM-MD5CACHE\n" );
+	return;
+    }
+    md5_cache_offset = st.st_size;
+    md5_cache_ino = st.st_ino;
+}
+
+/* Compute the MD5 sums of the n local plaintext files
+ * names[0], ..., names[n-1] as md5_files does, except
+ * that the sum of a file that has not changed since
+ * it was recorded in the MD5 cache is taken from the
+ * cache, and sums that are computed are recorded in
+ * the cache.
+ */
+int md5_plain_files ( char (* sums)[33],
+		      const char * const * names, int n )
+{
+    const char ** read = (const char **)
+	calloc ( n + 1, sizeof ( char * ) );
+    struct stat * st = (struct stat *)
+	malloc ( ( n + 1 ) * sizeof ( struct stat ) );
+    time_t start = time ( NULL );
+    FILE * out = NULL;
+    int result, i;
+
+    if ( read == NULL || st == NULL ) error ( ENOMEM );
+    read_md5_cache();
+    for ( i = 0; i < n; ++ i )
+    {
+	struct md5_cache_entry * c;
+	if ( names[i] == NULL ) continue;
+	read[i] = names[i];
+	if ( md5_cache_size == 0
+	     || stat ( names[i], st + i ) < 0 )
+	    continue;
+	c = md5_cache_find ( st[i].st_dev, st[i].st_ino );
+	if ( ! md5_cache_match ( c, st + i ) ) continue;
+	if ( trace )
+	    printf ( "* using MD5 sum of %s"
+		     " in EFM-MD5CACHE\n", names[i] );
+	strcpy ( sums[i], c->md5sum );
+	read[i] = NULL;
+    }
+
+    result = md5_files ( sums, read, n );
+
+    /* Record the sums of the files that were read,
+     * unless they changed while being read or might
+     * change again without changing their times.
+     */
+    for ( i = 0; i < n; ++ i )
+    {
+	struct md5_cache_entry c;
+	struct stat now;
+	if ( read[i] == NULL || sums[i][0] == 0
+	     || strchr ( read[i], '\n' ) != NULL
+	     || stat ( read[i], & now ) < 0
+	     || now.st_mtime > start - MD5_CACHE_RACE
+	     || now.st_ctime > start - MD5_CACHE_RACE )
+	    continue;
+	c.dev = now.st_dev;
+	c.ino = now.st_ino;
+	c.size = now.st_size;
+	c.mtime = now.st_mtime;
+	c.ctime = now.st_ctime;
+	strcpy ( c.md5sum, sums[i] );
+	c.filename = strdup ( read[i] );
+	if ( c.filename == NULL ) error ( ENOMEM );
+	if ( out == NULL )
+	{
+	    int fd = open ( "EFM-MD5CACHE",
+			    O_WRONLY + O_CREAT + O_APPEND,
+			    S_IRUSR + S_IWUSR );
+	    if ( fd < 0
+		 || ( out = fdopen ( fd, "a" ) ) == NULL )
+	    {
+		printf ( "ERROR: cannot open"
+			 " EFM-MD5CACHE for writing\n" );
+		free ( c.filename );
+		break;
+	    }
+	}
+	write_md5_cache_line ( out, & c );
+	fflush ( out );
+	md5_cache_set ( & c );
+    }
+    if ( out != NULL ) fclose ( out );
+    free ( read );
+    free ( st );
+    return result;
+}
+
+/* AES block cipher.  Only the encryption direction is
+ * implemented, as that is all CFB mode needs.  The
+ * S-box and T-tables are computed on first use.
+ */
+struct aes {
+    int rounds;
+    uint32_t rk[60];
+};
+
+unsigned char aes_sbox[256];
+uint32_t aes_t[4][256];
+
+#define XTIME(x) \
+    ( ( (x) << 1 ) ^ ( (x) & 0x80 ? 0x11b : 0 ) )
+
+void aes_init_tables ( void )
+{
+    unsigned char p = 1, q = 1, x;
+    int i;
+
+    if ( aes_sbox[0] != 0 ) return;
+
+    /* p runs through the multiplicative group of
+     * GF(2^8) and q is kept equal to the inverse of p.
+     */
+    do
+    {
+	p = XTIME ( p ) ^ p;
+	q ^= q << 1;
+	q ^= q << 2;
+	q ^= q << 4;
+	if ( q & 0x80 ) q ^= 0x09;
+	x = q ^ ( q << 1 | q >> 7 ) ^ ( q << 2 | q >> 6 )
+	      ^ ( q << 3 | q >> 5 ) ^ ( q << 4 | q >> 4 );
+	aes_sbox[p] = x ^ 0x63;
+    } while ( p != 1 );
+    aes_sbox[0] = 0x63;
+
+    for ( i = 0; i < 256; ++ i )
+    {
+	uint32_t s = aes_sbox[i];
+	uint32_t s2 = XTIME ( s );
+	uint32_t t = s2 << 24 | s << 16 | s << 8
+		   | ( s2 ^ s );
+	aes_t[0][i] = t;
+	aes_t[1][i] = ROR32 ( t, 8 );
+	aes_t[2][i] = ROR32 ( t, 16 );
+	aes_t[3][i] = ROR32 ( t, 24 );
+    }
+}
+
+#define SUBWORD(t) \
+    (   (uint32_t) aes_sbox[(t) >> 24] << 24 \
+      | (uint32_t) aes_sbox[(t) >> 16 & 255] << 16 \
+      | (uint32_t) aes_sbox[(t) >> 8 & 255] << 8 \
+      | (uint32_t) aes_sbox[(t) & 255] )
+
+/* Key length must be 16, 24, or 32 bytes.
+ */
+void aes_setkey ( struct aes * a, const unsigned char * key,
+		  int keylength )
+{
+    int nk = keylength / 4;
+    int total, i;
+    uint32_t rcon = 1;
+
+    aes_init_tables();
+    a->rounds = nk + 6;
+    total = 4 * ( a->rounds + 1 );
+    for ( i = 0; i < nk; ++ i )
+	a->rk[i] = GET32 ( key + 4 * i );
+    for ( ; i < total; ++ i )
+    {
+	uint32_t t = a->rk[i-1];
+	if ( i % nk == 0 )
+	{
+	    t = SUBWORD ( ROL32 ( t, 8 ) ) ^ ( rcon << 24 );
+	    rcon = XTIME ( rcon );
+	}
+	else if ( nk > 6 && i % nk == 4 )
+	    t = SUBWORD ( t );
+	a->rk[i] = a->rk[i-nk] ^ t;
+    }
+}
+
+#define AES_ROUND(a,b,c,d) (   aes_t[0][(a) >> 24] \
+			     ^ aes_t[1][(b) >> 16 & 255] \
+			     ^ aes_t[2][(c) >> 8 & 255] \
+			     ^ aes_t[3][(d) & 255] )
+#define AES_FINAL(a,b,c,d) \
+    (   (uint32_t) aes_sbox[(a) >> 24] << 24 \
+      | (uint32_t) aes_sbox[(b) >> 16 & 255] << 16 \
+      | (uint32_t) aes_sbox[(c) >> 8 & 255] << 8 \
+      | (uint32_t) aes_sbox[(d) & 255] )
+
+void aes_encrypt ( const struct aes * a,
+		   const unsigned char * in,
+		   unsigned char * out )
+{
+    const uint32_t * rk = a->rk;
+    uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+    int r, i;
+
+    s0 = GET32 ( in )      ^ rk[0];
+    s1 = GET32 ( in + 4 )  ^ rk[1];
+    s2 = GET32 ( in + 8 )  ^ rk[2];
+    s3 = GET32 ( in + 12 ) ^ rk[3];
+    for ( r = 1; r < a->rounds; ++ r )
+    {
+	rk += 4;
+	t0 = AES_ROUND ( s0, s1, s2, s3 ) ^ rk[0];
+	t1 = AES_ROUND ( s1, s2, s3, s0 ) ^ rk[1];
+	t2 = AES_ROUND ( s2, s3, s0, s1 ) ^ rk[2];
+	t3 = AES_ROUND ( s3, s0, s1, s2 ) ^ rk[3];
+	s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+    rk += 4;
+    t0 = AES_FINAL ( s0, s1, s2, s3 ) ^ rk[0];
+    t1 = AES_FINAL ( s1, s2, s3, s0 ) ^ rk[1];
+    t2 = AES_FINAL ( s2, s3, s0, s1 ) ^ rk[2];
+    t3 = AES_FINAL ( s3, s0, s1, s2 ) ^ rk[3];
+    for ( i = 0; i < 4; ++ i )
+    {
+	out[i]    = t0 >> ( 24 - 8 * i );
+	out[4+i]  = t1 >> ( 24 - 8 * i );
+	out[8+i]  = t2 >> ( 24 - 8 * i );
+	out[12+i] = t3 >> ( 24 - 8 * i );
+    }
+}
+
+/* OpenPGP CFB mode with a zero IV.  Pos is the index
+ * in iv of the next key stream byte; 16 means a new
+ * block must be encrypted first.
+ */
+struct cfb {
+    struct aes aes;
+    unsigned char iv[16];
+    int pos;
+};
+
+void cfb_init ( struct cfb * c, const unsigned char * key,
+		int keylength )
+{
+    aes_setkey ( & c->aes, key, keylength );
+    memset ( c->iv, 0, 16 );
+    c->pos = 16;
+}
+
+void cfb_encrypt ( struct cfb * c, unsigned char * p,
+		   size_t n )
+{
+    while ( n -- )
+    {
+	if ( c->pos == 16 )
+	{
+	    aes_encrypt ( & c->aes, c->iv, c->iv );
+	    c->pos = 0;
+	}
+	* p ^= c->iv[c->pos];
+	c->iv[c->pos ++] = * p ++;
+    }
+}
+
+void cfb_decrypt ( struct cfb * c, unsigned char * p,
+		   size_t n )
+{
+    while ( n -- )
+    {
+	unsigned char ct = * p;
+	if ( c->pos == 16 )
+	{
+	    aes_encrypt ( & c->aes, c->iv, c->iv );
+	    c->pos = 0;
+	}
+	* p ++ ^= c->iv[c->pos];
+	c->iv[c->pos ++] = ct;
+    }
+}
+
+/* Return the key length of an OpenPGP symmetric cipher
+ * algorithm, or 0 if the algorithm is not supported.
+ */
+int cipher_keylength ( int algo )
+{
+    return algo == 7 ? 16 : algo == 8 ? 24 :
+	   algo == 9 ? 32 : 0;
+}
+
+/* Random number generator.  Random bytes are AES-256
+ * in counter mode, keyed from getrandom once per pro-
+ * cess (a forked child has a different process ID
+ * and reseeds), so that making index entries never
+ * waits for the kernel.  After each request the key
+ * is replaced by further output, so the state does
+ * not reveal bytes already returned.
+ */
+struct aes random_aes;
+unsigned char random_counter[16];
+pid_t random_pid = 0;
+    /* Process that seeded random_aes, or 0. */
+
+void random_seed ( void )
+{
+    unsigned char seed[48];
+    int n = 0;
+
+    while ( n < 48 )
+    {
+	ssize_t r = getrandom ( seed + n, 48 - n, 0 );
+	if ( r < 0 && errno == EINTR ) continue;
+	if ( r < 0 && errno == ENOSYS ) break;
+	if ( r < 0 ) error ( errno );
+	n += r;
+    }
+    if ( n < 48 )
+    {
+	/* Kernels before 3.17 lack getrandom. */
+
+	int fd = open ( "/dev/urandom", O_RDONLY );
+	if ( fd < 0 ) error ( errno );
+	n = 0;
+	while ( n < 48 )
+	{
+	    int r = read ( fd, seed + n, 48 - n );
+	    if ( r < 0 && errno != EINTR )
+		error ( errno );
+	    if ( r > 0 ) n += r;
+	}
+	close ( fd );
+    }
+
+    aes_setkey ( & random_aes, seed, 32 );
+    memcpy ( random_counter, seed + 32, 16 );
+    memset ( seed, 0, sizeof ( seed ) );
+    random_pid = getpid();
+}
+
+void random_block ( unsigned char * out )
+{
+    int i = 16;
+    aes_encrypt ( & random_aes, random_counter, out );
+    while ( i > 0 && ++ random_counter[-- i] == 0 )
+	;
+}
+
+/* Fill buffer with n random bytes.
+ */
+void random_bytes ( unsigned char * buffer, int n )
+{
+    unsigned char block[16], key[32];
+
+    if ( random_pid != getpid() ) random_seed();
+    while ( n > 0 )
+    {
+	int k = ( n < 16 ? n : 16 );
+	random_block ( block );
+	memcpy ( buffer, block, k );
+	buffer += k;
+	n -= k;
+    }
+    random_block ( key );
+    random_block ( key + 16 );
+    aes_setkey ( & random_aes, key, 32 );
+    memset ( block, 0, sizeof ( block ) );
+    memset ( key, 0, sizeof ( key ) );
+}
+
+/* Write the 16 bytes b as a 32 hexadecimal digit key
+ * in buffer, which must be at least 33 characters.
+ */
+void format_key ( char * buffer, const unsigned char * b )
+{
+    sprintf ( buffer,
+	      "%02x%02x%02x%02x%02x%02x%02x%02x"
+	      "%02x%02x%02x%02x%02x%02x%02x%02x",
+	      b[0], b[1], b[2], b[3],
+	      b[4], b[5], b[6], b[7],
+	      b[8], b[9], b[10], b[11],
+	      b[12], b[13], b[14], b[15] );
+}
+
+/* Create a random 32 hexadecimal digit key.  Buffer
+ * must be at least 33 characters to hold key and
+ * trailing NUL.
+ */
+void newkey ( char * buffer )
+{
+    unsigned char b[16];
+    random_bytes ( b, 16 );
+    format_key ( buffer, b );
+}
+
+/* Create n random keys at once, as for a command that
+ * adds many files.
+ */
+void newkeys ( char (* keys)[33], int n )
+{
+    unsigned char * b =
+	(unsigned char *) malloc ( 16 * n + 1 );
+    int i;
+
+    if ( b == NULL ) error ( ENOMEM );
+    random_bytes ( b, 16 * n );
+    for ( i = 0; i < n; ++ i )
+	format_key ( keys[i], b + 16 * i );
+    memset ( b, 0, 16 * n );
+    free ( b );
+}
+
+/* Decode an OpenPGP S2K count byte.
+ */
+#define S2K_COUNT(c) \
+    ( (unsigned long) ( 16 + ( (c) & 15 ) ) \
+      << ( ( (c) >> 4 ) + 6 ) )
+
+/* Return the S2K count byte used when encrypting with
+ * a password.  Efm keys (32 hexadecimal digits) are
+ * already 128 bit random numbers, so stretching them
+ * buys nothing and they get the minimum count of 65536
+ * bytes.  Other passwords, such as the index password,
+ * get gpg's default count of 65011712 bytes.
+ */
+int s2k_count_byte ( const char * password, int plength )
+{
+    int i;
+    if ( plength != 32 ) return 0xff;
+    for ( i = 0; i < 32; ++ i )
+    {
+	if ( ! isxdigit ( (unsigned char) password[i] ) )
+	    return 0xff;
+    }
+    return 0x60;
+}
+
+/* Compute the OpenPGP string-to-key function.  Type is
+ * 0 (simple), 1 (salted), or 3 (iterated and salted),
+ * hash is 2 (SHA-1) or 8 (SHA-256), salt is 8 bytes,
+ * and count is the decoded iteration byte count.
+ */
+void s2k ( unsigned char * key, int keylength,
+	   int type, int hash,
+	   const unsigned char * salt, unsigned long count,
+	   const char * password, int plength )
+{
+    unsigned char buffer[4096];
+    unsigned char digest[32];
+    int unit = ( type == 0 ? 0 : 8 ) + plength;
+    int length = 0, done = 0, preload = 0;
+
+    /* Buffer holds as many copies of salt+password as
+     * fit, so large counts are hashed in large pieces.
+     */
+    while ( length + unit <= (int) sizeof ( buffer ) )
+    {
+	if ( type != 0 )
+	    memcpy ( buffer + length, salt, 8 );
+	memcpy ( buffer + length + unit - plength,
+		 password, plength );
+	length += unit;
+	if ( unit == 0 ) break;
+    }
+    if ( type != 3 || count < (unsigned long) unit )
+	count = unit;
+
+    while ( done < keylength )
+    {
+	struct sha s;
+	unsigned long left = count;
+	int i, n;
+
+	sha_init ( & s, hash );
+	for ( i = 0; i < preload; ++ i )
+	    sha_update ( & s, "", 1 );
+	while ( left > 0 )
+	{
+	    unsigned long k = left;
+	    if ( k > (unsigned long) length ) k = length;
+	    sha_update ( & s, buffer, k );
+	    left -= k;
+	}
+	n = sha_final ( & s, digest );
+	if ( n > keylength - done ) n = keylength - done;
+	memcpy ( key + done, digest, n );
+	done += n;
+	++ preload;
+    }
+}
+
+/* Byte sources and sinks used to chain the stages of
+ * the engine.  Read returns the number of bytes read,
+ * 0 at end of data, and -1 on error.  Write and close
+ * return 0 on success and -1 on error.  Error messages
+ * are written to stdout.
+ */
+struct source {
+    int ( * read ) ( struct source * s,
+		     unsigned char * buffer, int n );
+};
+struct sink {
+    int ( * write ) ( struct sink * s,
+		      const unsigned char * buffer, int n );
+    int ( * close ) ( struct sink * s );
+};
+
+/* Read exactly n bytes.  Return 0 on success, -1 on
+ * error or premature end of data.
+ */
+int read_exact ( struct source * s, unsigned char * buffer,
+		 int n )
+{
+    while ( n > 0 )
+    {
+	int r = s->read ( s, buffer, n );
+	if ( r < 0 ) return -1;
+	if ( r == 0 )
+	{
+	    printf ( "ERROR: encrypted data truncated\n" );
+	    return -1;
+	}
+	buffer += r;
+	n -= r;
+    }
+    return 0;
+}
+
+/* Write all n bytes to fd.  Return 0 on success, -1 on
+ * error.
+ */
+int write_all ( int fd, const void * buffer, size_t n )
+{
+    const char * p = buffer;
+    while ( n > 0 )
+    {
+	ssize_t r = write ( fd, p, n );
+	if ( r < 0 )
+	{
+	    if ( errno == EINTR ) continue;
+	    printf ( "ERROR: %s\n    writing data\n",
+		     strerror ( errno ) );
+	    return -1;
+	}
+	p += r;
+	n -= r;
+    }
+    return 0;
+}
+
+/* Buffered file descriptor source.
+ */
+struct fd_source {
+    struct source s;
+    int fd;
+    int piped;		/* 1 if fd is a pipe or socket. */
+    int start, end;
+    unsigned char buffer[PGP_BUFFER_SIZE];
+};
+
+int fd_source_read ( struct source * s,
+		     unsigned char * buffer, int n )
+{
+    struct fd_source * f = (struct fd_source *) s;
+    while ( f->start == f->end )
+    {
+	double t = f->piped ? wall_clock() : 0;
+	int r = read ( f->fd, f->buffer,
+		       sizeof ( f->buffer ) );
+	if ( f->piped )
+	{
+	    pipe_seconds += wall_clock() - t;
+	    if ( r > 0 ) pipe_bytes += r;
+	}
+	if ( r < 0 )
+	{
+	    if ( errno == EINTR ) continue;
+	    printf ( "ERROR: %s\n    reading data\n",
+		     strerror ( errno ) );
+	    return -1;
+	}
+	if ( r == 0 ) return 0;
+	f->start = 0;
+	f->end = r;
+    }
+    if ( n > f->end - f->start ) n = f->end - f->start;
+    memcpy ( buffer, f->buffer + f->start, n );
+    f->start += n;
+    return n;
+}
+
+/* Return 1 if fd is a pipe or socket, and 0 other-
+ * wise.
+ */
+int is_piped ( int fd )
+{
+    struct stat st;
+    return fstat ( fd, & st ) == 0
+	   && ( S_ISFIFO ( st.st_mode )
+		|| S_ISSOCK ( st.st_mode ) );
+}
+
+void fd_source_init ( struct fd_source * f, int fd )
+{
+    f->s.read = fd_source_read;
+    f->fd = fd;
+    f->piped = is_piped ( fd );
+    f->start = f->end = 0;
+}
+
+/* Buffered file descriptor sink.
+ */
+struct fd_sink {
+    struct sink s;
+    int fd;
+    int piped;		/* 1 if fd is a pipe or socket. */
+    int length;
+    unsigned char buffer[PGP_BUFFER_SIZE];
+};
+
+int fd_sink_close ( struct sink * s )
+{
+    struct fd_sink * f = (struct fd_sink *) s;
+    double t = f->piped ? wall_clock() : 0;
+    int r = write_all ( f->fd, f->buffer, f->length );
+    if ( f->piped )
+    {
+	pipe_seconds += wall_clock() - t;
+	pipe_bytes += f->length;
+    }
+    f->length = 0;
+    return r;
+}
+
+int fd_sink_write ( struct sink * s,
+		    const unsigned char * buffer, int n )
+{
+    struct fd_sink * f = (struct fd_sink *) s;
+    while ( n > 0 )
+    {
+	int k = sizeof ( f->buffer ) - f->length;
+	if ( k > n ) k = n;
+	memcpy ( f->buffer + f->length, buffer, k );
+	f->length += k;
+	buffer += k;
+	n -= k;
+	if ( f->length == sizeof ( f->buffer )
+	     &&
+	     fd_sink_close ( s ) < 0 )
+	    return -1;
+    }
+    return 0;
+}
+
+void fd_sink_init ( struct fd_sink * f, int fd )
+{
+    f->s.write = fd_sink_write;
+    f->s.close = fd_sink_close;
+    f->fd = fd;
+    f->piped = is_piped ( fd );
+    f->length = 0;
+}
+
+/* Source for an OpenPGP packet body, which may be sent
+ * in partial body length chunks, have a definite
+ * length, or (old format packets only) extend to the
+ * end of the enclosing data.
+ */
+struct body_source {
+    struct source s;
+    struct source * in;
+    uint32_t remaining;	/* In current chunk. */
+    int partial;	/* Current chunk is partial. */
+    int indeterminate;
+};
+
+/* Read a new format packet length.
+ */
+int read_new_length ( struct body_source * b )
+{
+    unsigned char c[4];
+    if ( read_exact ( b->in, c, 1 ) < 0 ) return -1;
+    b->partial = 0;
+    if ( c[0] < 192 )
+	b->remaining = c[0];
+    else if ( c[0] < 224 )
+    {
+	b->remaining = ( c[0] - 192 ) << 8;
+	if ( read_exact ( b->in, c, 1 ) < 0 ) return -1;
+	b->remaining += c[0] + 192;
+    }
+    else if ( c[0] == 255 )
+    {
+	if ( read_exact ( b->in, c, 4 ) < 0 ) return -1;
+	b->remaining = GET32 ( c );
+    }
+    else
+    {
+	b->remaining = (uint32_t) 1 << ( c[0] & 31 );
+	b->partial = 1;
+    }
+    return 0;
+}
+
+int body_read ( struct source * s,
+		unsigned char * buffer, int n )
+{
+    struct body_source * b = (struct body_source *) s;
+    int r;
+
+    if ( b->indeterminate )
+	return b->in->read ( b->in, buffer, n );
+    while ( b->remaining == 0 )
+    {
+	if ( ! b->partial ) return 0;
+	if ( read_new_length ( b ) < 0 ) return -1;
+    }
+    if ( (uint32_t) n > b->remaining ) n = b->remaining;
+    r = b->in->read ( b->in, buffer, n );
+    if ( r == 0 )
+    {
+	printf ( "ERROR: OpenPGP packet truncated\n" );
+	return -1;
+    }
+    if ( r > 0 ) b->remaining -= r;
+    return r;
+}
+
+/* Read an OpenPGP packet header from in, set tag, and
+ * initialize body to read the packet body.  Return 1
+ * if a header was read, 0 at end of data, and -1 on
+ * error.
+ */
+int read_packet_header ( struct source * in, int * tag,
+			 struct body_source * body )
+{
+    unsigned char c[4];
+    int r = in->read ( in, c, 1 );
+    if ( r <= 0 ) return r;
+
+    body->s.read = body_read;
+    body->in = in;
+    body->partial = 0;
+    body->indeterminate = 0;
+    if ( ( c[0] & 0x80 ) == 0 )
+    {
+	printf ( "ERROR: bad OpenPGP packet header\n" );
+	return -1;
+    }
+    if ( c[0] & 0x40 )
+    {
+	* tag = c[0] & 63;
+	return read_new_length ( body ) < 0 ? -1 : 1;
+    }
+    * tag = ( c[0] >> 2 ) & 15;
+    switch ( c[0] & 3 )
+    {
+    case 0:
+	if ( read_exact ( in, c, 1 ) < 0 ) return -1;
+	body->remaining = c[0];
+	break;
+    case 1:
+	if ( read_exact ( in, c, 2 ) < 0 ) return -1;
+	body->remaining = c[0] << 8 | c[1];
+	break;
+    case 2:
+	if ( read_exact ( in, c, 4 ) < 0 ) return -1;
+	body->remaining = GET32 ( c );
+	break;
+    case 3:
+	body->remaining = 0;
+	body->indeterminate = 1;
+	break;
+    }
+    return 1;
+}
+
+/* Sink that writes an OpenPGP packet with the given
+ * tag, using partial body length chunks of size
+ * PGP_BUFFER_SIZE, so the total length need not be
+ * known in advance.
+ */
+struct packet_sink {
+    struct sink s;
+    struct sink * out;
+    int tag;
+    int started;	/* Tag has been written. */
+    int length;
+    unsigned char buffer[PGP_BUFFER_SIZE];
+};
+
+int packet_sink_write
+	( struct sink * s,
+	  const unsigned char * buffer, int n )
+{
+    struct packet_sink * p = (struct packet_sink *) s;
+    while ( n > 0 )
+    {
+	int k;
+	if ( p->length == sizeof ( p->buffer ) )
+	{
+	    /* Full buffer and more data: write a
+	     * partial chunk.
+	     */
+	    unsigned char header[2];
+	    int h = 0, bits = 0;
+	    while ( ( 1 << bits ) < p->length ) ++ bits;
+	    if ( ! p->started ) header[h++] = 0xc0 | p->tag;
+	    header[h++] = 0xe0 | bits;
+	    p->started = 1;
+	    if ( p->out->write ( p->out, header, h ) < 0
+		 ||
+		 p->out->write ( p->out, p->buffer,
+				 p->length ) < 0 )
+		return -1;
+	    p->length = 0;
+	}
+	k = sizeof ( p->buffer ) - p->length;
+	if ( k > n ) k = n;
+	memcpy ( p->buffer + p->length, buffer, k );
+	p->length += k;
+	buffer += k;
+	n -= k;
+    }
+    return 0;
+}
+
+/* Write the last chunk, which has a definite length.
+ */
+int packet_sink_close ( struct sink * s )
+{
+    struct packet_sink * p = (struct packet_sink *) s;
+    unsigned char header[6];
+    int h = 0;
+    uint32_t n = p->length;
+
+    if ( ! p->started ) header[h++] = 0xc0 | p->tag;
+    if ( n < 192 )
+	header[h++] = n;
+    else if ( n < 8384 )
+    {
+	header[h++] = ( ( n - 192 ) >> 8 ) + 192;
+	header[h++] = n - 192;
+    }
+    else
+    {
+	header[h++] = 255;
+	header[h++] = n >> 24;
+	header[h++] = n >> 16;
+	header[h++] = n >> 8;
+	header[h++] = n;
+    }
+    if ( p->out->write ( p->out, header, h ) < 0
+	 ||
+	 p->out->write ( p->out, p->buffer, n ) < 0 )
+	return -1;
+    p->length = 0;
+    return 0;
+}
+
+void packet_sink_init ( struct packet_sink * p,
+			struct sink * out, int tag )
+{
+    p->s.write = packet_sink_write;
+    p->s.close = packet_sink_close;
+    p->out = out;
+    p->tag = tag;
+    p->started = 0;
+    p->length = 0;
+}
+
+/* Sink that hashes and encrypts the contents of a SEIPD
+ * packet, and appends the MDC packet on close.
+ */
+struct seip_sink {
+    struct sink s;
+    struct sink * out;
+    struct cfb cfb;
+    struct sha sha;
+    unsigned char buffer[PGP_BUFFER_SIZE];
+};
+
+int seip_sink_write ( struct sink * s,
+		      const unsigned char * buffer, int n )
+{
+    struct seip_sink * p = (struct seip_sink *) s;
+    while ( n > 0 )
+    {
+	int k = sizeof ( p->buffer );
+	if ( k > n ) k = n;
+	sha_update ( & p->sha, buffer, k );
+	memcpy ( p->buffer, buffer, k );
+	cfb_encrypt ( & p->cfb, p->buffer, k );
+	if ( p->out->write ( p->out, p->buffer, k ) < 0 )
+	    return -1;
+	buffer += k;
+	n -= k;
+    }
+    return 0;
+}
+
+int seip_sink_close ( struct sink * s )
+{
+    struct seip_sink * p = (struct seip_sink *) s;
+    unsigned char mdc[22];
+    mdc[0] = 0xd3;
+    mdc[1] = 0x14;
+    sha_update ( & p->sha, mdc, 2 );
+    sha_final ( & p->sha, mdc + 2 );
+    cfb_encrypt ( & p->cfb, mdc, 22 );
+    return p->out->write ( p->out, mdc, 22 );
+}
+
+/* Source that decrypts the contents of a SEIPD packet
+ * (mdc = 1) or a symmetrically encrypted data packet
+ * (mdc = 0).  With MDC the last 22 bytes are held back
+ * and checked against the hash of the data at the end.
+ * Without MDC, CFB is resynchronized after the 18 byte
+ * prefix.
+ */
+struct seip_source {
+    struct source s;
+    struct source * in;
+    struct cfb cfb;
+    struct sha sha;
+    int mdc;
+    int resync;
+	/* Prefix bytes decrypted so far if resynchron-
+	 * izing, else -1.
+	 */
+    unsigned char prefix[18];
+    int eof, checked;
+    int start, length;
+    unsigned char buffer[PGP_BUFFER_SIZE];
+};
+
+void seip_decrypt ( struct seip_source * p,
+		    unsigned char * q, int n )
+{
+    while ( p->resync >= 0 && n > 0 )
+    {
+	p->prefix[p->resync] = * q;
+	cfb_decrypt ( & p->cfb, q ++, 1 );
+	-- n;
+	if ( ++ p->resync == 18 )
+	{
+	    memcpy ( p->cfb.iv, p->prefix + 2, 16 );
+	    p->cfb.pos = 16;
+	    p->resync = -1;
+	}
+    }
+    cfb_decrypt ( & p->cfb, q, n );
+}
+
+int seip_source_read ( struct source * s,
+		       unsigned char * buffer, int n )
+{
+    struct seip_source * p = (struct seip_source *) s;
+    int hold = ( p->mdc ? 22 : 0 );
+    int avail;
+
+    while ( ( avail = p->length - p->start - hold ) <= 0
+	    &&
+	    ! p->eof )
+    {
+	int r;
+	memmove ( p->buffer, p->buffer + p->start,
+		  p->length - p->start );
+	p->length -= p->start;
+	p->start = 0;
+	r = p->in->read ( p->in, p->buffer + p->length,
+			  sizeof ( p->buffer )
+			  - p->length );
+	if ( r < 0 ) return -1;
+	if ( r == 0 ) p->eof = 1;
+	seip_decrypt ( p, p->buffer + p->length, r );
+	p->length += r;
+    }
+
+    if ( avail <= 0 )
+    {
+	unsigned char digest[20];
+	unsigned char * q = p->buffer + p->start;
+	if ( ! p->mdc || p->checked ) return 0;
+	if ( avail < 0 || q[0] != 0xd3 || q[1] != 0x14 )
+	{
+	    printf ( "ERROR: modification detection"
+		     " code missing\n" );
+	    return -1;
+	}
+	sha_update ( & p->sha, q, 2 );
+	sha_final ( & p->sha, digest );
+	if ( memcmp ( digest, q + 2, 20 ) != 0 )
+	{
+	    printf ( "ERROR: modification detection"
+		     " code does not match\n" );
+	    return -1;
+	}
+	p->checked = 1;
+	return 0;
+    }
+
+    if ( n > avail ) n = avail;
+    memcpy ( buffer, p->buffer + p->start, n );
+    if ( p->mdc ) sha_update ( & p->sha, buffer, n );
+    p->start += n;
+    return n;
+}
+
+/* Source that inflates ZIP (raw deflate) or ZLIB
+ * compressed data.
+ */
+struct inflate_source {
+    struct source s;
+    struct source * in;
+    z_stream z;
+    int end;
+    unsigned char buffer[PGP_BUFFER_SIZE];
+};
+
+int inflate_source_read ( struct source * s,
+			  unsigned char * buffer, int n )
+{
+    struct inflate_source * f =
+	(struct inflate_source *) s;
+
+    if ( f->end ) return 0;
+    f->z.next_out = buffer;
+    f->z.avail_out = n;
+    while ( f->z.avail_out == (unsigned) n )
+    {
+	int r;
+	if ( f->z.avail_in == 0 )
+	{
+	    r = f->in->read ( f->in, f->buffer,
+			      sizeof ( f->buffer ) );
+	    if ( r < 0 ) return -1;
+	    if ( r == 0 )
+	    {
+		printf ( "ERROR: compressed data"
+			 " truncated\n" );
+		return -1;
+	    }
+	    f->z.next_in = f->buffer;
+	    f->z.avail_in = r;
+	}
+	r = inflate ( & f->z, Z_NO_FLUSH );
+	if ( r == Z_STREAM_END )
+	{
+	    f->end = 1;
+	    break;
+	}
+	if ( r != Z_OK && r != Z_BUF_ERROR )
+	{
+	    printf ( "ERROR: bad compressed data\n" );
+	    return -1;
+	}
+    }
+    return n - f->z.avail_out;
+}
+
+/* Compute the session key from the body of a SKESK
+ * packet.  Return the key length, -1 on error, or -2
+ * if the packet uses an unsupported algorithm.
+ */
+int skesk_key ( const unsigned char * p, int length,
+		const char * password, int plength,
+		unsigned char * key )
+{
+    int keylength, type, hash, i;
+    unsigned long count = 0;
+
+    if ( length < 4 || p[0] != 4 ) return -2;
+    keylength = cipher_keylength ( p[1] );
+    type = p[2];
+    hash = p[3];
+    if ( keylength == 0 ) return -2;
+    if ( hash != 2 && hash != 8 ) return -2;
+    if ( type == 0 ) i = 4;
+    else if ( type == 1 ) i = 12;
+    else if ( type == 3 ) i = 13;
+    else return -2;
+    if ( length < i )
+    {
+	printf ( "ERROR: bad OpenPGP symmetric key"
+		 " packet\n" );
+	return -1;
+    }
+    if ( type == 3 ) count = S2K_COUNT ( p[12] );
+    s2k ( key, keylength, type, hash, p + 4, count,
+	  password, plength );
+
+    if ( length > i )
+    {
+	/* Encrypted session key follows. */
+
+	unsigned char esk[64];
+	struct cfb c;
+	int n = length - i;
+
+	memcpy ( esk, p + i, n );
+	cfb_init ( & c, key, keylength );
+	cfb_decrypt ( & c, esk, n );
+	keylength = cipher_keylength ( esk[0] );
+	if ( keylength == 0 ) return -2;
+	if ( keylength != n - 1 )
+	{
+	    printf ( "ERROR: bad key or password\n" );
+	    return -1;
+	}
+	memcpy ( key, esk + 1, keylength );
+    }
+    return keylength;
+}
+
+/* MD5 sums and sizes computed while encrypting or
+ * decrypting a file, so neither the file nor its en-
+ * cryption need be reread to compute them.
+ */
+struct crypt_sums {
+    char md5sum[33];	/* Of the plaintext. */
+    off_t size;
+    char emd5sum[33];	/* Of the ciphertext. */
+    off_t esize;
+};
+
+/* State of one decryption.  Allocated as a unit as it
+ * is too large for the stack.
+ */
+struct pgp_decryption {
+    struct fd_source in;
+    struct body_source packet, inner, literal;
+    struct seip_source seip;
+    struct inflate_source inflate;
+    int inflating;
+    struct md5 md5;
+    off_t size;
+    unsigned char buffer[PGP_BUFFER_SIZE];
+};
+
+int pgp_decrypt_1 ( struct pgp_decryption * d,
+		    int outfd,
+		    const char * password, int plength,
+		    struct crypt_sums * sums )
+{
+    unsigned char skesk[64], key[32], c[256];
+    int tag, r, keylength, skesk_length = -1;
+    struct source * data;
+
+    /* Find the SKESK packet and the encrypted data
+     * packet that follows it.
+     */
+    while ( 1 )
+    {
+	r = read_packet_header
+		( & d->in.s, & tag, & d->packet );
+	if ( r < 0 ) return -1;
+	if ( r == 0 )
+	{
+	    printf ( "ERROR: no OpenPGP encrypted data"
+		     " found\n" );
+	    return -1;
+	}
+	if ( tag == 9 || tag == 18 ) break;
+	if ( tag == 3 )
+	{
+	    skesk_length = 0;
+	    while ( ( r = d->packet.s.read
+			      ( & d->packet.s,
+				skesk + skesk_length,
+				sizeof ( skesk )
+				- skesk_length ) )
+		    > 0 )
+	    {
+		skesk_length += r;
+		if ( skesk_length == sizeof ( skesk ) )
+		    return -2;
+	    }
+	    if ( r < 0 ) return -1;
+	}
+	else if ( tag == 10 )
+	{
+	    /* Marker packet. */
+	    while ( ( r = d->packet.s.read
+			      ( & d->packet.s, c,
+				sizeof ( c ) ) )
+		    > 0 );
+	    if ( r < 0 ) return -1;
+	}
+	else return -2;
+    }
+    if ( skesk_length < 0 ) return -2;
+    keylength = skesk_key ( skesk, skesk_length,
+			    password, plength, key );
+    if ( keylength < 0 ) return keylength;
+
+    if ( tag == 18 )
+    {
+	if ( read_exact ( & d->packet.s, c, 1 ) < 0 )
+	    return -1;
+	if ( c[0] != 1 ) return -2;
+    }
+    d->seip.s.read = seip_source_read;
+    d->seip.in = & d->packet.s;
+    cfb_init ( & d->seip.cfb, key, keylength );
+    sha_init ( & d->seip.sha, 2 );
+    d->seip.mdc = ( tag == 18 );
+    d->seip.resync = ( tag == 18 ? -1 : 0 );
+    d->seip.eof = d->seip.checked = 0;
+    d->seip.start = d->seip.length = 0;
+
+    if ( read_exact ( & d->seip.s, c, 18 ) < 0 )
+	return -1;
+    if ( c[14] != c[16] || c[15] != c[17] )
+    {
+	printf ( "ERROR: bad key or password\n" );
+	return -1;
+    }
+
+    r = read_packet_header
+	    ( & d->seip.s, & tag, & d->inner );
+    if ( r <= 0 )
+    {
+	if ( r == 0 )
+	    printf ( "ERROR: encrypted data is"
+		     " empty\n" );
+	return -1;
+    }
+    data = & d->inner.s;
+    if ( tag == 8 )
+    {
+	/* Compressed data packet. */
+
+	if ( read_exact ( data, c, 1 ) < 0 ) return -1;
+	if ( c[0] == 1 || c[0] == 2 )
+	{
+	    memset ( & d->inflate.z, 0,
+		     sizeof ( d->inflate.z ) );
+	    if ( inflateInit2 ( & d->inflate.z,
+				c[0] == 1 ? -15 : 15 )
+		 != Z_OK )
+	    {
+		printf ( "ERROR: cannot initialize"
+			 " zlib\n" );
+		return -1;
+	    }
+	    d->inflating = 1;
+	    d->inflate.s.read = inflate_source_read;
+	    d->inflate.in = data;
+	    d->inflate.end = 0;
+	    data = & d->inflate.s;
+	}
+	else if ( c[0] != 0 ) return -2;
+
+	r = read_packet_header
+		( data, & tag, & d->literal );
+	if ( r <= 0 )
+	{
+	    if ( r == 0 )
+		printf ( "ERROR: compressed data is"
+			 " empty\n" );
+	    return -1;
+	}
+    }
+    else d->literal = d->inner;
+    if ( tag != 11 ) return -2;
+
+    /* Literal data packet: skip format, file name,
+     * and date.
+     */
+    if ( read_exact ( & d->literal.s, c, 2 ) < 0
+	 ||
+	 read_exact ( & d->literal.s, c, c[1] + 4 ) < 0 )
+	return -1;
+    while ( ( r = d->literal.s.read
+		      ( & d->literal.s, d->buffer,
+			sizeof ( d->buffer ) ) )
+	    > 0 )
+    {
+	if ( sums != NULL )
+	    md5_update ( & d->md5, d->buffer, r );
+	d->size += r;
+	if ( outfd >= 0
+	     && write_all ( outfd, d->buffer, r ) < 0 )
+	    return -1;
+    }
+    if ( r < 0 ) return -1;
+
+    /* Read rest of encrypted data to check MDC. */
+
+    while ( ( r = d->seip.s.read
+		      ( & d->seip.s, d->buffer,
+			sizeof ( d->buffer ) ) )
+	    > 0 );
+    return r;
+}
+
+/* Decrypt OpenPGP symmetrically encrypted data read
+ * from infd, writing the plaintext to outfd, or dis-
+ * carding it if outfd is -1.  If sums is not NULL,
+ * the MD5 sum and size of the plaintext are computed
+ * in the same pass and stored in sums.  Return 0 on
+ * success, -1 on error, and -2 if the data uses
+ * unsupported packets or algorithms, in which case
+ * nothing has been written to outfd.
+ */
+int pgp_decrypt ( int infd, int outfd,
+		  const char * password, int plength,
+		  struct crypt_sums * sums )
+{
+    struct pgp_decryption * d =
+	(struct pgp_decryption *)
+	malloc ( sizeof ( struct pgp_decryption ) );
+    double waited = pipe_seconds;
+    struct timing t;
+    int r;
+
+    if ( d == NULL ) error ( ENOMEM );
+    start_stage ( & t );
+    fd_source_init ( & d->in, infd );
+    d->inflating = 0;
+    md5_init ( & d->md5 );
+    d->size = 0;
+    r = pgp_decrypt_1 ( d, outfd, password, plength,
+			sums );
+    if ( r == 0 && sums != NULL )
+    {
+	md5_final ( & d->md5, sums->md5sum );
+	sums->size = d->size;
+    }
+    if ( d->inflating ) inflateEnd ( & d->inflate.z );
+
+    /* Only files, for which sums are computed, are
+     * timed, and not the index.  Time spent waiting
+     * for a pipe is not decryption time.
+     */
+    t.start += pipe_seconds - waited;
+    if ( sums != NULL )
+	end_stage ( & t, DECRYPT_STAGE, d->size );
+    free ( d );
+    return r;
+}
+
+/* Sink that computes the MD5 sum and size of the data
+ * passing through it.
+ */
+struct md5_sink {
+    struct sink s;
+    struct sink * out;
+    struct md5 md5;
+    off_t length;
+};
+
+int md5_sink_write ( struct sink * s,
+		     const unsigned char * buffer, int n )
+{
+    struct md5_sink * m = (struct md5_sink *) s;
+    md5_update ( & m->md5, buffer, n );
+    m->length += n;
+    return m->out->write ( m->out, buffer, n );
+}
+
+int md5_sink_close ( struct sink * s )
+{
+    struct md5_sink * m = (struct md5_sink *) s;
+    return m->out->close ( m->out );
+}
+
+/* Sink that compresses data as ZIP (raw deflate) or
+ * ZLIB, for the contents of a compressed data packet.
+ */
+struct deflate_sink {
+    struct sink s;
+    struct sink * out;
+    z_stream z;
+    unsigned char buffer[PGP_BUFFER_SIZE];
+};
+
+/* Run deflate with the given flush over the input
+ * set in f->z, writing all output.
+ */
+int deflate_sink_run ( struct deflate_sink * f,
+		       int flush )
+{
+    int r;
+    do
+    {
+	int n;
+	f->z.next_out = f->buffer;
+	f->z.avail_out = sizeof ( f->buffer );
+	r = deflate ( & f->z, flush );
+	if ( r == Z_STREAM_ERROR )
+	{
+	    printf ( "ERROR: zlib deflate failed\n" );
+	    return -1;
+	}
+	n = sizeof ( f->buffer ) - f->z.avail_out;
+	if ( n > 0
+	     && f->out->write ( f->out, f->buffer, n )
+		< 0 )
+	    return -1;
+    } while ( f->z.avail_out == 0
+	      || ( flush == Z_FINISH
+		   && r != Z_STREAM_END ) );
+    return 0;
+}
+
+int deflate_sink_write ( struct sink * s,
+			 const unsigned char * buffer,
+			 int n )
+{
+    struct deflate_sink * f = (struct deflate_sink *) s;
+    f->z.next_in = (unsigned char *) buffer;
+    f->z.avail_in = n;
+    return deflate_sink_run ( f, Z_NO_FLUSH );
+}
+
+int deflate_sink_close ( struct sink * s )
+{
+    struct deflate_sink * f = (struct deflate_sink *) s;
+    int r;
+    f->z.next_in = NULL;
+    f->z.avail_in = 0;
+    r = deflate_sink_run ( f, Z_FINISH );
+    deflateEnd ( & f->z );
+    return r;
+}
+
+/* Initialize f to compress with the given OpenPGP
+ * compression algorithm, 1 (ZIP) or 2 (ZLIB).
+ */
+void deflate_sink_init ( struct deflate_sink * f,
+			 struct sink * out, int algo )
+{
+    f->s.write = deflate_sink_write;
+    f->s.close = deflate_sink_close;
+    f->out = out;
+    memset ( & f->z, 0, sizeof ( f->z ) );
+    if ( deflateInit2 ( & f->z, Z_DEFAULT_COMPRESSION,
+			Z_DEFLATED,
+			algo == 1 ? -15 : 15, 8,
+			Z_DEFAULT_STRATEGY )
+	 != Z_OK )
+	error ( ENOMEM );
+}
+
+/* State of one encryption.
+ */
+struct pgp_encryption {
+    struct fd_sink out;
+    struct md5_sink tap;
+    struct packet_sink seipd, compressed, literal;
+    struct seip_sink seip;
+    struct deflate_sink deflate;
+    struct md5 md5;
+    unsigned char buffer[PGP_BUFFER_SIZE];
+};
+
+/* Encrypt data read from infd, writing an OpenPGP
+ * symmetrically encrypted message to outfd.  The data
+ * is compressed first if codec is not 0 (see codecs).
+ * If sums is not NULL, the MD5 sums and sizes of the
+ * data read and written are computed in the same pass
+ * and stored in sums.  Return 0 on success and -1 on
+ * error.
+ *
+ * If seed is not NULL, its first 8 bytes are used as
+ * the S2K salt and its next 16 bytes as the random
+ * prefix, instead of random bytes, so the same data
+ * and password always give the same message.  If
+ * limit is not -1, at most limit bytes are read.  If
+ * sink is not NULL, the message is written to sink
+ * instead of to outfd.
+ */
+int pgp_encrypt_part ( int infd, int outfd,
+		       const char * password, int plength,
+		       int codec,
+		       const unsigned char * seed,
+		       off_t limit, struct sink * sink,
+		       struct crypt_sums * sums )
+{
+    struct pgp_encryption * e =
+	(struct pgp_encryption *)
+	malloc ( sizeof ( struct pgp_encryption ) );
+    unsigned char skesk[15], key[32], prefix[18];
+    static const unsigned char literal[6] =
+	{ 'b', 0, 0, 0, 0, 0 };
+    static const unsigned char version = 1;
+    unsigned char algo = codec;
+    struct sink * out, * data;
+    off_t size = 0;
+    double waited = pipe_seconds;
+    struct timing t;
+    int r;
+
+    if ( e == NULL ) error ( ENOMEM );
+    start_stage ( & t );
+    fd_sink_init ( & e->out, outfd );
+    out = ( sink != NULL ? sink : & e->out.s );
+    if ( sums != NULL )
+    {
+	e->tap.s.write = md5_sink_write;
+	e->tap.s.close = md5_sink_close;
+	e->tap.out = out;
+	md5_init ( & e->tap.md5 );
+	e->tap.length = 0;
+	md5_init ( & e->md5 );
+	out = & e->tap.s;
+    }
+
+    skesk[0] = 0xc3;	/* New format tag 3. */
+    skesk[1] = 13;
+    skesk[2] = 4;	/* Version. */
+    skesk[3] = 9;	/* AES-256. */
+    skesk[4] = 3;	/* Iterated and salted S2K. */
+    skesk[5] = 2;	/* SHA-1. */
+    if ( seed != NULL ) memcpy ( skesk + 6, seed, 8 );
+    else random_bytes ( skesk + 6, 8 );
+    skesk[14] = s2k_count_byte ( password, plength );
+    s2k ( key, 32, 3, 2, skesk + 6, S2K_COUNT ( skesk[14] ),
+	  password, plength );
+
+    packet_sink_init ( & e->seipd, out, 18 );
+    e->seip.s.write = seip_sink_write;
+    e->seip.s.close = seip_sink_close;
+    e->seip.out = & e->seipd.s;
+    cfb_init ( & e->seip.cfb, key, 32 );
+    sha_init ( & e->seip.sha, 2 );
+    data = & e->seip.s;
+    if ( codec != 0 )
+    {
+	packet_sink_init ( & e->compressed, data, 8 );
+	deflate_sink_init ( & e->deflate,
+			    & e->compressed.s, codec );
+	data = & e->deflate.s;
+    }
+    packet_sink_init ( & e->literal, data, 11 );
+
+    if ( seed != NULL ) memcpy ( prefix, seed + 8, 16 );
+    else random_bytes ( prefix, 16 );
+    prefix[16] = prefix[14];
+    prefix[17] = prefix[15];
+
+    r = out->write ( out, skesk, 15 );
+    if ( r == 0 )
+	r = e->seipd.s.write ( & e->seipd.s, & version, 1 );
+    if ( r == 0 )
+	r = e->seip.s.write ( & e->seip.s, prefix, 18 );
+    if ( r == 0 && codec != 0 )
+	r = e->compressed.s.write ( & e->compressed.s,
+				    & algo, 1 );
+    if ( r == 0 )
+	r = e->literal.s.write ( & e->literal.s,
+				 literal, 6 );
+    while ( r == 0 )
+    {
+	int n = sizeof ( e->buffer );
+	if ( limit >= 0 && limit - size < n )
+	    n = limit - size;
+	if ( n == 0 ) break;
+	n = read ( infd, e->buffer, n );
+	if ( n < 0 )
+	{
+	    if ( errno == EINTR ) continue;
+	    printf ( "ERROR: %s\n    reading data\n",
+		     strerror ( errno ) );
+	    r = -1;
+	}
+	else if ( n == 0 ) break;
+	else
+	{
+	    if ( sums != NULL )
+		md5_update ( & e->md5, e->buffer, n );
+	    size += n;
+	    r = e->literal.s.write
+		    ( & e->literal.s, e->buffer, n );
+	}
+    }
+    if ( r == 0 ) r = e->literal.s.close ( & e->literal.s );
+    if ( codec != 0 )
+    {
+	if ( r == 0 ) r = data->close ( data );
+	else deflateEnd ( & e->deflate.z );
+	if ( r == 0 )
+	    r = e->compressed.s.close
+		    ( & e->compressed.s );
+    }
+    if ( r == 0 ) r = e->seip.s.close ( & e->seip.s );
+    if ( r == 0 ) r = e->seipd.s.close ( & e->seipd.s );
+    if ( r == 0 ) r = out->close ( out );
+    if ( r == 0 && sums != NULL )
+    {
+	md5_final ( & e->md5, sums->md5sum );
+	sums->size = size;
+	md5_final ( & e->tap.md5, sums->emd5sum );
+	sums->esize = e->tap.length;
+    }
+    t.start += pipe_seconds - waited;
+    if ( sums != NULL )
+	end_stage ( & t, ENCRYPT_STAGE, size );
+    free ( e );
+    return r;
+}
+
+int pgp_encrypt ( int infd, int outfd,
+		  const char * password, int plength,
+		  int codec, struct crypt_sums * sums )
+{
+    return pgp_encrypt_part ( infd, outfd,
+			      password, plength, codec,
+			      NULL, -1, NULL, sums );
+}
+
+/* Return 1 if the encrypted file name has an extension
+ * handled by the built-in OpenPGP engine, and 0 if gpg
+ * must be executed.  Trailing +'s and -'s, which mark
+ * new and backup copies of the index, are ignored.
+ */
+int builtin_crypt ( const char * encrypted )
+{
+    const char * p = encrypted + strlen ( encrypted );
+    while ( p > encrypted
+	    &&
+	    ( p[-1] == '+' || p[-1] == '-' ) )
+	-- p;
+    return p - encrypted >= 4
+	   &&
+	   strncmp ( p - 4, ".gpg", 4 ) == 0;
+}
+
+/* Trace execution of encryption or decryption.
+ */
+void trace_crypt ( const char * command,
+		   const char * input,
+		   const char * output )
+{
+    fprintf ( stderr, "* %s", command );
+    if ( input != NULL )
+	fprintf ( stderr, " \\\n            < %s", input );
+    if ( output != NULL )
+	fprintf ( stderr, " \\\n            > %s",
+		  output );
+    fprintf ( stderr, "\n" );
+    fflush ( stderr );
+}
+
+/* Encrypt/decrypt file.  If input file is NULL, return
+ * file descriptor to write input into.  If output file
+ * is NULL, return file descriptor to read output from.
+ * Either the input file or the output file or both must
+ * be non-NULL.
+ *
+ * If a descriptor is returned, the child process on
+ * the other end of the descriptor pipe has its pid
+ * returned in the child argument.  This can be passed
+ * to cwait after the returned descriptor is closed.
+ *
+ * Output files are created, truncated if they exist,
+ * and given user only read/write mode when they are
+ * created.  Password is plength string of bytes.  If
+ * error, returns -1 and writes error messages to
+ * stdout.
+ *
+ * The encrypted file (output if encrypting, input if
+ * decrypting) selects the encrypting program by its
+ * extension (see builtin_crypt).  The built-in engine
+ * runs in-process if both files are given, and other-
+ * wise in a child process that does not execute any
+ * program.  If the built-in engine finds it cannot de-
+ * crypt a file, gpg is executed instead.
+ */
+int crypt ( int decrypt,
+            const char * input,
+            const char * output,
+	    const char * password, int plength,
+	    pid_t * child )
+{
+    int infd, outfd, passfd, passwritefd, result;
+    int builtin =
+	builtin_crypt ( decrypt ? input : output );
+    assert ( input != NULL || output != NULL );
+
+    if ( input == NULL )
+    {
+        int fd[2];
+	if ( pipe ( fd ) < 0 ) error ( errno );
+	result = fd[1];
+	infd = fd[0];
+    }
+    else
+    {
+        infd = open ( input, O_RDONLY );
+	if ( infd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s"
+	             " for reading\n", input );
+	    return -1;
+	}
+    }
+
+    if ( output == NULL )
+    {
+        int fd[2];
+	if ( pipe ( fd ) < 0 ) error ( errno );
+	result = fd[0];
+	outfd = fd[1];
+    }
+    else
+    {
+        outfd = open ( output,
+	               O_WRONLY + O_CREAT + O_TRUNC,
+		       S_IWUSR + S_IRUSR );
+	if ( outfd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s"
+	             " for writing\n", output );
+	    return -1;
+	}
+    }
+
+    if ( builtin && input != NULL && output != NULL )
+    {
+	int r;
+	if ( trace )
+	    trace_crypt ( decrypt ?
+			  "built-in gpg decryption" :
+			  "built-in gpg -c encryption",
+			  input, output );
+	r = decrypt ?
+	    pgp_decrypt ( infd, outfd,
+			  password, plength, NULL ) :
+	    pgp_encrypt ( infd, outfd,
+			  password, plength, 0, NULL );
+	if ( r != -2 )
+	{
+	    close ( infd );
+	    if ( close ( outfd ) < 0 ) r = -1;
+	    * child = 0;
+	    return r;
+	}
+
+	/* Unsupported by built-in engine; nothing
+	 * has been written, so execute gpg.
+	 */
+	if ( lseek ( infd, 0, SEEK_SET ) < 0 )
+	    error ( errno );
+	builtin = 0;
+    }
+
+    /* The password is short enough to fit in the pipe,
+     * so write it before forking.
+     */
+    {
+        int fd[2];
+	if ( pipe ( fd ) < 0 ) error ( errno );
+	passfd = fd[0];
+	passwritefd = fd[1];
+    }
+    if ( write ( passwritefd, password, plength ) < 0 )
+	error ( errno );
+    close ( passwritefd );
+
+    fflush ( stdout );
+    fflush ( stderr );
+
+    * child = fork();
+    if ( * child < 0 ) error ( errno );
+
+    if ( * child == 0 )
+    {
+        int fd, nullfd;
+
+	if ( builtin )
+	{
+	    int r;
+
+	    /* Close the parent's end of any pipe so
+	     * end of file can be seen.
+	     */
+	    if ( input == NULL || output == NULL )
+		close ( result );
+	    if ( trace )
+		trace_crypt ( decrypt ?
+			      "built-in gpg decryption" :
+			      "built-in gpg -c encryption",
+			      input, output );
+	    r = decrypt ?
+		pgp_decrypt ( infd, outfd,
+			      password, plength, NULL ) :
+		pgp_encrypt ( infd, outfd,
+			      password, plength, 0, NULL );
+	    if ( r != -2 ) exit ( r < 0 ? 1 : 0 );
+	    if ( lseek ( infd, 0, SEEK_SET ) < 0 )
+		error ( errno );
+	}
+
+	/* Set fd's as follows:
+	 * 	0 -> infd
+	 *	1 -> outfd
+	 *	2 -> /dev/null
+	 *	3 -> passfd
+	 */
+	close ( 0 );
+	if ( dup2 ( infd, 0 ) < 0 ) error ( errno );
+	close ( infd );
+	close ( 1 );
+	if ( dup2 ( outfd, 1 ) < 0 ) error ( errno );
+	close ( outfd );
+
+	/*
+	nullfd = open ( "/dev/null", O_RDONLY );
+	if ( nullfd < 0 ) error ( errno );
+	close ( 2 );
+	if ( dup2 ( nullfd, 2 ) < 0 ) error ( errno );
+	close ( nullfd );
+	*/
+
+	if ( passfd != 3 )
+	{
+	    close ( 3 );
+	    if ( dup2 ( passfd, 3 ) < 0 )
+		error ( errno );
+	    close ( passfd );
+	}
+	fd = getdtablesize() - 1;
+	while ( fd > 3 ) close ( fd -- );
+
+	if ( decrypt )
+	{
+	    if ( trace )
+		trace_crypt ( "executing gpg --batch -q"
+		          " --no-tty"
+			      " --ignore-mdc-error",
+			      input, output );
+	    if ( execlp ( "gpg", "gpg",
+	                  "--passphrase-fd", "3",
+		          "--batch", "-q", "--no-tty",
+			  "--ignore-mdc-error",
+		          NULL ) < 0 )
+		error ( errno );
+	}
+	else
+	{
+	    if ( trace )
+		trace_crypt ( "executing gpg"
+			      " --batch -q --no-tty -c",
+			      input, output );
+	    if ( execlp ( "gpg", "gpg",
+	                  "--passphrase-fd", "3",
+		          "--batch", "-q", "--no-tty",
+			  "-c", NULL ) < 0 )
+	    error ( errno );
+	}
+    }
+
+    close ( infd );
+    close ( outfd );
+    close ( passfd );
+
+    if ( input != NULL && output != NULL )
+        return cwait ( * child );
+    else
+	return result;
+}
+
+/* The decrypted index may be in the text format read
+ * by read_index, or in the following binary format,
+ * which is loaded without parsing and without allocat-
+ * ing memory for each entry or field.  Integers are
+ * big-endian.  The format is:
+ *
+ *	"EFM-BIN1"
+ *	number of comments (4 bytes)
+ *	number of entries (4 bytes)
+ *	length of string table (4 bytes)
+ *	string table offset of each comment (4 bytes)
+ *	BINARY_ENTRY_SIZE byte record for each entry
+ *	string table of NUL terminated comment lines
+ *	    and filenames
+ *
+ * An entry record holds at byte offsets:
+ *
+ *	 0  filename string table offset (4 bytes)
+ *	 4  BINARY_... flags (4 bytes)
+ *	 8  mode (4 bytes)
+ *	12  codec (4 bytes)
+ *	16  mtime (8 bytes)
+ *	24  size (8 bytes)
+ *	32  esize (8 bytes)
+ *	40  md5sum (16 bytes)
+ *	56  emd5sum (16 bytes, zero if unknown)
+ *	72  key (16 bytes)
+ *
+ * The MD5 sums and key are stored as the 16 bytes their
+ * 32 hexadecimal digits denote, and the flags record
+ * which were upper case, since it is the digits and not
+ * the number that are the key.  An index with an MD5
+ * sum or key that is not 32 hexadecimal digits of one
+ * case cannot be written in binary format.
+ */
+#define BINARY_MAGIC "EFM-BIN1"
+#define BINARY_HEADER_SIZE 20
+#define BINARY_ENTRY_SIZE 88
+#define BINARY_CURRENT		1
+#define BINARY_EMD5SUM		2
+    /* Set if emd5sum is known. */
+#define BINARY_MD5SUM_UPPER	4
+#define BINARY_EMD5SUM_UPPER	8
+#define BINARY_KEY_UPPER	16
+#define BINARY_CHUNKED		32
+
+int index_binary = 0;
+    /* 1 if the index is written in binary format,
+       0 if in text format. */
+
+/* Store n byte big-endian integer.
+ */
+void put_be ( unsigned char * p, uint64_t v, int n )
+{
+    while ( n -- > 0 )
+    {
+	p[n] = (unsigned char) v;
+	v >>= 8;
+    }
+}
+
+/* Return n byte big-endian integer.
+ */
+uint64_t get_be ( const unsigned char * p, int n )
+{
+    uint64_t v = 0;
+    while ( n -- > 0 ) v = ( v << 8 ) | * p ++;
+    return v;
+}
+
+/* Convert 32 hexadecimal digit string to 16 bytes.
+ * Return 1 if the digits are upper case, 0 if they are
+ * lower case or have no letters, and -1 if the string
+ * is not 32 hexadecimal digits of one case.
+ */
+int hex_to_bytes ( unsigned char * b, const char * hex )
+{
+    int i, lower = 0, upper = 0;
+    for ( i = 0; i < 32; ++ i )
+    {
+	int c = hex[i], d;
+	if ( c >= '0' && c <= '9' )
+	    d = c - '0';
+	else if ( c >= 'a' && c <= 'f' )
+	    d = c - 'a' + 10, lower = 1;
+	else if ( c >= 'A' && c <= 'F' )
+	    d = c - 'A' + 10, upper = 1;
+	else
+	    return -1;
+	if ( i % 2 == 0 ) b[i/2] = d << 4;
+	else b[i/2] |= d;
+    }
+    if ( hex[32] != 0 || ( lower && upper ) )
+	return -1;
+    return upper;
+}
+
+/* Convert 16 bytes to 32 hexadecimal digits and a
+ * NUL.
+ */
+void bytes_to_hex ( char * hex, const unsigned char * b,
+		    int upper )
+{
+    const char * digits = upper ? "0123456789ABCDEF"
+				: "0123456789abcdef";
+    int i;
+    for ( i = 0; i < 16; ++ i )
+    {
+	hex[2*i] = digits[b[i] >> 4];
+	hex[2*i+1] = digits[b[i] & 15];
+    }
+    hex[32] = 0;
+}
+
+/* Make the binary record of an entry, given the string
+ * table offset of its filename.  Return 0 on success,
+ * and -1 if the entry cannot be written in binary
+ * format.
+ */
+int binary_entry ( unsigned char * r, struct entry * e,
+		   uint32_t offset )
+{
+    int upper, flags = 0;
+
+    memset ( r, 0, BINARY_ENTRY_SIZE );
+    put_be ( r, offset, 4 );
+    put_be ( r + 8, e->mode, 4 );
+    put_be ( r + 12, e->codec, 4 );
+    put_be ( r + 16, (int64_t) e->mtime, 8 );
+    put_be ( r + 24, e->size, 8 );
+    put_be ( r + 32, e->esize, 8 );
+
+    if ( e->current ) flags |= BINARY_CURRENT;
+    if ( e->chunked ) flags |= BINARY_CHUNKED;
+    upper = hex_to_bytes ( r + 40, e->md5sum );
+    if ( upper < 0 ) return -1;
+    if ( upper ) flags |= BINARY_MD5SUM_UPPER;
+    if ( e->emd5sum[0] != 0 )
+    {
+	upper = hex_to_bytes ( r + 56, e->emd5sum );
+	if ( upper < 0 ) return -1;
+	flags |= BINARY_EMD5SUM;
+	if ( upper ) flags |= BINARY_EMD5SUM_UPPER;
+    }
+    upper = hex_to_bytes ( r + 72, e->key );
+    if ( upper < 0 ) return -1;
+    if ( upper ) flags |= BINARY_KEY_UPPER;
+    put_be ( r + 4, flags, 4 );
+    return 0;
+}
+
+/* Write index into file stream in binary format.
+ * Return 0 on success, and -1 without writing any-
+ * thing if the index cannot be written in binary
+ * format.
+ */
+int write_binary_index ( FILE * f )
+{
+    unsigned char r[BINARY_ENTRY_SIZE];
+    uint32_t ncomments = 0, nentries = 0, strings = 0;
+    struct comment * c;
+    struct entry * e;
+
+    c = first_comment;
+    if ( c ) do
+    {
+	++ ncomments;
+	strings += strlen ( c->line ) + 1;
+    } while ( ( c = c->next ) != first_comment );
+    e = first_entry;
+    if ( e ) do
+    {
+	if ( binary_entry ( r, e, 0 ) < 0 ) return -1;
+	++ nentries;
+	strings += strlen ( e->filename ) + 1;
+    } while ( ( e = e->next ) != first_entry );
+
+    memcpy ( r, BINARY_MAGIC, 8 );
+    put_be ( r + 8, ncomments, 4 );
+    put_be ( r + 12, nentries, 4 );
+    put_be ( r + 16, strings, 4 );
+    fwrite ( r, 1, BINARY_HEADER_SIZE, f );
+
+    strings = 0;
+    c = first_comment;
+    if ( c ) do
+    {
+	put_be ( r, strings, 4 );
+	fwrite ( r, 1, 4, f );
+	strings += strlen ( c->line ) + 1;
+    } while ( ( c = c->next ) != first_comment );
+    e = first_entry;
+    if ( e ) do
+    {
+	binary_entry ( r, e, strings );
+	fwrite ( r, 1, BINARY_ENTRY_SIZE, f );
+	strings += strlen ( e->filename ) + 1;
+    } while ( ( e = e->next ) != first_entry );
+
+    c = first_comment;
+    if ( c ) do
+	fwrite ( c->line, 1, strlen ( c->line ) + 1, f );
+    while ( ( c = c->next ) != first_comment );
+    e = first_entry;
+    if ( e ) do
+	fwrite ( e->filename, 1,
+		 strlen ( e->filename ) + 1, f );
+    while ( ( e = e->next ) != first_entry );
+    return 0;
+}
+
+/* Print error message for bad binary index and
+ * exit ( 1 ).
+ */
+void bad_binary_index ( void )
+{
+    printf ( "ERROR: bad binary EFM-INDEX\n" );
+    exit ( 1 );
+}
+
+/* Read binary index from file stream.  The whole index
+ * is read into one block of memory, the index arena,
+ * that is then enlarged to hold the entries and their
+ * MD5 sum and key strings.  Filenames and comments
+ * point into the string table read.  On error print
+ * error message to stdout and exit ( 1 ).
+ */
+void read_binary_index ( FILE * f )
+{
+    size_t length = 0, size = 1 << 16, base, n;
+    uint32_t ncomments, nentries, strings, i;
+    char * b = (char *) malloc ( size );
+    const unsigned char * p;
+    struct entry * entries;
+    char * table, * hex;
+
+    index_read = 1;
+    index_binary = 1;
+
+    if ( b == NULL ) error ( ENOMEM );
+    while ( ( n = fread ( b + length, 1,
+			  size - length, f ) )
+	    > 0 )
+    {
+	length += n;
+	if ( length < size ) continue;
+	size *= 2;
+	b = (char *) realloc ( b, size );
+	if ( b == NULL ) error ( ENOMEM );
+    }
+    if ( ferror ( f ) ) error ( errno );
+
+    p = (const unsigned char *) b;
+    if ( length < BINARY_HEADER_SIZE
+	 ||
+	 memcmp ( b, BINARY_MAGIC, 8 ) != 0 )
+	bad_binary_index();
+    ncomments = get_be ( p + 8, 4 );
+    nentries = get_be ( p + 12, 4 );
+    strings = get_be ( p + 16, 4 );
+    if (   BINARY_HEADER_SIZE
+	 + 4 * (uint64_t) ncomments
+	 + BINARY_ENTRY_SIZE * (uint64_t) nentries
+	 + strings
+	 != length
+	 ||
+	 ( strings > 0 && b[length-1] != 0 ) )
+	bad_binary_index();
+
+    base = ( length + 15 ) & ~ (size_t) 15;
+    size = base + nentries
+		  * ( sizeof ( struct entry ) + 3 * 33 );
+    b = (char *) realloc ( b, size );
+    if ( b == NULL ) error ( ENOMEM );
+    index_arena = b;
+    index_arena_end = b + size;
+    p = (const unsigned char *) b + BINARY_HEADER_SIZE;
+    table = b + length - strings;
+    entries = (struct entry *) ( b + base );
+    hex = (char *) ( entries + nentries );
+
+    for ( i = 0; i < ncomments; ++ i, p += 4 )
+    {
+	uint32_t offset = get_be ( p, 4 );
+	struct comment * c =
+	    (struct comment *)
+	    malloc ( sizeof ( struct comment ) );
+	if ( offset >= strings ) bad_binary_index();
+	c->line = table + offset;
+	if ( first_comment == NULL )
+	    first_comment = c->previous
+			  = c->next = c;
+	else
+	{
+	    c->previous = first_comment->previous;
+	    c->next = first_comment;
+	    c->previous->next = c->next->previous = c;
+	}
+    }
+
+    for ( i = 0; i < nentries;
+	  ++ i, p += BINARY_ENTRY_SIZE )
+    {
+	struct entry * e = entries + i;
+	uint32_t offset = get_be ( p, 4 );
+	uint32_t flags = get_be ( p + 4, 4 );
+	if ( offset >= strings ) bad_binary_index();
+
+	e->current  = ( flags & BINARY_CURRENT ) != 0;
+	e->chunked  = ( flags & BINARY_CHUNKED ) != 0;
+	e->filename = table + offset;
+	e->mode     = get_be ( p + 8, 4 );
+	e->codec    = get_be ( p + 12, 4 );
+	if ( e->codec >= sizeof ( codecs )
+			 / sizeof ( codecs[0] ) - 1 )
+	    bad_binary_index();
+	e->mtime    = (time_t) (int64_t)
+		      get_be ( p + 16, 8 );
+	e->size     = get_be ( p + 24, 8 );
+	e->esize    = get_be ( p + 32, 8 );
+	e->md5sum   = hex;
+	bytes_to_hex ( hex, p + 40,
+		       flags & BINARY_MD5SUM_UPPER );
+	hex += 33;
+	e->emd5sum  = hex;
+	if ( flags & BINARY_EMD5SUM )
+	    bytes_to_hex ( hex, p + 56,
+			   flags & BINARY_EMD5SUM_UPPER );
+	else
+	    hex[0] = 0;
+	hex += 33;
+	e->key      = hex;
+	bytes_to_hex ( hex, p + 72,
+		       flags & BINARY_KEY_UPPER );
+	hex += 33;
+	e->modified = 0;
+
+	if ( first_entry == NULL )
+	    first_entry = e->previous = e->next = e;
+	else
+	{
+	    e->previous = first_entry->previous;
+	    e->next = first_entry;
+	    e->previous->next = e->next->previous = e;
+	}
+	hash_entry ( e );
+    }
+}
+
+/* The journal, EFM-JOURNAL.gpg, holds the changes made
+ * to the index since EFM-INDEX.gpg was last written,
+ * so that a command that changes a few entries need
+ * not re-encrypt the whole index.  It is a sequence
+ * of records, each a line giving the record length in
+ * decimal followed by that many bytes of OpenPGP
+ * message.  The first record is encrypted with the
+ * index password and contains the journal key, a
+ * random 32 hexadecimal digit key.  The other records
+ * are encrypted with the journal key, and each holds
+ * the subtracted filenames and changed entries of one
+ * command in the form read by read_index with journal
+ * == 1.
+ *
+ * The journal is compacted, i.e., the whole index is
+ * written and the journal deleted, when the journal
+ * is longer than JOURNAL_LIMIT bytes or the back-
+ * ground process is killed.
+ */
+#define JOURNAL_LIMIT ( 256 * 1024 )
+char journal_key[33] = "";
+    /* "" if there is no journal. */
+
+/* Encrypt the contents of in with key and append them
+ * to the journal open on fd as one record.  Return 0
+ * on success and -1 on error.
+ */
+int append_record ( int fd, FILE * in, const char * key )
+{
+    FILE * out = tmpfile ();
+    struct stat st;
+    char * record;
+    int n, r;
+
+    if ( out == NULL ) error ( errno );
+    fflush ( in );
+    if ( lseek ( fileno ( in ), 0, SEEK_SET ) < 0 )
+	error ( errno );
+    if ( pgp_encrypt ( fileno ( in ), fileno ( out ),
+		       key, strlen ( key ), 0, NULL )
+	 < 0 )
+    {
+	fclose ( out );
+	return -1;
+    }
+    if ( fstat ( fileno ( out ), & st ) < 0 )
+	error ( errno );
+
+    /* The record is appended by one write so that an
+     * interrupted append leaves at most one damaged
+     * record at the end of the journal.
+     */
+    record = (char *) malloc ( st.st_size + 32 );
+    if ( record == NULL ) error ( ENOMEM );
+    n = sprintf ( record, "%lld\n",
+		  (long long) st.st_size );
+    rewind ( out );
+    if ( fread ( record + n, 1, st.st_size, out )
+	 != st.st_size )
+	error ( errno );
+    r = write_all ( fd, record, n + st.st_size );
+    if ( r == 0 && fsync ( fd ) < 0 ) r = -1;
+    if ( r < 0 )
+	printf ( "ERROR: cannot write"
+		 " EFM-JOURNAL.gpg\n" );
+    free ( record );
+    fclose ( out );
+    return r;
+}
+
+/* Read the next record of the journal from in, decrypt
+ * it with the plength password, and write the result
+ * to out, or just skip the record if out is NULL.
+ * Return 1 on success, 0 at the end of the journal,
+ * and -1 if the record is incomplete or cannot be
+ * decrypted.
+ */
+int read_record ( FILE * in, FILE * out,
+		  const char * password, int plength )
+{
+    char header[32], * q;
+    long long size;
+    FILE * tmp;
+    int c, r;
+
+    if ( fgets ( header, sizeof ( header ), in )
+	 == NULL )
+	return 0;
+    size = strtoll ( header, & q, 10 );
+    if ( * q != '\n' || size <= 0 ) return -1;
+
+    tmp = ( out == NULL ? NULL : tmpfile () );
+    if ( out != NULL && tmp == NULL ) error ( errno );
+    while ( size > 0 && ( c = getc ( in ) ) != EOF )
+    {
+	if ( tmp != NULL ) putc ( c, tmp );
+	-- size;
+    }
+    if ( tmp == NULL || size > 0 )
+    {
+	if ( tmp != NULL ) fclose ( tmp );
+	return size > 0 ? -1 : 1;
+    }
+    fflush ( tmp );
+    fflush ( out );
+    if ( lseek ( fileno ( tmp ), 0, SEEK_SET ) < 0 )
+	error ( errno );
+    r = pgp_decrypt ( fileno ( tmp ), fileno ( out ),
+		      password, plength, NULL );
+    fclose ( tmp );
+    return r < 0 ? -1 : 1;
+}
+
+/* Mark all entries unmodified and discard the list of
+ * subtracted filenames, after the index or journal
+ * has been written or read.
+ */
+void clear_modified ( void )
+{
+    struct entry * e = first_entry;
+    if ( e ) do e->modified = 0;
+    while ( ( e = e->next ) != first_entry );
+
+    while ( first_removal != NULL )
+    {
+	struct removal * r = first_removal;
+	first_removal = r->next;
+	free ( r->filename );
+	free ( r );
+    }
+}
+
+/* Length of the journal that has been read into the
+ * index, or 0 if none has.
+ */
+off_t journal_offset = 0;
+
+/* Read the records of the journal after journal_off-
+ * set into the index, skipping the key record if
+ * journal_offset is 0, and advance journal_offset.
+ * Return 0 on success, or print a message and return
+ * -1 if the end of the journal is damaged or incom-
+ * plete, in which case the journal should be com-
+ * pacted if no other process is writing it.  But if
+ * writing is 1, another process may be appending a
+ * record, and an incomplete record at the end is left
+ * to be read later without error.  On other errors
+ * print message and exit ( 1 ).
+ */
+int replay_journal ( int writing )
+{
+    FILE * in, * out;
+    int r;
+
+    in = fopen ( "EFM-JOURNAL.gpg", "r" );
+    if ( in == NULL )
+    {
+	if ( errno == ENOENT ) return 0;
+	error ( errno );
+    }
+    if ( journal_offset == 0 )
+	r = read_record ( in, NULL, NULL, 0 );
+    else if ( fseek ( in, journal_offset, SEEK_SET )
+	      < 0 )
+	error ( errno );
+    else
+	r = 1;
+
+    while ( r > 0 )
+    {
+	journal_offset = ftell ( in );
+	out = tmpfile ();
+	if ( out == NULL ) error ( errno );
+	r = read_record ( in, out, journal_key, 32 );
+	if ( r > 0 )
+	{
+	    rewind ( out );
+	    read_index ( out, 1 );
+	}
+	fclose ( out );
+    }
+    fclose ( in );
+    clear_modified ();
+
+    if ( r < 0 && ! writing )
+    {
+	printf ( "ERROR: damaged or incomplete end of"
+		 " EFM-JOURNAL.gpg\n" );
+	return -1;
+    }
+    return 0;
+}
+
+/* Replay the journal, if it exists, into the index
+ * just read, first decrypting the journal key.  Re-
+ * turn as per replay_journal.
+ */
+int read_journal ( void )
+{
+    FILE * in, * out;
+    line_buffer buffer;
+
+    in = fopen ( "EFM-JOURNAL.gpg", "r" );
+    if ( in == NULL )
+    {
+	if ( errno == ENOENT ) return 0;
+	error ( errno );
+    }
+
+    out = tmpfile ();
+    if ( out == NULL ) error ( errno );
+    if ( read_record ( in, out, password,
+		       strlen ( password ) )
+	 <= 0 )
+    {
+	printf ( "ERROR: cannot decrypt"
+		 " EFM-JOURNAL.gpg\n" );
+	exit ( 1 );
+    }
+    rewind ( out );
+    if ( ! get_line ( buffer, out )
+	 || strlen ( buffer ) != 32 )
+    {
+	printf ( "ERROR: bad EFM-JOURNAL.gpg key\n" );
+	exit ( 1 );
+    }
+    fclose ( out );
+    strcpy ( journal_key, buffer );
+    journal_offset = ftell ( in );
+    fclose ( in );
+
+    return replay_journal ( 0 );
+}
+
+/* Append the entries changed and the filenames sub-
+ * tracted since the index or journal was last written
+ * to the journal as one record, first making the
+ * journal if it is empty or does not exist.  If
+ * there is no journal key, one is made and any exist-
+ * ing journal is discarded.  Return 0 on success and
+ * -1 on error.
+ */
+int write_journal ( void )
+{
+    FILE * f;
+    int fd, r = 0;
+    struct entry * e;
+    struct removal * d;
+    struct stat st;
+
+    fd = open ( "EFM-JOURNAL.gpg",
+		O_WRONLY + O_CREAT + O_APPEND,
+		S_IWUSR + S_IRUSR );
+    if ( fd < 0 )
+    {
+	printf ( "ERROR: cannot open EFM-JOURNAL.gpg"
+		 " for writing\n" );
+	return -1;
+    }
+    if ( journal_key[0] == 0 )
+    {
+	if ( ftruncate ( fd, 0 ) < 0 ) error ( errno );
+	newkey ( journal_key );
+    }
+    if ( fstat ( fd, & st ) < 0 ) error ( errno );
+    if ( st.st_size == 0 )
+    {
+	if ( trace )
+	    printf ( "* making EFM-JOURNAL.gpg\n" );
+	f = tmpfile ();
+	if ( f == NULL ) error ( errno );
+	fprintf ( f, "%s\n", journal_key );
+	r = append_record ( fd, f, password );
+	fclose ( f );
+    }
+    if ( r == 0 )
+    {
+	if ( trace )
+	    printf ( "* appending to"
+		     " EFM-JOURNAL.gpg\n" );
+	f = tmpfile ();
+	if ( f == NULL ) error ( errno );
+	for ( d = first_removal; d; d = d->next )
+	{
+	    line_buffer buffer;
+	    char * b = buffer;
+	    * b ++ = 'x';
+	    * b ++ = ' ';
+	    put_lexeme ( & b, d->filename );
+	    * b = 0;
+	    fprintf ( f, "%s\n", buffer );
+	}
+	e = first_entry;
+	if ( e ) do
+	{
+	    if ( e->modified )
+		write_index_entry ( f, e, 7, "" );
+	}
+	while ( ( e = e->next ) != first_entry );
+	r = append_record ( fd, f, journal_key );
+	fclose ( f );
+    }
+    close ( fd );
+    if ( r == 0 ) clear_modified ();
+    return r;
+}
+
+/* A child serving a command that changes the index
+ * (see command_class) appends the changes made for
+ * each file of a file command to the journal as the
+ * file is finished, as a record of its own at most
+ * once every PUBLISH_INTERVAL seconds, and not only
+ * when the command is done.  Each record is a version
+ * of the index that the background process reads
+ * before forking a child to serve a command that only
+ * reads the index, so such commands see the files
+ * finished so far.  The forked child has its own
+ * copy of the index, which does not change while it
+ * runs and is freed when it exits.
+ */
+#define PUBLISH_INTERVAL 1.0
+int publishing = 0;
+    /* 1 in a child serving a command that changes the
+     * index. */
+double published = 0;
+    /* Wall clock time changes were last published. */
+
+/* Return the seconds until publish_changes will write
+ * the changes not yet published, or -1 if there are
+ * none.  Changes made less than PUBLISH_INTERVAL
+ * seconds after the last were published are pending
+ * until then; wait_job then waits no longer, so they
+ * are published even if no other file finishes.
+ */
+double publish_delay ( void )
+{
+    double delay;
+
+    if ( ! publishing || ! index_modified ) return -1;
+    delay = published + PUBLISH_INTERVAL - wall_clock();
+    return delay < 0 ? 0 : delay;
+}
+
+void publish_changes ( void )
+{
+    if ( publish_delay() != 0 ) return;
+    published = wall_clock();
+    if ( write_journal() == 0 ) index_modified = 0;
+}
+
+/* Write the whole index to EFM-INDEX.gpg, keeping the
+ * previous EFM-INDEX.gpg as EFM-INDEX.gpg-, and delete
+ * the journal.  On error print message and exit ( 1 ).
+ */
+void write_index_file ( void )
+{
+    int indexchild;
+    int indexfd;
+    FILE * indexf;
+
+    indexfd = crypt ( 0, NULL, "EFM-INDEX.gpg+",
+		      password, strlen ( password ),
+		      & indexchild );
+    if ( indexfd < 0 ) exit ( 1 );
+    indexf = fdopen ( indexfd, "w" );
+    if ( trace )
+	printf ( "* writing %s EFM-INDEX.gpg+\n",
+		 index_binary ? "binary" : "text" );
+    if ( ! index_binary
+	 || write_binary_index ( indexf ) < 0 )
+	write_index ( indexf, 7, -1 );
+    fclose ( indexf );
+    if ( cwait ( indexchild ) < 0 )
+    {
+	if ( trace )
+	    printf ( "* deleting EFM-INDEX.gpg+\n" );
+	unlink ( "EFM-INDEX.gpg+" );
+	printf ( "ERROR: error encypting"
+		 " EFM-INDEX.gpg\n" );
+	exit ( 1 );
+    }
+
+    if ( access ( "EFM-INDEX.gpg-", F_OK ) >= 0 )
+    {
+	if ( trace )
+	    printf ( "* deleting EFM-INDEX.gpg-\n" );
+	unlink ( "EFM-INDEX.gpg-" );
+    }
+    if ( trace )
+	printf ( "* renaming EFM-INDEX.gpg to"
+		 " EFM-INDEX.gpg-\n" );
+    if ( link ( "EFM-INDEX.gpg", "EFM-INDEX.gpg-" )
+	 < 0
+	 &&
+	 errno != ENOENT )
+	error ( errno );
+    unlink ( "EFM-INDEX.gpg" );
+    if ( trace )
+	printf ( "* renaming EFM-INDEX.gpg+ to"
+		 " EFM-INDEX.gpg\n" );
+    if ( link ( "EFM-INDEX.gpg+", "EFM-INDEX.gpg" )
+	 < 0 )
+	error ( errno );
+    unlink ( "EFM-INDEX.gpg+" );
+
+    if ( journal_key[0] != 0
+	 ||
+	 access ( "EFM-JOURNAL.gpg", F_OK ) >= 0 )
+    {
+	if ( trace )
+	    printf ( "* deleting EFM-JOURNAL.gpg\n" );
+	unlink ( "EFM-JOURNAL.gpg" );
+	journal_key[0] = 0;
+	journal_offset = 0;
+    }
+    clear_modified ();
+    index_rewrite = 0;
+}
+
+/* Return true iff filename begins with `s3:'.  Also,
+ * if true is returned, checks that s3_config read,
+ * and if not, prints an error message and exits
+ * program.
+ */
+int is_s3 ( const char * filename )
+{
+    if ( strncmp ( "s3:", filename, 3 ) == 0 )
+    {
+        if ( s3_config[0] == 0 )
+	{
+	    printf ( "ERROR: S3 used in %s\n"
+		     "       but EFM-S3CONFIG.gpg"
+		     " missing\n",
+		     filename );
+	    exit ( 1 );
+	}
+	return 1;
+    }
+    else
+        return 0;
+}
+
+/* Return a pointer to the first `:' in the file name
+ * if there is a `:' and the first `:' is preceeded
+ * by exactly one `@'.
+ */
+const char * is_remote ( const char * filename )
+{
+    int at_found = 0;
+    const char * p = filename;
+    for ( ; * p; ++ p )
+    {
+	if ( * p == '@' )
+	{
+	    if ( at_found ) break;
+	    at_found = 1;
+	}
+	else if ( * p == ':' ) break;
+    }
+    return * p == ':' && at_found ? p : NULL;
+}
+
+/* Remote files are reached by executing ssh and scp,
+ * or the programs named by the EFM_SSH and EFM_SCP
+ * environment variables, which must accept the same
+ * arguments.  The background process keeps one ssh
+ * master connection for each remote account, whose
+ * control socket is in ssh_control_dir, and each ssh
+ * or scp executed reuses this connection instead of
+ * making a new one.  A master connection exits when
+ * it has been unused for SSH_PERSIST seconds, or when
+ * the background process is killed.  ssh_control_dir
+ * is "" if there is no such directory.
+ */
+#define SSH_PERSIST "600"
+char ssh_control_dir[32] = "";
+
+/* Return the program to execute in place of program,
+ * which is "ssh" or "scp".
+ */
+const char * ssh_program ( const char * program )
+{
+    const char * p =
+	getenv ( strcmp ( program, "ssh" ) == 0 ?
+		 "EFM_SSH" : "EFM_SCP" );
+    return p != NULL && p[0] != 0 ? p : program;
+}
+
+/* Execute program, which is "ssh" or "scp", with the
+ * NULL terminated list of arguments args, adding the
+ * options that make it use the master connection for
+ * its remote account.  Called in a child process;
+ * does not return.
+ */
+void exec_ssh ( const char * program,
+		const char * const * args )
+{
+    const char ** argv;
+    char path[64];
+    int n = 0;
+
+    while ( args[n] != NULL ) ++ n;
+    argv = (const char **)
+	malloc ( ( n + 8 ) * sizeof ( char * ) );
+    if ( argv == NULL ) error ( ENOMEM );
+    n = 0;
+    argv[n++] = ssh_program ( program );
+    if ( ssh_control_dir[0] != 0 )
+    {
+	sprintf ( path, "ControlPath=%s/%%C",
+		  ssh_control_dir );
+	argv[n++] = "-o";
+	argv[n++] = "ControlMaster=auto";
+	argv[n++] = "-o";
+	argv[n++] = path;
+	argv[n++] = "-o";
+	argv[n++] = "ControlPersist=" SSH_PERSIST;
+    }
+    while ( * args != NULL ) argv[n++] = * args ++;
+    argv[n] = NULL;
+    execvp ( argv[0], (char * const *) argv );
+    error ( errno );
+}
+
+/* Make ssh_control_dir, which only the user can
+ * access.  Called when the background process starts.
+ */
+void make_ssh_control_dir ( void )
+{
+    int n = 0;
+    while ( 1 )
+    {
+	sprintf ( ssh_control_dir, "/tmp/efm-%d-%d",
+		  (int) getpid(), n ++ );
+	if ( mkdir ( ssh_control_dir, 0700 ) >= 0 )
+	    return;
+	if ( errno != EEXIST ) error ( errno );
+    }
+}
+
+/* Tell the master connections whose control sockets
+ * are in ssh_control_dir to exit, and remove
+ * ssh_control_dir.  Called when the background pro-
+ * cess is killed.
+ */
+void close_ssh_control_dir ( void )
+{
+    DIR * dir;
+    struct dirent * d;
+    char path[128];
+    pid_t child;
+
+    if ( ssh_control_dir[0] == 0 ) return;
+    dir = opendir ( ssh_control_dir );
+    while ( dir != NULL
+	    && ( d = readdir ( dir ) ) != NULL )
+    {
+	if ( d->d_name[0] == '.' ) continue;
+	if ( strlen ( d->d_name ) > 64 ) continue;
+	sprintf ( path, "ControlPath=%s/%s",
+		  ssh_control_dir, d->d_name );
+	if ( trace )
+	{
+	    fprintf ( stderr,
+		      "* executing ssh -O exit"
+		      " -o %s\n", path );
+	    fflush ( stderr );
+	}
+	fflush ( stdout );
+	fflush ( stderr );
+	child = fork();
+	if ( child < 0 ) error ( errno );
+	if ( child == 0 )
+	{
+	    int newfd = open ( "/dev/null", O_RDWR );
+	    if ( newfd < 0 ) error ( errno );
+	    dup2 ( newfd, 0 );
+	    dup2 ( newfd, 1 );
+	    dup2 ( newfd, 2 );
+	    execlp ( ssh_program ( "ssh" ), "ssh",
+		     "-o", path, "-O", "exit",
+		     "efm", NULL );
+	    exit ( 1 );
+	}
+	cwait ( child );
+	unlink ( path + 12 );
+    }
+    if ( dir != NULL ) closedir ( dir );
+    rmdir ( ssh_control_dir );
+    ssh_control_dir[0] = 0;
+}
+
+/* Built-in S3 client.
+ *
+ * When EFM-S3CONFIG sets efm_builtin_client to True
+ * and use_https to False (see s3_builtin), S3 objects
+ * are transferred by efm itself over HTTP to the
+ * host_base endpoint (e.g., a local S3 compatible
+ * server), instead of by executing s3cmd.  Requests
+ * name objects by path (/bucket/key) and are signed by
+ * AWS signature version 4.  Payloads are not signed;
+ * their integrity is checked by MD5 sums (Content-MD5
+ * and ETags) instead.
+ *
+ * Objects longer than S3_PART_SIZE are written by a
+ * multipart upload and read by ranged GETs, with up to
+ * s3_parts parts being transferred at once, each by
+ * its own worker process, and each part being retried
+ * up to RETRIES times.  The process calling the client
+ * reads the parts to be uploaded from its input, and
+ * writes the downloaded parts to its output in order.
+ */
+#define S3_PART_SIZE ( 8 * 1024 * 1024 )
+#define S3_MAX_PARTS 10000
+#define S3_TIMEOUT 60	/* Seconds */
+
+/* An S3 object, and the endpoint and credentials used
+ * to access it.  Name is s3://bucket/key and path is
+ * the URI encoded /bucket/key.
+ */
+struct s3_object {
+    const char * name;
+    char host[256];
+    char region[64];
+    char access_key[256];
+    char secret_key[256];
+    char path[3*MAX_LINE_SIZE+2];
+};
+
+/* Write the URI encoding of s into out, in which each
+ * character other than a letter, digit, `-', `.',
+ * `_', or `~' (or `/', if slash is 1) is written as
+ * %XX.  Return a pointer to the NUL ending out.
+ */
+char * uri_encode ( char * out, const char * s,
+		    int slash )
+{
+    for ( ; * s; ++ s )
+    {
+	unsigned char c = * s;
+	if ( isalnum ( c ) || strchr ( "-._~", c )
+	     || ( slash && c == '/' ) )
+	    * out ++ = c;
+	else
+	    out += sprintf ( out, "%%%02X", c );
+    }
+    * out = 0;
+    return out;
+}
+
+/* Set up o to access the S3 object name, of the form
+ * s3://bucket/key, or the bucket itself if name is
+ * s3://bucket.  Return 0 on success and -1 on error,
+ * with error messages written on stdout.
+ */
+int s3_open ( struct s3_object * o, const char * name )
+{
+    o->name = name;
+    if ( strncmp ( name, "s3://", 5 ) != 0
+	 || name[5] == 0 || name[5] == '/' )
+    {
+	printf ( "ERROR: bad S3 name %s\n", name );
+	return -1;
+    }
+    if ( s3_setting ( "host_base", o->host,
+		      sizeof ( o->host ) ) < 0
+	 || s3_setting ( "access_key", o->access_key,
+			 sizeof ( o->access_key ) ) < 0
+	 || s3_setting ( "secret_key", o->secret_key,
+			 sizeof ( o->secret_key ) ) < 0 )
+    {
+	printf ( "ERROR: EFM-S3CONFIG does not set"
+		 " host_base,\n"
+		 "    access_key, and secret_key\n" );
+	return -1;
+    }
+    if ( s3_setting ( "bucket_location", o->region,
+		      sizeof ( o->region ) ) < 0
+	 || o->region[0] == 0
+	 || strcmp ( o->region, "US" ) == 0 )
+	strcpy ( o->region, "us-east-1" );
+    o->path[0] = '/';
+    uri_encode ( o->path + 1, name + 5, 1 );
+    return 0;
+}
+
+/* Compute the HMAC-SHA256 of the n bytes of data with
+ * the klength byte key, storing the 32 byte result in
+ * mac, which may be the key.
+ */
+void hmac_sha256 ( unsigned char * mac,
+		   const void * key, int klength,
+		   const void * data, size_t n )
+{
+    struct sha s;
+    unsigned char k[64], inner[32];
+    int i;
+
+    memset ( k, 0, sizeof ( k ) );
+    if ( klength > 64 )
+    {
+	sha_init ( & s, 8 );
+	sha_update ( & s, key, klength );
+	sha_final ( & s, k );
+    }
+    else
+	memcpy ( k, key, klength );
+
+    for ( i = 0; i < 64; ++ i ) k[i] ^= 0x36;
+    sha_init ( & s, 8 );
+    sha_update ( & s, k, 64 );
+    sha_update ( & s, data, n );
+    sha_final ( & s, inner );
+
+    for ( i = 0; i < 64; ++ i ) k[i] ^= 0x36 ^ 0x5c;
+    sha_init ( & s, 8 );
+    sha_update ( & s, k, 64 );
+    sha_update ( & s, inner, 32 );
+    sha_final ( & s, mac );
+}
+
+/* Write the base64 encoding of the n bytes b into out
+ * followed by a NUL.
+ */
+void base64 ( char * out, const unsigned char * b,
+	      int n )
+{
+    const char * digits =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"abcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+    for ( i = 0; i < n; i += 3 )
+    {
+	unsigned long v = (unsigned long) b[i] << 16;
+	if ( i + 1 < n ) v |= b[i+1] << 8;
+	if ( i + 2 < n ) v |= b[i+2];
+	* out ++ = digits[v >> 18];
+	* out ++ = digits[(v >> 12) & 63];
+	* out ++ = i + 1 < n ? digits[(v >> 6) & 63]
+			     : '=';
+	* out ++ = i + 2 < n ? digits[v & 63] : '=';
+    }
+    * out = 0;
+}
+
+/* Response to an S3 request.  The body of a successful
+ * response is written to outfd if that is not nega-
+ * tive, kept in body (followed by a NUL) if outfd is
+ * S3_MEMORY, or discarded if outfd is S3_DISCARD, and
+ * is also hashed into md5 if that is not NULL.  Writ-
+ * ten counts the body bytes so far, which may be re-
+ * ceived by several requests.  The start of the body
+ * of an unsuccessful response is kept in error.
+ */
+#define S3_MEMORY -1
+#define S3_DISCARD -2
+struct s3_response {
+    int outfd;
+    struct md5 * md5;
+    long long written;
+    unsigned char * body;
+    size_t body_size;
+    int ranged;		/* 1 if 200 is not success */
+    int status;
+    long long length;	/* Content-Length or -1 */
+    char etag[80];
+    char attrs[400];	/* x-amz-meta-s3cmd-attrs */
+    char error[1000];
+};
+
+void s3_response_init ( struct s3_response * r,
+			int outfd, struct md5 * md5 )
+{
+    memset ( r, 0, sizeof ( * r ) );
+    r->outfd = outfd;
+    r->md5 = md5;
+}
+
+/* Return 1 if r has a successful status and 0 if
+ * not.
+ */
+int s3_success ( struct s3_response * r )
+{
+    return r->status / 100 == 2
+	   && ! ( r->ranged && r->status == 200 );
+}
+
+/* Add the n bytes of data to the body of r.  Return 0
+ * on success and -1 on error, with error messages
+ * written on stdout.
+ */
+int s3_body ( struct s3_response * r,
+	      const unsigned char * data, int n )
+{
+    if ( ! s3_success ( r ) )
+    {
+	int used = strlen ( r->error );
+	if ( n > (int) sizeof ( r->error ) - 1 - used )
+	    n = sizeof ( r->error ) - 1 - used;
+	memcpy ( r->error + used, data, n );
+	r->error[used+n] = 0;
+	return 0;
+    }
+    if ( r->md5 != NULL ) md5_update ( r->md5, data, n );
+    if ( r->outfd >= 0 )
+    {
+	if ( write_all ( r->outfd, data, n ) < 0 )
+	    return -1;
+    }
+    else if ( r->outfd == S3_MEMORY )
+    {
+	if ( r->written + n + 1 > r->body_size )
+	{
+	    r->body_size = 2 * ( r->written + n + 1 );
+	    r->body = (unsigned char *)
+		realloc ( r->body, r->body_size );
+	    if ( r->body == NULL ) error ( ENOMEM );
+	}
+	memcpy ( r->body + r->written, data, n );
+	r->body[r->written+n] = 0;
+    }
+    r->written += n;
+    return 0;
+}
+
+/* Read a line ending in LF or CRLF from in into line,
+ * which has room for size characters, dropping the
+ * line end and any characters that do not fit.  Re-
+ * turn 0 on success and -1 on error or end of file,
+ * with error messages written on stdout.
+ */
+int http_line ( struct source * in, char * line,
+		int size )
+{
+    unsigned char c;
+    int n = 0, r;
+    while ( ( r = in->read ( in, & c, 1 ) ) == 1 )
+    {
+	if ( c == '\n' )
+	{
+	    if ( n > 0 && line[n-1] == '\r' ) -- n;
+	    line[n] = 0;
+	    return 0;
+	}
+	if ( n < size - 1 ) line[n++] = c;
+    }
+    if ( r == 0 )
+	printf ( "ERROR: S3 connection closed"
+		 " early\n" );
+    return -1;
+}
+
+/* If line is an HTTP header whose name is name (in
+ * lower case), return a pointer to its value, and
+ * otherwise return NULL.
+ */
+const char * http_header ( const char * line,
+			   const char * name )
+{
+    while ( * name && tolower ( * line ) == * name )
+	++ line, ++ name;
+    if ( * name || * line ++ != ':' ) return NULL;
+    while ( isspace ( * line ) ) ++ line;
+    return line;
+}
+
+/* Copy s into out, which has room for size characters,
+ * removing any enclosing quotes.
+ */
+void unquote ( char * out, const char * s, int size )
+{
+    int n;
+    if ( * s == '"' ) ++ s;
+    n = strlen ( s );
+    if ( n > 0 && s[n-1] == '"' ) -- n;
+    if ( n > size - 1 ) n = size - 1;
+    memcpy ( out, s, n );
+    out[n] = 0;
+}
+
+/* Copy into value, which has room for size characters,
+ * the text of the first <tag>...</tag> element in the
+ * XML string xml, decoding character entities.  Return
+ * a pointer just after the element, or NULL if there
+ * is no such element.
+ */
+const char * xml_value ( const char * xml,
+			 const char * tag,
+			 char * value, int size )
+{
+    static const char * entities[] =
+	{ "&amp;", "&", "&lt;", "<", "&gt;", ">",
+	  "&quot;", "\"", "&apos;", "'", NULL };
+    char open[64], close[64];
+    const char * p, * end;
+    int n = 0;
+
+    sprintf ( open, "<%s>", tag );
+    sprintf ( close, "</%s>", tag );
+    p = strstr ( xml, open );
+    if ( p == NULL ) return NULL;
+    p += strlen ( open );
+    end = strstr ( p, close );
+    if ( end == NULL ) return NULL;
+
+    while ( p < end && n < size - 1 )
+    {
+	const char ** e = entities;
+	if ( * p == '&' )
+	    for ( ; * e; e += 2 )
+	    {
+		if ( strncmp ( p, * e, strlen ( * e ) )
+		     == 0 )
+		    break;
+	    }
+	if ( * p == '&' && * e )
+	{
+	    value[n++] = e[1][0];
+	    p += strlen ( * e );
+	}
+	else
+	    value[n++] = * p ++;
+    }
+    value[n] = 0;
+    return end + strlen ( close );
+}
+
+/* Return a TCP connection to the S3 endpoint host,
+ * which has the form name or name:port, or -1 on
+ * error, with error messages written on stdout.
+ */
+int s3_connect ( const char * host )
+{
+    char name[256];
+    char * colon;
+    int port = 80, fd;
+    struct hostent * h;
+    struct sockaddr_in sa;
+    struct timeval tv;
+
+    strcpy ( name, host );
+    colon = strrchr ( name, ':' );
+    if ( colon != NULL )
+    {
+	* colon = 0;
+	port = atoi ( colon + 1 );
+    }
+    h = gethostbyname ( name );
+    if ( h == NULL || h->h_addrtype != AF_INET )
+    {
+	printf ( "ERROR: cannot find S3 host %s\n",
+		 name );
+	return -1;
+    }
+    memset ( & sa, 0, sizeof ( sa ) );
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons ( port );
+    memcpy ( & sa.sin_addr, h->h_addr_list[0],
+	     h->h_length );
+
+    fd = socket ( AF_INET, SOCK_STREAM, 0 );
+    if ( fd < 0 ) error ( errno );
+    tv.tv_sec = S3_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt ( fd, SOL_SOCKET, SO_RCVTIMEO,
+		 & tv, sizeof ( tv ) );
+    setsockopt ( fd, SOL_SOCKET, SO_SNDTIMEO,
+		 & tv, sizeof ( tv ) );
+    if ( connect ( fd, (struct sockaddr *) & sa,
+		   sizeof ( sa ) ) < 0 )
+    {
+	printf ( "ERROR: %s\n"
+		 "    connecting to S3 host %s\n",
+		 strerror ( errno ), host );
+	close ( fd );
+	return -1;
+    }
+    return fd;
+}
+
+/* Read the response to an S3 request with method from
+ * in into r.  Return 0 if a whole response is read and
+ * -1 otherwise, with error messages written on stdout.
+ */
+int s3_read_response ( struct source * in,
+		       const char * method,
+		       struct s3_response * r )
+{
+    line_buffer line;
+    const char * v;
+    int chunked = 0;
+    long long n = -1;
+
+    r->status = 0;
+    r->length = -1;
+    r->etag[0] = r->attrs[0] = r->error[0] = 0;
+
+    if ( http_line ( in, line, sizeof ( line ) ) < 0 )
+	return -1;
+    if ( sscanf ( line, "HTTP/%*s %d", & r->status )
+	 != 1 )
+    {
+	printf ( "ERROR: bad S3 response: %s\n",
+		 line );
+	return -1;
+    }
+    while ( 1 )
+    {
+	if ( http_line ( in, line, sizeof ( line ) )
+	     < 0 )
+	    return -1;
+	if ( line[0] == 0 ) break;
+	if ( ( v = http_header
+		       ( line, "content-length" ) ) )
+	    r->length = atoll ( v );
+	else if ( ( v = http_header
+			    ( line, "etag" ) ) )
+	    unquote ( r->etag, v,
+		      sizeof ( r->etag ) );
+	else if ( ( v = http_header
+			    ( line,
+			      "x-amz-meta-s3cmd-attrs"
+			    ) ) )
+	    unquote ( r->attrs, v,
+		      sizeof ( r->attrs ) );
+	else if ( ( v = http_header
+			    ( line,
+			      "transfer-encoding" ) )
+		  && strstr ( v, "chunked" ) )
+	    chunked = 1;
+    }
+    if ( strcmp ( method, "HEAD" ) == 0
+	 || r->status == 204 || r->status == 304 )
+	return 0;
+
+    while ( 1 )
+    {
+	unsigned char buffer[16384];
+	if ( chunked )
+	{
+	    if ( http_line ( in, line,
+			     sizeof ( line ) ) < 0 )
+		return -1;
+	    n = strtoll ( line, NULL, 16 );
+	    if ( n == 0 )
+	    {
+		/* Skip trailer */
+		do {
+		    if ( http_line
+			     ( in, line,
+			       sizeof ( line ) ) < 0 )
+			return -1;
+		} while ( line[0] != 0 );
+		return 0;
+	    }
+	}
+	else
+	    n = r->length;
+
+	while ( n != 0 )
+	{
+	    int m = sizeof ( buffer );
+	    if ( n > 0 && n < m ) m = n;
+	    m = in->read ( in, buffer, m );
+	    if ( m < 0 ) return -1;
+	    if ( m == 0 && n < 0 ) return 0;
+	    if ( m == 0 )
+	    {
+		printf ( "ERROR: S3 connection closed"
+			 " early\n" );
+		return -1;
+	    }
+	    if ( s3_body ( r, buffer, m ) < 0 )
+		return -1;
+	    if ( n > 0 ) n -= m;
+	}
+	if ( ! chunked ) return 0;
+	if ( http_line ( in, line, sizeof ( line ) )
+	     < 0 )
+	    return -1;
+    }
+}
+
+/* Send an S3 request with method and query string
+ * (whose parameters must be in canonical order) for
+ * object o, with the extra header lines headers (each
+ * ending in CRLF) and the n bytes of data as body,
+ * and read the response into r.  Return 0 if the
+ * response is successful and -1 otherwise, with error
+ * messages written on stdout.
+ */
+int s3_request ( struct s3_object * o,
+		 const char * method,
+		 const char * query,
+		 const char * headers,
+		 const void * data, size_t n,
+		 struct s3_response * r )
+{
+    char date[20], day[10], hash[65], signature[65];
+    char key[300];
+    unsigned char digest[32];
+    char * request;
+    time_t now = time ( NULL );
+    struct sha s;
+    struct fd_source * in;
+    int fd, result = -1;
+
+    strftime ( date, sizeof ( date ),
+	       "%Y%m%dT%H%M%SZ", gmtime ( & now ) );
+    memcpy ( day, date, 8 );
+    day[8] = 0;
+
+    request = (char *)
+	malloc ( strlen ( o->path ) + strlen ( query )
+		 + strlen ( headers ) + 2000 );
+    if ( request == NULL ) error ( ENOMEM );
+
+    /* Sign the hash of the canonical request with
+     * a key derived from the secret key, day,
+     * region, and service.
+     */
+    sprintf ( request,
+	      "%s\n%s\n%s\n"
+	      "host:%s\n"
+	      "x-amz-content-sha256:UNSIGNED-PAYLOAD\n"
+	      "x-amz-date:%s\n\n"
+	      "host;x-amz-content-sha256;x-amz-date\n"
+	      "UNSIGNED-PAYLOAD",
+	      method, o->path, query, o->host, date );
+    sha_init ( & s, 8 );
+    sha_update ( & s, request, strlen ( request ) );
+    sha_final ( & s, digest );
+    bytes_to_hex ( hash, digest, 0 );
+    bytes_to_hex ( hash + 32, digest + 16, 0 );
+    sprintf ( request,
+	      "AWS4-HMAC-SHA256\n%s\n"
+	      "%s/%s/s3/aws4_request\n%s",
+	      date, day, o->region, hash );
+    sprintf ( key, "AWS4%s", o->secret_key );
+    hmac_sha256 ( digest, key, strlen ( key ), day, 8 );
+    hmac_sha256 ( digest, digest, 32, o->region,
+		  strlen ( o->region ) );
+    hmac_sha256 ( digest, digest, 32, "s3", 2 );
+    hmac_sha256 ( digest, digest, 32,
+		  "aws4_request", 12 );
+    hmac_sha256 ( digest, digest, 32, request,
+		  strlen ( request ) );
+    bytes_to_hex ( signature, digest, 0 );
+    bytes_to_hex ( signature + 32, digest + 16, 0 );
+
+    sprintf ( request,
+	      "%s %s%s%s HTTP/1.1\r\n"
+	      "Host: %s\r\n"
+	      "x-amz-date: %s\r\n"
+	      "x-amz-content-sha256: UNSIGNED-PAYLOAD\r\n"
+	      "Authorization: AWS4-HMAC-SHA256"
+	      " Credential=%s/%s/%s/s3/aws4_request,"
+	      " SignedHeaders=host;x-amz-content-sha256;"
+	      "x-amz-date, Signature=%s\r\n"
+	      "Content-Length: %lu\r\n"
+	      "Connection: close\r\n"
+	      "%s\r\n",
+	      method, o->path, query[0] ? "?" : "",
+	      query, o->host, date, o->access_key, day,
+	      o->region, signature, (unsigned long) n,
+	      headers );
+
+    fd = s3_connect ( o->host );
+    if ( fd >= 0 )
+    {
+	if ( write_all ( fd, request,
+			 strlen ( request ) ) == 0
+	     && ( n == 0
+		  || write_all ( fd, data, n ) == 0 ) )
+	{
+	    in = (struct fd_source *)
+		malloc ( sizeof ( * in ) );
+	    if ( in == NULL ) error ( ENOMEM );
+	    fd_source_init ( in, fd );
+	    result = s3_read_response ( & in->s,
+					method, r );
+	    free ( in );
+	}
+	close ( fd );
+    }
+    free ( request );
+
+    if ( result == 0 && ! s3_success ( r ) )
+    {
+	char code[100];
+	if ( xml_value ( r->error, "Code", code,
+			 sizeof ( code ) ) == NULL )
+	    strcpy ( code, r->status == 200 ?
+			   "Range ignored" : "" );
+	printf ( "ERROR: S3 %s %s\n"
+		 "    failed with HTTP status %d %s\n",
+		 method, o->name, r->status, code );
+	result = -1;
+    }
+    else if ( result < 0 )
+	printf ( "ERROR: S3 %s %s failed\n",
+		 method, o->name );
+    return result;
+}
+
+/* Send an S3 request with method, query, and the
+ * string data (or no data if NULL) as body, keeping
+ * the response body in r->body, which must be freed.
+ * RETRIES retries are done on failure, except for a
+ * client error response.  Return 0 on success and -1
+ * on error, with error messages written on stdout.
+ */
+int s3_call ( struct s3_object * o,
+	      const char * method, const char * query,
+	      const char * data, struct s3_response * r )
+{
+    int retries = RETRIES;
+    while ( 1 )
+    {
+	s3_response_init ( r, S3_MEMORY, NULL );
+	if ( s3_request ( o, method, query, "",
+			  data,
+			  data ? strlen ( data ) : 0,
+			  r ) == 0 )
+	    return 0;
+	free ( r->body );
+	r->body = NULL;
+	if ( r->status / 100 == 4 || retries -- == 0 )
+	    return -1;
+	printf ( "RETRYING S3 %s %s\n",
+		 method, o->name );
+    }
+}
+
+/* Get the length bytes of object o beginning at offset
+ * into r, which is set up by the caller.  RETRIES re-
+ * tries are done on failure, each continuing after the
+ * bytes already received.  Return 0 on success and -1
+ * on error, with error messages written on stdout.
+ */
+int s3_get_range ( struct s3_object * o,
+		   long long offset, long long length,
+		   struct s3_response * r )
+{
+    int retries = RETRIES;
+    char range[100];
+    while ( r->written < length )
+    {
+	sprintf ( range, "Range: bytes=%lld-%lld\r\n",
+		  offset + r->written,
+		  offset + length - 1 );
+	r->ranged = ( offset + r->written > 0 );
+	if ( s3_request ( o, "GET", "", range,
+			  NULL, 0, r ) == 0
+	     && r->written != length )
+	{
+	    printf ( "ERROR: S3 GET %s\n"
+		     "    returned %lld bytes instead"
+		     " of %lld\n", o->name,
+		     r->written, length );
+	    return -1;
+	}
+	if ( r->written == length ) break;
+	if ( r->status / 100 == 4 || retries -- == 0 )
+	    return -1;
+	printf ( "RETRYING S3 GET %s\n"
+		 "    from byte %lld\n", o->name,
+		 offset + r->written );
+    }
+    return 0;
+}
+
+/* Return 1 if etag is the MD5 sum sum (possibly in
+ * another case), and 0 otherwise.
+ */
+int s3_etag_is ( const char * etag, const char * sum )
+{
+    for ( ; * etag && * sum; ++ etag, ++ sum )
+    {
+	if ( tolower ( * etag ) != tolower ( * sum ) )
+	    return 0;
+    }
+    return * etag == * sum;
+}
+
+/* Put the n bytes of data, whose hexadecimal MD5 sum
+ * is sum, as object o, or as a part of a multipart
+ * upload of o if query is not empty, checking that the
+ * returned ETag is sum.  RETRIES retries are done on
+ * failure.  Return 0 on success and -1 on error, with
+ * error messages written on stdout.
+ */
+int s3_put_data ( struct s3_object * o,
+		  const char * query,
+		  const unsigned char * data, size_t n,
+		  const char * sum )
+{
+    struct s3_response r;
+    unsigned char b[16];
+    char headers[100];
+    int retries = RETRIES;
+
+    hex_to_bytes ( b, sum );
+    strcpy ( headers, "Content-MD5: " );
+    base64 ( headers + strlen ( headers ), b, 16 );
+    strcat ( headers, "\r\n" );
+
+    while ( 1 )
+    {
+	s3_response_init ( & r, S3_DISCARD, NULL );
+	if ( s3_request ( o, "PUT", query, headers,
+			  data, n, & r ) == 0 )
+	{
+	    if ( s3_etag_is ( r.etag, sum ) ) return 0;
+	    printf ( "ERROR: S3 PUT %s\n"
+		     "    returned ETag %s instead of"
+		     " %s\n", o->name, r.etag, sum );
+	}
+	if ( r.status / 100 == 4 || retries -- == 0 )
+	    return -1;
+	printf ( "RETRYING S3 PUT %s%s%s\n", o->name,
+		 query[0] ? "?" : "", query );
+    }
+}
+
+/* Read from fd until n bytes are in buffer or end of
+ * file.  Return the number of bytes read, or -1 on
+ * error, with error messages written on stdout.
+ */
+ssize_t read_fd ( int fd, unsigned char * buffer,
+		  size_t n )
+{
+    size_t done = 0;
+    while ( done < n )
+    {
+	ssize_t r = read ( fd, buffer + done, n - done );
+	if ( r < 0 )
+	{
+	    if ( errno == EINTR ) continue;
+	    printf ( "ERROR: %s\n    reading data\n",
+		     strerror ( errno ) );
+	    return -1;
+	}
+	if ( r == 0 ) break;
+	done += r;
+    }
+    return done;
+}
+
+/* Flags of s3_put_object, s3_get_object, and s3_copy.
+ */
+#define S3_RESUME 1	/* Resume an earlier transfer */
+#define S3_KEEP 2	/* Keep what is transferred on
+			   failure, for S3_RESUME */
+
+/* Find an incomplete multipart upload of object o, as
+ * kept by s3_put_object with S3_KEEP, copy its id into
+ * upload, which has room for size characters, and set
+ * etags to the ETags of its parts, indexed by part
+ * number - 1, which are empty for parts not uploaded.
+ * Etags must be freed.  Return 1 if an upload is
+ * found, 0 if not, and -1 on error, with error mes-
+ * sages written on stdout.
+ */
+int s3_find_upload ( struct s3_object * o,
+		     char * upload, int size,
+		     char (** etags)[33] )
+{
+    struct s3_object b;
+    struct s3_response r;
+    line_buffer bucket, key;
+    char marker[20], etag[80], number[20];
+    char * query, * p, * end;
+    const char * k;
+    int found = 0, n;
+
+    strcpy ( bucket, o->name );
+    p = strchr ( bucket + 5, '/' );
+    * p = 0;
+    k = o->name + ( p - bucket ) + 1;
+    if ( s3_open ( & b, bucket ) < 0 ) return -1;
+
+    query = (char *) malloc ( 3 * ( strlen ( k ) + size )
+			      + 100 );
+    if ( query == NULL ) error ( ENOMEM );
+    p = query + sprintf ( query, "prefix=" );
+    p = uri_encode ( p, k, 0 );
+    strcpy ( p, "&uploads=" );
+    if ( s3_call ( & b, "GET", query, NULL, & r ) < 0 )
+    {
+	free ( query );
+	return -1;
+    }
+    for ( p = (char *) r.body;
+	  ( p = strstr ( p, "<Upload>" ) );
+	  p = end + 1 )
+    {
+	end = strstr ( p, "</Upload>" );
+	if ( end == NULL ) break;
+	* end = 0;
+	if ( xml_value ( p, "Key", key, sizeof ( key ) )
+	     && strcmp ( key, k ) == 0
+	     && xml_value ( p, "UploadId", upload, size ) )
+	    found = 1;
+    }
+    free ( r.body );
+
+    * etags = (char (*)[33])
+	calloc ( S3_MAX_PARTS, sizeof ( ** etags ) );
+    if ( * etags == NULL ) error ( ENOMEM );
+    marker[0] = 0;
+    while ( found )
+    {
+	p = query;
+	if ( marker[0] )
+	    p += sprintf ( p, "part-number-marker=%s&",
+			   marker );
+	p += sprintf ( p, "uploadId=" );
+	uri_encode ( p, upload, 0 );
+	if ( s3_call ( o, "GET", query, NULL, & r ) < 0 )
+	{
+	    found = -1;
+	    break;
+	}
+	for ( p = (char *) r.body;
+	      ( p = strstr ( p, "<Part>" ) );
+	      p = end + 1 )
+	{
+	    end = strstr ( p, "</Part>" );
+	    if ( end == NULL ) break;
+	    * end = 0;
+	    if ( ! xml_value ( p, "PartNumber", number,
+			       sizeof ( number ) )
+		 || ! xml_value ( p, "ETag", etag,
+				  sizeof ( etag ) ) )
+		continue;
+	    unquote ( etag, etag, sizeof ( etag ) );
+	    n = atoi ( number );
+	    if ( n >= 1 && n <= S3_MAX_PARTS
+		 && strlen ( etag ) == 32 )
+		strcpy ( ( * etags )[n-1], etag );
+	}
+	if ( ! xml_value ( (char *) r.body,
+			   "IsTruncated", number,
+			   sizeof ( number ) )
+	     || strcmp ( number, "true" ) != 0
+	     || ! xml_value ( (char *) r.body,
+			      "NextPartNumberMarker",
+			      marker, sizeof ( marker ) ) )
+	    marker[0] = 0;
+	free ( r.body );
+	if ( marker[0] == 0 ) break;
+    }
+    free ( query );
+    if ( found <= 0 )
+    {
+	free ( * etags );
+	* etags = NULL;
+    }
+    return found;
+}
+
+/* Write the S3 object name from the data read from
+ * infd until end of file, replacing any existing ob-
+ * ject.  Data longer than S3_PART_SIZE is written by
+ * a multipart upload, whose parts grow after each
+ * 2500 parts so that the S3_MAX_PARTS limit allows
+ * large objects.  With S3_KEEP, a multipart upload
+ * that fails is kept, and with S3_RESUME, such an
+ * upload is resumed, its parts whose ETags are the
+ * MD5 sums of the corresponding parts of the data
+ * being kept.  Return 0 on success and -1 on error,
+ * with error messages written on stdout.
+ */
+int s3_put_object ( const char * name, int infd,
+		    int flags )
+{
+    struct s3_object o;
+    struct s3_response r;
+    struct md5 m;
+    unsigned char * buffer, (* md5s)[16] = NULL;
+    size_t size = S3_PART_SIZE;
+    ssize_t n;
+    char upload[1000], id[3000], query[3100];
+    char sum[48], etag[80];
+	/* Sum may hold a multipart ETag: 32 digits,
+	   -, and up to S3_MAX_PARTS. */
+    char (* etags)[33] = NULL;
+    char * xml, * p;
+    int parts = 0, running = 0, failed = 0;
+    int found = 0, kept = 0, i;
+
+    if ( s3_open ( & o, name ) < 0 ) return -1;
+    if ( trace )
+    {
+	fprintf ( stderr, "* built-in S3 PUT %s\n",
+		  name );
+	fflush ( stderr );
+    }
+    buffer = (unsigned char *) malloc ( size );
+    if ( buffer == NULL ) error ( ENOMEM );
+    n = read_fd ( infd, buffer, size );
+    if ( n >= 0 && n < size )
+    {
+	md5_init ( & m );
+	md5_update ( & m, buffer, n );
+	md5_final ( & m, sum );
+	failed = s3_put_data ( & o, "", buffer, n, sum );
+	free ( buffer );
+	return failed;
+    }
+    else if ( n < 0 )
+    {
+	free ( buffer );
+	return -1;
+    }
+
+    if ( flags & S3_RESUME )
+	found = s3_find_upload ( & o, upload,
+				 sizeof ( upload ),
+				 & etags );
+    if ( found <= 0 )
+    {
+	if ( s3_call ( & o, "POST", "uploads=", NULL,
+		       & r ) < 0 )
+	{
+	    free ( buffer );
+	    return -1;
+	}
+	if ( xml_value ( (char *) r.body, "UploadId",
+			 upload, sizeof ( upload ) )
+	     == NULL )
+	{
+	    printf ( "ERROR: S3 POST %s?uploads\n"
+		     "    returned no UploadId\n",
+		     name );
+	    free ( r.body );
+	    free ( buffer );
+	    return -1;
+	}
+	free ( r.body );
+    }
+    uri_encode ( id, upload, 0 );
+
+    while ( 1 )
+    {
+	pid_t child;
+
+	md5s = (unsigned char (*)[16])
+	    realloc ( md5s, ( parts + 1 ) * 16 );
+	if ( md5s == NULL ) error ( ENOMEM );
+	md5_init ( & m );
+	md5_update ( & m, buffer, n );
+	md5_final ( & m, sum );
+	hex_to_bytes ( md5s[parts], sum );
+	++ parts;
+
+	if ( etags != NULL
+	     && s3_etag_is ( etags[parts-1], sum ) )
+	    ++ kept;
+	else
+	{
+	    if ( running == s3_parts )
+	    {
+		if ( cwait ( -1 ) < 0 ) failed = 1;
+		-- running;
+	    }
+	    if ( failed ) break;
+
+	    fflush ( stdout );
+	    fflush ( stderr );
+	    child = fork();
+	    if ( child < 0 ) error ( errno );
+	    if ( child == 0 )
+	    {
+		sprintf ( query,
+			  "partNumber=%d&uploadId=%s",
+			  parts, id );
+		exit ( s3_put_data ( & o, query, buffer,
+				     n, sum ) < 0 );
+	    }
+	    ++ running;
+	}
+
+	if ( n < size ) break;
+	if ( parts == S3_MAX_PARTS )
+	{
+	    printf ( "ERROR: S3 object %s has more"
+		     " than %d parts\n",
+		     name, S3_MAX_PARTS );
+	    failed = 1;
+	    break;
+	}
+	if ( parts % 2500 == 0 )
+	{
+	    size *= 2;
+	    buffer = (unsigned char *)
+		realloc ( buffer, size );
+	    if ( buffer == NULL ) error ( ENOMEM );
+	}
+	n = read_fd ( infd, buffer, size );
+	if ( n < 0 ) failed = 1;
+	if ( n <= 0 ) break;
+    }
+    free ( buffer );
+    free ( etags );
+    for ( ; running > 0; -- running )
+    {
+	if ( cwait ( -1 ) < 0 ) failed = 1;
+    }
+    if ( trace && kept > 0 )
+    {
+	fprintf ( stderr, "* kept %d of %d parts"
+			  " already uploaded\n",
+		  kept, parts );
+	fflush ( stderr );
+    }
+
+    if ( ! failed )
+    {
+	xml = (char *) malloc ( parts * 100 + 100 );
+	if ( xml == NULL ) error ( ENOMEM );
+	p = xml + sprintf ( xml,
+			    "<CompleteMultipartUpload>" );
+	for ( i = 0; i < parts; ++ i )
+	{
+	    bytes_to_hex ( sum, md5s[i], 0 );
+	    p += sprintf ( p, "<Part><PartNumber>%d"
+			      "</PartNumber><ETag>\"%s\""
+			      "</ETag></Part>",
+			   i + 1, sum );
+	}
+	strcpy ( p, "</CompleteMultipartUpload>" );
+
+	/* The ETag of a multipart object is the MD5
+	 * sum of its part MD5 sums, followed by -
+	 * and the number of parts.
+	 */
+	md5_init ( & m );
+	md5_update ( & m, md5s, parts * 16 );
+	md5_final ( & m, sum );
+	sprintf ( sum + 32, "-%d", parts );
+
+	sprintf ( query, "uploadId=%s", id );
+	if ( s3_call ( & o, "POST", query, xml, & r )
+	     < 0 )
+	    failed = 1;
+	else
+	{
+	    if ( strstr ( (char *) r.body, "<Error>" )
+		 || xml_value ( (char *) r.body, "ETag",
+				etag, sizeof ( etag ) )
+		    == NULL )
+	    {
+		printf ( "ERROR: S3 could not complete"
+			 " upload of %s\n%s\n",
+			 name, (char *) r.body );
+		failed = 1;
+	    }
+	    else
+	    {
+		unquote ( etag, etag, sizeof ( etag ) );
+		if ( ! s3_etag_is ( etag, sum ) )
+		{
+		    printf ( "ERROR: S3 upload of %s\n"
+			     "    returned ETag %s"
+			     " instead of %s\n",
+			     name, etag, sum );
+		    failed = 1;
+		}
+	    }
+	    free ( r.body );
+	}
+	free ( xml );
+    }
+    free ( md5s );
+
+    if ( failed && ( flags & S3_KEEP ) )
+	return -1;
+    else if ( failed )
+    {
+	sprintf ( query, "uploadId=%s", id );
+	if ( s3_call ( & o, "DELETE", query, NULL, & r )
+	     == 0 )
+	    free ( r.body );
+	return -1;
+    }
+    return 0;
+}
+
+/* Write the S3 object name, from byte start on, to
+ * outfd.  An object longer than S3_PART_SIZE is read
+ * in parts by ranged GETs of worker processes, each
+ * of which keeps its part in memory until the part can
+ * be written in order.  If record is not -1, the MD5
+ * sum of each whole S3_PART_SIZE part is written on it
+ * as a line once the part is written, preceded by the
+ * ETag of the object if start is 0 (see s3_copy).
+ * Return 0 on success and -1 on error, with error
+ * messages written on stdout.
+ */
+int s3_get_object ( const char * name, int outfd,
+		    long long start, int record )
+{
+    struct s3_object o;
+    struct s3_response r;
+    long long size, offset, length;
+    int nparts, next = 0, i, j, failed = 0;
+    pid_t * pid;
+    int * fd;
+
+    if ( s3_open ( & o, name ) < 0 ) return -1;
+    if ( trace )
+    {
+	fprintf ( stderr, "* built-in S3 GET %s\n",
+		  name );
+	fflush ( stderr );
+    }
+    if ( s3_call ( & o, "HEAD", "", NULL, & r ) < 0 )
+	return -1;
+    size = r.length;
+    if ( size < 0 )
+    {
+	printf ( "ERROR: S3 HEAD %s returned no"
+		 " length\n", name );
+	return -1;
+    }
+    if ( start > size )
+    {
+	printf ( "ERROR: S3 object %s is shorter"
+		 " than\n    the %lld bytes already"
+		 " copied\n", name, start );
+	return -1;
+    }
+    if ( record >= 0 && start == 0 )
+    {
+	char line[100];
+	sprintf ( line, "%s\n", r.etag );
+	if ( write_all ( record, line, strlen ( line ) )
+	     < 0 )
+	    return -1;
+    }
+    s3_response_init ( & r, outfd, NULL );
+    if ( size - start <= S3_PART_SIZE )
+	return s3_get_range ( & o, start, size - start,
+			      & r );
+
+    nparts = ( size - start + S3_PART_SIZE - 1 )
+	     / S3_PART_SIZE;
+    pid = (pid_t *) malloc ( s3_parts * sizeof ( pid_t ) );
+    fd = (int *) malloc ( s3_parts * sizeof ( int ) );
+    if ( pid == NULL || fd == NULL ) error ( ENOMEM );
+
+    for ( i = 0; i < nparts && ! failed; ++ i )
+    {
+	unsigned char buffer[16384];
+	long long count = 0;
+	int k = i % s3_parts;
+	struct md5 m;
+
+	while ( next < nparts && next - i < s3_parts )
+	{
+	    int p[2], slot = next % s3_parts;
+	    if ( pipe ( p ) < 0 ) error ( errno );
+	    fflush ( stdout );
+	    fflush ( stderr );
+	    pid[slot] = fork();
+	    if ( pid[slot] < 0 ) error ( errno );
+	    if ( pid[slot] == 0 )
+	    {
+		for ( j = i; j < next; ++ j )
+		    close ( fd[j%s3_parts] );
+		close ( p[0] );
+		offset = start
+			 + (long long) next * S3_PART_SIZE;
+		length = size - offset;
+		if ( length > S3_PART_SIZE )
+		    length = S3_PART_SIZE;
+		s3_response_init ( & r, S3_MEMORY, NULL );
+		if ( s3_get_range ( & o, offset, length,
+				    & r ) < 0
+		     || write_all ( p[1], r.body,
+				    length ) < 0 )
+		    exit ( 1 );
+		exit ( 0 );
+	    }
+	    close ( p[1] );
+	    fd[slot] = p[0];
+	    ++ next;
+	}
+
+	length = size - start
+		 - (long long) i * S3_PART_SIZE;
+	if ( length > S3_PART_SIZE )
+	    length = S3_PART_SIZE;
+	md5_init ( & m );
+	while ( 1 )
+	{
+	    ssize_t n = read ( fd[k], buffer,
+			       sizeof ( buffer ) );
+	    if ( n < 0 && errno == EINTR ) continue;
+	    if ( n <= 0 ) break;
+	    if ( write_all ( outfd, buffer, n ) < 0 )
+	    {
+		failed = 1;
+		break;
+	    }
+	    md5_update ( & m, buffer, n );
+	    count += n;
+	}
+	close ( fd[k] );
+	if ( failed ) kill ( pid[k], SIGKILL );
+	if ( cwait ( pid[k] ) < 0 || count != length )
+	    failed = 1;
+	else if ( record >= 0 && length == S3_PART_SIZE )
+	{
+	    char sum[34];
+	    md5_final ( & m, sum );
+	    strcat ( sum, "\n" );
+	    if ( write_all ( record, sum, 33 ) < 0 )
+		failed = 1;
+	}
+    }
+
+    /* On failure, stop the remaining workers.
+     */
+    for ( ; i < next; ++ i )
+    {
+	int k = i % s3_parts;
+	close ( fd[k] );
+	kill ( pid[k], SIGKILL );
+	cwait ( pid[k] );
+    }
+    free ( pid );
+    free ( fd );
+    if ( failed )
+    {
+	printf ( "ERROR: S3 GET %s failed\n", name );
+	return -1;
+    }
+    return 0;
+}
+
+/* Write on stdout the MD5 sum of the S3 object name in
+ * the form `s3cmd info' writes it, for md5sum.  The
+ * sum is the md5 attribute recorded by s3cmd, or else
+ * the ETag if it is an MD5 sum, or else is computed by
+ * reading the object.  Return 0 on success and -1 on
+ * error, with error messages written on stdout.
+ */
+int s3_print_md5 ( const char * name )
+{
+    struct s3_object o;
+    struct s3_response r;
+    unsigned char b[16];
+    char sum[33];
+    const char * p;
+
+    if ( s3_open ( & o, name ) < 0 ) return -1;
+    if ( trace )
+    {
+	fprintf ( stderr, "* built-in S3 HEAD %s\n",
+		  name );
+	fflush ( stderr );
+    }
+    if ( s3_call ( & o, "HEAD", "", NULL, & r ) < 0 )
+	return -1;
+    sum[0] = 0;
+    p = strstr ( r.attrs, "md5:" );
+    if ( p != NULL && strlen ( p ) >= 36 )
+    {
+	memcpy ( sum, p + 4, 32 );
+	sum[32] = 0;
+    }
+    if ( sum[0] == 0 || hex_to_bytes ( b, sum ) < 0 )
+    {
+	if ( hex_to_bytes ( b, r.etag ) >= 0 )
+	    strcpy ( sum, r.etag );
+	else
+	{
+	    struct md5 m;
+	    long long size = r.length;
+	    md5_init ( & m );
+	    s3_response_init ( & r, S3_DISCARD, & m );
+	    if ( s3_get_range ( & o, 0, size, & r ) < 0 )
+		return -1;
+	    md5_final ( & m, sum );
+	}
+    }
+    printf ( "%s\n   MD5 sum:   %s\n", name, sum );
+    return 0;
+}
+
+/* Write on stdout a line `SIZE SUM NAME' for each
+ * object NAME in the S3 directory dir (which ends in
+ * `/') whose ETag is an MD5 sum SUM, for md5_remote_
+ * files.  Return 0 on success and -1 on error, with
+ * error messages written on stdout.
+ */
+int s3_list_md5 ( const char * dir )
+{
+    struct s3_object o;
+    struct s3_response r;
+    line_buffer bucket, key;
+    char token[2000], etag[80], size[40];
+    char * query, * q, * p, * end;
+    const char * prefix;
+    int result = 0;
+
+    strcpy ( bucket, dir );
+    p = strchr ( bucket + 5, '/' );
+    if ( p == NULL ) p = bucket + strlen ( bucket );
+    prefix = dir + ( p - bucket ) + ( * p != 0 );
+    * p = 0;
+    if ( s3_open ( & o, bucket ) < 0 ) return -1;
+
+    query = (char *) malloc ( 3 * ( sizeof ( token )
+				    + strlen ( prefix ) )
+			      + 100 );
+    if ( query == NULL ) error ( ENOMEM );
+    token[0] = 0;
+    do {
+	q = query;
+	if ( token[0] )
+	{
+	    q += sprintf ( q, "continuation-token=" );
+	    q = uri_encode ( q, token, 0 );
+	    * q ++ = '&';
+	}
+	q += sprintf ( q, "list-type=2&prefix=" );
+	uri_encode ( q, prefix, 0 );
+	if ( s3_call ( & o, "GET", query, NULL, & r )
+	     < 0 )
+	{
+	    result = -1;
+	    break;
+	}
+
+	p = (char *) r.body;
+	while ( ( p = strstr ( p, "<Contents>" ) ) )
+	{
+	    end = strstr ( p, "</Contents>" );
+	    if ( end == NULL ) break;
+	    * end = 0;
+	    if ( xml_value ( p, "Key", key,
+			     sizeof ( key ) )
+		 && xml_value ( p, "ETag", etag,
+				sizeof ( etag ) )
+		 && xml_value ( p, "Size", size,
+				sizeof ( size ) ) )
+	    {
+		unquote ( etag, etag, sizeof ( etag ) );
+		printf ( "%s %s %s/%s\n",
+			 size, etag, bucket, key );
+	    }
+	    p = end + 1;
+	}
+
+	if ( ! xml_value ( (char *) r.body,
+			   "IsTruncated", size,
+			   sizeof ( size ) )
+	     || strcmp ( size, "true" ) != 0
+	     || ! xml_value ( (char *) r.body,
+			      "NextContinuationToken",
+			      token, sizeof ( token ) ) )
+	    token[0] = 0;
+	free ( r.body );
+    } while ( token[0] );
+    free ( query );
+    return result;
+}
+
+/* Delete the S3 object name.  Return 0 on success and
+ * -1 on error, with error messages written on stdout.
+ */
+int s3_delete_object ( const char * name )
+{
+    struct s3_object o;
+    struct s3_response r;
+    if ( s3_open ( & o, name ) < 0 ) return -1;
+    if ( trace )
+    {
+	fprintf ( stderr, "* built-in S3 DELETE %s\n",
+		  name );
+	fflush ( stderr );
+    }
+    if ( s3_call ( & o, "DELETE", "", NULL, & r ) < 0 )
+	return -1;
+    free ( r.body );
+    return 0;
+}
+
+/* Return the number of bytes at the start of the local
+ * file fd that are known to be the same as those of
+ * the S3 object source, according to the record kept
+ * in file record by an earlier download (see s3_get_-
+ * object), and rewrite the record to hold only the
+ * lines that verify them.  Nothing is known if the
+ * ETag of source has changed.  Otherwise each whole
+ * part of fd is kept while its MD5 sum is that re-
+ * corded.
+ */
+long long s3_verified_start ( const char * source,
+			      int fd, const char * record )
+{
+    struct s3_object o;
+    struct s3_response r;
+    unsigned char * buffer;
+    char etag[100], (* sums)[34] = NULL;
+    FILE * f = fopen ( record, "r" );
+    long long start = 0;
+    int n = 0, max = 0, i;
+
+    if ( f == NULL ) return 0;
+    if ( fgets ( etag, sizeof ( etag ), f ) == NULL
+	 || s3_open ( & o, source ) < 0
+	 || s3_call ( & o, "HEAD", "", NULL, & r ) < 0 )
+    {
+	fclose ( f );
+	return 0;
+    }
+    free ( r.body );
+    etag[strcspn ( etag, "\n" )] = 0;
+    if ( strcmp ( etag, r.etag ) != 0 )
+    {
+	if ( trace )
+	{
+	    fprintf ( stderr, "* %s has changed since"
+			      " it was partly copied\n",
+		      source );
+	    fflush ( stderr );
+	}
+	fclose ( f );
+	return 0;
+    }
+
+    buffer = (unsigned char *) malloc ( S3_PART_SIZE );
+    if ( buffer == NULL ) error ( ENOMEM );
+    if ( lseek ( fd, 0, SEEK_SET ) < 0 ) error ( errno );
+    while ( 1 )
+    {
+	struct md5 m;
+	char actual[33];
+
+	if ( n == max )
+	{
+	    max = ( max == 0 ? 64 : 2 * max );
+	    sums = (char (*)[34])
+		realloc ( sums, max * sizeof ( * sums ) );
+	    if ( sums == NULL ) error ( ENOMEM );
+	}
+	if ( fgets ( sums[n], sizeof ( * sums ), f )
+	     == NULL
+	     || read_fd ( fd, buffer, S3_PART_SIZE )
+		!= S3_PART_SIZE )
+	    break;
+	md5_init ( & m );
+	md5_update ( & m, buffer, S3_PART_SIZE );
+	md5_final ( & m, actual );
+	if ( strncmp ( actual, sums[n], 32 ) != 0 )
+	    break;
+	start += S3_PART_SIZE;
+	++ n;
+    }
+    free ( buffer );
+    fclose ( f );
+
+    f = fopen ( record, "w" );
+    if ( f != NULL )
+    {
+	fprintf ( f, "%s\n", etag );
+	for ( i = 0; i < n; ++ i )
+	    fputs ( sums[i], f );
+	if ( fclose ( f ) != 0 ) start = 0;
+    }
+    else
+	start = 0;
+    free ( sums );
+    return start;
+}
+
+/* Copy the S3 object source to the local file target,
+ * or the local file source to the S3 object target,
+ * for copyfile, with the flags of s3_put_object.  A
+ * download with S3_KEEP records the MD5 sums of the
+ * parts it writes in the file target followed by
+ * ".parts", and one with S3_RESUME keeps the parts
+ * already in target that the record verifies (see
+ * s3_verified_start).  On a download with S3_KEEP
+ * that fails, target is not deleted.  Return 0 on
+ * success and -1 on error, with error messages writ-
+ * ten on stdout.
+ */
+int s3_copy ( const char * source, const char * target,
+	      int flags )
+{
+    int fd, r;
+    if ( strncmp ( source, "s3:", 3 ) == 0 )
+    {
+	char record[MAX_LINE_SIZE+10];
+	int recordfd = -1;
+	long long start = 0;
+
+	sprintf ( record, "%s.parts", target );
+	fd = open ( target,
+		    O_RDWR + O_CREAT
+		    + ( flags & S3_RESUME ? 0 : O_TRUNC ),
+		    0666 );
+	if ( fd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s"
+		     " for writing\n", target );
+	    return -1;
+	}
+	if ( flags & S3_RESUME )
+	    start = s3_verified_start ( source, fd,
+					record );
+	if ( ftruncate ( fd, start ) < 0
+	     || lseek ( fd, start, SEEK_SET ) < 0 )
+	    error ( errno );
+	if ( trace && start > 0 )
+	{
+	    fprintf ( stderr, "* keeping %lld bytes"
+			      " already copied\n",
+		      start );
+	    fflush ( stderr );
+	}
+	if ( flags & S3_KEEP )
+	{
+	    recordfd = open ( record,
+			      O_WRONLY + O_CREAT
+			      + ( start > 0 ? O_APPEND
+					    : O_TRUNC ),
+			      0600 );
+	    if ( recordfd < 0 ) error ( errno );
+	}
+	r = s3_get_object ( source, fd, start,
+			    recordfd );
+	if ( close ( fd ) < 0 ) r = -1;
+	if ( recordfd >= 0 ) close ( recordfd );
+	if ( r == 0 || ! ( flags & S3_KEEP ) )
+	    unlink ( record );
+	if ( r < 0 && ! ( flags & S3_KEEP ) )
+	    unlink ( target );
+    }
+    else
+    {
+	fd = open ( source, O_RDONLY );
+	if ( fd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s"
+		     " for reading\n", source );
+	    return -1;
+	}
+	r = s3_put_object ( target, fd, flags );
+	close ( fd );
+    }
+    return r;
+}
+
+/* Copy the remote or S3 file source to outfd, reading
+ * it from ssh executing cat, from s3cmd get, or from
+ * the built-in S3 client, and return 0 on success and
+ * -1 on error, with error messages written on stdout.
+ * RETRIES retries are done on failure, each of which
+ * resumes after the bytes already copied, reading the
+ * rest of a remote source from ssh executing tail and
+ * the rest of an S3 source by a ranged GET of the
+ * built-in S3 client.  S3cmd get cannot resume, and a
+ * retry by it reads all of source again, skipping the
+ * bytes already copied.  Account and path are the
+ * parts of a remote source, and are NULL for an S3
+ * source.
+ */
+int fetch_source ( const char * source,
+		   const char * account,
+		   const char * path, int outfd )
+{
+    int retries = RETRIES;
+    int s3_name = ( path == NULL );
+    long long done = 0;
+    unsigned char * buffer =
+	(unsigned char *) malloc ( PGP_BUFFER_SIZE );
+
+    if ( buffer == NULL ) error ( ENOMEM );
+    while ( 1 )
+    {
+	int fd[2], failed = 0;
+	long long position;
+	pid_t child;
+	ssize_t n;
+
+	fflush ( stdout );
+	fflush ( stderr );
+	if ( s3_name && setup_s3_pipe() < 0 )
+	    break;
+	if ( pipe ( fd ) < 0 ) error ( errno );
+
+	child = fork();
+	if ( child < 0 )
+	{
+	    int saved_errno = errno;
+	    if ( s3_name )
+		unlink ( s3_pipe );
+	    error ( saved_errno );
+	}
+
+	if ( child == 0 )
+	{
+	    char offset[40];
+
+	    if ( dup2 ( fd[1], 1 ) < 0 ) error ( errno );
+	    close ( fd[0] );
+	    close ( fd[1] );
+	    close ( outfd );
+
+	    if ( s3_name && s3_builtin() )
+	    {
+		/* Error messages must not go into
+		 * the pipe.
+		 */
+		int outfd = dup ( 1 );
+		if ( outfd < 0 || dup2 ( 2, 1 ) < 0 )
+		    error ( errno );
+		exit ( s3_get_object ( source, outfd,
+				       done, -1 ) < 0 );
+	    }
+	    else if ( s3_name )
+	    {
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing s3cmd"
+			      " get %s \\\n"
+			      "                 "
+			      "     -\n",
+			      source );
+		    fflush ( stderr );
+		}
+		execlp ( "s3cmd", "s3cmd",
+			 "-c", s3_pipe,
+			 "get", source, "-",
+			 NULL );
+		int saved_errno = errno;
+		unlink ( s3_pipe );
+		error ( saved_errno );
+	    }
+	    else if ( done == 0 )
+	    {
+		const char * args[] =
+		    { account, "cat", path, NULL };
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing ssh %s"
+			      " \\\n"
+			      "            cat"
+			      " %s\n",
+			      account, path );
+		    fflush ( stderr );
+		}
+		exec_ssh ( "ssh", args );
+	    }
+	    else
+	    {
+		const char * args[] =
+		    { account, "tail", "-c", offset,
+		      path, NULL };
+		sprintf ( offset, "+%lld", done + 1 );
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing ssh %s"
+			      " \\\n"
+			      "            tail -c"
+			      " %s %s\n",
+			      account, offset, path );
+		    fflush ( stderr );
+		}
+		exec_ssh ( "ssh", args );
+	    }
+	}
+
+	close ( fd[1] );
+	if ( s3_name ) write_s3_pipe();
+
+	/* S3cmd reads source from its start. */
+	position = ( s3_name && ! s3_builtin() ?
+		     0 : done );
+	while ( ( n = read ( fd[0], buffer,
+			     PGP_BUFFER_SIZE ) ) != 0 )
+	{
+	    int skip = 0;
+	    if ( n < 0 )
+	    {
+		if ( errno == EINTR ) continue;
+		failed = 1;
+		break;
+	    }
+	    if ( position < done )
+		skip = ( done - position < n ?
+			 done - position : n );
+	    position += n;
+	    if ( write_all ( outfd, buffer + skip,
+			     n - skip ) < 0 )
+	    {
+		/* Retrying would not help. */
+		retries = 0;
+		failed = 1;
+		break;
+	    }
+	    if ( position > done ) done = position;
+	}
+	close ( fd[0] );
+	if ( cwait ( child ) < 0 ) failed = 1;
+	if ( s3_name ) unlink ( s3_pipe );
+
+	if ( ! failed )
+	{
+	    free ( buffer );
+	    return 0;
+	}
+	else if ( retries -- == 0 )
+	    break;
+	printf ( "RETRYING copy of %s\n"
+		 "    after byte %lld\n",
+		 source, done );
+    }
+    free ( buffer );
+    return -1;
+}
+
+/* Return a file descriptor from which the remote or
+ * S3 file source can be read, and set * child to the
+ * process copying it by fetch_source, which exits
+ * with status 0 if all of source was copied.
+ */
+int open_fetch ( const char * source, pid_t * child )
+{
+    line_buffer account;
+    char * path = NULL;
+    int fd[2];
+
+    strcpy ( account, source );
+    if ( ! is_s3 ( source ) )
+    {
+	path = (char *) is_remote ( account );
+	* path ++ = 0;
+    }
+
+    fflush ( stdout );
+    fflush ( stderr );
+    if ( pipe ( fd ) < 0 ) error ( errno );
+    * child = fork();
+    if ( * child < 0 ) error ( errno );
+    if ( * child == 0 )
+    {
+	int newfd, d;
+
+	/* Set fd's as follows:
+	 * 	0 -> /dev/null
+	 *	1 -> parent's fd 1
+	 *	2 -> parent's fd 1
+	 *	3 -> fd[1]
+	 */
+	newfd = open ( "/dev/null", O_RDONLY );
+	if ( newfd < 0 ) error ( errno );
+	close ( 0 );
+	if ( dup2 ( newfd, 0 ) < 0 )
+	    error ( errno );
+	close ( newfd );
+	close ( 2 );
+	if ( dup2 ( 1, 2 ) < 0
+	     || dup2 ( fd[1], 3 ) < 0 )
+	    error ( errno );
+	d = getdtablesize() - 1;
+	while ( d > 3 ) close ( d -- );
+	exit ( fetch_source ( source,
+			      path == NULL ? NULL
+					   : account,
+			      path, 3 ) < 0 );
+    }
+    close ( fd[1] );
+    return fd[0];
+}
+
+/* Compute the MD5 sum of the remote or S3 file name
+ * by reading all of it from open_fetch, and put it in
+ * buffer.  Return 0 on success and -1 on error, with
+ * error messages written on stdout.
+ */
+int fetch_md5 ( char * buffer, const char * name )
+{
+    unsigned char * data =
+	(unsigned char *) malloc ( PGP_BUFFER_SIZE );
+    struct md5 m;
+    pid_t child;
+    ssize_t n;
+    int fd, r = 0;
+
+    if ( data == NULL ) error ( ENOMEM );
+    fd = open_fetch ( name, & child );
+    md5_init ( & m );
+    while ( ( n = read ( fd, data, PGP_BUFFER_SIZE ) )
+	    != 0 )
+    {
+	if ( n < 0 )
+	{
+	    if ( errno == EINTR ) continue;
+	    r = -1;
+	    break;
+	}
+	md5_update ( & m, data, n );
+    }
+    close ( fd );
+    if ( cwait ( child ) < 0 ) r = -1;
+    free ( data );
+    if ( r == 0 ) md5_final ( & m, buffer );
+    return r;
+}
+
+/* Compute the MD5 sum of a file.  The filename may have
+ * any format acceptable to scp, and must not be longer
+ * than MAX_LEXEME_SIZE.  The 32 character md5sum
+ * followed by a NUL is returned in the buffer, which
+ * must be at least 33 characters long.  0 is returned
+ * on success, -1 on error.  Error messages are written
+ * on stdout.  If filename is remote (has @ and :) then
+ * RETRIES retries are done on failure.  Local files
+ * are read and hashed in-process by md5_files.  An S3
+ * object for which s3cmd info reports no MD5 sum, but
+ * only the ETag of a multipart upload, is read by
+ * fetch_md5 to compute its sum.
+ */
+int md5sum_1 ( char * buffer,
+	       const char * filename )
+{
+    line_buffer name, line;
+    int retries = RETRIES;
+    int s3_name, at_found, error_found;
+    char * p;
+
+    strcpy ( name, filename );
+    p = (char *) is_remote ( name );
+    s3_name = is_s3 ( name );
+    if ( s3_name )
+	/* Do Nothing */;
+    else if ( p != NULL )
+	* p ++ = 0;
+    else
+    {
+	char sum[1][33];
+	if ( md5_files ( sum, & filename, 1 ) < 0 )
+	    return -1;
+	strcpy ( buffer, sum[0] );
+	return 0;
+    }
+
+    while ( 1 )
+    {
+	int fd[2];
+	int child;
+	FILE * inf;
+	if ( pipe ( fd ) < 0 ) error ( errno );
+
+	fflush ( stdout );
+	fflush ( stderr );
+
+	if ( s3_name && setup_s3_pipe() < 0 )
+	    return -1;
+
+	child = fork();
+	if ( child < 0 )
+	{
+	    int saved_errno = errno;
+	    if ( s3_name )
+		unlink ( s3_pipe );
+	    error ( saved_errno );
+	}
+
+	if ( child == 0 )
+	{
+	    int newfd, d;
+
+	    close ( fd[0] );
+
+	    /* Set fd's as follows:
+	     * 	0 -> /dev/null
+	     *	1 -> fd[1]
+	     *	2 -> parent's fd 1
+	     */
+	    newfd = open ( "/dev/null", O_RDONLY );
+	    if ( newfd < 0 ) error ( errno );
+	    close ( 0 );
+	    if ( dup2 ( newfd, 0 ) < 0 )
+	    	error ( errno );
+	    close ( newfd );
+	    close ( 2 );
+	    if ( dup2 ( 1, 2 ) < 0 )
+	    	error ( errno );
+	    close ( 1 );
+	    if ( dup2 ( fd[1], 1 ) < 0 )
+	    	error ( errno );
+	    close ( fd[1] );
+	    d = getdtablesize() - 1;
+	    while ( d > 2 ) close ( d -- );
+
+	    if ( s3_name )
+	    {
+		/* Remote s3cmd file. */
+
+		if ( s3_builtin() )
+		    exit ( s3_print_md5 ( name ) < 0 );
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing s3cmd"
+			      " info \\\n"
+			      "    %s\n",
+			      name );
+		    fflush ( stderr );
+		}
+		execlp ( "s3cmd", "s3cmd",
+			 "-c", s3_pipe,
+		         "info", name, NULL );
+		int saved_errno = errno;
+		unlink ( s3_pipe );
+		error ( saved_errno );
+	    }
+	    else
+	    {
+		/* Remote scp/ssh file. */
+
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing ssh %s \\\n"
+			      "            md5sum %s\n",
+			      name, p );
+		    fflush ( stderr );
+		}
+		const char * args[] =
+		    { name, "md5sum", p, NULL };
+		exec_ssh ( "ssh", args );
+	    }
+	}
+
+	close ( fd[1] );
+	inf = fdopen ( fd[0], "r" );
+
+	error_found = 0;
+
+	if ( s3_name )
+	{
+	    write_s3_pipe();
+
+	    int first = 1;
+	    buffer[0] = 0;
+	    while ( get_line ( line, inf ) )
+	    {
+	        const char * p = line;
+	        if ( first )
+		{
+		    /* First line is object name */
+		    if ( ! is_s3 ( line ) )
+		    {
+			do {
+			    printf ( "%s\n", line );
+			} while
+			    ( get_line ( line, inf ) );
+			error_found = 1;
+		    }
+		    first = 0;
+		    continue;
+		}
+		while ( isspace ( * p ) ) ++ p;
+		if ( strncmp ( "MD5 sum:", p, 8 ) == 0 )
+		{
+		    p += 8;
+		    while ( isspace ( * p ) ) ++ p;
+		    /* A multipart ETag, with a -, leaves
+		     * buffer empty.
+		     */
+		    if ( strlen ( p ) == 32 )
+			strcpy ( buffer, p );
+		    else if ( strchr ( p, '-' ) == NULL )
+		    {
+		        printf ( "ERROR: wrong size MD5"
+			         " sum: %s\n", p );
+			error_found = 1;
+		    }
+		}
+		else
+		{
+		    if ( p != line )
+		        while ( * p && * p != ':' )
+			    ++ p;
+		    if ( p == line || * p == 0 ) do {
+			/* Likely error messages */
+			printf ( "%s\n", line );
+			error_found = 1;
+		    } while ( get_line ( line, inf ) );
+		}
+	    }
+	}
+	else if ( get_line ( line, inf ) )
+	{
+	    char * p = line;
+	    while ( * p != 0 && ! isspace ( * p ) )
+	        ++ p;
+	    if ( p - line == 32 )
+	    {
+	        strncpy ( buffer, line, 32 );
+		buffer[32] = 0;
+	    }
+	    else
+	    {
+		* p = 0;
+		printf ( "ERROR: wrong size MD5"
+			 " sum: %s\n", line );
+		error_found = 1;
+	    }
+	    while ( get_line ( line, inf ) )
+	    {
+		/* Extra lines indicate an error */
+	        printf ( "%s\n", line );
+		error_found = 1;
+	    }
+	}
+	else
+	{
+	    printf ( "ERROR: md5sum produced no"
+	             " output\n" );
+	    error_found = 1;
+	}
+
+	if ( ! error_found )
+	{
+	    char * p = buffer;
+	    for ( ; * p; ++ p )
+	    {
+		char c = * p;
+		if ( '0' <= c && c <= '9' ) continue;
+		if ( 'a' <= c && c <= 'f' ) continue;
+		if ( 'A' <= c && c <= 'F' ) continue;
+		break;
+	    }
+	    if ( * p )
+	    {
+	        printf ( "ERROR: bad digits in MD5 sum:"
+		         " %s\n", buffer );
+		error_found = 1;
+	    }
+	}
+	fclose ( inf );
+	if ( cwait ( child ) < 0 ) error_found = 1;
+	if ( s3_name ) unlink ( s3_pipe );
+
+	if ( error_found && retries > 0 )
+	{
+	    printf ( "RETRYING md5sum %s\n", filename );
+	    -- retries;
+	    continue;
+	}
+	else if ( error_found == 0 && s3_name
+		  && buffer[0] == 0
+		  && fetch_md5 ( buffer, filename ) < 0 )
+	    error_found = 1;
+	if ( error_found != 0 )
+	{
+	    printf ( "ERROR: cannot compute MD5 sum of"
+		     " %s\n", filename );
+	    return -1;
+	}
+	else return 0;
+    }
+}
+
+/* Compute the MD5 sum of a file as md5sum_1 does,
+ * timing the computation for a remote or S3 file as
+ * the verify stage (md5_files times that of a local
+ * file as the hash stage).
+ */
+int md5sum ( char * buffer, const char * filename )
+{
+    struct timing t;
+    int r;
+
+    if ( ! is_s3 ( filename )
+	 && is_remote ( filename ) == NULL )
+	return md5sum_1 ( buffer, filename );
+    start_stage ( & t );
+    r = md5sum_1 ( buffer, filename );
+    end_stage ( & t, VERIFY_STAGE, 0 );
+    return r;
+}
+
+/* Maximum number of files whose MD5 sums are computed
+ * by one remote md5sum command.
+ */
+#define REMOTE_MD5_BATCH 1000
+
+/* A name given to md5_remote_files, with the index of
+ * the name.  The key is the name as it appears in the
+ * output of the remote command.
+ */
+struct remote_name {
+    const char * key;
+    int index;
+};
+
+int compare_remote_names ( const void * a,
+			   const void * b )
+{
+    return strcmp
+	( ( (const struct remote_name *) a )->key,
+	  ( (const struct remote_name *) b )->key );
+}
+
+/* Compute the MD5 sums of the n remote or S3 files
+ * names[0], ..., names[n-1], which must all be in the
+ * same directory, storing the sum of names[i] in
+ * sums[i].  Names that are NULL are skipped.  The
+ * sums of remote files are computed by executing
+ * md5sum with up to REMOTE_MD5_BATCH files at once,
+ * and those of S3 files are taken from one listing of
+ * their directory by s3cmd ls --list-md5.  Names
+ * whose sums are not found this way (e.g., because
+ * the file does not exist or the remote command
+ * failed) are freed and set to NULL, so batch_md5sum
+ * computes their sums one at a time by md5sum, which
+ * retries and writes any error messages.
+ */
+void md5_remote_files ( char (* sums)[33],
+			const char ** names, int n )
+{
+    struct remote_name * r, * found, key;
+    int s3_name = -1, nr = 0, done = 0, i;
+    line_buffer account, line;
+    struct timing t;
+
+    start_stage ( & t );
+    r = (struct remote_name *)
+	malloc ( ( n + 1 ) * sizeof ( * r ) );
+    if ( r == NULL ) error ( ENOMEM );
+    for ( i = 0; i < n; ++ i )
+    {
+	const char * p;
+	if ( names[i] == NULL ) continue;
+	sums[i][0] = 0;
+	if ( s3_name < 0 )
+	{
+	    s3_name = is_s3 ( names[i] );
+	    strcpy ( account, names[i] );
+	}
+	p = s3_name ? names[i] : is_remote ( names[i] );
+	if ( p == NULL ) continue;
+	r[nr].key = s3_name ? p : p + 1;
+	r[nr].index = i;
+	++ nr;
+    }
+    qsort ( r, nr, sizeof ( * r ), compare_remote_names );
+
+    /* Account is now the S3 directory or the remote
+     * account.
+     */
+    if ( nr == 0 )
+	/* Do Nothing */;
+    else if ( s3_name )
+	* ( strrchr ( account, '/' ) + 1 ) = 0;
+    else
+	* (char *) is_remote ( account ) = 0;
+
+    while ( done < nr )
+    {
+	int fd[2], count;
+	pid_t child;
+	FILE * inf;
+
+	count = nr - done;
+	if ( ! s3_name && count > REMOTE_MD5_BATCH )
+	    count = REMOTE_MD5_BATCH;
+
+	if ( trace )
+	{
+	    if ( s3_name && s3_builtin() )
+		printf ( "* built-in S3 listing of"
+			 " %s\n", account );
+	    else if ( s3_name )
+		printf ( "* executing s3cmd ls"
+			 " --list-md5 \\\n"
+			 "    %s\n", account );
+	    else
+		printf ( "* executing ssh %s \\\n"
+			 "            md5sum of %d"
+			 " files\n", account, count );
+	}
+
+	fflush ( stdout );
+	fflush ( stderr );
+	if ( s3_name && setup_s3_pipe() < 0 )
+	    break;
+	if ( pipe ( fd ) < 0 ) error ( errno );
+
+	child = fork();
+	if ( child < 0 )
+	{
+	    int saved_errno = errno;
+	    if ( s3_name )
+		unlink ( s3_pipe );
+	    error ( saved_errno );
+	}
+
+	if ( child == 0 )
+	{
+	    int newfd, d;
+
+	    close ( fd[0] );
+
+	    /* Set fd's as follows:
+	     * 	0 -> /dev/null
+	     *	1 -> fd[1]
+	     *	2 -> /dev/null
+	     *
+	     * Errors are reported by md5sum when it
+	     * retries the files not found.
+	     */
+	    newfd = open ( "/dev/null", O_RDWR );
+	    if ( newfd < 0 ) error ( errno );
+	    close ( 0 );
+	    close ( 2 );
+	    if ( dup2 ( newfd, 0 ) < 0
+		 || dup2 ( newfd, 2 ) < 0 )
+		error ( errno );
+	    close ( newfd );
+	    close ( 1 );
+	    if ( dup2 ( fd[1], 1 ) < 0 )
+		error ( errno );
+	    close ( fd[1] );
+	    d = getdtablesize() - 1;
+	    while ( d > 2 ) close ( d -- );
+
+	    if ( s3_name )
+	    {
+		if ( s3_builtin() )
+		    exit ( s3_list_md5 ( account ) < 0 );
+		execlp ( "s3cmd", "s3cmd",
+			 "-c", s3_pipe, "ls",
+			 "--list-md5", account,
+			 NULL );
+		exit ( 1 );
+	    }
+	    else
+	    {
+		const char ** args =
+		    (const char **)
+		    malloc ( ( count + 3 )
+			     * sizeof ( char * ) );
+		if ( args == NULL ) error ( ENOMEM );
+		args[0] = account;
+		args[1] = "md5sum";
+		for ( i = 0; i < count; ++ i )
+		    args[i+2] = r[done+i].key;
+		args[count+2] = NULL;
+		exec_ssh ( "ssh", args );
+	    }
+	}
+
+	close ( fd[1] );
+	inf = fdopen ( fd[0], "r" );
+	if ( s3_name ) write_s3_pipe();
+
+	/* Md5sum output lines are `SUM  NAME' or
+	 * `SUM *NAME', and s3cmd ls lines are
+	 * `DATE TIME SIZE SUM NAME' where NAME
+	 * begins with s3://.
+	 */
+	while ( get_line ( line, inf ) )
+	{
+	    char * sum = line, * p;
+	    if ( s3_name )
+	    {
+		key.key = strstr ( line, " s3://" );
+		if ( key.key == NULL ) continue;
+		p = (char *) key.key;
+		* p ++ = 0;
+		key.key = p;
+		sum = strrchr ( line, ' ' );
+		if ( sum == NULL ) continue;
+		++ sum;
+	    }
+	    else
+	    {
+		if ( strlen ( line ) < 34 ) continue;
+		if ( line[33] != ' '
+		     && line[33] != '*' )
+		    continue;
+		key.key = line + 34;
+	    }
+	    if ( strlen ( sum ) < 32
+		 || ( sum[32] != 0 && sum[32] != ' ' ) )
+		continue;
+	    for ( p = sum; p < sum + 32; ++ p )
+	    {
+		if ( ! isxdigit ( * p ) ) break;
+	    }
+	    if ( p < sum + 32 ) continue;
+	    found = (struct remote_name *)
+		bsearch ( & key, r, nr, sizeof ( * r ),
+			  compare_remote_names );
+	    if ( found == NULL ) continue;
+	    memcpy ( sums[found->index], sum, 32 );
+	    sums[found->index][32] = 0;
+	}
+
+	fclose ( inf );
+	cwait ( child );
+	if ( s3_name ) unlink ( s3_pipe );
+	done += count;
+    }
+
+    for ( i = 0; i < n; ++ i )
+    {
+	if ( names[i] == NULL || sums[i][0] != 0 )
+	    continue;
+	free ( (char *) names[i] );
+	names[i] = NULL;
+    }
+    free ( r );
+    if ( nr > 0 ) end_stage ( & t, VERIFY_STAGE, 0 );
+}
+
+/* Encrypt the local input file to make the local output
+ * file, compressing with codec (see pgp_encrypt), and
+ * return the MD5 sums and sizes of both in sums.  With
+ * the built-in engine this is done in one pass over
+ * the input; otherwise the output is made by crypt
+ * (without compression) and both files are then read
+ * again to compute their sums.  Return 0 on success
+ * and -1 on error, with error messages written on
+ * stdout.
+ */
+int encrypt_file ( const char * input,
+		   const char * output,
+		   const char * key, int codec,
+		   struct crypt_sums * sums )
+{
+    struct stat st;
+    pid_t child;
+
+    if ( builtin_crypt ( output ) )
+    {
+	int infd, outfd, r;
+
+	infd = open ( input, O_RDONLY );
+	if ( infd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s"
+		     " for reading\n", input );
+	    return -1;
+	}
+	outfd = open ( output,
+		       O_WRONLY + O_CREAT + O_TRUNC,
+		       S_IWUSR + S_IRUSR );
+	if ( outfd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s"
+		     " for writing\n", output );
+	    close ( infd );
+	    return -1;
+	}
+	if ( trace )
+	    trace_crypt ( "built-in gpg -c encryption"
+			  " with md5sum",
+			  input, output );
+	r = pgp_encrypt ( infd, outfd, key, 32, codec,
+			  sums );
+	close ( infd );
+	if ( close ( outfd ) < 0 ) r = -1;
+	return r;
+    }
+
+    if ( crypt ( 0, input, output, key, 32, & child )
+	 < 0 )
+	return -1;
+    if ( md5sum ( sums->md5sum, input ) < 0 )
+	return -1;
+    if ( stat ( input, & st ) < 0 )
+    {
+	printf ( "ERROR: cannot stat %s\n", input );
+	return -1;
+    }
+    sums->size = st.st_size;
+    if ( md5sum ( sums->emd5sum, output ) < 0 )
+	return -1;
+    if ( stat ( output, & st ) < 0 )
+    {
+	printf ( "ERROR: cannot stat %s\n", output );
+	return -1;
+    }
+    sums->esize = st.st_size;
+    return 0;
+}
+
+/* Tar archives written in-process by the archive com-
+ * mand.  The archive of a directory is in the GNU tar
+ * format that "tar cf ARCHIVE DIRECTORY" writes, with
+ * long names in ././@LongLink records, and holds the
+ * directories, regular files, and symbolic links in
+ * DIRECTORY, each directory's entries in name order.
+ * Hard links are archived as separate files, and
+ * other special files are skipped.  Member names are
+ * DIRECTORY names without any leading '/'.
+ *
+ * As with "tar --exclude-from", each line of DIREC-
+ * TORY/.BACKUP-IGNORE is a glob pattern, and a file is
+ * skipped (with everything in it if it is a direc-
+ * tory) if the pattern matches its member name or any
+ * part of that name that follows a '/'.
+ */
+#define TAR_BLOCK 512
+#define TAR_RECORD ( 20 * TAR_BLOCK )
+
+struct tar {
+    int fd;
+    unsigned char buffer[TAR_RECORD];
+    int length;		/* Of data in buffer. */
+    long long size;	/* Total written. */
+    char ** ignore;	/* Patterns from .BACKUP-IGNORE */
+    int nignore;
+    int errors;		/* Number of files that could
+			   not be archived. */
+};
+
+void tar_flush ( struct tar * t )
+{
+    unsigned char * p = t->buffer;
+    while ( t->length > 0 )
+    {
+	ssize_t r = write ( t->fd, p, t->length );
+	if ( r < 0 && errno == EINTR ) continue;
+	if ( r < 0 ) exit ( 1 );
+	p += r;
+	t->length -= r;
+    }
+}
+
+void tar_write ( struct tar * t, const void * data,
+		 size_t n )
+{
+    const unsigned char * p =
+	(const unsigned char *) data;
+    while ( n > 0 )
+    {
+	size_t k = TAR_RECORD - t->length;
+	if ( k > n ) k = n;
+	memcpy ( t->buffer + t->length, p, k );
+	t->length += k;
+	t->size += k;
+	p += k;
+	n -= k;
+	if ( t->length == TAR_RECORD ) tar_flush ( t );
+    }
+}
+
+/* Write zeros to fill the last block written. */
+
+void tar_pad ( struct tar * t )
+{
+    static const unsigned char zeros[TAR_BLOCK];
+    if ( t->size % TAR_BLOCK != 0 )
+	tar_write ( t, zeros,
+		    TAR_BLOCK - t->size % TAR_BLOCK );
+}
+
+/* Store value in the width character header field f
+ * in octal, or in base 256 if it is too large.
+ */
+void tar_number ( char * f, int width,
+		  unsigned long long value )
+{
+    if ( value < 1ULL << ( 3 * ( width - 1 ) ) )
+	sprintf ( f, "%0*llo", width - 1, value );
+    else
+    {
+	int i;
+	for ( i = width - 1; i > 0; -- i )
+	    f[i] = (char) ( value & 255 ), value >>= 8;
+	f[0] = (char) 0x80;
+    }
+}
+
+/* Write a header of the given type for a member with
+ * the given name and status, preceded by records for
+ * any name or link too long for the header.
+ */
+void tar_header ( struct tar * t, const char * name,
+		  const struct stat * st, char type,
+		  unsigned long long size,
+		  const char * link )
+{
+    char h[TAR_BLOCK];
+    unsigned sum = 0;
+    int i;
+
+    if ( strlen ( name ) >= 100 )
+    {
+	struct stat s = * st;
+	s.st_mode = s.st_mtime = 0;
+	s.st_uid = s.st_gid = 0;
+	tar_header ( t, "././@LongLink", & s, 'L',
+		     strlen ( name ) + 1, "" );
+	tar_write ( t, name, strlen ( name ) + 1 );
+	tar_pad ( t );
+    }
+    if ( strlen ( link ) >= 100 )
+    {
+	struct stat s = * st;
+	s.st_mode = s.st_mtime = 0;
+	s.st_uid = s.st_gid = 0;
+	tar_header ( t, "././@LongLink", & s, 'K',
+		     strlen ( link ) + 1, "" );
+	tar_write ( t, link, strlen ( link ) + 1 );
+	tar_pad ( t );
+    }
+
+    memset ( h, 0, sizeof ( h ) );
+    strncpy ( h, name, 99 );
+    tar_number ( h + 100, 8, st->st_mode & 07777 );
+    tar_number ( h + 108, 8, st->st_uid );
+    tar_number ( h + 116, 8, st->st_gid );
+    tar_number ( h + 124, 12, size );
+    tar_number ( h + 136, 12, st->st_mtime );
+    memset ( h + 148, ' ', 8 );
+    h[156] = type;
+    strncpy ( h + 157, link, 99 );
+    memcpy ( h + 257, "ustar  ", 8 );
+    for ( i = 0; i < TAR_BLOCK; ++ i )
+	sum += (unsigned char) h[i];
+    sprintf ( h + 148, "%06o", sum );
+    tar_write ( t, h, TAR_BLOCK );
+}
+
+/* Return 1 if member name matches a .BACKUP-IGNORE
+ * pattern, and 0 otherwise.
+ */
+int tar_ignored ( struct tar * t, const char * name )
+{
+    int i;
+    for ( i = 0; i < t->nignore; ++ i )
+    {
+	const char * p = name;
+	while ( 1 )
+	{
+	    if ( fnmatch ( t->ignore[i], p, 0 ) == 0 )
+		return 1;
+	    p = strchr ( p, '/' );
+	    if ( p == NULL || * ++ p == 0 ) break;
+	}
+    }
+    return 0;
+}
+
+int compare_names ( const void * a, const void * b )
+{
+    return strcmp ( * (char * const *) a,
+		    * (char * const *) b );
+}
+
+/* Archive the file path, whose member name is name. */
+
+void tar_file ( struct tar * t, const char * path,
+		const char * name )
+{
+    struct stat st;
+
+    if ( tar_ignored ( t, name ) ) return;
+    if ( lstat ( path, & st ) < 0 )
+    {
+	printf ( "ERROR: cannot stat %s\n", path );
+	++ t->errors;
+	return;
+    }
+
+    if ( S_ISDIR ( st.st_mode ) )
+    {
+	DIR * d = opendir ( path );
+	struct dirent * de;
+	char ** names = NULL;
+	int n = 0, max = 0, i;
+	char * dname = (char *)
+	    malloc ( strlen ( name ) + 2 );
+
+	if ( dname == NULL ) error ( ENOMEM );
+	sprintf ( dname, "%s/", name );
+	tar_header ( t, dname, & st, '5', 0, "" );
+	free ( dname );
+	if ( d == NULL )
+	{
+	    printf ( "ERROR: cannot read directory"
+		     " %s\n", path );
+	    ++ t->errors;
+	    return;
+	}
+	while ( ( de = readdir ( d ) ) != NULL )
+	{
+	    if ( strcmp ( de->d_name, "." ) == 0
+		 || strcmp ( de->d_name, ".." ) == 0 )
+		continue;
+	    if ( n == max )
+	    {
+		max = ( max == 0 ? 64 : 2 * max );
+		names = (char **) realloc
+		    ( names, max * sizeof ( char * ) );
+		if ( names == NULL ) error ( ENOMEM );
+	    }
+	    names[n] = strdup ( de->d_name );
+	    if ( names[n ++] == NULL ) error ( ENOMEM );
+	}
+	closedir ( d );
+	qsort ( names, n, sizeof ( char * ),
+		compare_names );
+	for ( i = 0; i < n; ++ i )
+	{
+	    char * p = (char *) malloc
+		( strlen ( path ) + strlen ( names[i] )
+				  + 2 );
+	    if ( p == NULL ) error ( ENOMEM );
+	    sprintf ( p, "%s/%s", path, names[i] );
+	    tar_file ( t, p,
+		       p + ( name - path ) );
+	    free ( p );
+	    free ( names[i] );
+	}
+	free ( names );
+    }
+    else if ( S_ISLNK ( st.st_mode ) )
+    {
+	line_buffer link;
+	ssize_t r = readlink ( path, link,
+			       sizeof ( link ) - 1 );
+	if ( r < 0 )
+	{
+	    printf ( "ERROR: cannot read symbolic"
+		     " link %s\n", path );
+	    ++ t->errors;
+	    return;
+	}
+	link[r] = 0;
+	tar_header ( t, name, & st, '2', 0, link );
+    }
+    else if ( S_ISREG ( st.st_mode ) )
+    {
+	/* Exactly st_size bytes are archived, padded
+	 * with zeros if the file shrinks.
+	 */
+	static unsigned char buffer[TAR_RECORD];
+	unsigned long long left = st.st_size;
+	int fd = open ( path, O_RDONLY );
+
+	if ( fd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s for"
+		     " reading\n", path );
+	    ++ t->errors;
+	    return;
+	}
+	tar_header ( t, name, & st, '0', left, "" );
+	while ( left > 0 )
+	{
+	    size_t k = ( left < sizeof ( buffer ) ?
+			 left : sizeof ( buffer ) );
+	    ssize_t r = read ( fd, buffer, k );
+	    if ( r < 0 && errno == EINTR ) continue;
+	    if ( r <= 0 )
+	    {
+		printf ( "ERROR: %s changed while"
+			 " being archived\n", path );
+		++ t->errors;
+		memset ( buffer, 0, k );
+		r = k;
+	    }
+	    tar_write ( t, buffer, r );
+	    left -= r;
+	}
+	close ( fd );
+	tar_pad ( t );
+    }
+    else if ( trace )
+	printf ( "* %s is a special file and is"
+		 " not archived\n", path );
+}
+
+/* Return a file descriptor from which the tar archive
+ * of directory can be read, and set * child to the
+ * process writing it, which exits with status 0 if the
+ * whole directory was archived.
+ */
+int open_archive ( const char * directory,
+		   pid_t * child )
+{
+    int fd[2];
+
+    fflush ( stdout );
+    fflush ( stderr );
+    if ( pipe ( fd ) < 0 ) error ( errno );
+    * child = fork();
+    if ( * child < 0 ) error ( errno );
+    if ( * child == 0 )
+    {
+	static struct tar t;
+	static const unsigned char zeros[2*TAR_BLOCK];
+	int d = getdtablesize() - 1;
+	line_buffer ignore;
+	FILE * in;
+	char * path = strdup ( directory );
+	char * name;
+
+	if ( path == NULL ) error ( ENOMEM );
+	if ( dup2 ( fd[1], 3 ) < 0 ) error ( errno );
+	while ( d > 3 ) close ( d -- );
+	t.fd = 3;
+
+	sprintf ( ignore, "%s/.BACKUP-IGNORE",
+		  directory );
+	in = fopen ( ignore, "r" );
+	while ( in != NULL
+		&& fgets ( ignore, sizeof ( ignore ),
+			   in ) )
+	{
+	    char * p = ignore + strlen ( ignore );
+	    while ( p > ignore && isspace ( p[-1] ) )
+		* -- p = 0;
+	    if ( ignore[0] == 0 ) continue;
+	    t.ignore = (char **) realloc
+		( t.ignore, ( t.nignore + 1 )
+			    * sizeof ( char * ) );
+	    if ( t.ignore == NULL ) error ( ENOMEM );
+	    t.ignore[t.nignore] = strdup ( ignore );
+	    if ( t.ignore[t.nignore ++] == NULL )
+		error ( ENOMEM );
+	}
+	if ( in != NULL ) fclose ( in );
+
+	name = path + strlen ( path );
+	while ( name > path + 1 && name[-1] == '/' )
+	    * -- name = 0;
+	name = path;
+	while ( * name == '/' && name[1] != 0 ) ++ name;
+	tar_file ( & t, path, name );
+
+	tar_write ( & t, zeros, sizeof ( zeros ) );
+	if ( t.length > 0 )
+	{
+	    memset ( t.buffer + t.length, 0,
+		     TAR_RECORD - t.length );
+	    t.length = TAR_RECORD;
+	    tar_flush ( & t );
+	}
+	exit ( t.errors > 0 );
+    }
+    close ( fd[1] );
+    return fd[0];
+}
+
+/* State of a copy between a local file and a remote
+ * file, kept by copyfile while the copy is retried, so
+ * that a retry can resume after the part of the target
+ * already written.  The source is divided into
+ * TRANSFER_CHUNK byte chunks whose MD5 sums are re-
+ * corded in sums when first needed.  A retry looks for
+ * the last whole chunk of the target whose MD5 sum
+ * matches that of the source chunk, checking at most
+ * TRANSFER_CHECKS chunks, and copies only the rest of
+ * the source.
+ *
+ * Encrypt_to_1 also keeps this state for its copy of
+ * encrypted data to a remote file.  The source is then
+ * the encrypted data, which is made the same by each
+ * retry as seed is kept, and whose chunk sums are re-
+ * corded as the data is made, size counting only the
+ * whole chunks recorded.
+ */
+#define TRANSFER_CHUNK ( 16 * 1024 * 1024 )
+#define TRANSFER_CHECKS 4
+struct transfer {
+    const char * source, * target;
+    int upload;		/* 1 if target is remote */
+    line_buffer account;	/* Remote account */
+    const char * path;	/* Remote file in account,
+			   or NULL if the copy cannot
+			   be resumed */
+    long long size;	/* Of source, or -1 if not
+			   yet known */
+    int mode;		/* Of source */
+    time_t mtime;	/* Of source */
+    char (* sums)[33];	/* Of source chunks, or ""
+			   if not yet computed */
+    unsigned char seed[24];
+			/* S2K salt and prefix of
+			   encrypted data (see pgp_-
+			   encrypt_part) */
+};
+
+void transfer_init ( struct transfer * t,
+		     const char * source,
+		     const char * target )
+{
+    char * p;
+    t->source = source;
+    t->target = target;
+    t->upload = ( is_remote ( target ) != NULL );
+    t->path = NULL;
+    t->size = -1;
+    t->sums = NULL;
+    if ( t->upload == ( is_remote ( source ) != NULL ) )
+	return;
+    strcpy ( t->account, t->upload ? target : source );
+    p = (char *) is_remote ( t->account );
+    * p ++ = 0;
+    t->path = p;
+}
+
+/* Execute ssh with args, whose first is the remote
+ * account, and copy the first line that ssh writes on
+ * its standard output into line.  Return 0 on success
+ * and -1 if ssh fails or writes nothing.  Error mes-
+ * sages written by ssh are discarded.
+ */
+int ssh_line ( const char ** args, char * line )
+{
+    int fd[2], r = -1;
+    pid_t child;
+    FILE * inf;
+    line_buffer extra;
+
+    fflush ( stdout );
+    fflush ( stderr );
+    if ( pipe ( fd ) < 0 ) error ( errno );
+    child = fork();
+    if ( child < 0 ) error ( errno );
+    if ( child == 0 )
+    {
+	int newfd, d;
+	newfd = open ( "/dev/null", O_RDWR );
+	if ( newfd < 0 ) error ( errno );
+	if ( dup2 ( newfd, 0 ) < 0
+	     || dup2 ( newfd, 2 ) < 0
+	     || dup2 ( fd[1], 1 ) < 0 )
+	    error ( errno );
+	d = getdtablesize() - 1;
+	while ( d > 2 ) close ( d -- );
+	exec_ssh ( "ssh", args );
+    }
+    close ( fd[1] );
+    inf = fdopen ( fd[0], "r" );
+    if ( get_line ( line, inf ) ) r = 0;
+    while ( get_line ( extra, inf ) );
+    fclose ( inf );
+    if ( cwait ( child ) < 0 ) r = -1;
+    return r;
+}
+
+/* Get the size, mode, and modification time of the
+ * remote file path of t.  Return 0 on success and -1
+ * on error.
+ */
+int remote_stat ( struct transfer * t,
+		  long long * size, int * mode,
+		  time_t * mtime )
+{
+    line_buffer line;
+    long m;
+    unsigned int u;
+    const char * args[] =
+	{ t->account, "stat", "-c", "%s:%a:%Y",
+	  t->path, NULL };
+    if ( ssh_line ( args, line ) < 0
+	 || sscanf ( line, "%lld:%o:%ld",
+		     size, & u, & m ) != 3 )
+	return -1;
+    * mode = u;
+    * mtime = m;
+    return 0;
+}
+
+/* Compute the MD5 sum of chunk k of the remote file
+ * path of t if remote is 1, or of the local file
+ * if remote is 0, putting it in sum.  Return 0 on
+ * success and -1 on error.
+ */
+int chunk_md5 ( struct transfer * t, int remote,
+		const char * file, int k, char * sum )
+{
+    if ( remote )
+    {
+	line_buffer line;
+	char ifarg[MAX_LINE_SIZE+10], bs[40], skip[40];
+	const char * args[] =
+	    { t->account, "dd", ifarg, bs, skip,
+	      "count=1", "2>/dev/null", "|", "md5sum",
+	      NULL };
+	sprintf ( ifarg, "if=%s", file );
+	sprintf ( bs, "bs=%d", TRANSFER_CHUNK );
+	sprintf ( skip, "skip=%d", k );
+	if ( ssh_line ( args, line ) < 0
+	     || strlen ( line ) < 32 )
+	    return -1;
+	memcpy ( sum, line, 32 );
+	sum[32] = 0;
+	return 0;
+    }
+    else
+    {
+	unsigned char buffer[65536];
+	long long n = TRANSFER_CHUNK;
+	struct md5 m;
+	int fd = open ( file, O_RDONLY );
+	if ( fd < 0 ) return -1;
+	if ( lseek ( fd, (off_t) k * TRANSFER_CHUNK,
+		     SEEK_SET ) < 0 )
+	{
+	    close ( fd );
+	    return -1;
+	}
+	md5_init ( & m );
+	while ( n > 0 )
+	{
+	    ssize_t r = read ( fd, buffer,
+			       n < sizeof ( buffer ) ?
+			       n : sizeof ( buffer ) );
+	    if ( r < 0 && errno == EINTR ) continue;
+	    if ( r <= 0 ) break;
+	    md5_update ( & m, buffer, r );
+	    n -= r;
+	}
+	close ( fd );
+	if ( n > 0 ) return -1;
+	md5_final ( & m, sum );
+	return 0;
+    }
+}
+
+/* Return the number of bytes at the start of the tar-
+ * get of t, which has tsize bytes, that a retry of the
+ * copy of t need not copy again, found as described
+ * above.
+ */
+long long resume_point ( struct transfer * t,
+			 long long tsize )
+{
+    char sum[33];
+    int k, checks;
+
+    k = ( tsize < t->size ? tsize : t->size )
+	/ TRANSFER_CHUNK;
+    for ( checks = 0; k > 0; -- k, ++ checks )
+    {
+	if ( checks == TRANSFER_CHECKS
+	     || ( t->sums[k-1][0] == 0
+		  && chunk_md5 ( t, ! t->upload,
+				 t->upload ? t->source
+					   : t->path,
+				 k - 1, t->sums[k-1] )
+		     < 0 )
+	     || chunk_md5 ( t, t->upload,
+			    t->upload ? t->path
+				      : t->target,
+			    k - 1, sum ) < 0 )
+	    return 0;
+	if ( strcmp ( sum, t->sums[k-1] ) == 0 ) break;
+    }
+    return (long long) k * TRANSFER_CHUNK;
+}
+
+/* Resume the copy of t after a failure, as described
+ * above.  Return 0 on success and -1 on error, with
+ * error messages written on stdout.
+ */
+int resume_copy ( struct transfer * t )
+{
+    long long tsize = 0, done;
+    int mode, fd;
+    time_t mtime;
+    pid_t child;
+    char offset[40], modes[20], touch[40];
+    struct stat st;
+
+    if ( t->size < 0 )
+    {
+	if ( ! t->upload )
+	{
+	    if ( remote_stat ( t, & t->size, & t->mode,
+			       & t->mtime ) < 0 )
+	    {
+		printf ( "ERROR: cannot stat %s\n",
+			 t->source );
+		return -1;
+	    }
+	}
+	else if ( stat ( t->source, & st ) < 0 )
+	{
+	    printf ( "ERROR: cannot stat %s\n",
+		     t->source );
+	    return -1;
+	}
+	else
+	{
+	    t->size = st.st_size;
+	    t->mode = st.st_mode;
+	    t->mtime = st.st_mtime;
+	}
+	t->sums = (char (*)[33])
+	    calloc ( t->size / TRANSFER_CHUNK + 1,
+		     sizeof ( * t->sums ) );
+	if ( t->sums == NULL ) error ( ENOMEM );
+    }
+
+    if ( ! t->upload )
+    {
+	if ( stat ( t->target, & st ) == 0 )
+	    tsize = st.st_size;
+    }
+    else if ( remote_stat ( t, & tsize, & mode,
+			    & mtime ) < 0 )
+	tsize = 0;
+
+    done = resume_point ( t, tsize );
+    if ( trace )
+	printf ( "* resuming copy of %s\n"
+		 "*     to %s\n"
+		 "*     after byte %lld\n",
+		 t->source, t->target, done );
+
+    fflush ( stdout );
+    fflush ( stderr );
+    if ( t->upload )
+	fd = open ( t->source, O_RDONLY );
+    else
+	fd = open ( t->target, O_WRONLY + O_CREAT,
+		    S_IRUSR + S_IWUSR );
+    if ( fd < 0 )
+    {
+	printf ( "ERROR: cannot open %s\n",
+		 t->upload ? t->source : t->target );
+	return -1;
+    }
+    if ( ( ! t->upload && ftruncate ( fd, done ) < 0 )
+	 || lseek ( fd, done, SEEK_SET ) < 0 )
+	error ( errno );
+
+    child = fork();
+    if ( child < 0 ) error ( errno );
+    if ( child == 0 )
+    {
+	int d;
+
+	/* Set fd's as follows:
+	 *	0 -> source, if upload
+	 *	1 -> target, if download
+	 *	2 -> parent's fd 1
+	 */
+	if ( dup2 ( 1, 2 ) < 0
+	     || dup2 ( fd, t->upload ? 0 : 1 ) < 0 )
+	    error ( errno );
+	d = getdtablesize() - 1;
+	while ( d > 2 ) close ( d -- );
+
+	if ( t->upload )
+	{
+	    const char * args[] =
+		{ t->account, "chmod", "u+w", t->path,
+		  "2>/dev/null", ";", "truncate", "-s",
+		  offset, t->path, "&&", "cat", ">>",
+		  t->path, "&&", "chmod", modes, t->path,
+		  "&&", "touch", "-d", touch, t->path,
+		  NULL };
+	    sprintf ( offset, "%lld", done );
+	    sprintf ( modes, "%o", t->mode & 07777 );
+	    sprintf ( touch, "@%ld", (long) t->mtime );
+	    exec_ssh ( "ssh", args );
+	}
+	else
+	{
+	    const char * args[] =
+		{ t->account, "tail", "-c", offset,
+		  t->path, NULL };
+	    sprintf ( offset, "+%lld", done + 1 );
+	    exec_ssh ( "ssh", args );
+	}
+    }
+    close ( fd );
+    if ( cwait ( child ) < 0 ) return -1;
+
+    if ( ! t->upload )
+    {
+	struct utimbuf ut;
+	ut.actime = ut.modtime = t->mtime;
+	if ( chmod ( t->target, t->mode & 07777 ) < 0
+	     || utime ( t->target, & ut ) < 0 )
+	{
+	    printf ( "ERROR: cannot set mode and"
+		     " modification time of %s\n",
+		     t->target );
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* Sink for the encrypted data of encrypt_to_1, which
+ * records the MD5 sum of each whole TRANSFER_CHUNK
+ * byte chunk of the data in t, and writes the data to
+ * out, except for its first skip bytes, which a retry
+ * has found already written to the target.
+ */
+struct transfer_sink {
+    struct sink s;
+    struct transfer * t;
+    struct md5 md5;
+    long long length, skip;
+    struct fd_sink out;
+};
+
+int transfer_sink_write ( struct sink * s,
+			  const unsigned char * buffer,
+			  int n )
+{
+    struct transfer_sink * f =
+	(struct transfer_sink *) s;
+    struct transfer * t = f->t;
+    while ( n > 0 )
+    {
+	int k = TRANSFER_CHUNK
+		- f->length % TRANSFER_CHUNK;
+	if ( k > n ) k = n;
+	md5_update ( & f->md5, buffer, k );
+	if ( f->length + k > f->skip )
+	{
+	    int m = ( f->length < f->skip ?
+		      f->skip - f->length : 0 );
+	    if ( f->out.s.write ( & f->out.s,
+				  buffer + m, k - m )
+		 < 0 )
+		return -1;
+	}
+	f->length += k;
+	buffer += k;
+	n -= k;
+	if ( f->length % TRANSFER_CHUNK == 0 )
+	{
+	    long long c = f->length / TRANSFER_CHUNK;
+	    if ( f->length > t->size )
+	    {
+		t->sums = (char (*)[33])
+		    realloc ( t->sums,
+			      c * sizeof ( * t->sums ) );
+		if ( t->sums == NULL )
+		    error ( ENOMEM );
+		t->size = f->length;
+	    }
+	    md5_final ( & f->md5, t->sums[c-1] );
+	    md5_init ( & f->md5 );
+	}
+    }
+    return 0;
+}
+
+int transfer_sink_close ( struct sink * s )
+{
+    struct transfer_sink * f =
+	(struct transfer_sink *) s;
+    return f->out.s.close ( & f->out.s );
+}
+
+/* Encrypt the local file filename with key and codec,
+ * writing the encrypted file to target without making
+ * a local copy of it, and return the MD5 sums and
+ * sizes of both in sums.  If archive is not NULL, the
+ * tar archive of directory archive (see open_archive)
+ * is encrypted instead, and filename just names it.
+ * Target may have any form acceptable to copyfile,
+ * and is replaced if it exists.  The encrypted data
+ * is piped into ssh executing cat for a remote tar-
+ * get, or into s3cmd put or the built-in S3 client
+ * for an S3 target, and RETRIES retries are done on
+ * failure.
+ *
+ * Each retry encrypts with the S2K salt and prefix of
+ * the first try, so it makes the same encrypted data.
+ * A retry to a remote target appends to the part of
+ * the target that matches this data, found as de-
+ * scribed for struct transfer, and a retry by the
+ * built-in S3 client resumes the multipart upload of
+ * the failed try, as described for s3_put_object.
+ * S3cmd put cannot resume, and a retry by it writes
+ * all the data again.  Return 0 on success and -1 on
+ * error, with error messages written on stdout.
+ */
+int encrypt_to_1 ( const char * filename,
+		   const char * archive,
+		   const char * target,
+		   const char * key, int codec,
+		   struct crypt_sums * sums )
+{
+    line_buffer name;
+    int retries = RETRIES;
+    int s3_name = is_s3 ( target );
+    char * p = NULL;
+    struct transfer t;
+    struct transfer_sink * sink;
+    int r;
+
+    strcpy ( name, target );
+    if ( ! s3_name )
+	p = (char *) is_remote ( name );
+    if ( p != NULL ) * p ++ = 0;
+
+    transfer_init ( & t, filename, target );
+    random_bytes ( t.seed, sizeof ( t.seed ) );
+    sink = (struct transfer_sink *)
+	malloc ( sizeof ( struct transfer_sink ) );
+    if ( sink == NULL ) error ( ENOMEM );
+
+    while ( 1 )
+    {
+	int infd, fd[2];
+	pid_t child = 0, tar_child = 0;
+	long long done = 0, tsize;
+	int mode;
+	time_t mtime;
+
+	if ( retries < RETRIES && p != NULL
+	     && remote_stat ( & t, & tsize, & mode,
+			      & mtime ) == 0 )
+	    done = resume_point ( & t, tsize );
+	if ( trace && done > 0 )
+	    printf ( "* resuming encryption of %s\n"
+		     "*     to %s\n"
+		     "*     after byte %lld\n",
+		     filename, target, done );
+
+	if ( archive != NULL )
+	    infd = open_archive ( archive, & tar_child );
+	else
+	    infd = open ( filename, O_RDONLY );
+	if ( infd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s"
+		     " for reading\n", filename );
+	    r = -1;
+	    break;
+	}
+
+	if ( ! s3_name && p == NULL )
+	{
+	    if ( trace )
+		trace_crypt ( "built-in gpg -c"
+			      " encryption with md5sum",
+			      filename, target );
+	    unlink ( target );
+	    fd[1] = open ( target,
+			   O_WRONLY + O_CREAT + O_TRUNC,
+			   S_IRUSR );
+	    if ( fd[1] < 0 )
+	    {
+		printf ( "ERROR: cannot open %s"
+			 " for writing\n", target );
+		close ( infd );
+		if ( tar_child != 0 ) cwait ( tar_child );
+		r = -1;
+		break;
+	    }
+	}
+	else
+	{
+	    fflush ( stdout );
+	    fflush ( stderr );
+	    if ( s3_name && setup_s3_pipe() < 0 )
+	    {
+		close ( infd );
+		if ( tar_child != 0 ) cwait ( tar_child );
+		r = -1;
+		break;
+	    }
+	    if ( pipe ( fd ) < 0 ) error ( errno );
+
+	    child = fork();
+	    if ( child < 0 )
+	    {
+		int saved_errno = errno;
+		if ( s3_name )
+		    unlink ( s3_pipe );
+		error ( saved_errno );
+	    }
+
+	    if ( child == 0 )
+	    {
+		int d;
+
+		/* Set fd's as follows:
+		 * 	0 -> fd[0]
+		 *	1 -> parent's fd 1
+		 *	2 -> parent's fd 1
+		 */
+		close ( 0 );
+		if ( dup2 ( fd[0], 0 ) < 0 )
+		    error ( errno );
+		close ( 2 );
+		if ( dup2 ( 1, 2 ) < 0 )
+		    error ( errno );
+		d = getdtablesize() - 1;
+		while ( d > 2 ) close ( d -- );
+
+		if ( s3_name && s3_builtin() )
+		    exit ( s3_put_object
+			       ( target, 0,
+				 ( retries < RETRIES ?
+				   S3_RESUME : 0 )
+				 | ( retries > 0 ?
+				     S3_KEEP : 0 ) )
+			   < 0 );
+		else if ( s3_name )
+		{
+		    if ( trace )
+		    {
+			fprintf ( stderr,
+				  "* executing s3cmd"
+				  " put - \\\n"
+				  "                 "
+				  "     %s\n",
+				  target );
+			fflush ( stderr );
+		    }
+		    execlp ( "s3cmd", "s3cmd",
+			     "-c", s3_pipe,
+			     "put", "-", target,
+			     NULL );
+		    int saved_errno = errno;
+		    unlink ( s3_pipe );
+		    error ( saved_errno );
+		}
+		else if ( done == 0 )
+		{
+		    /* The file is made user-only
+		     * read-only, as scp -p would.
+		     */
+		    const char * args[] =
+			{ name, "rm", "-f", p, ";",
+			  "umask", "277", ";",
+			  "cat", ">", p, NULL };
+		    if ( trace )
+		    {
+			fprintf ( stderr,
+				  "* executing ssh %s"
+				  " \\\n"
+				  "            cat >"
+				  " %s\n",
+				  name, p );
+			fflush ( stderr );
+		    }
+		    exec_ssh ( "ssh", args );
+		}
+		else
+		{
+		    char offset[40];
+		    const char * args[] =
+			{ name, "chmod", "u+w", p,
+			  "2>/dev/null", ";", "truncate",
+			  "-s", offset, p, "&&", "cat",
+			  ">>", p, "&&", "chmod", "400",
+			  p, NULL };
+		    sprintf ( offset, "%lld", done );
+		    if ( trace )
+		    {
+			fprintf ( stderr,
+				  "* executing ssh %s"
+				  " \\\n"
+				  "            cat >>"
+				  " %s\n",
+				  name, p );
+			fflush ( stderr );
+		    }
+		    exec_ssh ( "ssh", args );
+		}
+	    }
+
+	    close ( fd[0] );
+	    if ( s3_name ) write_s3_pipe();
+	    if ( trace )
+		trace_crypt ( "built-in gpg -c"
+			      " encryption with md5sum",
+			      filename, NULL );
+	}
+
+	sink->s.write = transfer_sink_write;
+	sink->s.close = transfer_sink_close;
+	sink->t = & t;
+	md5_init ( & sink->md5 );
+	sink->length = 0;
+	sink->skip = done;
+	fd_sink_init ( & sink->out, fd[1] );
+	r = pgp_encrypt_part ( infd, fd[1], key, 32, codec,
+			       t.seed, -1,
+			       p != NULL ? & sink->s : NULL,
+			       sums );
+	close ( infd );
+	if ( close ( fd[1] ) < 0 ) r = -1;
+	if ( child != 0 && cwait ( child ) < 0 )
+	    r = -1;
+	if ( tar_child != 0 && cwait ( tar_child ) < 0 )
+	{
+	    /* Retrying would not help. */
+	    r = -1;
+	    child = 0;
+	}
+	if ( s3_name ) unlink ( s3_pipe );
+
+	if ( r == 0 || child == 0 || retries -- == 0 )
+	    break;
+	printf ( "RETRYING encryption of %s\n"
+		 "    to %s\n", filename, target );
+    }
+    free ( sink );
+    free ( t.sums );
+    return r;
+}
+
+/* Encrypt filename as encrypt_to_1 does.  For a re-
+ * mote or S3 target, the time not spent encrypting is
+ * timed as the transfer stage of the bytes piped to
+ * target.
+ */
+int encrypt_to ( const char * filename,
+		 const char * archive,
+		 const char * target,
+		 const char * key, int codec,
+		 struct crypt_sums * sums )
+{
+    long long piped = pipe_bytes;
+    struct timing t;
+    int r;
+
+    if ( ! is_s3 ( target )
+	 && is_remote ( target ) == NULL )
+	return encrypt_to_1 ( filename, archive, target,
+			      key, codec, sums );
+    start_stage ( & t );
+    r = encrypt_to_1 ( filename, archive, target, key,
+		       codec, sums );
+    end_stage ( & t, TRANSFER_STAGE,
+		pipe_bytes - piped );
+    return r;
+}
+
+/* Copy file.  0 is returned on success, -1 on error.
+ * Error messages are written on stdout.  The mode
+ * and mtime of the file are preserved if this is
+ * easy to do, but not for files stored in S3 (it
+ * would be possible using the MIME type to do so,
+ * but we do not).  The filenames may have any format
+ * acceptable to scp or s3cmd.  If a filename has
+ * S3 form (begins with `s3:'), the other file name
+ * must be local (not have `@' before a `:' or begin
+ * with `s3:').  RETRIES retries are done on failure
+ * (it is assumed that one of the file names is
+ * probably remote).  A retry of a copy between a
+ * local and a remote file resumes the copy as de-
+ * scribed for struct transfer, and a retry of a copy
+ * by the built-in S3 client resumes it as described
+ * for s3_copy.
+ */
+int copyfile_1
+	( const char * source, const char * target )
+{
+    int child;
+    int retries = RETRIES;
+    int s3_source = is_s3 ( source );
+    int s3_target = is_s3 ( target );
+    int resume = 0, r;
+    struct transfer t;
+
+    transfer_init ( & t, source, target );
+    while ( 1 )
+    {
+	int flags = ( resume ? S3_RESUME : 0 )
+		    | ( retries > 0 ? S3_KEEP : 0 );
+
+	fflush ( stdout );
+	fflush ( stderr );
 
 	if ( ( s3_source || s3_target )
 	      && setup_s3_pipe() < 0 )
 	    return -1;
 
-	child = fork();
-	if ( child < 0 )
+	child = fork();
+	if ( child < 0 )
+	{
+	    int saved_errno = errno;
+	    if ( s3_source || s3_target )
+		unlink ( s3_pipe );
+	    error ( saved_errno );
+	}
+
+	if ( child == 0 )
+	{
+	    int newfd, d;
+
+	    /* Set fd's as follows:
+	     * 	0 -> /dev/null
+	     *	1 -> parent's fd 1
+	     *	2 -> parent's fd 1
+	     */
+	    newfd = open ( "/dev/null", O_RDONLY );
+	    if ( newfd < 0 ) error ( errno );
+	    close ( 0 );
+	    if ( dup2 ( newfd, 0 ) < 0 )
+	    	error ( errno );
+	    close ( newfd );
+	    close ( 2 );
+	    if ( dup2 ( 1, 2 ) < 0 )
+	    	error ( errno );
+	    d = getdtablesize() - 1;
+	    while ( d > 2 ) close ( d -- );
+
+	    if ( s3_source )
+	    {
+		if ( s3_target)
+		{
+		    printf ( "ERROR: both source %s\n"
+		             "       and target %s\n"
+			     "       of file copy are"
+			     " S3\n",
+			     source, target );
+		    exit ( 1 );
+		}
+		else if ( is_remote ( target ) )
+		{
+		    printf ( "ERROR: attempt to copy S3"
+		             " source %s\n"
+		             "       to remote target"
+			     " %s\n",
+			     source, target );
+		    exit ( 1 );
+		}
+		 
+		if ( s3_builtin() )
+		    exit ( s3_copy ( source, target,
+				     flags ) < 0 );
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing s3cmd"
+			      " get %s \\\n"
+			      "                 "
+			      "     %s\n",
+			      source, target );
+		    fflush ( stderr );
+		}
+		execlp ( "s3cmd", "s3cmd",
+			 "-c", s3_pipe,
+			 // trace ? "-v" : "-q",
+		         "get", source, target,
+			 NULL );
+		int saved_errno = errno;
+		unlink ( s3_pipe );
+		error ( saved_errno );
+	    }
+	    else if ( s3_target )
+	    {
+		if ( is_remote ( target ) )
+		{
+		    printf ( "ERROR: attempt to copy"
+		             " remote source %s\n"
+		             "       to S3 target"
+			     " %s\n",
+			     source, target );
+		    exit ( 1 );
+		}
+		 
+		if ( s3_builtin() )
+		    exit ( s3_copy ( source, target,
+				     flags ) < 0 );
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing s3cmd"
+			      " put %s \\\n"
+			      "                 "
+			      "     %s\n",
+			      source, target );
+		    fflush ( stderr );
+		}
+		execlp ( "s3cmd", "s3cmd",
+			 "-c", s3_pipe,
+			 // trace ? "-v" : "-q",
+		         "put", source, target,
+			 NULL );
+		int saved_errno = errno;
+		unlink ( s3_pipe );
+		error ( saved_errno );
+	    }
+	    else
+	    {
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing scp -p"
+			      " %s \\\n"
+			      "                   %s\n",
+			      source, target );
+		    fflush ( stderr );
+		}
+		const char * args[] =
+		    { "-p", source, target, NULL };
+		exec_ssh ( "scp", args );
+	    }
+	}
+
+	if ( s3_source || s3_target )
+	    write_s3_pipe();
+
+	r = cwait ( child );
+	if ( s3_source || s3_target )
+	    unlink ( s3_pipe );
+
+	while ( r < 0 && t.path != NULL && retries > 0 )
+	{
+	    -- retries;
+	    printf ( "RETRYING copy of %s\n"
+		     "    to %s\n", source, target );
+	    r = resume_copy ( & t );
+	}
+	if ( r == 0 || retries == 0 ) break;
+	-- retries;
+	printf ( "RETRYING copy of %s\n"
+		 "    to %s\n", source, target );
+	resume = 1;
+    }
+    free ( t.sums );
+    return r;
+}
+
+/* Copy file as copyfile_1 does, timing the copy as the
+ * transfer stage of the size of the local file.
+ */
+int copyfile
+	( const char * source, const char * target )
+{
+    const char * local =
+	! is_s3 ( source ) && is_remote ( source ) == NULL ?
+	source : target;
+    struct timing t;
+    struct stat st;
+    int r;
+
+    start_stage ( & t );
+    r = copyfile_1 ( source, target );
+    end_stage ( & t, TRANSFER_STAGE,
+		r == 0 && stat ( local, & st ) == 0 ?
+		st.st_size : 0 );
+    return r;
+}
+
+/* Delete file.  0 is returned on success, -1 on error.
+ * Error messages are written on stdout.  The filename
+ * may have the format acceptable to scp, and must
+ * not be longer than MAX_LEXEME_SIZE.  If filename is
+ * remote (has @ and :) then RETRIES retries are done on
+ * failure.
+ */
+int delfile ( const char * filename )
+{
+    int at_found, child;
+    char * p;
+    line_buffer name;
+    int retries = RETRIES;
+    int s3_file = is_s3 ( filename );
+
+    strcpy ( name, filename );
+    p = (char *) is_remote ( name );
+    if ( ! s3_file && ! p )
+    {
+        /* Not a remote file. */
+	if ( unlink ( filename ) < 0
+	     &&
+	     errno != ENOENT )
+	{
+	    const char * s = strerror ( errno );
+	    printf ( "ERROR: %s\n", s );
+	    printf ( "    could not delete %s\n",
+	             filename );
+	    return -1;
+	}
+	else
+	    return 0;
+    }
+
+    /* Now name points at account and p at file
+     * within account.
+     */
+
+    while ( 1 )
+    {
+	fflush ( stdout );
+	fflush ( stderr );
+
+	if ( s3_file && setup_s3_pipe() < 0 )
+	    return -1;
+
+	child = fork();
+	if ( child < 0 )
+	{
+	    int saved_errno = errno;
+	    if ( s3_file )
+		unlink ( s3_pipe );
+	    error ( saved_errno );
+	}
+
+	if ( child == 0 )
+	{
+	    int newfd, d;
+
+	    /* Set fd's as follows:
+	     * 	0 -> /dev/null
+	     *	1 -> parent's fd 1
+	     *	2 -> parent's fd 1
+	     */
+	    newfd = open ( "/dev/null", O_RDONLY );
+	    if ( newfd < 0 ) error ( errno );
+	    close ( 0 );
+	    if ( dup2 ( newfd, 0 ) < 0 )
+	        error ( errno );
+	    close ( newfd );
+	    close ( 2 );
+	    if ( dup2 ( 1, 2 ) < 0 )
+	        error ( errno );
+	    d = getdtablesize() - 1;
+	    while ( d > 2 ) close ( d -- );
+
+	    if ( s3_file )
+	    {
+		if ( s3_builtin() )
+		    exit ( s3_delete_object ( filename )
+			   < 0 );
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing s3cmd"
+			      " del; %s \n",
+			      filename );
+		    fflush ( stderr );
+		}
+		execlp ( "s3cmd", "s3cmd",
+			 "-c", s3_pipe,
+			 // trace ? "-v" : "-q",
+		         "del", filename,
+			 NULL );
+		int saved_errno = errno;
+		unlink ( s3_pipe );
+		error ( saved_errno );
+	    }
+	    else
+	    {
+		* p ++ = 0;
+
+		if ( trace )
+		{
+		    fprintf ( stderr,
+			      "* executing ssh %s \\\n"
+			      "            rm -f %s\n",
+			      name, p );
+		    fflush ( stderr );
+		}
+		const char * args[] =
+		    { name, "rm", "-f", p, NULL };
+		exec_ssh ( "ssh", args );
+	    }
+	}
+
+	if (s3_file ) write_s3_pipe();
+
+	if ( cwait ( child ) < 0 )
+	{
+	    if (s3_file )
+		unlink ( s3_pipe );
+	    if ( retries -- )
+	    {
+		printf ( "RETRYING deletion of %s\n",
+		         filename );
+		continue;
+	    }
+	    else return -1;
+	}
+
+	if (s3_file )
+	    unlink ( s3_pipe );
+	return 0;
+    }
+}
+
+/* Decrypt the encrypted file source with key by exe-
+ * cuting gpg, writing the decrypted file to output,
+ * or discarding it if output is NULL, and return the
+ * MD5 sum of the decrypted file in sum.  A source that
+ * is not local is first copied to a temporary file in
+ * the current directory.  Return 0 on success and -1
+ * on error, with error messages written on stdout.
+ */
+int decrypt_by_gpg ( const char * source,
+		     const char * output,
+		     const char * key, char * sum )
+{
+    char tmpfile[64];
+    const char * input = source;
+    pid_t child;
+    int r = 0;
+
+    if ( is_s3 ( source ) || is_remote ( source ) )
+    {
+	sprintf ( tmpfile, "EFM-%d.gpg", (int) getpid() );
+	if ( trace )
+	    printf ( "* copying %s\n"
+		     "*     to %s\n",
+		     source, tmpfile );
+	unlink ( tmpfile );
+	if ( copyfile ( source, tmpfile ) < 0 )
+	{
+	    unlink ( tmpfile );
+	    return -1;
+	}
+	input = tmpfile;
+    }
+
+    if ( output != NULL )
+    {
+	if ( crypt ( 1, input, output, key, 32, & child )
+	     < 0
+	     || md5sum ( sum, output ) < 0 )
+	    r = -1;
+    }
+    else
+    {
+	int fd = crypt ( 1, input, NULL, key, 32,
+			 & child );
+	struct md5 md5;
+	unsigned char buffer[8192];
+	int n;
+
+	if ( fd < 0 )
+	    r = -1;
+	else
+	{
+	    md5_init ( & md5 );
+	    while ( ( n = read ( fd, buffer,
+				 sizeof ( buffer ) ) )
+		    != 0 )
+	    {
+		if ( n > 0 )
+		    md5_update ( & md5, buffer, n );
+		else if ( errno != EINTR )
+		{
+		    r = -1;
+		    break;
+		}
+	    }
+	    close ( fd );
+	    if ( cwait ( child ) < 0 ) r = -1;
+	    md5_final ( & md5, sum );
+	}
+    }
+
+    if ( input != source ) unlink ( input );
+    return r;
+}
+
+/* Decrypt the encrypted file source with key, writing
+ * the decrypted file to output, or discarding it if
+ * output is NULL, and return the MD5 sum of the de-
+ * crypted file in sum, which is computed as the file
+ * is decrypted.  Source may have any form acceptable
+ * to copyfile.  A remote or S3 source is read from
+ * open_fetch, so no local copy of it is made, and a
+ * failed read of source is retried by fetch_source,
+ * after the part of source already decrypted.  If the built-in engine cannot decrypt
+ * source, decrypt_by_gpg is used instead.  Return 0
+ * on success and -1 on error, with error messages
+ * written on stdout.
+ */
+int decrypt_from_1 ( const char * source,
+		     const char * output,
+		     const char * key, char * sum )
+{
+    int local = ( ! is_s3 ( source )
+		  && is_remote ( source ) == NULL );
+    int infd, outfd = -1, r;
+    int child_failed = 0;
+    pid_t child = 0;
+    struct crypt_sums sums;
+
+    if ( output != NULL )
+    {
+	outfd = open ( output,
+		       O_WRONLY + O_CREAT + O_TRUNC,
+		       S_IWUSR + S_IRUSR );
+	if ( outfd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s"
+		     " for writing\n", output );
+	    return -1;
+	}
+    }
+
+    if ( ! local )
+	infd = open_fetch ( source, & child );
+    else if ( ( infd = open ( source, O_RDONLY ) ) < 0 )
+    {
+	printf ( "ERROR: cannot open %s"
+		 " for reading\n", source );
+	if ( outfd >= 0 ) close ( outfd );
+	return -1;
+    }
+
+    if ( trace )
+	trace_crypt ( "built-in gpg decryption"
+		      " with md5sum",
+		      local ? source : NULL, output );
+    r = pgp_decrypt ( infd, outfd, key, 32, & sums );
+    close ( infd );
+    if ( outfd >= 0 && close ( outfd ) < 0 )
+	r = -1;
+    if ( child != 0 && cwait ( child ) < 0 )
+	child_failed = 1;
+
+    if ( r == -2 )
+	return decrypt_by_gpg
+		   ( source, output, key, sum );
+    else if ( r < 0 || child_failed )
+	return -1;
+    strcpy ( sum, sums.md5sum );
+    return 0;
+}
+
+/* Decrypt source as decrypt_from_1 does.  For a re-
+ * mote or S3 source, the time not spent decrypting
+ * is timed as the transfer stage of the bytes piped
+ * from source.
+ */
+int decrypt_from ( const char * source,
+		   const char * output,
+		   const char * key, char * sum )
+{
+    long long piped = pipe_bytes;
+    struct timing t;
+    int r;
+
+    if ( ! is_s3 ( source )
+	 && is_remote ( source ) == NULL )
+	return decrypt_from_1 ( source, output,
+				key, sum );
+    start_stage ( & t );
+    r = decrypt_from_1 ( source, output, key, sum );
+    end_stage ( & t, TRANSFER_STAGE,
+		pipe_bytes - piped );
+    return r;
+}
+
+/* The chunk store.  The file of a chunked index entry
+ * is split into chunks at boundaries chosen by its
+ * contents, so that changing part of the file changes
+ * only the chunks near that part.  Each chunk is en-
+ * crypted with a key made from its contents and kept
+ * in the target directory as CCCC.chunk.gpg, where
+ * CCCC is a name also made from its contents (see
+ * chunk_secret), so a chunk shared by several files,
+ * or by several versions of one file, is stored and
+ * copied only once.  The entry's own MMMM.gpg holds
+ * its manifest, which is encrypted with the entry's
+ * key and lists the MD5 sum, length, key, and name of
+ * each chunk of the file in order.
+ *
+ * Chunks and manifests are encrypted with seeds made
+ * from their contents (see pgp_encrypt_part), so the
+ * same contents always give the same encrypted file.
+ * So a chunk already in the target directory is good
+ * if its MD5 sum is that of the chunk encrypted again,
+ * and the esize and emd5sum of an entry, which are
+ * those of its encrypted manifest, are the same in
+ * every directory.
+ *
+ * A chunk ends after a byte at which the top CHUNK_-
+ * BITS bits of the gear hash of the bytes before it are
+ * zero, if the chunk is at least CHUNK_MIN bytes long,
+ * and otherwise at CHUNK_MAX bytes.  The gear table is
+ * made by splitmix64 from seed 0, and must never
+ * change, or new chunks would not match the chunks
+ * already stored.
+ */
+#define CHUNK_MIN ( 256 * 1024 )
+#define CHUNK_BITS 20
+#define CHUNK_MAX ( 4 * 1024 * 1024 )
+#define CHUNK_JOBS 4	/* Chunks copied at once. */
+
+uint64_t chunk_gear[256];
+int chunk_gear_made = 0;
+
+void make_chunk_gear ( void )
+{
+    uint64_t x = 0;
+    int i;
+    for ( i = 0; i < 256; ++ i )
+    {
+	uint64_t z = ( x += 0x9e3779b97f4a7c15ULL );
+	z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+	z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+	chunk_gear[i] = z ^ ( z >> 31 );
+    }
+    chunk_gear_made = 1;
+}
+
+struct chunk {
+    off_t offset;
+    int length;
+    char md5sum[33];
+    char key[33];
+    char name[33];
+    unsigned char mac[32];
+	/* HMAC-SHA-256 code of the chunk, from which
+	 * its key, name, and seed are made.  Not known
+	 * for chunks read from a manifest.
+	 */
+};
+
+struct chunk_list {
+    struct chunk * chunks;
+    int n, allocated;
+    char md5sum[33];	/* Of the whole file. */
+    off_t length;
+};
+
+/* Append an empty chunk to l and return it.
+ */
+struct chunk * add_chunk ( struct chunk_list * l )
+{
+    struct chunk * c;
+    if ( l->n == l->allocated )
+    {
+	l->allocated = 2 * l->allocated + 64;
+	l->chunks = (struct chunk *)
+	    realloc ( l->chunks,
+		      l->allocated
+		      * sizeof ( struct chunk ) );
+	if ( l->chunks == NULL ) error ( ENOMEM );
+    }
+    c = l->chunks + l->n ++;
+    memset ( c, 0, sizeof ( * c ) );
+    return c;
+}
+
+/* Chunk keys, names, and seeds are made from HMAC-
+ * SHA-256 message authentication codes under a random
+ * 32 byte secret, so they reveal nothing about the
+ * contents of a chunk to anyone who does not have the
+ * index, yet equal chunks still get equal codes.  The
+ * secret is kept in the index as a comment line begin-
+ * ning with CHUNK_SECRET followed by 64 hexadecimal
+ * digits, which the "chunking on" command adds if it
+ * is not there.
+ */
+#define CHUNK_SECRET "#efm-chunk-secret "
+unsigned char chunk_secret[32];
+int chunk_secret_found = 0;
+
+/* Set chunk_secret from the index comment line holding
+ * it.  Return 0 on success and -1 if there is no such
+ * line.
+ */
+int find_chunk_secret ( void )
+{
+    struct comment * c = first_comment;
+    size_t n = strlen ( CHUNK_SECRET );
+
+    if ( chunk_secret_found ) return 0;
+    if ( c ) do
+    {
+	char hex[33];
+	if ( strncmp ( c->line, CHUNK_SECRET, n ) != 0
+	     || strlen ( c->line ) != n + 64 )
+	    continue;
+	memcpy ( hex, c->line + n, 32 );
+	hex[32] = 0;
+	if ( hex_to_bytes ( chunk_secret, hex ) != 0 )
+	    continue;
+	memcpy ( hex, c->line + n + 32, 32 );
+	if ( hex_to_bytes ( chunk_secret + 16, hex )
+	     != 0 )
+	    continue;
+	chunk_secret_found = 1;
+	return 0;
+    } while ( ( c = c->next ) != first_comment );
+    return -1;
+}
+
+/* Add a new random chunk secret to the index if it has
+ * none.  The whole index is then rewritten, as the
+ * journal does not hold comment lines.
+ */
+void make_chunk_secret ( void )
+{
+    struct comment * c;
+    char * p;
+    int i;
+
+    if ( find_chunk_secret() == 0 ) return;
+    random_bytes ( chunk_secret, 32 );
+    c = (struct comment *)
+	malloc ( sizeof ( struct comment ) );
+    p = (char *) malloc ( strlen ( CHUNK_SECRET ) + 65 );
+    if ( c == NULL || p == NULL ) error ( ENOMEM );
+    c->line = p;
+    p += sprintf ( p, "%s", CHUNK_SECRET );
+    for ( i = 0; i < 32; ++ i )
+	p += sprintf ( p, "%02x", chunk_secret[i] );
+    if ( first_comment == NULL )
+	first_comment = c->previous = c->next = c;
+    else
+    {
+	c->previous = first_comment->previous;
+	c->next = first_comment;
+	c->previous->next = c->next->previous = c;
+    }
+    chunk_secret_found = 1;
+    index_rewrite = 1;
+}
+
+/* The HMAC-SHA-256 code under chunk_secret of some
+ * data is computed by chunk_mac_init, sha_update for
+ * the data, and chunk_mac_final, which stores the 32
+ * byte code in mac.
+ */
+void chunk_mac_init ( struct sha * sha )
+{
+    unsigned char pad[64];
+    int i;
+    for ( i = 0; i < 64; ++ i )
+	pad[i] = ( i < 32 ? chunk_secret[i] : 0 ) ^ 0x36;
+    sha_init ( sha, 8 );
+    sha_update ( sha, pad, 64 );
+}
+
+void chunk_mac_final ( struct sha * sha,
+		       unsigned char * mac )
+{
+    unsigned char pad[64], h[32];
+    int i;
+    sha_final ( sha, h );
+    for ( i = 0; i < 64; ++ i )
+	pad[i] = ( i < 32 ? chunk_secret[i] : 0 ) ^ 0x5c;
+    sha_init ( sha, 8 );
+    sha_update ( sha, pad, 64 );
+    sha_update ( sha, h, 32 );
+    sha_final ( sha, mac );
+}
+
+/* Make the 24 byte seed of a chunk or manifest from
+ * the HMAC-SHA-256 code of its contents, as the first
+ * 24 bytes of the SHA-256 hash of that code.
+ */
+void chunk_seed ( unsigned char * seed,
+		  const unsigned char * mac )
+{
+    struct sha sha;
+    unsigned char h[32];
+    sha_init ( & sha, 8 );
+    sha_update ( & sha, mac, 32 );
+    sha_final ( & sha, h );
+    memcpy ( seed, h, 24 );
+}
+
+/* Finish the chunk c, whose MD5 sum and HMAC-SHA-256
+ * code have been computed in md5 and sha.  Its key is
+ * the upper case hexadecimal of the first 16 bytes of
+ * the code, and its name the lower case hexadecimal of
+ * the last 16.
+ */
+void finish_chunk ( struct chunk * c, struct md5 * md5,
+		    struct sha * sha )
+{
+    md5_final ( md5, c->md5sum );
+    chunk_mac_final ( sha, c->mac );
+    bytes_to_hex ( c->key, c->mac, 1 );
+    bytes_to_hex ( c->name, c->mac + 16, 0 );
+}
+
+/* Split the local file filename into chunks, adding
+ * them to the empty list l, and compute the MD5 sum
+ * and length of the whole file.  Return 0 on success
+ * and -1 on error, with error messages written on
+ * stdout.
+ */
+int chunk_file ( const char * filename,
+		 struct chunk_list * l )
+{
+    unsigned char * buffer =
+	(unsigned char *) malloc ( PGP_BUFFER_SIZE );
+    struct md5 file_md5, md5;
+    struct sha sha;
+    struct chunk * c = NULL;
+    struct timing t;
+    uint64_t h = 0;
+    int fd, r = 0;
+
+    if ( buffer == NULL ) error ( ENOMEM );
+    if ( ! chunk_gear_made ) make_chunk_gear();
+    start_stage ( & t );
+    fd = open ( filename, O_RDONLY );
+    if ( fd < 0 )
+    {
+	printf ( "ERROR: cannot open %s for reading\n",
+		 filename );
+	free ( buffer );
+	return -1;
+    }
+    md5_init ( & file_md5 );
+    while ( 1 )
+    {
+	int start = 0, i;
+	int n = read ( fd, buffer, PGP_BUFFER_SIZE );
+	if ( n < 0 )
+	{
+	    if ( errno == EINTR ) continue;
+	    printf ( "ERROR: %s\n    reading %s\n",
+		     strerror ( errno ), filename );
+	    r = -1;
+	    break;
+	}
+	if ( n == 0 ) break;
+	md5_update ( & file_md5, buffer, n );
+	for ( i = 0; i < n; ++ i )
+	{
+	    if ( c == NULL )
+	    {
+		c = add_chunk ( l );
+		c->offset = l->length + i;
+		md5_init ( & md5 );
+		chunk_mac_init ( & sha );
+		h = 0;
+	    }
+	    h = ( h << 1 ) + chunk_gear[buffer[i]];
+	    ++ c->length;
+	    if ( c->length >= CHUNK_MAX
+		 || ( c->length >= CHUNK_MIN
+		      && ( h >> ( 64 - CHUNK_BITS ) )
+			 == 0 ) )
+	    {
+		md5_update ( & md5, buffer + start,
+			     i + 1 - start );
+		sha_update ( & sha, buffer + start,
+			     i + 1 - start );
+		finish_chunk ( c, & md5, & sha );
+		start = i + 1;
+		c = NULL;
+	    }
+	}
+	if ( c != NULL )
+	{
+	    md5_update ( & md5, buffer + start,
+			 n - start );
+	    sha_update ( & sha, buffer + start,
+			 n - start );
+	}
+	l->length += n;
+    }
+    if ( c != NULL ) finish_chunk ( c, & md5, & sha );
+    md5_final ( & file_md5, l->md5sum );
+    close ( fd );
+    free ( buffer );
+    end_stage ( & t, HASH_STAGE, l->length );
+    return r;
+}
+
+/* State of put_chunked or get_chunked, shared with the
+ * child processes that copy the chunks.
+ */
+struct chunk_copy {
+    struct chunk_list l;
+    const char * file;	/* Local file (put only). */
+    line_buffer dir;	/* Target or source directory,
+			   ending in '/'. */
+    int local;		/* 1 if dir is local. */
+    int codec;		/* Of the entry (put only). */
+    char (* sums)[33];	/* MD5 sums of the encrypted
+			   chunks in a remote or S3
+			   dir, "" if not found (put
+			   only). */
+    pid_t pid;		/* Of the process that made
+			   the chunk_copy. */
+    int outfd;		/* Output file, or -1 (get
+			   only). */
+    struct md5 md5;	/* Of output (get only). */
+};
+
+/* Run job ( a, k ) for k = 0, ..., n-1, each in its own
+ * child process, with up to CHUNK_JOBS processes run-
+ * ning at once.  The stages timed by each child are
+ * added to those of this process.  If done is not
+ * NULL, done ( a, k ) is then called in this process
+ * for each k in order, as soon as the child for k has
+ * succeeded.  Return 0 if
+ * every job and done returned 0.  Otherwise return -1,
+ * after starting no more jobs and waiting for those
+ * already started.
+ */
+int chunk_jobs ( int ( * job ) ( void * a, int k ),
+		 int ( * done ) ( void * a, int k ),
+		 void * a, int n )
+{
+    pid_t pid[CHUNK_JOBS];
+    int fd[CHUNK_JOBS][2];
+    int next = 0, r = 0, k, status;
+
+    for ( k = 0; k < n; ++ k )
+    {
+	while ( r == 0 && next < n
+		       && next < k + CHUNK_JOBS )
+	{
+	    int * f = fd[next % CHUNK_JOBS];
+	    fflush ( stdout );
+	    fflush ( stderr );
+	    if ( pipe ( f ) < 0 ) error ( errno );
+	    pid[next % CHUNK_JOBS] = fork();
+	    if ( pid[next % CHUNK_JOBS] < 0 )
+		error ( errno );
+	    if ( pid[next % CHUNK_JOBS] == 0 )
+	    {
+		memset ( file_stages, 0,
+			 sizeof ( file_stages ) );
+		status = job ( a, next );
+		send_stages ( f[1] );
+		exit ( status < 0 );
+	    }
+	    close ( f[1] );
+	    ++ next;
+	}
+	if ( k == next ) break;
+	status = cwait ( pid[k % CHUNK_JOBS] );
+	receive_stages ( fd[k % CHUNK_JOBS][0],
+			 file_stages );
+	close ( fd[k % CHUNK_JOBS][0] );
+	if ( status < 0 )
+	    r = -1;
+	else if ( r == 0 && done != NULL
+			 && done ( a, k ) < 0 )
+	    r = -1;
+    }
+    return r;
+}
+
+/* Encrypt chunk k of p->file into a temporary file
+ * and copy it to p->dir, unless a good copy of it is
+ * already there.  Run by chunk_jobs.
+ */
+int put_chunk ( void * a, int k )
+{
+    struct chunk_copy * p = (struct chunk_copy *) a;
+    struct chunk * c = p->l.chunks + k;
+    struct crypt_sums sums;
+    unsigned char seed[24];
+    line_buffer name;
+    char tmpfile[64], sum[33];
+    int infd, outfd, r, present;
+
+    sprintf ( name, "%s%s.chunk.gpg", p->dir,
+	      c->name );
+    sprintf ( tmpfile, "EFM-%d.chunk.gpg",
+	      (int) getpid() );
+    chunk_seed ( seed, c->mac );
+
+    infd = open ( p->file, O_RDONLY );
+    if ( infd < 0 )
+    {
+	printf ( "ERROR: cannot open %s"
+		 " for reading\n", p->file );
+	return -1;
+    }
+    if ( lseek ( infd, c->offset, SEEK_SET ) < 0 )
+	error ( errno );
+    unlink ( tmpfile );
+    outfd = open ( tmpfile, O_WRONLY + O_CREAT + O_TRUNC,
+		   S_IRUSR );
+    if ( outfd < 0 )
+    {
+	printf ( "ERROR: cannot open %s"
+		 " for writing\n", tmpfile );
+	close ( infd );
+	return -1;
+    }
+    r = pgp_encrypt_part ( infd, outfd, c->key, 32,
+			   p->codec, seed, c->length,
+			   NULL, & sums );
+    close ( infd );
+    if ( close ( outfd ) < 0 ) r = -1;
+    if ( r == 0
+	 && ( strcmp ( sums.md5sum, c->md5sum ) != 0
+	      || sums.size != c->length ) )
+    {
+	printf ( "ERROR: %s changed while being"
+		 " copied\n", p->file );
+	r = -1;
+    }
+
+    if ( p->local )
+    {
+	present = access ( name, F_OK ) == 0;
+	if ( present && md5sum ( sum, name ) < 0 )
+	    sum[0] = 0;
+    }
+    else
+    {
+	present = p->sums[k][0] != 0;
+	strcpy ( sum, p->sums[k] );
+    }
+
+    if ( r == 0 && present
+		&& strcmp ( sum, sums.emd5sum ) == 0 )
+    {
+	if ( trace )
+	    printf ( "* keeping %s\n", name );
+    }
+    else if ( r == 0 )
+    {
+	if ( trace )
+	    printf ( "* copying chunk of %s\n"
+		     "*     to %s\n", p->file, name );
+	if ( present ) r = delfile ( name );
+	if ( r == 0 ) r = copyfile ( tmpfile, name );
+	if ( r == 0 && ! ( is_s3 ( name )
+			   && s3_builtin() ) )
+	{
+	    r = md5sum ( sum, name );
+	    if ( r == 0
+		 && strcmp ( sum, sums.emd5sum ) != 0 )
+	    {
+		printf ( "ERROR: MD5 sum of %s (%s)\n"
+			 "    does not match that"
+			 " computed while encrypting"
+			 " (%s)\n",
+			 name, sum, sums.emd5sum );
+		r = -1;
+	    }
+	}
+    }
+    unlink ( tmpfile );
+    return r;
+}
+
+/* Copy filename, the file of the chunked entry e, to
+ * target, which is the name of its encrypted manifest
+ * in the target directory (see above), copying only
+ * the chunks not already there.  The sizes and MD5
+ * sums of the file and of its encrypted manifest are
+ * returned in sums.  Return 0 on success and -1 on
+ * error, with error messages written on stdout.
+ */
+int put_chunked ( const char * filename,
+		  const char * target,
+		  struct entry * e,
+		  struct crypt_sums * sums )
+{
+    struct chunk_copy * p = (struct chunk_copy *)
+	calloc ( 1, sizeof ( struct chunk_copy ) );
+    char tmpfile[64], efile[64], sum[33];
+    unsigned char mac[32], seed[24];
+    struct sha sha;
+    char * q;
+    FILE * f;
+    int infd, outfd, r, k;
+
+    if ( p == NULL ) error ( ENOMEM );
+    strcpy ( p->dir, target );
+    q = strrchr ( p->dir, '/' );
+    assert ( q != NULL );
+    q[1] = 0;
+    p->file = filename;
+    p->local = ! is_s3 ( target )
+	       && is_remote ( target ) == NULL;
+    p->codec = e->codec;
+    sprintf ( tmpfile, "EFM-%d.manifest",
+	      (int) getpid() );
+    sprintf ( efile, "EFM-%d.manifest.gpg",
+	      (int) getpid() );
+
+    if ( find_chunk_secret() < 0 )
+    {
+	printf ( "ERROR: the index has no chunk secret"
+		 " for chunked %s\n", filename );
+	free ( p );
+	return -1;
+    }
+    if ( trace )
+	printf ( "* splitting %s into chunks\n",
+		 filename );
+    r = chunk_file ( filename, & p->l );
+    if ( r == 0
+	 && ( strcmp ( p->l.md5sum, e->md5sum ) != 0
+	      || p->l.length != e->size ) )
+    {
+	printf ( "ERROR: %s changed while being"
+		 " split into chunks\n", filename );
+	r = -1;
+    }
+
+    /* Write the manifest and encrypt it.
+     */
+    f = r == 0 ? fopen ( tmpfile, "w" ) : NULL;
+    if ( r == 0 && f == NULL )
+    {
+	printf ( "ERROR: cannot open %s"
+		 " for writing\n", tmpfile );
+	r = -1;
+    }
+    if ( r == 0 )
+    {
+	chunk_mac_init ( & sha );
+	for ( k = 0; k < p->l.n; ++ k )
+	{
+	    line_buffer line;
+	    struct chunk * c = p->l.chunks + k;
+	    sprintf ( line, "%s %d %s %s\n", c->md5sum,
+		      c->length, c->key, c->name );
+	    sha_update ( & sha, line, strlen ( line ) );
+	    fputs ( line, f );
+	}
+	if ( fclose ( f ) != 0 ) r = -1;
+	chunk_mac_final ( & sha, mac );
+	chunk_seed ( seed, mac );
+    }
+    if ( r == 0 )
+    {
+	infd = open ( tmpfile, O_RDONLY );
+	unlink ( efile );
+	outfd = open ( efile,
+		       O_WRONLY + O_CREAT + O_TRUNC,
+		       S_IRUSR );
+	if ( infd < 0 || outfd < 0 ) error ( errno );
+	r = pgp_encrypt_part ( infd, outfd, e->key, 32,
+			       e->codec, seed, -1, NULL,
+			       sums );
+	close ( infd );
+	if ( close ( outfd ) < 0 ) r = -1;
+	strcpy ( sums->md5sum, p->l.md5sum );
+	sums->size = p->l.length;
+    }
+    unlink ( tmpfile );
+    if ( r == 0 && e->emd5sum[0] != 0
+		&& strcmp ( e->emd5sum, sums->emd5sum )
+		   != 0 )
+    {
+	printf ( "ERROR: md5sum has changed from %s\n"
+		 "    to %s\n    for %s\n",
+		 e->emd5sum, sums->emd5sum, target );
+	r = -1;
+    }
+
+    /* Find the chunks already in a remote or S3
+     * directory, and copy the others.
+     */
+    if ( r == 0 && ! p->local && p->l.n > 0 )
+    {
+	const char ** names = (const char **)
+	    malloc ( p->l.n * sizeof ( char * ) );
+	p->sums = (char (*)[33])
+	    malloc ( p->l.n * 33 );
+	if ( names == NULL || p->sums == NULL )
+	    error ( ENOMEM );
+	for ( k = 0; k < p->l.n; ++ k )
+	{
+	    line_buffer name;
+	    sprintf ( name, "%s%s.chunk.gpg", p->dir,
+		      p->l.chunks[k].name );
+	    names[k] = strdup ( name );
+	}
+	md5_remote_files ( p->sums, names, p->l.n );
+	for ( k = 0; k < p->l.n; ++ k )
+	{
+	    if ( names[k] == NULL )
+		p->sums[k][0] = 0;
+	    free ( (char *) names[k] );
+	}
+	free ( names );
+    }
+    if ( r == 0 )
+	r = chunk_jobs ( put_chunk, NULL, p, p->l.n );
+
+    /* Copy the manifest last, so it never lists a
+     * chunk that is not there.
+     */
+    if ( r == 0 )
+    {
+	if ( trace )
+	    printf ( "* copying manifest of %s\n"
+		     "*     to %s\n", filename, target );
+	r = delfile ( target );
+	if ( r == 0 ) r = copyfile ( efile, target );
+	if ( r == 0 && ! ( is_s3 ( target )
+			   && s3_builtin() ) )
+	{
+	    r = md5sum ( sum, target );
+	    if ( r == 0
+		 && strcmp ( sum, sums->emd5sum ) != 0 )
+	    {
+		printf ( "ERROR: MD5 sum of %s (%s)\n"
+			 "    does not match that"
+			 " computed while encrypting"
+			 " (%s)\n",
+			 target, sum, sums->emd5sum );
+		r = -1;
+	    }
+	}
+    }
+    unlink ( efile );
+    free ( p->sums );
+    free ( p->l.chunks );
+    free ( p );
+    return r;
+}
+
+/* Decrypt chunk k from p->dir into a temporary file,
+ * and check its MD5 sum.  Run by chunk_jobs.
+ */
+int get_chunk ( void * a, int k )
+{
+    struct chunk_copy * p = (struct chunk_copy *) a;
+    struct chunk * c = p->l.chunks + k;
+    line_buffer name;
+    char tmpfile[64], sum[33];
+
+    sprintf ( name, "%s%s.chunk.gpg", p->dir,
+	      c->name );
+    sprintf ( tmpfile, "EFM-%d-%d.chunk", (int) p->pid,
+	      k );
+    if ( trace )
+	printf ( "* decrypting %s\n", name );
+    if ( decrypt_from ( name, tmpfile, c->key, sum )
+	 < 0 )
+	return -1;
+    if ( strcmp ( sum, c->md5sum ) != 0 )
+    {
+	printf ( "ERROR: MD5 sum of decrypted %s"
+		 " is %s\n", name, sum );
+	return -1;
+    }
+    return 0;
+}
+
+/* Append the decrypted chunk k to the output and its
+ * MD5 sum, and delete it.  Run by chunk_jobs.
+ */
+int got_chunk ( void * a, int k )
+{
+    struct chunk_copy * p = (struct chunk_copy *) a;
+    char tmpfile[64];
+    unsigned char buffer[8192];
+    int fd, n, r = 0;
+
+    sprintf ( tmpfile, "EFM-%d-%d.chunk", (int) p->pid,
+	      k );
+    fd = open ( tmpfile, O_RDONLY );
+    if ( fd < 0 )
+    {
+	printf ( "ERROR: cannot open %s"
+		 " for reading\n", tmpfile );
+	return -1;
+    }
+    while ( r == 0
+	    && ( n = read ( fd, buffer,
+			    sizeof ( buffer ) ) )
+	       != 0 )
+    {
+	if ( n < 0 )
+	{
+	    if ( errno == EINTR ) continue;
+	    error ( errno );
+	}
+	md5_update ( & p->md5, buffer, n );
+	if ( p->outfd >= 0
+	     && write_all ( p->outfd, buffer, n ) < 0 )
+	    r = -1;
+    }
+    close ( fd );
+    unlink ( tmpfile );
+    return r;
+}
+
+/* Decrypt the encrypted manifest source of the chunked
+ * entry e, adding the chunks it lists to the empty
+ * list l.  Return 0 on success and -1 on error, with
+ * error messages written on stdout.
+ */
+int read_manifest ( const char * source,
+		    struct entry * e,
+		    struct chunk_list * l )
+{
+    char tmpfile[64], msum[33];
+    char md5[40], key[40], name[40];
+    int length, r;
+    FILE * f;
+
+    sprintf ( tmpfile, "EFM-%d.manifest",
+	      (int) getpid() );
+    if ( trace )
+	printf ( "* decrypting manifest %s\n",
+		 source );
+    r = decrypt_from ( source, tmpfile, e->key, msum );
+    f = r == 0 ? fopen ( tmpfile, "r" ) : NULL;
+    if ( r == 0 && f == NULL )
+    {
+	printf ( "ERROR: cannot open %s"
+		 " for reading\n", tmpfile );
+	r = -1;
+    }
+    if ( r == 0 )
+    {
+	while ( fscanf ( f, "%39s %d %39s %39s",
+			 md5, & length, key, name )
+		== 4 )
+	{
+	    struct chunk * c = add_chunk ( l );
+	    if (    strlen ( md5 ) != 32
+		 || strlen ( key ) != 32
+		 || strlen ( name ) != 32
+		 || strspn ( name, "0123456789abcdef" )
+		    != 32
+		 || length <= 0
+		 || length > CHUNK_MAX )
+		break;
+	    strcpy ( c->md5sum, md5 );
+	    strcpy ( c->key, key );
+	    strcpy ( c->name, name );
+	    c->length = length;
+	    c->offset = l->length;
+	    l->length += length;
+	}
+	if ( ! feof ( f ) || l->length != e->size )
+	{
+	    printf ( "ERROR: bad manifest %s\n",
+		     source );
+	    r = -1;
+	}
+	fclose ( f );
+    }
+    unlink ( tmpfile );
+    return r;
+}
+
+/* Like decrypt_from, but for the chunked entry e whose
+ * encrypted manifest is source: the chunks listed in
+ * the manifest are fetched from the directory of
+ * source and decrypted CHUNK_JOBS at a time, and the
+ * file is assembled from them in order.
+ */
+int get_chunked ( const char * source,
+		  const char * output,
+		  struct entry * e, char * sum )
+{
+    struct chunk_copy * p = (struct chunk_copy *)
+	calloc ( 1, sizeof ( struct chunk_copy ) );
+    char tmpfile[64], * q;
+    int r, k;
+
+    if ( p == NULL ) error ( ENOMEM );
+    strcpy ( p->dir, source );
+    q = strrchr ( p->dir, '/' );
+    assert ( q != NULL );
+    q[1] = 0;
+    p->pid = getpid();
+    p->outfd = -1;
+
+    r = read_manifest ( source, e, & p->l );
+
+    if ( r == 0 && output != NULL )
+    {
+	p->outfd = open ( output,
+			  O_WRONLY + O_CREAT + O_TRUNC,
+			  S_IWUSR + S_IRUSR );
+	if ( p->outfd < 0 )
+	{
+	    printf ( "ERROR: cannot open %s"
+		     " for writing\n", output );
+	    r = -1;
+	}
+    }
+    if ( r == 0 )
+    {
+	md5_init ( & p->md5 );
+	r = chunk_jobs ( get_chunk, got_chunk,
+			 p, p->l.n );
+	md5_final ( & p->md5, sum );
+    }
+    if ( p->outfd >= 0 && close ( p->outfd ) < 0 )
+	r = -1;
+    for ( k = 0; k < p->l.n; ++ k )
+    {
+	sprintf ( tmpfile, "EFM-%d-%d.chunk",
+		  (int) p->pid, k );
+	unlink ( tmpfile );
+    }
+    free ( p->l.chunks );
+    free ( p );
+    return r;
+}
+
+/* Add a copy of name to the array * names of * n names,
+ * which has room for * max.
+ */
+void add_name ( char *** names, int * n, int * max,
+		const char * name )
+{
+    if ( * n == * max )
+    {
+	* max = ( * max == 0 ? 64 : 2 * * max );
+	* names = (char **) realloc
+	    ( * names, * max * sizeof ( char * ) );
+	if ( * names == NULL ) error ( ENOMEM );
+    }
+    ( * names )[* n] = strdup ( name );
+    if ( ( * names )[( * n ) ++] == NULL )
+	error ( ENOMEM );
+}
+
+/* List the local, remote, or S3 directory dir, which
+ * ends in `/', setting * names to a malloc'ed array of
+ * the malloc'ed names of its files, sorted, and return
+ * their number.  Remote directories are listed by ex-
+ * ecuting ls, and S3 directories by s3cmd ls, whose
+ * objects in subdirectories of dir are skipped.  Re-
+ * turn -1 on error, with error messages written on
+ * stdout.
+ */
+int list_directory ( const char * dir, char *** names )
+{
+    int s3_name = is_s3 ( dir ), n = 0, max = 0, i;
+    size_t length = strlen ( dir );
+    line_buffer account, line;
+    const char * path;
+    int fd[2];
+    pid_t child;
+    FILE * inf;
+
+    * names = NULL;
+    strcpy ( account, dir );
+    path = is_remote ( account );
+    if ( ! s3_name && path == NULL )
+    {
+	DIR * d = opendir ( dir );
+	struct dirent * de;
+	if ( d == NULL )
+	{
+	    printf ( "ERROR: cannot read directory"
+		     " %s\n", dir );
+	    return -1;
+	}
+	while ( ( de = readdir ( d ) ) != NULL )
+	{
+	    if ( strcmp ( de->d_name, "." ) != 0
+		 && strcmp ( de->d_name, ".." ) != 0 )
+		add_name ( names, & n, & max,
+			   de->d_name );
+	}
+	closedir ( d );
+	qsort ( * names, n, sizeof ( char * ),
+		compare_names );
+	return n;
+    }
+
+    if ( trace )
+    {
+	if ( s3_name && s3_builtin() )
+	    printf ( "* built-in S3 listing of %s\n",
+		     dir );
+	else if ( s3_name )
+	    printf ( "* executing s3cmd ls %s\n", dir );
+	else
+	    printf ( "* executing ssh ls of %s\n", dir );
+    }
+    fflush ( stdout );
+    fflush ( stderr );
+    if ( s3_name && setup_s3_pipe() < 0 )
+	return -1;
+    if ( pipe ( fd ) < 0 ) error ( errno );
+
+    child = fork();
+    if ( child < 0 )
+    {
+	int saved_errno = errno;
+	if ( s3_name )
+	    unlink ( s3_pipe );
+	error ( saved_errno );
+    }
+
+    if ( child == 0 )
+    {
+	int newfd, d;
+
+	close ( fd[0] );
+
+	/* Set fd's as follows:
+	 * 	0 -> /dev/null
+	 *	1 -> fd[1]
+	 *	2 -> parent's fd 1
+	 */
+	newfd = open ( "/dev/null", O_RDONLY );
+	if ( newfd < 0 ) error ( errno );
+	close ( 0 );
+	if ( dup2 ( newfd, 0 ) < 0 )
+	    error ( errno );
+	close ( newfd );
+	close ( 2 );
+	if ( dup2 ( 1, 2 ) < 0 )
+	    error ( errno );
+	close ( 1 );
+	if ( dup2 ( fd[1], 1 ) < 0 )
+	    error ( errno );
+	close ( fd[1] );
+	d = getdtablesize() - 1;
+	while ( d > 2 ) close ( d -- );
+
+	if ( s3_name )
+	{
+	    if ( s3_builtin() )
+		exit ( s3_list_md5 ( dir ) < 0 );
+	    execlp ( "s3cmd", "s3cmd",
+		     "-c", s3_pipe, "ls", dir,
+		     NULL );
+	    exit ( 1 );
+	}
+	else
+	{
+	    const char * args[5];
+	    * (char *) path = 0;
+	    args[0] = account;
+	    args[1] = "ls";
+	    args[2] = "-a";
+	    args[3] = path[1] != 0 ? path + 1 : ".";
+	    args[4] = NULL;
+	    exec_ssh ( "ssh", args );
+	}
+    }
+
+    close ( fd[1] );
+    inf = fdopen ( fd[0], "r" );
+    if ( s3_name ) write_s3_pipe();
+
+    /* Ls output lines are names, and s3cmd ls lines
+     * are `DATE TIME SIZE NAME' where NAME begins with
+     * s3://, or `DIR NAME' for a subdirectory.
+     */
+    while ( get_line ( line, inf ) )
+    {
+	char * name = line;
+	if ( s3_name )
+	{
+	    name = strstr ( line, " s3://" );
+	    if ( name == NULL
+		 || strncmp ( ++ name, dir, length )
+		    != 0 )
+		continue;
+	    name += length;
+	    if ( name[0] == 0
+		 || strchr ( name, '/' ) != NULL )
+		continue;
+	}
+	else if ( strcmp ( name, "." ) == 0
+		  || strcmp ( name, ".." ) == 0 )
+	    continue;
+	add_name ( names, & n, & max, name );
+    }
+
+    fclose ( inf );
+    if ( s3_name ) unlink ( s3_pipe );
+    if ( cwait ( child ) < 0 )
+    {
+	printf ( "ERROR: cannot list %s\n", dir );
+	for ( i = 0; i < n; ++ i ) free ( ( * names )[i] );
+	free ( * names );
+	* names = NULL;
+	return -1;
+    }
+    qsort ( * names, n, sizeof ( char * ),
+	    compare_names );
+    return n;
+}
+
+/* Delete the chunks in dir, which ends in `/', that
+ * are not listed in the manifest in dir of any chunked
+ * entry, current or obsolete.  If a manifest in dir
+ * cannot be read, no chunk is deleted.  Return 0 on
+ * success and -1 on error, with error messages written
+ * on stdout.
+ */
+int collect_chunks ( const char * dir )
+{
+    char ** names, ** found;
+    char * used;
+    struct entry * e = first_entry;
+    int n = list_directory ( dir, & names );
+    int r = 0, deleted = 0, i, k;
+
+    if ( n < 0 ) return -1;
+    used = (char *) calloc ( n + 1, 1 );
+    if ( used == NULL ) error ( ENOMEM );
+
+    /* Mark the manifests read and the chunks they
+     * list.
+     */
+    if ( e ) do
+    {
+	struct chunk_list l;
+	line_buffer name;
+	char * p = name;
+
+	if ( ! e->chunked ) continue;
+	sprintf ( name, "%s.gpg", e->md5sum );
+	found = (char **)
+	    bsearch ( & p, names, n, sizeof ( char * ),
+		      compare_names );
+	if ( found == NULL || used[found - names] )
+	    continue;
+	used[found - names] = 1;
+	memset ( & l, 0, sizeof ( l ) );
+	sprintf ( name, "%s%s.gpg", dir, e->md5sum );
+	if ( read_manifest ( name, e, & l ) < 0 )
+	{
+	    printf ( "ERROR: no chunks deleted from"
+		     " %s\n", dir );
+	    free ( l.chunks );
+	    r = -1;
+	    break;
+	}
+	for ( k = 0; k < l.n; ++ k )
+	{
+	    sprintf ( name, "%s.chunk.gpg",
+		      l.chunks[k].name );
+	    found = (char **)
+		bsearch ( & p, names, n,
+			  sizeof ( char * ),
+			  compare_names );
+	    if ( found != NULL )
+		used[found - names] = 1;
+	}
+	free ( l.chunks );
+    } while ( ( e = e->next ) != first_entry );
+
+    for ( i = 0; i < n; ++ i )
+    {
+	line_buffer name;
+	const char * p = names[i];
+	if ( r == 0 && ! used[i]
+		    && strlen ( p ) == 42
+		    && strspn ( p, "0123456789abcdef" )
+		       == 32
+		    && strcmp ( p + 32, ".chunk.gpg" )
+		       == 0 )
+	{
+	    sprintf ( name, "%s%s", dir, p );
+	    if ( trace )
+		printf ( "* deleting %s\n", name );
+	    if ( delfile ( name ) < 0 )
+		r = -1;
+	    else
+		++ deleted;
+	}
+	free ( names[i] );
+    }
+    free ( names );
+    free ( used );
+    if ( r == 0 || deleted > 0 )
+	printf ( "efm gc: %d unused chunks deleted"
+		 " from %s\n", deleted, dir );
+    return r;
+}
+
+/* Return 0 if filename may be used as an index entry
+ * filename, and -1 with an error message written on
+ * stdout if it contains a '/' or linefeed.
+ */
+int check_filename ( const char * filename )
+{
+    const char * p = filename;
+    for ( ; * p; ++ p )
+    {
+        if ( * p == '/' )
+	{
+	    printf ( "ERROR: filename contains '/':"
+	             " %s\n", filename );
+	    return -1;
+	}
+        if ( * p == '\n' )
+	{
+	    printf ( "ERROR: filename contains"
+	             " linefeed: %s\n", filename );
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* Make a current index entry for the file with the
+ * given stat, MD5 sum, and key, and link it into the
+ * index.  The encrypted file size and MD5 sum are left
+ * unknown.  Return the new entry.
+ */
+struct entry * add_entry ( const char * filename,
+			   const struct stat * st,
+			   const char * sum,
+			   const char * key )
+{
+    struct entry * e = (struct entry *)
+	malloc ( sizeof ( struct entry ) );
+    e->current  = 1;
+    e->filename = strdup ( filename );
+    e->mode     = st->st_mode & 07777;
+    e->mtime    = st->st_mtime;
+    e->size     = st->st_size;
+    e->md5sum   = strdup ( sum );
+
+    e->emd5sum  = strdup ( "" );
+    e->esize    = 0;
+    e->codec    = compression;
+    e->chunked  = 0;
+
+    e->key      = strdup ( key );
+    e->modified = 1;
+
+    if ( first_entry == NULL )
+	first_entry = e->previous = e->next = e;
+    else
+    {
+	e->previous = first_entry->previous;
+	e->next = first_entry;
+	e->previous->next = e->next->previous = e;
+    }
+    hash_entry ( e );
+    index_modified = 1;
+    if ( trace )
+    {
+	printf ( "* added index entry:\n" );
+	write_index_entry ( stdout, e, 7, "* " );
+    }
+    return e;
+}
+
+/* Add file entry to index, using fresh_key as its key if
+ * no other entry has the same MD5 sum.  Return -1 on
+ * error, 0 on success.
+ */
+int add ( const char * filename, const char * fresh_key )
+{
+    struct entry * e;
+    char sum [33];
+    struct stat st;
+    char key[33];
+
+    if ( check_filename ( filename ) < 0 ) return -1;
+    if ( find_filename ( filename ) )
+    {
+        printf ( "ERROR: index entry already exists"
+	         " for %s\n", filename );
+	return -1;
+    }
+
+    if ( stat ( filename, & st ) < 0 )
+    {
+        printf ( "ERROR: cannot stat %s\n", filename );
+	return -1;
+    }
+
+    if ( md5_plain_files ( & sum, & filename, 1 ) < 0 )
+	return -1;
+    e = find_md5sum ( sum, 1 );
+    if ( e != NULL )
+    {
+        printf ( "ERROR: cannot make index entry for"
+	         " %s\n    as it has the same MD5 sum"
+		 " as existing entry for %s\n",
+		 filename, e->filename );
+	return -1;
+    }
+
+
+    e = find_md5sum ( sum, 0 );
+    if ( e != NULL )
+        strcpy ( key, e->key );
+    else
+	strcpy ( key, fresh_key );
+
+    add_entry ( filename, & st, sum, key );
+    return 0;
+}
+
+/* Subtract file entry from index.  Return -1 on error,
+ * 0 on success.
+ */
+int sub ( const char * filename )
+{
+    struct entry * e = find_filename ( filename );
+    struct removal * r;
+    if ( e == NULL )
+    {
+        printf ( "ERROR: subtracting nonexistent file:"
+	         " %s\n", filename );
+	return -1;
+    }
+    if ( trace )
+    {
+        printf ( "* removing index entry:\n" );
+	write_index_entry ( stdout, e, 7, "* " );
+    }
+    r = (struct removal *)
+	malloc ( sizeof ( struct removal ) );
+    r->filename = strdup ( filename );
+    r->next = first_removal;
+    first_removal = r;
+    remove_entry ( e );
+    index_modified = 1;
+    return 0;
+}
+
+/* Encrypt filename for copyto or moveto, making or
+ * remaking its index entry as necessary, and set
+ * * entry to the entry.  The encrypted file is left in
+ * the current directory as MMMM.gpg, where MMMM is the
+ * MD5 sum of filename, with user-only read-only mode.
+ *
+ * If md5sum is not NULL it is the MD5 sum of filename,
+ * and the file is not encrypted unless the entry is
+ * current and has a known encrypted MD5 sum.  Instead
+ * the entry is left with esize 0 and emd5sum "", so
+ * the file can be encrypted as it is copied to its
+ * target by encrypt_to.  A new entry made this way is
+ * chunked if chunking is on, and a chunked entry is
+ * never encrypted here but by put_chunked.
+ *
+ * The file is encrypted to a temporary name while its
+ * MD5 sum, size, and encrypted MD5 sum and size are
+ * computed in the same pass; until the MD5 sum is
+ * known the final name is not.  An existing current
+ * entry supplies the key and codec.  Otherwise the
+ * codec is compression, any obsolete entry for file-
+ * name is removed, and a new entry is made; if an
+ * obsolete entry for another file has the same MD5
+ * sum, its key must be reused, and in this rare case
+ * the file is encrypted a second time.
+ *
+ * Return 0 on success and -1 on error, with error
+ * messages written on stdout.
+ */
+int encrypt_entry ( const char * filename,
+		    struct entry ** entry,
+		    const char * md5sum )
+{
+    struct entry * e = find_filename ( filename );
+    struct entry * f;
+    struct stat st;
+    struct crypt_sums sums;
+    char tmpfile[64], efile[64], key[33];
+    int stream, codec;
+
+    if ( stat ( filename, & st ) < 0 )
+    {
+	printf ( "ERROR: file not found: %s\n",
+		 filename );
+	return -1;
+    }
+    if ( access ( filename, R_OK ) < 0 )
+    {
+	printf ( "ERROR: file %s is not"
+		 " readable\n", filename );
+	return -1;
+    }
+    if ( e == NULL && check_filename ( filename ) < 0 )
+	return -1;
+
+    if ( e != NULL && e->current )
+    {
+	strcpy ( key, e->key );
+	codec = e->codec;
+    }
+    else
+    {
+	newkey ( key );
+	codec = compression;
+    }
+
+    if ( e != NULL && e->current && e->chunked
+		   && md5sum == NULL )
+    {
+	printf ( "ERROR: chunked %s cannot be copied"
+		 " to \".\"\n", filename );
+	return -1;
+    }
+    stream = ( md5sum != NULL
+	       &&
+	       (    e == NULL || ! e->current
+		 || e->emd5sum[0] == 0
+		 || e->chunked ) );
+    sprintf ( tmpfile, "EFM-%d.gpg", (int) getpid() );
+    if ( stream )
+    {
+	strcpy ( sums.md5sum, md5sum );
+	sums.size = st.st_size;
+    }
+    else
+    {
+	if ( trace )
+	    printf ( "* encrypting %s\n"
+		     "*     to make %s\n",
+		     filename, tmpfile );
+	unlink ( tmpfile );
+	if ( encrypt_file ( filename, tmpfile, key,
+			    codec, & sums )
+	     < 0 )
 	{
-	    int saved_errno = errno;
-	    if ( s3_source || s3_target )
-	        unlink ( "EFM-S3CONFIG.pipe" );
-	    error ( saved_errno );
+	    printf ( "ERROR: could not encrypt %s\n",
+		     filename );
+	    unlink ( tmpfile );
+	    return -1;
 	}
+    }
 
-	if ( child == 0 )
+    if ( e != NULL && e->current )
+    {
+	if ( strcmp ( sums.md5sum, e->md5sum ) != 0 )
 	{
-	    int newfd, d;
+	    printf ( "ERROR: MD5 sum %s\n"
+		     "    of existing file %s\n"
+		     "    does not match the MD5 sum"
+		     " %s in the index\n",
+		     sums.md5sum, filename,
+		     e->md5sum );
+	    unlink ( tmpfile );
+	    return -1;
+	}
+    }
+    else
+    {
+	f = find_md5sum ( sums.md5sum, 1 );
+	if ( f != NULL )
+	{
+	    printf ( "ERROR: cannot %s index entry"
+		     " for %s\n"
+		     "    as it would have the same"
+		     " MD5 sum as the existing"
+		     " current entry\n"
+		     "    for %s\n",
+		     e == NULL ? "make" : "remake",
+		     filename, f->filename );
+	    unlink ( tmpfile );
+	    return -1;
+	}
+	if ( e != NULL ) sub ( filename );
 
-	    /* Set fd's as follows:
-	     * 	0 -> /dev/null
-	     *	1 -> parent's fd 1
-	     *	2 -> parent's fd 1
-	     */
-	    newfd = open ( "/dev/null", O_RDONLY );
-	    if ( newfd < 0 ) error ( errno );
-	    close ( 0 );
-	    if ( dup2 ( newfd, 0 ) < 0 )
-	    	error ( errno );
-	    close ( newfd );
-	    close ( 2 );
-	    if ( dup2 ( 1, 2 ) < 0 )
-	    	error ( errno );
-	    d = getdtablesize() - 1;
-	    while ( d > 2 ) close ( d -- );
+	f = find_md5sum ( sums.md5sum, 0 );
+	if ( f != NULL && stream )
+	    strcpy ( key, f->key );
+	else if ( f != NULL )
+	{
+	    struct crypt_sums again;
 
-	    if ( s3_source )
-	    {
-		if ( s3_target)
-		{
-		    printf ( "ERROR: both source %s\n"
-		             "       and target %s\n"
-			     "       of file copy are"
-			     " S3\n",
-			     source, target );
-		    exit ( 1 );
-		}
-		else if ( is_remote ( target ) )
-		{
-		    printf ( "ERROR: attempt to copy S3"
-		             " source %s\n"
-		             "       to remote target"
-			     " %s\n",
-			     source, target );
-		    exit ( 1 );
-		}
-		 
-		if ( trace )
-		{
-		    fprintf ( stderr,
-			      "* executing s3cmd"
-			      " get %s \\\n"
-			      "                 "
-			      "     %s\n",
-			      source, target );
-		    fflush ( stderr );
-		}
-		execlp ( "s3cmd", "s3cmd",
-		         "-c", "EFM-S3CONFIG.pipe",
-			 // trace ? "-v" : "-q",
-		         "get", source, target,
-			 NULL );
-		int saved_errno = errno;
-		unlink ( "EFM-S3CONFIG.pipe" );
-		error ( saved_errno );
-	    }
-	    else if ( s3_target )
+	    strcpy ( key, f->key );
+	    if ( trace )
+		printf ( "* re-encrypting %s with"
+			 " the key of\n"
+			 "*     obsolete entry %s\n",
+			 filename, f->filename );
+	    if ( encrypt_file ( filename, tmpfile, key,
+				codec, & again )
+		 < 0 )
 	    {
-		if ( is_remote ( target ) )
-		{
-		    printf ( "ERROR: attempt to copy"
-		             " remote source %s\n"
-		             "       to S3 target"
-			     " %s\n",
-			     source, target );
-		    exit ( 1 );
-		}
-		 
-		if ( trace )
-		{
-		    fprintf ( stderr,
-			      "* executing s3cmd"
-			      " put %s \\\n"
-			      "                 "
-			      "     %s\n",
-			      source, target );
-		    fflush ( stderr );
-		}
-		execlp ( "s3cmd", "s3cmd",
-		         "-c", "EFM-S3CONFIG.pipe",
-			 // trace ? "-v" : "-q",
-		         "put", source, target,
-			 NULL );
-		int saved_errno = errno;
-		unlink ( "EFM-S3CONFIG.pipe" );
-		error ( saved_errno );
+		printf ( "ERROR: could not encrypt"
+			 " %s\n", filename );
+		unlink ( tmpfile );
+		return -1;
 	    }
-	    else
+	    if ( strcmp ( again.md5sum, sums.md5sum )
+		 != 0 )
 	    {
-		if ( trace )
-		{
-		    fprintf ( stderr,
-			      "* executing scp -p"
-			      " %s \\\n"
-			      "                   %s\n",
-			      source, target );
-		    fflush ( stderr );
-		}
-		if ( execlp ( "scp", "scp", "-p",
-			      source, target, NULL )
-		     < 0 )
-		    error ( errno );
+		printf ( "ERROR: %s changed while"
+			 " being encrypted\n",
+			 filename );
+		unlink ( tmpfile );
+		return -1;
 	    }
+	    sums = again;
+	}
+
+	if ( sums.size != st.st_size )
+	{
+	    printf ( "ERROR: %s changed while"
+		     " being encrypted\n",
+		     filename );
+	    unlink ( tmpfile );
+	    return -1;
+	}
+	e = add_entry ( filename, & st, sums.md5sum,
+			key );
+	e->chunked = stream && chunking;
+    }
+
+    if ( stream )
+    {
+	* entry = e;
+	return 0;
+    }
+
+    sprintf ( efile, "%s.gpg", e->md5sum );
+    if ( e->esize == 0 )
+    {
+	e->esize = sums.esize;
+	e->modified = 1;
+	index_modified = 1;
+    }
+    else if ( e->esize != sums.esize )
+    {
+	printf ( "ERROR: esize has changed from %llu"
+		 " to %llu\n    for %s\n",
+		 (unsigned long long) e->esize,
+		 (unsigned long long) sums.esize,
+		 efile );
+	unlink ( tmpfile );
+	return -1;
+    }
+    if ( e->emd5sum[0] == 0 )
+    {
+	free_field ( e->emd5sum );
+	e->emd5sum = strdup ( sums.emd5sum );
+	e->modified = 1;
+	index_modified = 1;
+    }
+    else if ( strcmp ( sums.emd5sum, e->emd5sum ) != 0 )
+    {
+	printf ( "ERROR: md5sum has changed from %s\n"
+		 "    to %s\n    for %s\n",
+		 e->emd5sum, sums.emd5sum, efile );
+	unlink ( tmpfile );
+	return -1;
+    }
+
+    if ( trace )
+	printf ( "* changing mode of %s\n"
+		 "*     to user-only read-only\n"
+		 "* renaming it to %s\n",
+		 tmpfile, efile );
+    if ( chmod ( tmpfile, S_IRUSR ) < 0 )
+    {
+	printf ( "ERROR: cannot chmod %s\n", tmpfile );
+	unlink ( tmpfile );
+	return -1;
+    }
+    if ( rename ( tmpfile, efile ) < 0 )
+    {
+	printf ( "ERROR: cannot rename %s to %s\n",
+		 tmpfile, efile );
+	unlink ( tmpfile );
+	return -1;
+    }
+    * entry = e;
+    return 0;
+}
+
+/* Make index entry name for the tar archive of direc-
+ * tory (see open_archive), and encrypt the archive to
+ * the directory target, which must have room for the
+ * name of the encrypted file to be appended to it, as
+ * moveto does for a file.  The archive is not written
+ * locally.  As the encrypted file is named by the MD5
+ * sum of the archive, the archive is made once to
+ * compute that sum and again to encrypt it, and it is
+ * an error if they differ.  Return -1 on error, 0 on
+ * success.
+ */
+int archive ( const char * name,
+	      const char * directory, char * target )
+{
+    struct entry * e = find_filename ( name );
+    struct crypt_sums sums;
+    struct stat st;
+    struct md5 m;
+    struct timing t;
+    char sum[33], key[33], efile[40], target_sum[33];
+    unsigned char * buffer;
+    unsigned long long size = 0;
+    time_t now = time ( NULL );
+    pid_t child;
+    int fd, r;
+
+    if ( check_filename ( name ) < 0 ) return -1;
+    if ( e != NULL && e->current )
+    {
+	printf ( "ERROR: index entry already exists"
+		 " for %s\n", name );
+	return -1;
+    }
+    if ( stat ( directory, & st ) < 0
+	 || ! S_ISDIR ( st.st_mode ) )
+    {
+	printf ( "ERROR: %s is not a directory\n",
+		 directory );
+	return -1;
+    }
+
+    if ( trace )
+	printf ( "* computing MD5 sum of the archive"
+		 " of %s\n", directory );
+    buffer = (unsigned char *)
+	malloc ( PGP_BUFFER_SIZE );
+    if ( buffer == NULL ) error ( ENOMEM );
+    start_stage ( & t );
+    md5_init ( & m );
+    fd = open_archive ( directory, & child );
+    while ( ( r = read ( fd, buffer, PGP_BUFFER_SIZE ) )
+	    != 0 )
+    {
+	if ( r < 0 && errno == EINTR ) continue;
+	if ( r < 0 ) error ( errno );
+	md5_update ( & m, buffer, r );
+	size += r;
+    }
+    close ( fd );
+    free ( buffer );
+    md5_final ( & m, sum );
+    end_stage ( & t, HASH_STAGE, size );
+    if ( cwait ( child ) < 0 )
+    {
+	printf ( "ERROR: could not archive %s\n",
+		 directory );
+	return -1;
+    }
+
+    e = find_md5sum ( sum, 1 );
+    if ( e != NULL )
+    {
+	printf ( "ERROR: cannot make index entry for"
+		 " %s\n    as it has the same MD5 sum"
+		 " as existing entry for %s\n",
+		 name, e->filename );
+	return -1;
+    }
+    e = find_md5sum ( sum, 0 );
+    if ( e != NULL )
+	strcpy ( key, e->key );
+    else
+	newkey ( key );
+
+    sprintf ( efile, "%s.gpg", sum );
+    strcat ( target, "/" );
+    strcat ( target, efile );
+    if ( trace )
+	printf ( "* encrypting the archive of %s\n"
+		 "*     to make %s\n",
+		 directory, target );
+    r = encrypt_to ( name, directory, target, key,
+		     compression, & sums );
+    if ( r < 0 )
+    {
+	printf ( "ERROR: could not encrypt %s\n",
+		 name );
+	return -1;
+    }
+    if ( strcmp ( sums.md5sum, sum ) != 0
+	 || sums.size != size )
+    {
+	printf ( "ERROR: %s changed while"
+		 " being archived\n", directory );
+	return -1;
+    }
+    if ( is_s3 ( target ) && s3_builtin() )
+    {
+	if ( trace )
+	    printf ( "* MD5 sum of %s\n"
+		     "*     checked by S3\n",
+		     target );
+    }
+    else
+    {
+	if ( trace )
+	    printf ( "* comparing MD5 sum of %s\n"
+		     "*     with that computed while"
+		     " encrypting\n", target );
+	if ( md5sum ( target_sum, target ) < 0 )
+	    return -1;
+	if ( strcmp ( sums.emd5sum, target_sum ) != 0 )
+	{
+	    printf ( "ERROR: MD5 sum of %s (%s)\n"
+		     "    does not match that"
+		     " computed while encrypting"
+		     " (%s)\n",
+		     target, target_sum,
+		     sums.emd5sum );
+	    return -1;
 	}
+    }
+
+    /* The entry is that moveto would make for a user-
+     * only read-only file made now.
+     */
+    if ( find_filename ( name ) != NULL ) sub ( name );
+    st.st_mode = S_IFREG + S_IRUSR;
+    st.st_mtime = now;
+    st.st_size = size;
+    e = add_entry ( name, & st, sum, key );
+    e->esize = sums.esize;
+    free_field ( e->emd5sum );
+    e->emd5sum = strdup ( sums.emd5sum );
+    printf ( "ARCHIVED: %s\n", name );
+    return 0;
+}
+
+
+/* Efm and the background process exchange frames,
+ * each a type byte, a 4 byte big-endian payload
+ * length, and the payload.  Efm sends a COMMAND_FRAME
+ * for each command, whose payload is the arguments of
+ * the command, each followed by a NUL.  For each com-
+ * mand, in the order sent, the background process
+ * replies with a BEGIN_FRAME holding the 4 byte pro-
+ * cess group of the process serving the command, to
+ * which efm routes signals, OUTPUT_FRAMEs holding all
+ * that the command writes on the standard output, and
+ * an END_FRAME holding its 4 byte exit status.  Efm
+ * may send several commands on one connection without
+ * waiting for replies; they are served one at a time.
+ */
+#define FRAME_HEADER 5
+#define COMMAND_FRAME 'C'
+#define BEGIN_FRAME 'B'
+#define OUTPUT_FRAME 'O'
+#define END_FRAME 'E'
+
+/* The arguments of a command being served.  Next is
+ * the offset in data of the next argument.
+ */
+struct request {
+    char * data;
+    size_t length, next;
+};
 
-	if ( s3_source || s3_target )
-	    write_s3_pipe();
+/* As write_all, but without an error message, as the
+ * other end of a connection may have gone away.
+ */
+int send_all ( int fd, const void * buffer, size_t n )
+{
+    const char * p = (const char *) buffer;
+    while ( n > 0 )
+    {
+	ssize_t r = write ( fd, p, n );
+	if ( r < 0 && errno == EINTR ) continue;
+	if ( r < 0 ) return -1;
+	p += r;
+	n -= r;
+    }
+    return 0;
+}
 
-	if ( cwait ( child ) < 0 )
+int write_frame ( int fd, int type,
+		  const void * data, size_t length )
+{
+    unsigned char header[FRAME_HEADER];
+    header[0] = type;
+    put_be ( header + 1, length, 4 );
+    if ( send_all ( fd, header, FRAME_HEADER ) < 0
+	 || send_all ( fd, data, length ) < 0 )
+	return -1;
+    return 0;
+}
+
+/* Write the 4 byte value as the payload of a frame. */
+
+int write_value_frame ( int fd, int type,
+			uint32_t value )
+{
+    unsigned char payload[4];
+    put_be ( payload, value, 4 );
+    return write_frame ( fd, type, payload, 4 );
+}
+
+/* Read n bytes from fd.  Return 1 on success, 0 on
+ * end of file before any byte, and -1 on error or end
+ * of file after some but not all bytes.
+ */
+int read_all ( int fd, void * buffer, size_t n )
+{
+    char * p = (char *) buffer;
+    while ( n > 0 )
+    {
+	ssize_t r = read ( fd, p, n );
+	if ( r < 0 && errno == EINTR ) continue;
+	if ( r <= 0 )
+	    return r == 0 && p == (char *) buffer ?
+		   0 : -1;
+	p += r;
+	n -= r;
+    }
+    return 1;
+}
+
+/* Read a COMMAND_FRAME from fd into request.  Return 0
+ * on success and -1 on error.
+ */
+int read_request ( int fd, struct request * request )
+{
+    unsigned char header[FRAME_HEADER];
+
+    if ( read_all ( fd, header, FRAME_HEADER ) <= 0
+	 || header[0] != COMMAND_FRAME )
+	return -1;
+    request->length = get_be ( header + 1, 4 );
+    request->next = 0;
+    request->data = (char *)
+	malloc ( request->length + 1 );
+    if ( request->data == NULL ) error ( ENOMEM );
+    if ( read_all ( fd, request->data,
+		    request->length ) < 0 )
+    {
+	free ( request->data );
+	return -1;
+    }
+    request->data[request->length] = 0;
+    return 0;
+}
+
+/* Copy what is written on the pipe in to connection
+ * fd as OUTPUT_FRAMEs until control is closed, and
+ * then copy what remains in the pipe.  Control is
+ * needed as descendants of the command may keep the
+ * pipe open after the command is done.
+ */
+void run_framer ( int in, int control, int fd )
+{
+    static char buffer[PGP_BUFFER_SIZE];
+    struct pollfd fds[2];
+    int done = 0;
+
+    fds[0].fd = in;
+    fds[0].events = POLLIN;
+    fds[1].fd = control;
+    fds[1].events = POLLIN;
+    while ( 1 )
+    {
+	ssize_t r;
+
+	if ( ! done
+	     && poll ( fds, 2, -1 ) < 0 )
 	{
-	    if ( s3_source || s3_target )
-	        unlink ( "EFM-S3CONFIG.pipe" );
-	    if ( retries -- )
-	    {
-		printf ( "RETRYING scp -p %s \\\n"
-			 "                %s\\n",
-			 source, target );
-	    }
-	    else return -1;
+	    if ( errno == EINTR ) continue;
+	    error ( errno );
 	}
+	if ( ! done && fds[1].revents != 0 )
+	{
+	    done = 1;
+	    if ( fcntl ( in, F_SETFL, O_NONBLOCK ) < 0 )
+		error ( errno );
+	}
+	if ( ! done && fds[0].revents == 0 ) continue;
 
-	if ( s3_source || s3_target )
-	    unlink ( "EFM-S3CONFIG.pipe" );
-	return 0;
+	r = read ( in, buffer, sizeof ( buffer ) );
+	if ( r < 0 && errno == EINTR ) continue;
+	if ( r <= 0 ) break;
+	if ( write_frame ( fd, OUTPUT_FRAME, buffer, r )
+	     < 0 )
+	    break;
     }
 }
 
-/* Delete file.  0 is returned on success, -1 on error.
- * Error messages are written on stdout.  The filename
- * may have the format acceptable to scp, and must
- * not be longer than MAX_LEXEME_SIZE.  If filename is
- * remote (has @ and :) then RETRIES retries are done on
- * failure.
+/* Copy the next argument of the request into
+ * line_buffer.  Return a pointer to the NUL termi-
+ * nated argument, or NULL if there is no argument.
+ * If more arguments are gotten than are available,
+ * NULL is returned repeatedly.
  */
-int delfile ( const char * filename )
+char * get_argument ( line_buffer buffer,
+		      struct request * in )
 {
-    int at_found, child;
-    char * p;
-    line_buffer name;
-    int retries = RETRIES;
-    int s3_file = is_s3 ( filename );
+    char * arg;
+    size_t length;
 
-    strcpy ( name, filename );
-    p = (char *) is_remote ( name );
-    if ( ! s3_file && ! p )
+    if ( in->next >= in->length ) return NULL;
+    arg = in->data + in->next;
+    length = strlen ( arg );
+    in->next += length + 1;
+    if ( length > MAX_LEXEME_SIZE )
     {
-        /* Not a remote file. */
-	if ( unlink ( filename ) < 0
-	     &&
-	     errno != ENOENT )
+	printf ( "ERROR: argument too long:"
+		 " %.40s...\n", arg );
+	in->next = in->length;
+	return NULL;
+    }
+    memcpy ( buffer, arg, length + 1 );
+    return buffer;
+}
+
+/* Get all the remaining arguments from the input
+ * stream.  Return a malloc'ed vector of n malloc'ed
+ * strings; free_arguments frees it.
+ */
+char ** get_arguments ( line_buffer buffer,
+			struct request * in, int * n )
+{
+    char ** args = NULL;
+    char * arg;
+    int max = 0;
+
+    * n = 0;
+    while ( arg = get_argument ( buffer, in ) )
+    {
+	if ( * n == max )
 	{
-	    const char * s = strerror ( errno );
-	    printf ( "ERROR: %s\n", s );
-	    printf ( "    could not delete %s\n",
-	             filename );
-	    return -1;
+	    max = ( max == 0 ? 64 : 2 * max );
+	    args = (char **)
+		realloc ( args, max * sizeof ( char * ) );
+	    if ( args == NULL ) error ( ENOMEM );
 	}
-	else
-	    return 0;
+	args[(* n) ++] = strdup ( arg );
     }
+    return args;
+}
 
-    /* Now name points at account and p at file
-     * within account.
+void free_arguments ( char ** args, int n )
+{
+    while ( n > 0 ) free ( args[-- n] );
+    free ( args );
+}
+
+/* MD5 sums of local files computed by md5_files before
+ * they are needed, so that the files of one command
+ * are hashed together.  If names[i] is NULL, sums[i]
+ * was not computed.
+ */
+struct md5_batch {
+    const char ** names;
+    char (* sums)[33];
+};
+
+/* Return in buffer the MD5 sum of filename, which is
+ * taken from batch entry i if that was computed, and
+ * otherwise is computed by md5sum.  Return 0 on
+ * success and -1 on error, as md5sum does.  Error
+ * messages for batch entries were written by md5_-
+ * files.
+ */
+int batch_md5sum ( char * buffer, struct md5_batch * b,
+		   int i, const char * filename )
+{
+    if ( b->names[i] == NULL )
+	return md5sum ( buffer, filename );
+    if ( b->sums[i][0] == 0 ) return -1;
+    strcpy ( buffer, b->sums[i] );
+    return 0;
+}
+
+/* State shared by the files of one copyto, copyfrom,
+ * moveto, movefrom, remove, check, md5check, or del
+ * command.
+ */
+struct file_command {
+    char op;		/* m, c, r, d, k (check), or
+			   s (md5check). */
+    char direction;	/* t (to) or f (from). */
+    int current_directory;
+			/* 1 if directory is ".". */
+    char * dbegin, * dend;
+			/* Directory name followed by
+			   '/'; dend points after the
+			   '/'. */
+    int nargs;
+    struct md5_batch batch;
+    struct crypt_sums * sums;
+			/* Sums[i] is set when args[i]
+			   is encrypted by encrypt_to,
+			   and otherwise has esize 0. */
+};
+
+/* Prepare to process args[i] of a file command: find
+ * its index entry, and on copyto or moveto encrypt
+ * the file into the current directory if the target
+ * directory is ".".  Otherwise the file is encrypted
+ * by transfer_file as it is copied to the target.
+ * Set * entry to the entry.  This is done by the
+ * parent process as it may change the index.  Return
+ * 0 on success and -1 if processing of the file is
+ * aborted.
+ */
+int prepare_file ( struct file_command * c, int i,
+		   const char * arg,
+		   struct entry ** entry )
+{
+    struct entry * e = find_filename ( arg );
+    char direction = c->direction;
+
+    /* On copyto or moveto, encrypt the file,
+     * making or remaking its index entry
+     * as necessary.
      */
+    if ( direction == 't' )
+    {
+	char sum[33];
+	const char * md5 = NULL;
+	if (    ! c->current_directory
+	     && c->batch.names[i] != NULL )
+	{
+	    if ( batch_md5sum ( sum, & c->batch,
+				i, arg )
+		 < 0 )
+	    {
+		printf ( "    Processing %s"
+			 " aborted.\n", arg );
+		return -1;
+	    }
+	    md5 = sum;
+	}
+	if ( encrypt_entry ( arg, & e, md5 ) < 0 )
+	{
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    return -1;
+	}
+    }
+    else if ( e == NULL )
+    {
+	printf ( "ERROR: no index entry"
+		 " exists for %s\n",
+		 arg );
+	printf ( "    Processing %s"
+		 " aborted.\n", arg );
+	return -1;
+    }
+    else if ( access ( arg, R_OK ) >= 0 )
+    {
+	char sum [33];
+	if ( batch_md5sum ( sum, & c->batch,
+			    i, arg )
+	     < 0 )
+	{
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    return -1;
+	}
+	if ( strcmp ( sum, e->md5sum )
+	     != 0 )
+	{
+	    printf ( "ERROR: MD5 sum %s\n"
+		     "    of existing file"
+		     " %s\n"
+		     "    does not match"
+		     " the MD5 sum %s in"
+		     " the index\n",
+		     sum, arg, e->md5sum );
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    return -1;
+	}
+    }
 
-    while ( 1 )
+    * entry = e;
+    return 0;
+}
+
+/* Commands that do not change the index run at once
+ * in their own processes (see command_class), so two
+ * may process the same file.  Each file is transferred
+ * while holding locks on its name and on its MD5 sum,
+ * which names its encrypted files: an exclusive lock
+ * on a file that is written or deleted, and a shared
+ * lock on one that is only read.  The locks are fcntl
+ * locks on one byte of EFM-LOCK, at an offset found by
+ * hashing the name or sum, names below LOCK_RANGE and
+ * sums above, and are always taken name first, so
+ * processes cannot deadlock.  Two files may share a
+ * byte, which only makes one wait for the other.
+ */
+#define LOCK_RANGE 0x40000000L
+int lock_fd = -1;
+
+/* Lock or unlock (type F_RDLCK, F_WRLCK, or F_UNLCK)
+ * the byte of EFM-LOCK for s, which is a file name if
+ * sum is 0 and an MD5 sum if sum is 1.
+ */
+void lock_byte ( const char * s, int sum, int type )
+{
+    struct flock fl;
+
+    if ( lock_fd < 0 )
     {
-	fflush ( stdout );
-	fflush ( stderr );
+	lock_fd = open ( "EFM-LOCK", O_RDWR + O_CREAT,
+			 S_IRUSR + S_IWUSR );
+	if ( lock_fd < 0 ) error ( errno );
+    }
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = hash_string ( s ) % LOCK_RANGE
+		 + sum * LOCK_RANGE;
+    fl.l_len = 1;
+    if ( fcntl ( lock_fd, F_SETLK, & fl ) == 0 ) return;
+    if ( errno != EACCES && errno != EAGAIN )
+	error ( errno );
+    if ( trace )
+	printf ( "* waiting for another command"
+		 " to finish with %s\n", s );
+    fflush ( stdout );
+    while ( fcntl ( lock_fd, F_SETLKW, & fl ) < 0 )
+	if ( errno != EINTR ) error ( errno );
+}
 
-	if ( s3_file && setup_s3_pipe() < 0 )
-	    return -1;
+/* Lock, if lock is 1, or unlock, if it is 0, the
+ * file name arg and the MD5 sum of its entry e for
+ * transfer_file, according to the operation of c.
+ */
+void lock_transfer ( struct file_command * c,
+		     const char * arg,
+		     struct entry * e, int lock )
+{
+    char op = c->op, direction = c->direction;
 
-	child = fork();
-	if ( child < 0 )
+    /* Copyto reads arg, and copyfrom and the moves
+     * write or delete it; the other operations do
+     * not use it.
+     */
+    if ( op == 'c' || op == 'm' )
+	lock_byte ( arg, 0,
+		    ! lock ? F_UNLCK :
+		    op == 'c' && direction == 't' ?
+		    F_RDLCK : F_WRLCK );
+
+    /* Copyfrom, check, and md5check only read the
+     * encrypted file.
+     */
+    lock_byte ( e->md5sum, 1,
+		! lock ? F_UNLCK :
+		( op == 'c' && direction == 'f' )
+		|| op == 'k' || op == 's' ?
+		F_RDLCK : F_WRLCK );
+}
+
+/* Copy, move, remove, check, or delete args[i] of a
+ * file command, whose index entry e has been found
+ * by prepare_file.  The index is not changed, so
+ * this may be done by a worker process.  Return 0 on
+ * success, 1 if the file was processed but an error
+ * occurred, and -1 if processing was aborted.
+ */
+int transfer_file ( struct file_command * c, int i,
+		    const char * arg,
+		    struct entry * e )
+{
+    char op = c->op, direction = c->direction;
+    int current_directory = c->current_directory;
+    char * dbegin = c->dbegin, * dend = c->dend;
+    int nargs = c->nargs;
+    char efile [40];
+    int status = 0;
+
+    /* Perform Copying and Remote
+       MD5 checking */
+
+    strcpy ( efile, e->md5sum );
+    strcpy ( efile + 32, ".gpg" );
+    strcpy ( dend, efile );
+    if ( direction == 't' && e->chunked )
+    {
+	if ( put_chunked ( arg, dbegin, e,
+			   c->sums + i ) < 0 )
 	{
-	    int saved_errno = errno;
-	    if ( s3_file )
-	        unlink ( "EFM-S3CONFIG.pipe" );
-	    error ( saved_errno );
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    c->sums[i].esize = 0;
+	    return -1;
 	}
-
-	if ( child == 0 )
+    }
+    else if ( direction == 't' && ! current_directory
+			       && e->emd5sum[0] == 0 )
+    {
+	struct crypt_sums * sums = c->sums + i;
+	char dbegin_sum[33];
+	int r;
+
+	if ( trace )
+	    printf ( "* encrypting %s\n"
+		     "*     to make %s\n",
+		     arg, dbegin );
+	r = encrypt_to ( arg, NULL, dbegin, e->key,
+			 e->codec, sums );
+	if ( r < 0 )
 	{
-	    int newfd, d;
-
-	    /* Set fd's as follows:
-	     * 	0 -> /dev/null
-	     *	1 -> parent's fd 1
-	     *	2 -> parent's fd 1
+	    printf ( "ERROR: could not encrypt %s\n",
+		     arg );
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    sums->esize = 0;
+	    return -1;
+	}
+	if ( strcmp ( sums->md5sum, e->md5sum ) != 0
+	     || sums->size != e->size )
+	{
+	    printf ( "ERROR: %s changed while"
+		     " being encrypted\n", arg );
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    sums->esize = 0;
+	    return -1;
+	}
+	if ( is_s3 ( dbegin ) && s3_builtin() )
+	{
+	    /* s3_put_object has checked the ETags that
+	     * S3 computed as it was written.
 	     */
-	    newfd = open ( "/dev/null", O_RDONLY );
-	    if ( newfd < 0 ) error ( errno );
-	    close ( 0 );
-	    if ( dup2 ( newfd, 0 ) < 0 )
-	        error ( errno );
-	    close ( newfd );
-	    close ( 2 );
-	    if ( dup2 ( 1, 2 ) < 0 )
-	        error ( errno );
-	    d = getdtablesize() - 1;
-	    while ( d > 2 ) close ( d -- );
-
-	    if ( s3_file )
+	    if ( trace )
+		printf ( "* MD5 sum of %s\n"
+			 "*     checked by S3\n",
+			 dbegin );
+	}
+	else
+	{
+	    if ( trace )
+		printf ( "* comparing MD5 sum of %s\n"
+			 "*     with that computed while"
+			 " encrypting\n", dbegin );
+	    if ( md5sum ( dbegin_sum, dbegin ) < 0 )
 	    {
-		if ( trace )
-		{
-		    fprintf ( stderr,
-			      "* executing s3cmd"
-			      " del; %s \n",
-			      filename );
-		    fflush ( stderr );
-		}
-		execlp ( "s3cmd", "s3cmd",
-		         "-c", "EFM-S3CONFIG.pipe",
-			 // trace ? "-v" : "-q",
-		         "del", filename,
-			 NULL );
-		int saved_errno = errno;
-		unlink ( "EFM-S3CONFIG.pipe" );
-		error ( saved_errno );
+		printf ( "    Processing %s"
+			 " aborted.\n", arg );
+		sums->esize = 0;
+		return -1;
 	    }
-	    else
+	    if ( strcmp ( sums->emd5sum, dbegin_sum ) != 0 )
 	    {
-		* p ++ = 0;
+		printf ( "ERROR: MD5 sum of %s (%s)\n"
+			 "    does not match that"
+			 " computed while encrypting"
+			 " (%s)\n",
+			 dbegin, dbegin_sum,
+			 sums->emd5sum );
+		printf ( "    Processing %s"
+			 " aborted.\n", arg );
+		sums->esize = 0;
+		return -1;
+	    }
+	}
+    }
+    else if ( direction == 't' )
+    {
+	char dbegin_sum[33];
 
-		if ( trace )
-		{
-		    fprintf ( stderr,
-			      "* executing ssh %s \\\n"
-			      "            rm -f %s\n",
-			      name, p );
-		    fflush ( stderr );
-		}
-		if ( execlp ( "ssh", "ssh", name,
-			      "rm", "-f", p, NULL )
-		     < 0 )
-		    error ( errno );
+	if ( ! current_directory )
+	{
+
+	    if ( trace )
+		printf ( "* deleting %s\n",
+			 dbegin );
+	    if ( delfile ( dbegin ) < 0 )
+	    {
+		printf ( "    Processing %s"
+			 " aborted.\n",
+			 arg );
+		return -1;
+	    }
+	    if ( trace )
+		printf ( "* copying %s\n"
+			 "*     to %s\n",
+			 efile, dbegin );
+	    if ( copyfile ( efile, dbegin )
+		 < 0 )
+	    {
+		printf ( "    Processing %s"
+			 " aborted.\n",
+			 arg );
+		return -1;
+	    }
+	    if ( trace )
+		printf ( "* comparing MD5"
+			 " sums of %s\n"
+			 "*     and %s\n",
+			 efile, dbegin );
+	    if ( md5sum ( dbegin_sum,
+			  dbegin )
+		 < 0 )
+	    {
+		printf ( "    Processing %s"
+			 " aborted.\n",
+			 arg );
+		return -1;
 	    }
+	    if ( strcmp ( e->emd5sum,
+			  dbegin_sum )
+		 != 0 )
+	    {
+		printf ( "ERROR: MD5 sum of"
+			 " %s (%s)\n"
+			 "    does not"
+			 " match that of %s"
+			 " (%s)\n",
+			 efile, e->emd5sum,
+			 dbegin,
+			 dbegin_sum );
+		printf ( "    Processing %s"
+			 " aborted.\n",
+			 arg );
+		return -1;
+	    }
+	    if ( trace )
+		printf ( "* deleting %s\n",
+			 efile );
+	    unlink ( efile );
 	}
+    }
+    else if ( op == 'm' || op == 'c'
+			|| op == 'k' )
+    {
+	char sum [33];
+	char temp [64];
+	const char * output =
+	    ( op == 'k' ? NULL : temp );
 
-	if (s3_file ) write_s3_pipe();
+	if ( current_directory
+	     && access ( efile, R_OK ) < 0 )
+	{
+	    printf ( "ERROR: encrypted %s\n"
+		     "    (%s) cannot be"
+		     " read\n",
+		     arg, efile );
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    return -1;
+	}
 
-	if ( cwait ( child ) < 0 )
+	/* Check only computes the MD5 sum of the
+	 * decrypted file, and does not write it.
+	 * Others decrypt it to a temporary file of
+	 * their own, as another command may be doing
+	 * the same for the same file.
+	 */
+	sprintf ( temp, "EFM-%d-%s", (int) getpid(),
+		  e->md5sum );
+	if ( trace )
+	    printf ( "* decrypting %s\n"
+		     "*     to %s\n",
+		     dbegin,
+		     output != NULL ? output :
+		     "compute its MD5 sum" );
+	if ( output != NULL ) unlink ( output );
+	if ( ( e->chunked ?
+	       get_chunked ( dbegin, output, e, sum ) :
+	       decrypt_from ( dbegin, output, e->key,
+			      sum ) )
+	     < 0 )
+	{
+	    printf ( "ERROR: could not"
+		     " decrypt %s\n"
+		     "    for %s\n",
+		     dbegin, arg );
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    if ( output != NULL ) unlink ( output );
+	    return -1;
+	}
+	if ( strcmp ( sum, e->md5sum )
+	     != 0 )
+	{
+	    printf ( "ERROR: MD5 sum of decrypted"
+		     " %s is %s\n    "
+		     "bad retrieval of"
+		     " %s\n", dbegin,
+		     sum, arg );
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    return -1;
+	}
+	if ( op != 'k' )
 	{
-	    if (s3_file )
-		unlink ( "EFM-S3CONFIG.pipe" );
-	    if ( retries -- )
+	    struct utimbuf ut;
+
+	    if ( trace )
+		printf
+		    ( "* linking %s\n"
+		      "*     to %s\n",
+		      temp, arg );
+	    unlink ( arg );
+	    if ( link ( temp, arg )
+		 < 0 )
 	    {
-		printf ( "RETRYING deletion of %s\n",
-		         filename );
+		printf ( "ERROR: cannot"
+			 " rename %s\n"
+			 "    to %s\n",
+			 temp, arg );
+		printf ( "    Processing %s"
+			 " aborted.\n",
+			 arg );
+		return -1;
+	    }
+	    if ( trace )
+		printf
+		    ( "* changing mode and"
+		      " modification time"
+		      " of %s\n", arg );
+	    if ( chmod ( arg, e->mode )
+		 < 0 )
+	    {
+		printf ( "ERROR: cannot"
+			 " chmod %s\n",
+			 arg );
+		status = 1;
+	    }
+	    ut.actime = time ( NULL );
+	    ut.modtime = e->mtime;
+	    if ( utime ( arg, & ut ) < 0 )
+	    {
+		printf ( "ERROR: cannot set"
+			 " modification"
+			 " time of %s\n",
+			 arg );
+		status = 1;
 	    }
-	    else return -1;
 	}
-
-	if (s3_file )
-	    unlink ( "EFM-S3CONFIG.pipe" );
-	return 0;
+	if ( output != NULL )
+	{
+	    if ( trace )
+		printf
+		    ( "* deleting %s\n",
+		      temp );
+	    unlink ( temp );
+	}
     }
-}
-
-/* Add file entry to index.  Return -1 on error, 0 on
- * success.
- */
-int add ( const char * filename )
-{
-    const char * p;
-    struct entry * e;
-    char sum [33];
-    struct stat st;
-    char key[33];
-
-    p = filename;
-    for ( ; * p; ++ p )
+    else if ( op == 's' )
     {
-        if ( * p == '/' )
+	char dbegin_sum[33];
+
+	if ( trace )
+	    printf ( "* comparing MD5"
+		     " sums of %s\n"
+		     "*     and %s\n",
+		     efile, dbegin );
+	if ( batch_md5sum ( dbegin_sum,
+			    & c->batch,
+			    nargs + i,
+			    dbegin )
+	     < 0 )
 	{
-	    printf ( "ERROR: filename contains '/':"
-	             " %s\n", filename );
+	    printf ( "    Processing %s"
+		     " aborted.\n",
+		     arg );
 	    return -1;
 	}
-        if ( * p == '\n' )
+	if ( e->emd5sum[0] == 0 )
 	{
-	    printf ( "ERROR: filename contains"
-	             " linefeed: %s\n", filename );
+	    printf ( "ERROR: index has no"
+		     " MD5 sum for %s\n",
+		     efile );
+	    printf ( "    Processing %s"
+		     " aborted.\n",
+		     arg );
+	    return -1;
+	}
+	if ( strcmp ( e->emd5sum,
+		      dbegin_sum )
+	     != 0 )
+	{
+	    printf ( "ERROR: MD5 sum of"
+		     " %s (%s)\n"
+		     "    does not"
+		     " match that of %s"
+		     " (%s)\n",
+		     efile, e->emd5sum,
+		     dbegin,
+		     dbegin_sum );
+	    printf ( "    Processing %s"
+		     " aborted.\n",
+		     arg );
 	    return -1;
 	}
     }
-    if ( find_filename ( filename ) )
+
+    /* Perform source file deletion. */
+
+    if ( ( op == 'm' && direction == 'f' )
+	 || op == 'r' || op == 'd' )
     {
-        printf ( "ERROR: index entry already exists"
-	         " for %s\n", filename );
-	return -1;
+	if ( trace )
+	    printf
+		( "* deleting %s\n",
+		  dbegin );
+	if ( delfile ( dbegin ) < 0 )
+	{
+	    printf ( "    Processing %s"
+		     " aborted.\n", arg );
+	    return -1;
+	}
     }
-
-    if ( stat ( filename, & st ) < 0 )
+    else if (    op == 'm'
+	      && direction == 't' )
     {
-        printf ( "ERROR: cannot stat %s\n", filename );
-	return -1;
+	if ( trace )
+	    printf
+		( "* deleting %s\n", arg );
+	if ( delfile ( arg ) < 0 )
+	{
+	    printf ( "    Processing %s"
+		     " aborted.\n",
+		     arg );
+	    return -1;
+	}
     }
 
-    if ( md5sum ( sum, filename ) < 0 ) return -1;
-    e = find_md5sum ( sum, 1 );
-    if ( e != NULL )
+    return status;
+}
+
+/* Finish processing args[i] of a file command after
+ * transfer_file succeeds: record the encrypted size
+ * and MD5 sum computed by encrypt_to, make the index
+ * entry obsolete on movefrom or remove, and report.
+ */
+void finish_file ( struct file_command * c, int i,
+		   const char * arg,
+		   struct entry * e )
+{
+    char op = c->op, direction = c->direction;
+
+    if ( c->sums[i].esize != 0 && e->emd5sum[0] == 0 )
     {
-        printf ( "ERROR: cannot make index entry for"
-	         " %s\n    as it has the same MD5 sum"
-		 " as existing entry for %s\n",
-		 filename, e->filename );
-	return -1;
+	e->esize = c->sums[i].esize;
+	free_field ( e->emd5sum );
+	e->emd5sum = strdup ( c->sums[i].emd5sum );
+	e->modified = 1;
+	index_modified = 1;
     }
 
+    /* Delete entry if necessary. */
 
-    e = find_md5sum ( sum, 0 );
-    if ( e != NULL )
-        strcpy ( key, e->key );
-    else
-	newkey ( key );
+    if ( ( op == 'm' && direction == 'f' )
+	 || op == 'r' )
+    {
+	e->current = 0;
+	e->modified = 1;
+	index_modified = 1;
+	if ( trace )
+	{
+	    printf ( "* made index entry"
+		     " obsolete\n" );
+	    write_index_entry
+		( stdout, e, 7, "* " );
+	}
+    }
 
-    e = (struct entry *)
-        malloc ( sizeof ( struct entry ) );
-    e->current  = 1;
-    e->filename = strdup ( filename );
-    e->mode     = st.st_mode & 07777;
-    e->mtime    = st.st_mtime;
-    e->size     = st.st_size;
-    e->md5sum   = strdup ( sum );
+    printf ( "%s: %s\n",
+	     op == 'm' ? "MOVED" :
+	     op == 'c' ? "COPIED" :
+	     op == 'r' ? "REMOVED" :
+	     op == 'd' ? "DELETED" :
+	     op == 'k' ? "OK" :
+	     op == 's' ? "OK" :
+			 "DONE",
+	     arg );
+    publish_changes();
+}
 
-    e->emd5sum  = strdup ( "" );
-    e->esize    = 0;
+/* A file of a file command processed by a worker
+ * process.  Everything written on the standard output
+ * while processing the file goes to the output tem-
+ * porary file, and is copied to the real standard
+ * output once all earlier files have been reported.
+ */
+struct job {
+    const char * arg;	/* File name. */
+    pid_t pid;		/* Of worker; 0 if none or it
+			   has finished. */
+    struct entry * e;
+    int status;		/* As returned by prepare_-
+			   file if that failed, else
+			   by transfer_file. */
+    FILE * output;
+    int sums_fd;	/* Pipe on which the worker
+			   sends the file's crypt_sums
+			   and stages, or -1 if none. */
+    struct stage stages[STAGES];
+			/* Timed for the file. */
+};
 
-    e->key      = strdup ( key );
+/* Redirect the standard output to output if it is not
+ * NULL, and otherwise restore it.
+ */
+void redirect_stdout ( FILE * output )
+{
+    static int saved = -1;
 
-    if ( first_entry == NULL )
-	first_entry = e->previous = e->next = e;
-    else
+    fflush ( stdout );
+    if ( output != NULL )
     {
-	e->previous = first_entry->previous;
-	e->next = first_entry;
-	e->previous->next = e->next->previous = e;
+	saved = dup ( 1 );
+	if ( saved < 0 ) error ( errno );
+	if ( dup2 ( fileno ( output ), 1 ) < 0 )
+	    error ( errno );
     }
-    index_modified = 1;
-    if ( trace )
+    else
     {
-        printf ( "* added index entry:\n" );
-	write_index_entry ( stdout, e, 7, "* " );
+	if ( dup2 ( saved, 1 ) < 0 ) error ( errno );
+	close ( saved );
+	saved = -1;
     }
-    return 0;
 }
 
-/* Subtract file entry from index.  Return -1 on error,
- * 0 on success.
+/* Return the number of the first n jobs that have
+ * running workers.
  */
-int sub ( const char * filename )
+int running_jobs ( struct job * job, int n )
 {
-    struct entry * e = find_filename ( filename );
-    if ( e == NULL )
+    int i, running = 0;
+    for ( i = 0; i < n; ++ i )
+	if ( job[i].pid != 0 ) ++ running;
+    return running;
+}
+
+/* SIGALRM handler that only interrupts wait_job.
+ */
+void publish_alarm ( int signum ) { }
+
+/* Wait for a worker of the first n jobs to finish and
+ * record its status in its job.  If changes to the
+ * index are pending publication (see publish_delay),
+ * wait only until they are due, and publish them.
+ * The timer repeats, lest it expire before waitpid
+ * is called.
+ */
+void wait_job ( struct job * job, int n )
+{
+    int status, i;
+    pid_t pid;
+    double delay = publish_delay();
+    struct itimerval timer;
+
+    if ( delay == 0 )
     {
-        printf ( "ERROR: subtracting nonexistent file:"
-	         " %s\n", filename );
-	return -1;
+	publish_changes();
+	return;
     }
-    if ( trace )
+    if ( delay > 0 )
     {
-        printf ( "* removing index entry:\n" );
-	write_index_entry ( stdout, e, 7, "* " );
+	struct sigaction act;
+	act.sa_flags = 0;
+	sigemptyset ( & act.sa_mask );
+	act.sa_handler = publish_alarm;
+	sigaction ( SIGALRM, & act, NULL );
+	timer.it_value.tv_sec = (long) delay;
+	timer.it_value.tv_usec = (long)
+	    ( ( delay - (long) delay ) * 1e6 );
+	if ( timer.it_value.tv_sec == 0
+	     && timer.it_value.tv_usec == 0 )
+	    timer.it_value.tv_usec = 1;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 100000;
+	setitimer ( ITIMER_REAL, & timer, NULL );
+    }
+    pid = waitpid ( -1, & status, 0 );
+    if ( delay > 0 )
+    {
+	memset ( & timer, 0, sizeof ( timer ) );
+	setitimer ( ITIMER_REAL, & timer, NULL );
+    }
+
+    if ( pid < 0 )
+    {
+	if ( errno != EINTR ) error ( errno );
+	publish_changes();
+	return;
+    }
+    for ( i = 0; i < n; ++ i )
+    {
+	if ( job[i].pid != pid ) continue;
+	job[i].pid = 0;
+	if ( ! WIFEXITED ( status ) )
+	{
+	    fprintf ( job[i].output,
+		      "ERROR: worker for %s"
+		      " killed by signal %d\n",
+		      job[i].arg, WTERMSIG ( status ) );
+	    job[i].status = -1;
+	}
+	else
+	    job[i].status =
+		WEXITSTATUS ( status ) == 0 ?  0 :
+		WEXITSTATUS ( status ) == 2 ?  1 :
+					      -1;
     }
-    e->next->previous = e->previous;
-    e->previous->next = e->next;
-    if ( first_entry == e ) first_entry = e->next;
-    if ( first_entry == e ) first_entry = NULL;
-    free ( e->filename );
-    free ( e->md5sum );
-    free ( e->emd5sum );
-    free ( e->key );
-    free ( e );
-    index_modified = 1;
-    return 0;
 }
 
+/* Report the finished jobs from * reported on that
+ * precede the first unfinished job, in order, and
+ * finish their files.  Set * result to -1 if any
+ * had errors.
+ */
+void report_jobs ( struct file_command * c,
+		   struct job * job, int n,
+		   int * reported, int * result )
+{
+    while ( * reported < n && job[* reported].pid == 0 )
+    {
+	struct job * j = job + * reported;
+	int ch;
+
+	rewind ( j->output );
+	while ( ( ch = getc ( j->output ) ) != EOF )
+	    putchar ( ch );
+	fclose ( j->output );
+	if ( j->sums_fd >= 0 )
+	{
+	    struct crypt_sums * sums =
+		c->sums + * reported;
+	    if ( read ( j->sums_fd, sums,
+			sizeof ( * sums ) )
+		 != sizeof ( * sums ) )
+		sums->esize = 0;
+	    receive_stages ( j->sums_fd, j->stages );
+	    close ( j->sums_fd );
+	}
+	if ( j->status != 0 ) * result = -1;
+	if ( j->status >= 0 )
+	    finish_file ( c, * reported, j->arg,
+			  j->e );
+	file_done ( j->arg, j->stages );
+	++ * reported;
+    }
+}
 
-/* Fetch argument from input stream into line_buffer.
- * Return a pointer to the NUL terminated argument,
- * or NULL if there is no argument.
- *
- * Eol_found must be set to 0 before getting first
- * argument.  If more arguments are gotten than are
- * available, NULL is returned repeatedly.
+/* Process the files args[0], ..., args[c->nargs-1] of
+ * a file command, transferring up to njobs files at
+ * once in worker processes.  Index changes are made
+ * by this process, one file at a time, and results
+ * are reported in argument order.  Return 0 if there
+ * were no errors and -1 otherwise.
  */
-int eol_found;
-char * get_argument ( line_buffer buffer, FILE * in )
+int process_files ( struct file_command * c,
+		    char ** args, int njobs )
 {
-    char * b, *r, * j;
-    if ( eol_found ) return NULL;
-    if ( ! get_line ( buffer, in ) )
+    int n = c->nargs;
+    struct job * job;
+    int i, k, reported = 0, result = 0;
+
+    /* When publishing changes as files finish (see
+     * publish_changes), files are transferred by
+     * workers even one at a time, so that changes are
+     * published on time while a long transfer runs.
+     */
+    if ( njobs <= 1 && ! publishing )
     {
-        eol_found = 1;
-	return NULL;
+	for ( i = 0; i < n; ++ i )
+	{
+	    struct entry * e;
+	    int status;
+
+	    if ( prepare_file ( c, i, args[i], & e )
+		 < 0 )
+		status = -1;
+	    else
+	    {
+		lock_transfer ( c, args[i], e, 1 );
+		status = transfer_file ( c, i, args[i],
+					 e );
+		lock_transfer ( c, args[i], e, 0 );
+		if ( status >= 0 )
+		    finish_file ( c, i, args[i], e );
+	    }
+	    if ( status != 0 ) result = -1;
+	    file_done ( args[i], file_stages );
+	}
+	return result;
+    }
+
+    job = (struct job *)
+	calloc ( n, sizeof ( struct job ) );
+    if ( job == NULL ) error ( ENOMEM );
+
+    for ( i = 0; i < n; ++ i )
+    {
+	struct job * j = job + i;
+
+	/* Prepare args[i] only when fewer than njobs
+	 * workers are running, and not while a worker
+	 * for an earlier instance of the same file name
+	 * is running.
+	 */
+	while ( 1 )
+	{
+	    report_jobs ( c, job, i, & reported,
+			  & result );
+	    for ( k = reported; k < i; ++ k )
+		if ( job[k].pid != 0
+		     && strcmp ( job[k].arg, args[i] )
+			== 0 )
+		    break;
+	    if ( k == i && running_jobs ( job, i )
+			   < njobs )
+		break;
+	    wait_job ( job, i );
+	}
+
+	j->arg = args[i];
+	j->sums_fd = -1;
+	j->output = tmpfile();
+	if ( j->output == NULL ) error ( errno );
+	redirect_stdout ( j->output );
+	j->status = prepare_file ( c, i, j->arg, & j->e );
+	add_stages ( j->stages, file_stages );
+
+	/* Workers use temporary files named by MD5
+	 * sum, so two must not run with the same MD5
+	 * sum.
+	 */
+	while ( j->status == 0 )
+	{
+	    for ( k = reported; k < i; ++ k )
+		if ( job[k].pid != 0
+		     && strcmp ( job[k].e->md5sum,
+				 j->e->md5sum )
+			== 0 )
+		    break;
+	    if ( k == i ) break;
+	    wait_job ( job, i );
+	}
+
+	if ( j->status == 0 )
+	{
+	    int fd[2];
+
+	    if ( trace )
+		printf ( "* starting worker for %s\n",
+			 j->arg );
+	    fflush ( stdout );
+	    if ( pipe ( fd ) < 0 ) error ( errno );
+	    j->pid = fork();
+	    if ( j->pid < 0 ) error ( errno );
+	    if ( j->pid == 0 )
+	    {
+		int status;
+
+		lock_transfer ( c, j->arg, j->e, 1 );
+		status =
+		    transfer_file ( c, i, j->arg, j->e );
+		fflush ( stdout );
+		if ( write ( fd[1], c->sums + i,
+			     sizeof ( c->sums[i] ) )
+		     < 0 )
+		    status = -1;
+		send_stages ( fd[1] );
+		_exit ( status == 0 ? 0 :
+			status > 0  ? 2 :
+				      1 );
+	    }
+	    close ( fd[1] );
+	    j->sums_fd = fd[0];
+	}
+	redirect_stdout ( NULL );
     }
-    b = buffer;
-    r = get_lexeme ( & b );
-    j = get_lexeme ( & b );
-    if ( j != NULL )
+
+    while ( reported < n )
     {
-        printf ( "ERROR: junk at end of argument"
-	         " line:\n    %s\n", j );
-	exit ( 1 );
+	report_jobs ( c, job, n, & reported, & result );
+	if ( reported < n ) wait_job ( job, n );
     }
-    if ( r == NULL ) eol_found = 1;
-    return r;
+
+    free ( job );
+    return result;
+}
+
+/* Return 1 if command takes a list of files and may
+ * be given by a batch, and 0 otherwise.
+ */
+int batch_command ( const char * command )
+{
+    static const char * commands[] =
+	{ "cur", "obs", "add", "sub", "copyto",
+	  "copyfrom", "moveto", "movefrom", "remove",
+	  "check", "md5check", "del", NULL };
+    const char ** p;
+
+    for ( p = commands; * p; ++ p )
+	if ( strcmp ( command, * p ) == 0 ) return 1;
+    return 0;
 }
 
 /* Execute one command.  Arguments are gotten from the
- * input stream via get_argument, and results are writ-
- * ten to stdout.  Return 1 if kill command processed
+ * request via get_argument, and results are written
+ * to stdout.  Return 1 if kill command processed
  * (do nothing else for kill), 0 if command processed
  * without error, and -1 if command processed with
  * error.
  */
-int execute_command ( FILE * in )
+int execute_command ( struct request * in )
 {
     int result = 0;
     char * arg;
     line_buffer buffer, directory;
 
-    eol_found = 0;
     arg = get_argument ( buffer, in );
 
+    /* A batch is executed as its command, but without
+     * publishing changes to the index as it runs (see
+     * publish_changes), so they are written once, at
+     * its end.
+     */
+    if ( arg != NULL && strcmp ( arg, "batch" ) == 0 )
+    {
+	arg = get_argument ( buffer, in );
+	if ( arg == NULL || ! batch_command ( arg ) )
+	{
+	    printf ( "ERROR: bad batch command: %s\n",
+		     arg == NULL ? "(none)" : arg );
+	    while ( get_argument ( buffer, in ) )
+		;
+	    return -1;
+	}
+	publishing = 0;
+    }
+
     if ( arg == NULL ) return 0;
     else if ( strcmp ( arg, "start" ) == 0 )
         /* Do Nothing */;
@@ -2075,31 +12688,117 @@ int execute_command ( FILE * in )
 	printf ( "efm killed\n" );
         result = 1;
     }
-    else if ( strcmp ( arg, "trace" ) == 0 )
+    else if ( strcmp ( arg, "trace" ) == 0 )
+    {
+	arg = get_argument ( buffer, in );
+	if ( arg == NULL )
+	{
+	    printf ( "* efm trace %s\n",
+	             trace ? "on" : "off" );
+	}
+	else if ( strcmp ( arg, "on" ) == 0 )
+	{
+	    trace = 1;
+	    printf ( "* efm trace on\n" );
+	}
+	else if ( strcmp ( arg, "off" ) == 0 )
+	{
+	    if ( trace ) printf ( "* efm trace off\n" );
+	    trace = 0;
+	}
+	else
+	{
+	    printf ( "ERROR: bad argument to trace:"
+	             " %s\n", arg );
+	    result = -1;
+	}
+    }
+    else if ( strcmp ( arg, "jobs" ) == 0 )
+    {
+	arg = get_argument ( buffer, in );
+	if ( arg == NULL )
+	    printf ( "efm jobs %d\n", jobs );
+	else if ( atoi ( arg ) >= 1 )
+	{
+	    jobs = atoi ( arg );
+	    printf ( "efm jobs %d\n", jobs );
+	}
+	else
+	{
+	    printf ( "ERROR: bad argument to jobs:"
+		     " %s\n", arg );
+	    result = -1;
+	}
+    }
+    else if ( strcmp ( arg, "s3parts" ) == 0 )
+    {
+	arg = get_argument ( buffer, in );
+	if ( arg == NULL )
+	    printf ( "efm s3parts %d\n", s3_parts );
+	else if ( isdigit ( arg[0] ) )
+	{
+	    s3_parts = atoi ( arg );
+	    printf ( "efm s3parts %d\n", s3_parts );
+	}
+	else
+	{
+	    printf ( "ERROR: bad argument to s3parts:"
+		     " %s\n", arg );
+	    result = -1;
+	}
+    }
+    else if ( strcmp ( arg, "compress" ) == 0 )
+    {
+	arg = get_argument ( buffer, in );
+	if ( arg == NULL )
+	    printf ( "efm compress %s\n",
+		     codecs[compression] );
+	else if ( find_codec ( arg ) >= 0 )
+	{
+	    compression = find_codec ( arg );
+	    printf ( "efm compress %s\n",
+		     codecs[compression] );
+	}
+	else
+	{
+	    printf ( "ERROR: bad argument to compress:"
+		     " %s\n", arg );
+	    result = -1;
+	}
+    }
+    else if ( strcmp ( arg, "chunking" ) == 0 )
     {
 	arg = get_argument ( buffer, in );
 	if ( arg == NULL )
-	{
-	    printf ( "* efm trace %s\n",
-	             trace ? "on" : "off" );
-	}
+	    printf ( "efm chunking %s\n",
+		     chunking ? "on" : "off" );
 	else if ( strcmp ( arg, "on" ) == 0 )
 	{
-	    trace = 1;
-	    printf ( "* efm trace on\n" );
+	    make_chunk_secret();
+	    chunking = 1;
+	    printf ( "efm chunking on\n" );
 	}
 	else if ( strcmp ( arg, "off" ) == 0 )
 	{
-	    if ( trace ) printf ( "* efm trace off\n" );
-	    trace = 0;
+	    chunking = 0;
+	    printf ( "efm chunking off\n" );
 	}
 	else
 	{
-	    printf ( "ERROR: bad argument to trace:"
-	             " %s\n", arg );
+	    printf ( "ERROR: bad argument to chunking:"
+		     " %s\n", arg );
 	    result = -1;
 	}
     }
+    else if ( strcmp ( arg, "stats" ) == 0 )
+    {
+	struct stats * s = & daemon_stats;
+	receive_stats();
+	printf ( "efm stats: %lld commands, %lld files,"
+		 " %.2f s\n",
+		 s->commands, s->files, s->seconds );
+	print_stages ( "    ", s->stages );
+    }
     else if ( strcmp ( arg, "s3cmd" ) == 0 )
     {
 #	define ARG_LIST_SIZE 1000
@@ -2108,7 +12807,7 @@ int execute_command ( FILE * in )
 	char ** p = arg_list;
 	* p ++ = "s3cmd";
 	* p ++ = "-c";
-	* p ++ = "EFM-S3CONFIG.pipe";
+	* p ++ = s3_pipe;
 	while ( arg = get_argument
 			  ( buffer, in ) )
 	{
@@ -2131,18 +12830,21 @@ int execute_command ( FILE * in )
 
 	if ( result == -1 )
 	    child = -1;
-	else if ( setup_s3_pipe() < 0 )
+	else if ( s3_config[0] == 0 )
 	{
+	    printf ( "ERROR: EFM-S3CONFIG.gpg"
+		     " missing\n" );
 	    result = -1;
 	    child = -1;
 	}
 	else
 	{
+	    make_s3_pipe();
 	    child = fork();
 	    if ( child < 0 )
 	    {
 		int saved_errno = errno;
-		unlink ( "EFM-S3CONFIG.pipe" );
+		unlink ( s3_pipe );
 		error ( saved_errno );
 	    }
 	}
@@ -2177,7 +12879,7 @@ int execute_command ( FILE * in )
 
 	    execvp ( "s3cmd", arg_list );
 	    int saved_errno = errno;
-	    unlink ( "EFM-S3CONFIG.pipe" );
+	    unlink ( s3_pipe );
 	    error ( saved_errno );
 	}
 
@@ -2187,12 +12889,128 @@ int execute_command ( FILE * in )
 	while ( * p ) free ( * p ++ );
 	if ( child >= 0 && cwait ( child ) < 0 )
 	    result = -1;
-	unlink ( "EFM-S3CONFIG.pipe" );
+	unlink ( s3_pipe );
     }
     /* Rest of commands require EFM-INDEX.gpg be read.
      */
     else if ( ! check_index() )
     	result = -1;
+    else if ( strcmp ( arg, "query" ) == 0 )
+    {
+	struct query q;
+	line_buffer glob, prefix;
+	char * end;
+
+	q.current = 1;
+	q.glob = NULL;
+	q.prefix = "";
+	q.after = (time_t) LONG_MIN;
+	q.before = (time_t) LONG_MAX;
+	q.min_size = 0;
+	q.max_size = ULLONG_MAX;
+	q.sort = SORT_NAME;
+	q.reverse = 0;
+	q.offset = 0;
+	q.limit = ULONG_MAX;
+	q.mode = 2;
+
+	while ( result == 0
+		&& ( arg = get_argument ( buffer, in ) ) )
+	{
+	    char * value = arg;
+		/* Set to NULL if an option value
+		 * is missing or bad. */
+	    int k;
+
+	    if ( strcmp ( arg, "-current" ) == 0 )
+		q.current = 1;
+	    else if ( strcmp ( arg, "-obsolete" ) == 0 )
+		q.current = 0;
+	    else if ( strcmp ( arg, "-all" ) == 0 )
+		q.current = -1;
+	    else if ( strcmp ( arg, "-reverse" ) == 0 )
+		q.reverse = 1;
+	    else if ( strcmp ( arg, "-keys" ) == 0 )
+		q.mode = 6;
+	    else if ( strcmp ( arg, "-files" ) == 0 )
+		q.mode = 0;
+	    else if ( strcmp ( arg, "-name" ) == 0 )
+		q.glob = value =
+		    get_argument ( glob, in );
+	    else if ( strcmp ( arg, "-prefix" ) == 0 )
+		q.prefix = value =
+		    get_argument ( prefix, in );
+	    else if ( strcmp ( arg, "-sort" ) == 0 )
+	    {
+		value = get_argument ( directory, in );
+		for ( k = 0; value != NULL
+			     && k < SORT_KEYS; ++ k )
+		    if ( strcmp ( value, sort_names[k] )
+			 == 0 )
+			break;
+		if ( k == SORT_KEYS ) value = NULL;
+		q.sort = k;
+	    }
+	    else if ( strcmp ( arg, "-after" ) == 0
+		      || strcmp ( arg, "-before" ) == 0 )
+	    {
+		int before = ( arg[1] == 'b' );
+		value = get_argument ( directory, in );
+		if ( value != NULL
+		     && query_time ( before ? & q.before
+					    : & q.after,
+				     value, before )
+			< 0 )
+		    value = NULL;
+	    }
+	    else if ( strcmp ( arg, "-minsize" ) == 0
+		      || strcmp ( arg, "-maxsize" ) == 0
+		      || strcmp ( arg, "-offset" ) == 0
+		      || strcmp ( arg, "-limit" ) == 0 )
+	    {
+		unsigned long long n;
+		char option =
+		    ( arg[1] == 'm' ? arg[2] : arg[1] );
+		value = get_argument ( directory, in );
+		if ( value != NULL )
+		{
+		    n = strtoull ( value, & end, 10 );
+		    if ( * end != 0
+			 || ! isdigit ( (unsigned char)
+					    * value ) )
+			value = NULL;
+		}
+		if ( value == NULL ) /* Error */;
+		else if ( option == 'i' )
+		    q.min_size = n;
+		else if ( option == 'a' )
+		    q.max_size = n;
+		else if ( option == 'o' )
+		    q.offset = n;
+		else
+		    q.limit = n;
+	    }
+	    else
+	    {
+		printf ( "ERROR: bad query option %s\n",
+			 arg );
+		result = -1;
+		continue;
+	    }
+	    if ( value == NULL )
+	    {
+		printf ( "ERROR: missing or bad value"
+			 " for query option %s\n", arg );
+		result = -1;
+	    }
+	}
+
+	if ( result == 0 )
+	{
+	    if ( q.current == -1 ) q.mode |= 1;
+	    run_query ( & q );
+	}
+    }
     else if ( strcmp ( arg, "listfiles" ) == 0
               ||
 	      strcmp ( arg, "listcurfiles" ) == 0
@@ -2250,11 +13068,13 @@ int execute_command ( FILE * in )
 		     &&
 		     strcmp ( arg + 32, ".gpg" ) == 0 )
 		{
-		    struct entry * e = first_entry;
-		    if ( e != NULL ) do
+		    struct entry * e;
+		    arg[32] = 0;
+		    e = find_md5sum ( arg, 0 );
+		    for ( ; e != NULL;
+			    e = e->next_md5sum )
 		    {
-		        if ( strncmp
-			         ( arg, e->md5sum, 32 )
+			if ( strcmp ( arg, e->md5sum )
 			     != 0 )
 			    continue;
 			if ( current == -1
@@ -2265,8 +13085,8 @@ int execute_command ( FILE * in )
 				( stdout, e, mode, "" );
 			    printed = 1;
 			}
-		    } while ( ( e = e->next )
-		    	      != first_entry );
+		    }
+		    arg[32] = '.';
 		}
 	    }
 
@@ -2278,6 +13098,52 @@ int execute_command ( FILE * in )
 	    }
 	} while ( arg = get_argument ( buffer, in ) );
     }
+    else if ( strcmp ( arg, "export" ) == 0 )
+	write_index ( stdout, 7, -1 );
+    else if ( strcmp ( arg, "format" ) == 0 )
+    {
+	arg = get_argument ( buffer, in );
+	if ( arg == NULL )
+	    /* Do Nothing */;
+	else if ( strcmp ( arg, "binary" ) == 0 )
+	{
+	    unsigned char r[BINARY_ENTRY_SIZE];
+	    struct entry * e = first_entry;
+	    if ( e ) do
+	    {
+		if ( binary_entry ( r, e, 0 ) < 0 )
+		{
+		    printf ( "ERROR: index entry for"
+			     " %s cannot be written in"
+			     " binary format\n",
+			     e->filename );
+		    result = -1;
+		}
+	    } while ( ( e = e->next ) != first_entry );
+	    if ( result == 0 && ! index_binary )
+	    {
+		index_binary = 1;
+		index_rewrite = 1;
+	    }
+	}
+	else if ( strcmp ( arg, "text" ) == 0 )
+	{
+	    if ( index_binary )
+	    {
+		index_binary = 0;
+		index_rewrite = 1;
+	    }
+	}
+	else
+	{
+	    printf ( "ERROR: bad argument to format:"
+		     " %s\n", arg );
+	    result = -1;
+	}
+	if ( result == 0 )
+	    printf ( "efm format %s\n",
+		     index_binary ? "binary" : "text" );
+    }
     else if ( strcmp ( arg, "obs" ) == 0
               ||
 	      strcmp ( arg, "cur" ) == 0 )
@@ -2317,6 +13183,7 @@ int execute_command ( FILE * in )
 	    }
 
 	    e->current = current;
+	    e->modified = 1;
 	    index_modified = 1;
 	    if ( trace )
 	    {
@@ -2330,10 +13197,21 @@ int execute_command ( FILE * in )
     }
     else if ( strcmp ( arg, "add" ) == 0 )
     {
-        while ( arg = get_argument ( buffer, in ) )
+	int nargs, i;
+	char ** args =
+	    get_arguments ( buffer, in, & nargs );
+	char (* keys)[33] = (char (*)[33])
+	    malloc ( ( nargs + 1 ) * 33 );
+
+	if ( keys == NULL ) error ( ENOMEM );
+	newkeys ( keys, nargs );
+	for ( i = 0; i < nargs; ++ i )
 	{
-	    if ( add ( arg ) < 0 ) result = -1;
+	    if ( add ( args[i], keys[i] ) < 0 )
+		result = -1;
 	}
+	free ( keys );
+	free_arguments ( args, nargs );
     }
     else if ( strcmp ( arg, "sub" ) == 0 )
     {
@@ -2342,6 +13220,47 @@ int execute_command ( FILE * in )
 	    if ( sub ( arg ) < 0 ) result = -1;
 	}
     }
+    else if ( strcmp ( arg, "gc" ) == 0 )
+    {
+	char * dbegin = get_argument ( directory, in );
+	if ( dbegin == NULL
+	     || get_argument ( buffer, in ) != NULL )
+	{
+	    printf ( "ERROR: usage: efm gc target\n" );
+	    result = -1;
+	}
+	else
+	{
+	    strcat ( dbegin, "/" );
+	    if ( collect_chunks ( dbegin ) < 0 )
+		result = -1;
+	}
+    }
+    else if ( strcmp ( arg, "archive" ) == 0 )
+    {
+	line_buffer name, source_buffer;
+	char * source, * target;
+	double start = wall_clock();
+
+	arg = get_argument ( name, in );
+	source = get_argument ( source_buffer, in );
+	target = get_argument ( directory, in );
+	if ( target == NULL
+	     || get_argument ( buffer, in ) != NULL )
+	{
+	    printf ( "ERROR: usage: efm archive NAME"
+		     " DIRECTORY target\n" );
+	    result = -1;
+	}
+	else
+	{
+	    if ( archive ( arg, source, target ) < 0 )
+		result = -1;
+	    file_done ( arg, file_stages );
+	    command_done ( "archive",
+			   wall_clock() - start );
+	}
+    }
     else if (    strcmp ( arg, "copyto" ) == 0
               || strcmp ( arg, "copyfrom" ) == 0
               || strcmp ( arg, "moveto" ) == 0
@@ -2357,575 +13276,705 @@ int execute_command ( FILE * in )
 	                                       arg[0] );
 	char direction = ( ( op == 'm' || op == 'c' ) ?
 	                   arg[4] : 'f' );
-	char * dbegin = get_argument ( directory, in );
-	if ( dbegin == NULL )
+	char command[16];
+	char * dbegin;
+	int njobs = jobs;
+	double start = wall_clock();
+
+	strcpy ( command, arg );
+	dbegin = get_argument ( directory, in );
+	if ( dbegin != NULL
+	     && strcmp ( dbegin, "-j" ) == 0 )
+	{
+	    arg = get_argument ( buffer, in );
+	    njobs = ( arg == NULL ? 0 : atoi ( arg ) );
+	    dbegin = get_argument ( directory, in );
+	}
+	if ( njobs < 1 )
+	{
+	    printf ( "ERROR: bad -j argument\n" );
+	    result = -1;
+	}
+	else if ( dbegin == NULL )
 	{
 	    printf ( "ERROR: missing directory" );
 	    result = -1;
 	}
 	else
 	{
-	    int current_directory =
-	        ( strcmp ( dbegin, "." ) == 0 );
+	    struct file_command c;
 	    char * dend = dbegin + strlen ( dbegin );
+	    int local_directory =
+		(    ! is_s3 ( dbegin )
+		  && is_remote ( dbegin ) == NULL );
+	    int nargs, i;
+	    char ** args =
+		get_arguments ( buffer, in, & nargs );
+
 	    * dend ++ = '/';
-	    while ( arg = get_argument ( buffer, in ) )
-	    {
-	        /* Get valid index entry. */
+	    c.op = op;
+	    c.direction = direction;
+	    c.current_directory =
+		( strcmp ( dbegin, "./" ) == 0 );
+	    c.dbegin = dbegin;
+	    c.dend = dend;
+	    c.nargs = nargs;
+
+	    /* Hash the existing local files (except on
+	     * copyto or moveto to ".", where they are
+	     * hashed as they are encrypted), and on
+	     * md5check the encrypted files in the
+	     * source directory, all at once.  Batch
+	     * entry i is for args[i] and entry nargs+i
+	     * for its encrypted file.
+	     */
+	    c.batch.names = (const char **)
+		calloc ( 2 * nargs + 1,
+			 sizeof ( char * ) );
+	    c.batch.sums = (char (*)[33])
+		malloc ( ( 2 * nargs + 1 ) * 33 );
+	    c.sums = (struct crypt_sums *)
+		calloc ( nargs + 1,
+			 sizeof ( struct crypt_sums ) );
+	    if ( c.batch.names == NULL
+		 || c.batch.sums == NULL
+		 || c.sums == NULL )
+		error ( ENOMEM );
+	    if ( direction == 't'
+		 && ! c.current_directory )
+		for ( i = 0; i < nargs; ++ i )
+		{
+		    if ( access ( args[i], R_OK ) >= 0 )
+			c.batch.names[i] = args[i];
+		}
+	    else if ( direction == 'f' )
+		for ( i = 0; i < nargs; ++ i )
+		{
+		    struct entry * e =
+			find_filename ( args[i] );
+		    char * name;
+		    if ( e == NULL ) continue;
+		    if ( access ( args[i], R_OK ) >= 0 )
+			c.batch.names[i] = args[i];
+		    if ( op != 's' ) continue;
+		    name = (char *)
+			malloc ( dend - dbegin + 37 );
+		    if ( name == NULL ) error ( ENOMEM );
+		    strcpy ( dend, e->md5sum );
+		    strcpy ( dend + 32, ".gpg" );
+		    strcpy ( name, dbegin );
+		    c.batch.names[nargs+i] = name;
+		}
+	    md5_plain_files ( c.batch.sums, c.batch.names,
+			      nargs );
+	    if ( local_directory )
+		md5_files ( c.batch.sums + nargs,
+			    c.batch.names + nargs, nargs );
+	    else
+		md5_remote_files ( c.batch.sums + nargs,
+				   c.batch.names + nargs,
+				   nargs );
 
-		struct entry * e =
-		    find_filename ( arg );
-		char efile [40];
-		pid_t child;
+	    /* The batch is not of any one file. */
 
-		/* On copyto or moveto with an obsolete
-		 * entry, delete the entry here so it
-		 * can be recomputed below.  Be sure
-		 * file exists and can have its MD5 sum
-		 * computed before deleting entry.
-		 */
-		if ( e != NULL && ! e->current
-		     && direction == 't' )
-		{
-		    char sum [33];
+	    add_stages ( command_stats.stages,
+			 file_stages );
 
-		    if ( access ( arg, R_OK ) < 0 )
-		    {
-		        printf ( "ERROR: file %s is not"
-			         " readable\n", arg );
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( md5sum ( sum, arg ) < 0 )
-		    {
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
+	    result = process_files ( & c, args, njobs );
+	    command_done ( command, wall_clock() - start );
 
-		    e = find_md5sum ( sum, 1 );
-		    if ( e != NULL )
-		    {
-			printf ( "ERROR: cannot remake"
-			         " index entry for %s\n"
-				 "    as it would have"
-				 " the same MD5 sum as"
-				 " the existing current"
-				 " entry\n"
-				 "    for %s\n",
-				 arg, e->filename );
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
+	    for ( i = nargs; i < 2 * nargs; ++ i )
+		free ( (char *) c.batch.names[i] );
+	    free ( c.batch.names );
+	    free ( c.batch.sums );
+	    free ( c.sums );
+	    free_arguments ( args, nargs );
+	}
+    }
+    else
+    {
+        printf ( "ERROR: bad command (ignored):"
+	         " %s\n", arg );
+	result = -1;
+    }
 
-		    sub ( arg );
-		    e = NULL;
-		}
+    arg = get_argument ( buffer, in );
+    if ( arg != NULL && result != -1 )
+    {
+	printf ( "ERROR: extra argument (ignored):"
+		 " %s\n", arg );
+	result = -1;
+    }
 
-		if ( e == NULL )
-		{
-		    if ( direction != 't' )
-		    {
-		        printf ( "ERROR: no index entry"
-			         " exists for %s\n",
-				 arg );
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( add ( arg ) < 0 )
-		    {
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    e = find_filename ( arg );
-		    assert ( e != NULL );
-		}
-		else if ( access ( arg, R_OK ) >= 0 )
-		{
-		    char sum [33];
-		    if ( md5sum ( sum, arg ) < 0 )
-		    {
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( strcmp ( sum, e->md5sum )
-		         != 0 )
-		    {
-		        printf ( "ERROR: MD5 sum %s\n"
-			         "    of existing file"
-				 " %s\n"
-				 "    does not match"
-				 " the MD5 sum %s in"
-				 " the index\n",
-				 sum, arg, e->md5sum );
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		} else if ( direction == 't' ) {
-		    printf ( "ERROR: file not found:"
-		             " %s\n", arg );
-		    printf ( "    Processing %s"
-			     " aborted.\n", arg );
-		    result = -1;
-		    continue;
-		}
+    while ( arg != NULL )
+        arg = get_argument ( buffer, in );
 
-		/* Perform Copying and Remote
-		   MD5 checking */
+    return result;
+}
 
-		strcpy ( efile, e->md5sum );
-		strcpy ( efile + 32, ".gpg" );
-		strcpy ( dend, efile );
-		if ( direction == 't' )
-		{
-		    struct stat st;
-		    char efile_sum[33];
-		    char dbegin_sum[33];
+/* The background process serves each connection in
+ * one of the following ways, according to its com-
+ * mand:
+ *
+ *	'p'  In the background process at once.  For
+ *	     quick commands that set its state.
+ *	'i'  In the background process when no child
+ *	     that may change the index is running.  For
+ *	     commands that rewrite the index.
+ *	'w'  In a child that may change the index when
+ *	     no other such child is running.  The child
+ *	     appends its changes to the journal, from
+ *	     which the background process reads them
+ *	     when the child is done.
+ *	'r'  In a child at once.  For commands that do
+ *	     not change the index.
+ *	'q'  As for 'r', after the background process
+ *	     has updated its sorted views of the index
+ *	     (see update_views).
+ *
+ * So commands that only read the index are served at
+ * once, even while a long command that changes the
+ * index runs, and see the index as that command left
+ * it, or as it was before that command with the
+ * changes that command has published so far (see
+ * publish_changes).
+ */
+int command_class ( const char * command )
+{
+    static const char * p_commands[] =
+	{ "start", "trace", "jobs", "s3parts",
+	  "compress", "stats", NULL };
+    static const char * i_commands[] =
+	{ "kill", "format", "chunking", NULL };
+    static const char * q_commands[] =
+	{ "query", NULL };
+    static const char * w_commands[] =
+	{ "cur", "obs", "add", "sub", "copyto",
+	  "moveto", "movefrom", "remove", "archive",
+	  "gc", NULL };
+    const char ** p;
+
+    for ( p = p_commands; * p; ++ p )
+	if ( strcmp ( command, * p ) == 0 ) return 'p';
+    for ( p = i_commands; * p; ++ p )
+	if ( strcmp ( command, * p ) == 0 ) return 'i';
+    for ( p = q_commands; * p; ++ p )
+	if ( strcmp ( command, * p ) == 0 ) return 'q';
+    for ( p = w_commands; * p; ++ p )
+	if ( strcmp ( command, * p ) == 0 ) return 'w';
+    return 'r';
+}
 
-		    if ( trace )
-		        printf ( "* encrypting %s\n"
-			         "*     to make %s\n",
-				 arg, efile );
-		    unlink ( efile );
-		    if ( crypt ( 0, arg, efile,
-		                 e->key, 32,
-				 & child ) < 0 )
-		    {
-		        printf ( "ERROR: could not"
-			         " encrypt %s\n", arg );
-			printf ( "    Processing %s"
-				 " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( trace )
-		        printf ( "* changing mode of"
-			         " %s\n"
-			         "*     to user-only"
-				 " read-only\n",
-				 efile );
-		    if ( chmod ( efile, S_IRUSR ) < 0 )
-		    {
-		        printf ( "ERROR: cannot chmod"
-			         " %s\n", efile );
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( stat ( efile, & st ) < 0 )
-		    {
-		        printf ( "ERROR: cannot stat"
-			         " %s\n", efile );
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( e->esize == 0 )
-		    {
-		        e->esize = st.st_size;
-			index_modified = 1;
-		    }
-		    else if ( e->esize != st.st_size )
-		    {
-		        printf ( "ERROR: esize has"
-			         " changed from %llu to"
-				 " %llu\n    for %s\n",
-				 (unsigned long long)
-				 e->esize,
-				 (unsigned long long)
-				 st.st_size,
-				 efile );
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( md5sum ( efile_sum,
-				  efile )
-			 < 0 )
-		    {
-			printf ( "    Processing %s"
-				 " aborted.\n",
-				 arg );
-			result = -1;
-			continue;
-		    }
-		    if ( e->emd5sum[0] == 0 )
-		    {
-		        free ( e->emd5sum );
-		        e->emd5sum =
-			    strdup ( efile_sum );
-			index_modified = 1;
-		    }
-		    else if ( strcmp ( efile_sum,
-				       e->emd5sum )
-			      != 0 )
-		    {
-		        printf ( "ERROR: md5sum has"
-			         " changed from %s\n"
-				 "    to %s\n"
-				 "    for %s\n",
-				 e->emd5sum, efile_sum,
-				 efile );
-			printf ( "    Processing %s"
-				 " aborted.\n",
-				 arg );
-			result = -1;
-			continue;
-		    }
+/* Connections accepted by the background process.
+ * Class is 0 until the name of the next command has
+ * arrived, and is then the command class (see com-
+ * mand_class).  Child is the child serving the com-
+ * mand, or 0 if none.  The next command on a connec-
+ * tion is not read until the last is done.
+ */
+struct connection {
+    int fd;
+    int class;
+    pid_t child;
+};
+struct connection * connections = NULL;
+int nconnections = 0, max_connections = 0;
+
+int listen_fd = -1;
+    /* Socket on which connections are accepted. */
+int sigchld_pipe[2];
+    /* A byte is written on [1] when a child of the
+       background process terminates. */
+pid_t index_child = 0;
+    /* Child that may change the index or is compact-
+       ing the journal, or 0 if none. */
+int compacting = 0;
+    /* 1 if index_child is compacting the journal. */
+
+void sigchld_handler ( int signum )
+{
+    int saved_errno = errno;
+    if ( write ( sigchld_pipe[1], "", 1 ) < 0 )
+    {
+	/* Pipe is full; a byte is already there. */
+    }
+    errno = saved_errno;
+}
+
+/* Return the class of the command arriving on connec-
+ * tion fd, or 0 if the name of the command has not yet
+ * all arrived, or -1 if the connection is closed or
+ * has sent a bad frame.  The command is left to be
+ * read when the connection is served.
+ */
+int peek_command ( int fd )
+{
+    char buffer[FRAME_HEADER
+		+ 2 * ( MAX_LEXEME_SIZE + 1 )];
+    char * command, * end;
+    size_t length;
+    int n;
+
+    n = recv ( fd, buffer, sizeof ( buffer ), MSG_PEEK );
+    if ( n <= 0 ) return -1;
+    if ( buffer[0] != COMMAND_FRAME ) return -1;
+    if ( n < FRAME_HEADER ) return 0;
+    length = get_be ( (unsigned char *) buffer + 1, 4 );
+    if ( length == 0 ) return 'p';
+    command = buffer + FRAME_HEADER;
+    n -= FRAME_HEADER;
+    if ( (size_t) n > length ) n = (int) length;
+    end = (char *) memchr ( command, 0, n );
+    if ( end == NULL )
+	return (size_t) n == length
+	       || n > MAX_LEXEME_SIZE ? 'r' : 0;
+
+    /* A batch is served as its command is.
+     */
+    if ( strcmp ( command, "batch" ) == 0
+	 && end + 1 < command + length )
+    {
+	n -= end + 1 - command;
+	command = end + 1;
+	end = (char *) memchr ( command, 0, n );
+	if ( end == NULL )
+	    return command + n == buffer + FRAME_HEADER
+				  + length
+		   || n > MAX_LEXEME_SIZE ? 'r' : 0;
+    }
+    return command_class ( command );
+}
+
+/* Execute the command arriving on connection fd with
+ * stdout rerouted to the connection, append any
+ * changes to the index to the journal, or rewrite the
+ * index if necessary.  Return the value of execute_-
+ * command.
+ *
+ * Stdout is a pipe read by a child that copies what
+ * is written on it to the connection in OUTPUT_-
+ * FRAMEs, so the output of the processes the command
+ * runs is framed too.
+ */
+int serve ( int fd )
+{
+    struct request request;
+    int done, out[2], control[2];
+    pid_t framer;
+
+    if ( read_request ( fd, & request ) < 0 )
+	return -1;
+    write_value_frame ( fd, BEGIN_FRAME, getpgrp() );
+
+    /* Reroute stdout to the framer.
+     */
+    assert ( fd != 1 );
+    fflush ( stdout );
+    if ( pipe ( out ) < 0 || pipe ( control ) < 0 )
+	error ( errno );
+    framer = fork();
+    if ( framer < 0 ) error ( errno );
+    if ( framer == 0 )
+    {
+	close ( out[1] );
+	close ( control[1] );
+	run_framer ( out[0], control[0], fd );
+	exit ( 0 );
+    }
+    close ( out[0] );
+    close ( control[0] );
+    close ( 1 );
+    dup2 ( out[1], 1 );
+    close ( out[1] );
+
+    index_modified = 0;
+    done = execute_command ( & request );
+    if ( index_rewrite
+	 ||
+	 ( done == 1 && journal_key[0] != 0 ) )
+	write_index_file();
+    else if ( index_modified && write_journal() < 0 )
+	done = -1;
+
+    fflush ( stdout );
+    close ( 1 );
+    dup2 ( 2, 1 );
+    close ( control[1] );
+    cwait ( framer );
+    write_value_frame ( fd, END_FRAME,
+			done == 1 ? 0 : - done );
+    free ( request.data );
+    return done;
+}
+
+/* Fork a child of the background process with its own
+ * process group, and close the descriptors of the
+ * background process in the child, except for con-
+ * nection fd if that is not -1.  Return as per fork.
+ */
+pid_t fork_child ( int fd )
+{
+    struct sigaction act;
+    pid_t child;
+    int i;
+
+    fflush ( stdout );
+    child = fork();
+    if ( child < 0 ) error ( errno );
+    if ( child > 0 )
+    {
+	setpgid ( child, child );
+	return child;
+    }
+
+    setpgid ( 0, 0 );
+    act.sa_flags = 0;
+    sigemptyset ( & act.sa_mask );
+    act.sa_handler = SIG_DFL;
+    sigaction ( SIGCHLD, & act, NULL );
+    close ( listen_fd );
+    close ( sigchld_pipe[0] );
+    close ( sigchld_pipe[1] );
+    close ( stats_pipe[0] );
+    for ( i = 0; i < nconnections; ++ i )
+    {
+	if ( connections[i].fd != fd )
+	    close ( connections[i].fd );
+    }
+    return 0;
+}
+
+/* Reap terminated children of the background process,
+ * making their connections ready for their next com-
+ * mands.  When the child that may change the index is
+ * done,
+ * read its changes from the journal, and compact the
+ * journal in a new child if it is too long or dam-
+ * aged.
+ */
+void reap_children ( void )
+{
+    pid_t child;
+    int status;
+    struct stat st;
+
+    receive_stats();
+    while ( ( child = waitpid ( -1, & status, WNOHANG ) )
+	    > 0 )
+    {
+	int i;
+	for ( i = 0; i < nconnections; ++ i )
+	{
+	    if ( connections[i].child == child )
+	    {
+		connections[i].child = 0;
+		connections[i].class = 0;
+	    }
+	}
+	if ( child != index_child ) continue;
+	index_child = 0;
+	if ( compacting )
+	{
+	    compacting = 0;
+	    if ( WIFEXITED ( status )
+		 &&
+		 WEXITSTATUS ( status ) == 0 )
+	    {
+		journal_key[0] = 0;
+		journal_offset = 0;
+	    }
+	    continue;
+	}
+	if ( replay_journal ( 0 ) == 0
+	     &&
+	     ( stat ( "EFM-JOURNAL.gpg", & st ) < 0
+	       || st.st_size <= JOURNAL_LIMIT ) )
+	    continue;
+
+	index_child = fork_child ( -1 );
+	if ( index_child == 0 )
+	{
+	    write_index_file();
+	    exit ( 0 );
+	}
+	compacting = 1;
+    }
+}
 
-		    if ( ! current_directory )
-		    {
+/* Run the background process, serving connections to
+ * listen_fd until killed.  Commands are served as de-
+ * scribed for command_class, and commands that must
+ * wait for the index are served in the order they
+ * arrive.
+ */
+void run_daemon ( void )
+{
+    struct pollfd * fds = NULL;
+    struct sigaction act;
+    int done = 0, i, j;
 
-			if ( trace )
-			    printf ( "* deleting %s\n",
-			             dbegin );
-			if ( delfile ( dbegin ) < 0 )
-			{
-			    printf ( "    Processing %s"
-				     " aborted.\n",
-				     arg );
-			    result = -1;
-			    continue;
-			}
-			if ( trace )
-			    printf ( "* copying %s\n"
-			             "*     to %s\n",
-			             efile, dbegin );
-			if ( copyfile ( efile, dbegin )
-			     < 0 )
-			{
-			    printf ( "    Processing %s"
-				     " aborted.\n",
-				     arg );
-			    result = -1;
-			    continue;
-			}
-			if ( trace )
-			    printf ( "* comparing MD5"
-			             " sums of %s\n"
-				     "*     and %s\n",
-			             efile, dbegin );
-			if ( md5sum ( dbegin_sum,
-				      dbegin )
-			     < 0 )
-			{
-			    printf ( "    Processing %s"
-				     " aborted.\n",
-				     arg );
-			    result = -1;
-			    continue;
-			}
-			if ( strcmp ( efile_sum,
-				      dbegin_sum )
-			     != 0 )
-			{
-			    printf ( "ERROR: MD5 sum of"
-			             " %s (%s)\n"
-				     "    does not"
-				     " match that of %s"
-				     " (%s)\n",
-			             efile, efile_sum,
-				     dbegin,
-				     dbegin_sum );
-			    printf ( "    Processing %s"
-				     " aborted.\n",
-				     arg );
-			    result = -1;
-			    continue;
-			}
-			if ( trace )
-			    printf ( "* deleting %s\n",
-			             efile );
-			unlink ( efile );
-		    }
-		}
-		else if ( op == 'm' || op == 'c'
-		                    || op == 'k' )
-		{
-		    char sum [33];
+    if ( pipe ( sigchld_pipe ) < 0 ) error ( errno );
+    if ( fcntl ( sigchld_pipe[1], F_SETFL, O_NONBLOCK )
+	 < 0 )
+	error ( errno );
 
-		    if ( ! current_directory )
-		    {
-			if ( trace )
-			    printf ( "* copying %s\n"
-			             "*     to %s\n",
-			             dbegin, efile );
-			unlink ( efile );
-			if ( copyfile ( dbegin, efile )
-			     < 0 )
-			{
-			    printf ( "    Processing %s"
-				     " aborted.\n",
-				     arg );
-			    result = -1;
-			    continue;
-			}
-		    }
-		    else if ( access ( efile, R_OK )
-		              < 0 )
-		    {
-		        printf ( "ERROR: encrypted %s\n"
-			         "    (%s) cannot be"
-				 " read\n",
-				 arg, efile );
-			printf ( "    Processing %s"
-				 " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( trace )
-		        printf ( "* decrypting %s\n"
-			         "*     to make %s\n",
-				 efile, e->md5sum );
-		    unlink ( e->md5sum );
-		    if ( crypt ( 1, efile, e->md5sum,
-				 e->key, 32,
-				 & child ) < 0 )
-		    {
-			printf ( "ERROR: could not"
-				 " decrypt %s\n"
-				 "    for %s\n",
-				 efile, arg );
-			printf ( "    Processing %s"
-				 " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
+    /* Stats_pipe is not polled, but is read when
+     * children terminate and by the stats command.
+     */
+    if ( pipe ( stats_pipe ) < 0 ) error ( errno );
+    if ( fcntl ( stats_pipe[0], F_SETFL, O_NONBLOCK )
+	 < 0
+	 ||
+	 fcntl ( stats_pipe[1], F_SETFL, O_NONBLOCK )
+	 < 0 )
+	error ( errno );
+    act.sa_flags = 0;
+    sigemptyset ( & act.sa_mask );
+    act.sa_handler = sigchld_handler;
+    if ( sigaction ( SIGCHLD, & act, NULL ) < 0 )
+	error ( errno );
 
-		    if ( ! current_directory )
-		    {
-			if ( trace )
-			    printf ( "* deleting %s\n",
-				     efile );
-			unlink ( efile );
-		    }
+    /* SIGPIPE is ignored, so that a command whose
+     * client goes away still finishes and records
+     * its changes to the index.
+     */
+    act.sa_handler = SIG_IGN;
+    if ( sigaction ( SIGPIPE, & act, NULL ) < 0 )
+	error ( errno );
 
-		    if ( trace )
-		        printf ( "* checking MD5 sum of"
-			         " %s\n", e->md5sum );
-		    if ( md5sum ( sum, e->md5sum ) < 0 )
-		    {
-		        printf ( "ERROR: cannot compute"
-			         " MD5 sum of %s\n    "
-				 "which is the"
-				 " retrieval of %s\n",
-				 e->md5sum, arg );
-			printf ( "    Processing %s"
-				 " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( strcmp ( sum, e->md5sum )
-		         != 0 )
-		    {
-		        printf ( "ERROR: MD5 sum of %s"
-			         " is %s\n    "
-				 "bad retrieval of"
-				 " %s\n", e->md5sum,
-				 sum, arg );
-			printf ( "    Processing %s"
-				 " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
-		    if ( op != 'k' )
-		    {
-			struct utimbuf ut;
-
-			if ( trace )
-			    printf
-				( "* linking %s\n"
-				  "*     to %s\n",
-				  e->md5sum, arg );
-		        unlink ( arg );
-			if ( link ( e->md5sum, arg )
-			     < 0 )
-			{
-			    printf ( "ERROR: cannot"
-			             " rename %s\n"
-				     "    to %s\n",
-				     e->md5sum, arg );
-			    printf ( "    Processing %s"
-				     " aborted.\n",
-				     arg );
-			    result = -1;
-			    continue;
-			}
-			if ( trace )
-			    printf
-				( "* changing mode and"
-				  " modification time"
-				  " of %s\n", arg );
-			if ( chmod ( arg, e->mode )
-			     < 0 )
-			{
-			    printf ( "ERROR: cannot"
-			             " chmod %s\n",
-				     arg );
-			    result = -1;
-			}
-			ut.actime = time ( NULL );
-			ut.modtime = e->mtime;
-			if ( utime ( arg, & ut ) < 0 )
-			{
-			    printf ( "ERROR: cannot set"
-				     " modification"
-				     " time of %s\n",
-				     arg );
-			    result = -1;
-			}
-		    }
-		    if ( trace )
-			printf
-			    ( "* deleting %s\n",
-			      e->md5sum );
-		    unlink ( e->md5sum );
-		}
-		else if ( op == 's' )
-		{
-		    char dbegin_sum[33];
+    while ( done != 1 )
+    {
+	fds = (struct pollfd *)
+	    realloc ( fds, ( nconnections + 2 )
+			   * sizeof ( struct pollfd ) );
+	if ( fds == NULL ) error ( ENOMEM );
+	fds[0].fd = listen_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = sigchld_pipe[0];
+	fds[1].events = POLLIN;
+	for ( i = 0; i < nconnections; ++ i )
+	{
+	    /* Connections not polled are given fd -1,
+	     * lest a hangup wake poll while they wait.
+	     */
+	    fds[i+2].fd =
+		( connections[i].class == 0
+		  && connections[i].child == 0 ?
+		  connections[i].fd : -1 );
+	    fds[i+2].events = POLLIN;
+	}
+	if ( poll ( fds, nconnections + 2, -1 ) < 0 )
+	{
+	    if ( errno == EINTR ) continue;
+	    error ( errno );
+	}
 
-		    if ( trace )
-			printf ( "* comparing MD5"
-				 " sums of %s\n"
-				 "*     and %s\n",
-				 efile, dbegin );
-		    if ( md5sum ( dbegin_sum, dbegin )
-			 < 0 )
-		    {
-			printf ( "    Processing %s"
-				 " aborted.\n",
-				 arg );
-			result = -1;
-			continue;
-		    }
-		    if ( e->emd5sum[0] == 0 )
-		    {
-			printf ( "ERROR: index has no"
-				 " MD5 sum for %s\n",
-				 efile );
-			printf ( "    Processing %s"
-				 " aborted.\n",
-				 arg );
-			result = -1;
-			continue;
-		    }
-		    if ( strcmp ( e->emd5sum,
-				  dbegin_sum )
-			 != 0 )
-		    {
-			printf ( "ERROR: MD5 sum of"
-				 " %s (%s)\n"
-				 "    does not"
-				 " match that of %s"
-				 " (%s)\n",
-				 efile, e->emd5sum,
-				 dbegin,
-				 dbegin_sum );
-			printf ( "    Processing %s"
-				 " aborted.\n",
-				 arg );
-			result = -1;
-			continue;
-		    }
-		}
+	if ( fds[1].revents != 0 )
+	{
+	    char buffer[64];
+	    if ( read ( sigchld_pipe[0], buffer,
+			sizeof ( buffer ) ) < 0 )
+		error ( errno );
+	    reap_children();
+	}
 
-		/* Perform source file deletion. */
+	/* Find the classes of new commands, serving
+	 * those that can be served at once.  Closed
+	 * connections are given fd -1.
+	 */
+	for ( i = 0; i < nconnections; ++ i )
+	{
+	    struct connection * c = connections + i;
+	    if ( c->class != 0 || c->child != 0
+		 || fds[i+2].revents == 0 )
+		continue;
+	    c->class = peek_command ( c->fd );
+	    if ( c->class < 0 )
+	    {
+		close ( c->fd );
+		c->fd = -1;
+	    }
+	    else if ( c->class == 'p' )
+	    {
+		serve ( c->fd );
+		c->class = 0;
+	    }
+	    else if ( c->class == 'r' || c->class == 'q' )
+	    {
+		if ( index_child != 0 && ! compacting )
+		    replay_journal ( 1 );
+		if ( c->class == 'q' ) update_views();
+		c->child = fork_child ( c->fd );
+		if ( c->child == 0 )
+		{
+		    serve ( c->fd );
+		    exit ( 0 );
+		}
+	    }
+	}
 
-		if ( ( op == 'm' && direction == 'f' )
-		     || op == 'r' || op == 'd' )
+	/* Serve the first command waiting for the
+	 * index, if the index is free.
+	 */
+	for ( i = 0;
+	      index_child == 0 && done != 1
+	      && i < nconnections;
+	      ++ i )
+	{
+	    struct connection * c = connections + i;
+	    if ( c->fd < 0 || c->child != 0 ) continue;
+	    if ( c->class == 'i' )
+	    {
+		done = serve ( c->fd );
+		c->class = 0;
+	    }
+	    else if ( c->class == 'w' )
+	    {
+		if ( journal_key[0] == 0 )
 		{
-		    if ( trace )
-			printf
-			    ( "* deleting %s\n",
-			      dbegin );
-		    if ( delfile ( dbegin ) < 0 )
-		    {
-			printf ( "    Processing %s"
-			         " aborted.\n", arg );
-			result = -1;
-			continue;
-		    }
+		    unlink ( "EFM-JOURNAL.gpg" );
+		    newkey ( journal_key );
 		}
-		else if (    op == 'm'
-		          && direction == 't' )
+		index_child = fork_child ( c->fd );
+		if ( index_child == 0 )
 		{
-		    if ( trace )
-			printf
-			    ( "* deleting %s\n", arg );
-		    if ( delfile ( arg ) < 0 )
-		    {
-			printf ( "    Processing %s"
-				 " aborted.\n",
-				 arg );
-			result = -1;
-			continue;
-		    }
+		    publishing = 1;
+		    serve ( c->fd );
+		    exit ( 0 );
 		}
+		c->child = index_child;
+	    }
+	}
 
-		/* Delete entry if necessary. */
+	for ( i = j = 0; i < nconnections; ++ i )
+	{
+	    if ( connections[i].fd >= 0 )
+		connections[j++] = connections[i];
+	}
+	nconnections = j;
 
-		if ( ( op == 'm' && direction == 'f' )
-		     || op == 'r' )
+	if ( fds[0].revents != 0 )
+	{
+	    int fd = accept ( listen_fd, NULL, NULL );
+	    if ( fd < 0 )
+	    {
+		if ( errno != EINTR
+		     && errno != ECONNABORTED )
+		    error ( errno );
+	    }
+	    else
+	    {
+		if ( nconnections == max_connections )
 		{
-		    e->current = 0;
-		    index_modified = 1;
-		    if ( trace )
-		    {
-			printf ( "* made index entry"
-			         " obsolete\n" );
-			write_index_entry
-			    ( stdout, e, 7, "* " );
-		    }
+		    max_connections =
+			( max_connections == 0 ?
+			  16 : 2 * max_connections );
+		    connections = (struct connection *)
+			realloc ( connections,
+				  max_connections
+				  * sizeof
+				    ( struct connection ) );
+		    if ( connections == NULL )
+			error ( ENOMEM );
 		}
-
-		printf ( "%s: %s\n",
-		         op == 'm' ? "MOVED" :
-		         op == 'c' ? "COPIED" :
-		         op == 'r' ? "REMOVED" :
-		         op == 'd' ? "DELETED" :
-		         op == 'k' ? "OK" :
-		         op == 's' ? "OK" :
-			             "DONE",
-			 arg );
+		connections[nconnections].fd = fd;
+		connections[nconnections].class = 0;
+		connections[nconnections].child = 0;
+		++ nconnections;
 	    }
 	}
     }
-    else
+
+    unlink ( "EFM-INDEX.sock" );
+    close_ssh_control_dir();
+    exit ( 0 );
+}
+
+/* A buffer of bytes that grows as needed.
+ */
+struct bytes {
+    char * data;
+    size_t length, max;
+};
+
+/* Append n bytes to b, copied from data unless that is
+ * NULL.
+ */
+void append_bytes ( struct bytes * b, const void * data,
+		    size_t n )
+{
+    if ( b->length + n > b->max )
     {
-        printf ( "ERROR: bad command (ignored):"
-	         " %s\n", arg );
-	result = -1;
+	while ( b->length + n > b->max )
+	    b->max = ( b->max == 0 ? 4096 : 2 * b->max );
+	b->data = (char *) realloc ( b->data, b->max );
+	if ( b->data == NULL ) error ( ENOMEM );
     }
+    if ( data != NULL )
+	memcpy ( b->data + b->length, data, n );
+    b->length += n;
+}
 
-    arg = get_argument ( buffer, in );
-    if ( arg != NULL && result != -1 )
+/* Fill in the header of the COMMAND_FRAME beginning at
+ * offset start of b, which ends at the end of b.
+ */
+void end_command_frame ( struct bytes * b, size_t start )
+{
+    b->data[start] = COMMAND_FRAME;
+    put_be ( (unsigned char *) b->data + start + 1,
+	     b->length - start - FRAME_HEADER, 4 );
+}
+
+/* Append to b the file names read from the standard
+ * input, which are separated by separator, each fol-
+ * lowed by a NUL.  Empty names are ignored.
+ */
+void read_batch_files ( struct bytes * b, int separator )
+{
+    size_t start = b->length;
+    int c;
+
+    do
     {
-	printf ( "ERROR: extra argument (ignored):"
-		 " %s\n", arg );
-	result = -1;
-    }
+	char * name;
+	c = getchar();
+	if ( c != separator && c != EOF )
+	{
+	    char ch = c;
+	    append_bytes ( b, & ch, 1 );
+	    continue;
+	}
+	if ( b->length == start ) continue;
+	append_bytes ( b, "", 1 );
+	name = b->data + start;
+	if ( b->length - start > MAX_LEXEME_SIZE + 1 )
+	{
+	    printf ( "ERROR: file name too long: %s\n",
+		     name );
+	    exit ( 1 );
+	}
+	if ( strchr ( name, '\n' ) != NULL )
+	{
+	    printf ( "ERROR: file name contains line"
+		     " feed: %s\n", name );
+	    exit ( 1 );
+	}
+	start = b->length;
+    } while ( c != EOF );
+}
 
-    while ( arg != NULL )
-        arg = get_argument ( buffer, in );
+/* Write line of output from the background process,
+ * unless it is one of the unwanted missives from gpg.
+ */
+void write_output_line ( const char * line )
+{
+    char ** fp;
 
-    return result;
+    for ( fp = ofilter; * fp; ++ fp )
+    {
+	if ( strcmp ( * fp, line ) == 0 ) return;
+    }
+    printf ( "%s\n", line );
 }
 
 int main ( int argc, char ** argv )
@@ -2935,8 +13984,12 @@ int main ( int argc, char ** argv )
     struct sockaddr_un sa;
     int listenfd;
     pid_t childpid;
-    FILE * tof;
-    char ** argp;
+    char ** argp, * p;
+    struct bytes out = { NULL, 0, 0 },
+		 in = { NULL, 0, 0 },
+		 line = { NULL, 0, 0 };
+    size_t sent = 0;
+    int commands = 0, ended = 0, status = 0;
 
     if ( argc < 2
          ||
@@ -3077,6 +14130,7 @@ int main ( int argc, char ** argv )
 	    int indexchild;
 	    int indexfd;
 	    FILE * indexf;
+	    int c;
 	    indexfd =
 		crypt ( 1, "EFM-INDEX.gpg", NULL,
 			password,
@@ -3084,7 +14138,12 @@ int main ( int argc, char ** argv )
 			& indexchild );
 	    if ( indexfd < 0 ) exit ( 1 );
 	    indexf = fdopen ( indexfd, "r" );
-	    read_index ( indexf );
+	    c = getc ( indexf );
+	    if ( c != EOF ) ungetc ( c, indexf );
+	    if ( c == BINARY_MAGIC[0] )
+		read_binary_index ( indexf );
+	    else
+		read_index ( indexf, 0 );
 	    fclose ( indexf );
 	    if ( cwait ( indexchild ) < 0 )
 	    {
@@ -3092,6 +14151,8 @@ int main ( int argc, char ** argv )
 			 " EFM-INDEX.gpg\n" );
 		exit ( 1 );
 	    }
+	    if ( read_journal() < 0 )
+		write_index_file();
 	}
 
 	listenfd =
@@ -3100,126 +14161,23 @@ int main ( int argc, char ** argv )
 		    (const struct sockaddr *) & sa,
 		    sizeof ( sa ) ) < 0 )
 	    error ( errno );
-	if ( listen ( listenfd, 0 ) < 0 )
+	if ( listen ( listenfd, 64 ) < 0 )
 	    error ( errno );
 	childpid = fork ( );
 	if ( childpid < 0 ) error ( errno );
 	if ( childpid == 0 )
 	{
-	    int done;
-
 	    close ( tofd );
 
-	    /* Temporarily reroute stdout to error
-	     * descriptor.
+	    /* Reroute stdout to error descriptor.
 	     */
 	    fflush ( stdout );
 	    close ( 1 );
 	    dup2 ( 2, 1 );
 
-	    done = 0;  /* Res
-	        /* 0 if done without error.
-		   -1 if done with error.
-		   1 to kill (without error).
-		 */
-	    while ( done != 1 )
-	    {
-		int fromfd;
-		FILE * inf;
-
-		fromfd =
-		    accept ( listenfd, NULL, NULL );
-		if ( fromfd < 0 ) error ( errno );
-
-		/* Reroute stdout to new descriptor.
-		 */
-		assert ( fromfd != 1 );
-		fflush ( stdout );
-		close ( 1 );
-		dup2 ( fromfd, 1 );
-		inf = fdopen ( fromfd, "r" );
-
-		printf ( "%s%lld\n", BEGIN_STRING,
-		         (long long) getpgrp() );
-		index_modified = 0;
-		done = execute_command ( inf );
-		if ( index_modified )
-		{
-		    int indexchild;
-		    int indexfd;
-		    FILE * indexf;
-
-		    indexfd =
-			crypt ( 0,
-				NULL, "EFM-INDEX.gpg+",
-				password,
-				strlen ( password ),
-				& indexchild );
-		    if ( indexfd < 0 ) exit ( 1 );
-		    indexf = fdopen ( indexfd, "w" );
-		    if ( trace )
-		        printf ( "* writing"
-			         " EFM-INDEX.gpg+\n" );
-		    write_index ( indexf, 7, -1 );
-		    fclose ( indexf );
-		    if ( cwait ( indexchild ) < 0 )
-		    {
-			if ( trace )
-			    printf
-			        ( "* deleting"
-			          " EFM-INDEX.gpg+\n" );
-		        unlink ( "EFM-INDEX.gpg+" );
-			printf ( "ERROR: error"
-			         " encypting"
-				 " EFM-INDEX.gpg\n" );
-			exit ( 1 );
-		    }
-
-		    if ( access ( "EFM-INDEX.gpg-",
-		                  F_OK )
-		         >= 0 )
-		    {
-			if ( trace )
-			    printf
-				( "* deleting"
-				  " EFM-INDEX.gpg-\n"
-			        );
-			unlink ( "EFM-INDEX.gpg-" );
-		    }
-		    if ( trace )
-			printf
-			    ( "* renaming"
-			      " EFM-INDEX.gpg to"
-			      " EFM-INDEX.gpg-\n"
-			    );
-		    if ( link ( "EFM-INDEX.gpg",
-		                "EFM-INDEX.gpg-" ) < 0
-			 &&
-			 errno != ENOENT )
-		        error ( errno );
-		    unlink ( "EFM-INDEX.gpg" );
-		    if ( trace )
-			printf
-			    ( "* renaming"
-			      " EFM-INDEX.gpg+ to"
-			      " EFM-INDEX.gpg\n"
-			    );
-		    if ( link ( "EFM-INDEX.gpg+",
-		                "EFM-INDEX.gpg" ) < 0 )
-		        error ( errno );
-		    unlink ( "EFM-INDEX.gpg+" );
-		}
-
-		printf ( "%s%d\n", END_STRING,
-		         done == 1 ? 0 : - done );
-		fflush ( stdout );
-		fclose ( inf );
-		close ( 1 );
-		dup2 ( 2, 1 );
-	    }
-
-	    unlink ( "EFM-INDEX.sock" );
-	    exit ( 0 );
+	    listen_fd = listenfd;
+	    make_ssh_control_dir();
+	    run_daemon();
 	}
 	if ( connect ( tofd,
 		       (const struct sockaddr *) & sa,
@@ -3227,76 +14185,168 @@ int main ( int argc, char ** argv )
 	    error ( errno );
     }
 
-    /* To work the parent needs one a+ FILE for some
-     * reason.
+    /* Make the COMMAND_FRAMEs to send: one for the
+     * program arguments, or, if the only argument is
+     * -, one for each non-blank line of the standard
+     * input, whose lexemes are the arguments.
      */
-    tof = fdopen ( tofd, "a+" );
-
-    if ( ! get_line ( buffer, tof ) )
+    if ( strcmp ( argv[1], "-" ) == 0 && argc == 2 )
     {
-	printf ( "ERROR: efm background process has"
-	         " died\n" );
-	exit ( 1 );
+	while ( get_line ( buffer, stdin ) )
+	{
+	    char * b = buffer;
+	    size_t start = out.length;
+	    char * arg = get_lexeme ( & b );
+	    if ( arg == NULL ) continue;
+	    append_bytes ( & out, "\0\0\0\0\0",
+			   FRAME_HEADER );
+	    for ( ; arg; arg = get_lexeme ( & b ) )
+		append_bytes ( & out, arg,
+			       strlen ( arg ) + 1 );
+	    end_command_frame ( & out, start );
+	    ++ commands;
+	}
     }
-    if ( strncmp ( buffer, BEGIN_STRING,
-                   strlen ( BEGIN_STRING ) ) != 0 )
+    else
     {
-	printf ( "ERROR: efm background process sent"
-	         " bad hello message\n" );
-	exit ( 1 );
-    }
-
-    siggroup = (pid_t)
-        atoll ( buffer + strlen ( BEGIN_STRING ) );
+	int batch = ( strcmp ( argv[1], "batch" ) == 0 );
+	int separator = '\n';
 
-    /* Send arguments to child.  Each argument sent as
-     * a lexeme on its own line.  At the end of the
-     * argument list, a blank line is written.
-     */
-    argp = argv + 1;
-    for ( ; * argp; ++ argp )
-    {
-        char * b = buffer;
-	const char * p;
-	if ( strlen ( * argp ) > MAX_LEXEME_SIZE )
-	{
-	    printf ( "ERROR: program argument too long:"
-	             " %s\n", * argp );
-	    exit ( 1 );
-	}
-	p = * argp;
-	while ( * p )
+	append_bytes ( & out, "\0\0\0\0\0",
+		       FRAME_HEADER );
+	for ( argp = argv + 1; * argp; ++ argp )
 	{
-	    if ( * p ++ == '\n')
+	    if ( batch && argp == argv + 2
+		 && strcmp ( * argp, "-0" ) == 0 )
+	    {
+		separator = 0;
+		continue;
+	    }
+	    if ( strlen ( * argp ) > MAX_LEXEME_SIZE )
 	    {
-		printf ( "ERROR: program argument"
-		         " contains line feed: %s\n",
-			 * argp );
+		printf ( "ERROR: program argument too"
+			 " long: %s\n", * argp );
 		exit ( 1 );
 	    }
+	    append_bytes ( & out, * argp,
+			   strlen ( * argp ) + 1 );
 	}
-	put_lexeme ( & b , * argp );
-	* b ++ = 0;
-	fprintf ( tof, "%s\n", buffer );
+	if ( batch ) read_batch_files ( & out, separator );
+	end_command_frame ( & out, 0 );
+	commands = 1;
     }
-    fprintf ( tof, "\n" );
-    while ( get_line ( buffer, tof ) )
+
+    /* Send the commands while reading the frames sent
+     * back, so the background process never waits for
+     * us to read while we wait for it to read.  Output
+     * is written line by line, so ofilter can be ap-
+     * plied.
+     */
+    if ( fcntl ( tofd, F_SETFL, O_NONBLOCK ) < 0 )
+	error ( errno );
+    while ( ended < commands )
     {
-	char ** fp;
+	struct pollfd fds;
+	size_t length;
+	ssize_t r;
+
+	fds.fd = tofd;
+	fds.events =
+	    ( sent < out.length ? POLLIN | POLLOUT
+				: POLLIN );
+	fflush ( stdout );
+	if ( poll ( & fds, 1, -1 ) < 0 )
+	{
+	    if ( errno == EINTR ) continue;
+	    error ( errno );
+	}
 
-        if ( strncmp ( buffer, END_STRING,
-		       strlen ( END_STRING) ) == 0 )
-	    break;
+	if ( fds.revents & POLLOUT )
+	{
+	    r = write ( tofd, out.data + sent,
+			out.length - sent );
+	    if ( r > 0 ) sent += r;
+	    else if ( r < 0 && errno != EAGAIN
+			    && errno != EINTR
+			    && errno != EPIPE )
+		error ( errno );
+	}
+	if ( ( fds.revents & ~ POLLOUT ) == 0 )
+	    continue;
 
-	/* Filter out unwanted missives from gpg. */
+	append_bytes ( & in, NULL, PGP_BUFFER_SIZE );
+	in.length -= PGP_BUFFER_SIZE;
+	r = read ( tofd, in.data + in.length,
+		   PGP_BUFFER_SIZE );
+	if ( r == 0 ) break;
+	if ( r < 0 )
+	{
+	    if ( errno == EAGAIN || errno == EINTR )
+		continue;
+	    if ( errno == ECONNRESET ) break;
+	    error ( errno );
+	}
+	in.length += r;
 
-	fp = ofilter;
-	for ( ; * fp; ++ fp )
+	/* Act on the complete frames read.
+	 */
+	for ( p = in.data;
+	      in.data + in.length - p >= FRAME_HEADER;
+	      p += FRAME_HEADER + length )
 	{
-	    if ( strcmp ( * fp, buffer ) == 0 ) break;
+	    unsigned char * data =
+		(unsigned char *) p + FRAME_HEADER;
+	    length = get_be ( data - 4, 4 );
+	    if ( in.data + in.length - p
+		 < FRAME_HEADER + length )
+		break;
+	    if ( * p == BEGIN_FRAME && length == 4 )
+		siggroup = (pid_t) get_be ( data, 4 );
+	    else if ( * p == OUTPUT_FRAME )
+	    {
+		size_t i;
+		for ( i = 0; i < length; ++ i )
+		{
+		    if ( data[i] != '\n' )
+		    {
+			append_bytes ( & line, data + i,
+				       1 );
+			continue;
+		    }
+		    append_bytes ( & line, "", 1 );
+		    write_output_line ( line.data );
+		    line.length = 0;
+		}
+	    }
+	    else if ( * p == END_FRAME && length == 4 )
+	    {
+		int s = (int) get_be ( data, 4 );
+		if ( line.length > 0 )
+		{
+		    fwrite ( line.data, 1, line.length,
+			     stdout );
+		    line.length = 0;
+		}
+		if ( s != 0 ) status = s;
+		++ ended;
+	    }
+	    else
+	    {
+		printf ( "ERROR: efm background process"
+			 " sent bad frame\n" );
+		exit ( 1 );
+	    }
 	}
-	if ( * fp == NULL ) printf ( "%s\n", buffer );
+	in.length -= p - in.data;
+	memmove ( in.data, p, in.length );
+    }
+    close ( tofd );
+
+    if ( ended < commands )
+    {
+	printf ( "ERROR: efm background process has"
+		 " died\n" );
+	exit ( 1 );
     }
-    fclose ( tof );
-    exit ( atoi ( buffer + strlen ( END_STRING ) ) );
+    exit ( status );
 }